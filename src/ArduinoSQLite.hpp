@@ -5,24 +5,219 @@
 
 #include <FS.h>
 
+class SdFs;
+
 class T41SQLite
 {
   public:
     using LogCallback = void (*)(void* pArg, int iErrCode, const char* zMsg);
 
+    // STRICT:      flush the file after every write and on every xSync (default)
+    // COMMIT_ONLY: flush only when SQLite calls xSync, i.e. at the points PRAGMA synchronous asks for
+    // DEFERRED:    like COMMIT_ONLY, but xSync only queues the work, poll() does it in bounded slices and barrier()
+    //              waits for it; a power loss can lose the last commits, the database stays consistent
+    enum class SyncPolicy
+    {
+      STRICT,
+      COMMIT_ONLY,
+      DEFERRED
+    };
+
+    // what the VFS reports to SQLite for files on a filesystem via xSectorSize/xDeviceCharacteristics
+    struct FilesystemCharacteristics
+    {
+      int m_sectorSize;               // smallest unit the medium writes (or erases), power of two
+      int m_deviceCharacteristics;    // SQLITE_IOCAP_XXX flags
+    };
+
+    enum class StorageMedium
+    {
+      SD_CARD,                        // FAT/exFAT via SdFat
+      LITTLEFS_FLASH,                 // LittleFS on QSPI/SPI NOR flash
+      RAM_DISK                        // LittleFS_RAM, PSRAM disks, ...
+    };
+
+    enum class MemoryRegion
+    {
+      RAM2,                           // DMAMEM, through the heap
+      PSRAM                           // EXTMEM
+    };
+
+    enum class CheckpointMode
+    {
+      PASSIVE = SQLITE_CHECKPOINT_PASSIVE,
+      FULL = SQLITE_CHECKPOINT_FULL,
+      RESTART = SQLITE_CHECKPOINT_RESTART,
+      TRUNCATE = SQLITE_CHECKPOINT_TRUNCATE
+    };
+
+    struct ReadCacheStats
+    {
+      uint32_t m_hits = 0;
+      uint32_t m_misses = 0;
+      uint32_t m_evictions = 0;
+      uint32_t m_readAheads = 0;      // multi-sector refills of a read-ahead buffer
+      uint32_t m_readAheadHits = 0;   // reads served from a read-ahead buffer
+    };
+
+    struct FilePoolStats
+    {
+      uint32_t m_opensAvoided = 0;    // journal opens served by a handle kept open from the previous transaction
+      uint32_t m_deletesAvoided = 0;  // journal deletes done by truncating a kept handle instead
+      uint32_t m_poolExhausted = 0;   // files opened with a heap allocated handle because every pool slot was busy
+      uint32_t m_directoryWalksAvoided = 0; // xAccess answered by the existence cache or a kept journal handle
+    };
+
+    struct TierStats
+    {
+      uint32_t m_hits = 0;            // page reads served by the tier file on the fast filesystem
+      uint32_t m_misses = 0;          // page reads that went to the database file
+      uint32_t m_promotions = 0;      // pages copied to the tier file
+      uint32_t m_demotions = 0;       // pages dropped from the tier file to make room for hotter ones
+      uint32_t m_discards = 0;        // tier file pages found damaged (power loss), or tier files dropped after an error
+    };
+
+    struct MemoryVFSStats
+    {
+      uint32_t m_flushes = 0;         // flushes of a memory VFS database that wrote to its backing file
+      uint64_t m_bytesFlushed = 0;    // dirty bytes written to backing files (the batch log doubles the card writes)
+    };
+
+    struct CompressionStats
+    {
+      uint32_t m_pagesWritten = 0;    // pages written to compressed databases
+      uint32_t m_rawPages = 0;        // written pages that did not compress and were stored as they are
+      uint32_t m_pagesRead = 0;       // pages read from compressed databases
+      uint64_t m_bytesIn = 0;         // bytes of the written pages
+      uint64_t m_bytesOut = 0;        // bytes of their log records, headers included (m_bytesIn / m_bytesOut is the ratio)
+    };
+
+    struct LogStats
+    {
+      uint64_t m_bytesAppended = 0;   // bytes of page and truncation records appended to logs
+      uint32_t m_segmentsStarted = 0; // segment files started
+      uint32_t m_segmentsRemoved = 0; // segment files removed by poll() after their live pages were copied
+      uint32_t m_pagesCopied = 0;     // live pages copied by poll() from segments being freed
+      uint32_t m_checkpoints = 0;     // page maps written to a map file
+    };
+
+    struct RawSectorStats
+    {
+      uint32_t m_contiguousFiles = 0; // main database files found contiguous, at open or after growing
+      uint32_t m_fragmentedFiles = 0; // main database files left to File because their clusters are not contiguous
+      uint32_t m_sectorsRead = 0;     // sectors read from the card directly
+      uint32_t m_sectorsWritten = 0;  // sectors written to the card directly
+      uint32_t m_partialSectors = 0;  // sectors read into the bounce buffer for an unaligned read or write
+    };
+
+    struct AllocationStats
+    {
+      uint32_t m_allocations = 0;     // heap allocations (SQLite heap or EXTMEM) made inside VFS callbacks and poll()
+      uint64_t m_bytes = 0;           // bytes requested by them
+      uint32_t m_fileHandles = 0;     // File handles allocated with new (busy handle pool, batch logs, tier and log files)
+      uint32_t m_fileOpens = 0;       // FS::open() calls, the filesystem library allocates its file object on each
+    };
+
+    struct PageCacheStats
+    {
+      uint32_t m_slots = 0;           // page slots in the preallocated region
+      uint32_t m_slotsUsed = 0;       // slots holding a page now
+      uint32_t m_slotsPeak = 0;       // highest m_slotsUsed since the last reset
+      uint32_t m_overflowBytes = 0;   // bytes of pages that found no free slot (or did not fit one) and came from the heap
+      uint32_t m_overflowPeak = 0;    // highest m_overflowBytes since the last reset
+      uint32_t m_largestRequest = 0;  // largest page cache allocation since the last reset, more than the slot size overflows
+    };
+
+    struct TwoTierPageCacheStats
+    {
+      uint32_t m_fastSlots = 0;       // page slots in the fast tier buffer
+      uint32_t m_fastPages = 0;       // pages cached in the fast tier now
+      uint32_t m_slowPages = 0;       // pages cached in EXTMEM now
+      uint32_t m_fastHits = 0;        // fetches of pages in the fast tier
+      uint32_t m_slowHits = 0;        // fetches of pages in EXTMEM
+      uint32_t m_misses = 0;          // pages new to the cache, loaded by SQLite
+      uint32_t m_promotions = 0;      // pages moved to the fast tier, SQLite loads each again
+      uint32_t m_demotions = 0;       // least recently used fast pages dropped to make room for a promoted one
+    };
+
+    struct HybridMemoryStats
+    {
+      uint32_t m_ram1Used = 0;        // bytes SQLite holds in the RAM1 slabs (allocation sizes, not requested sizes)
+      uint32_t m_ram2Used = 0;        // bytes SQLite holds on the RAM2 heap
+      uint32_t m_psramUsed = 0;       // bytes SQLite holds in EXTMEM
+      uint32_t m_ram1Peak = 0;        // highest m_ram1Used since the last reset
+      uint32_t m_ram2Peak = 0;
+      uint32_t m_psramPeak = 0;
+      uint32_t m_ram1Allocations = 0; // allocations served from each region
+      uint32_t m_ram2Allocations = 0;
+      uint32_t m_psramAllocations = 0;
+      uint32_t m_fallbacks = 0;       // allocations passed on to the next slower region because theirs was full
+    };
+
   public:
     static const int IS_DEFAULT_VFS = 1;
     static const int ACCESS_FAILED = 0;
     static const int ACCESS_SUCCESFUL = 1;
+    static const int MAX_FILESYSTEMS = 4;
+    static const int MAX_FILESYSTEM_NAME = 15;
+    static constexpr const char* MEMORY_VFS_NAME = "T41_MEMVFS";
+    static constexpr const char* TIER_VFS_NAME = "T41_TIERVFS";
+    static constexpr const char* COMPRESSED_VFS_NAME = "T41_LZ4VFS";
+    static constexpr const char* LOG_VFS_NAME = "T41_LOGVFS";
     
   private:
-    FS* m_filesystem = nullptr;
+    // entry 0 is the filesystem given to begin(), the others are taken in order by filesystems added by name or
+    // configured with setFilesystemCharacteristics()/setRawSectorAccess()
+    struct FilesystemEntry
+    {
+      FS* m_filesystem = nullptr;
+      FilesystemCharacteristics m_characteristics = { 0, 0 };
+      SdFs* m_sdfs = nullptr;                     // card and volume of the filesystem for raw sector I/O, or nullptr
+      char m_name[MAX_FILESYSTEM_NAME + 1] = "";  // empty if the filesystem was not added by name
+    };
+
+  private:
+    bool m_isInitialized = false;
+    FilesystemEntry m_filesystemEntries[MAX_FILESYSTEMS];
     String m_dbDirFullpath = "/";
+    size_t m_readCacheSizeInBytes = 0;
+    size_t m_writeBufferSizeInBytes = 0;
+    SyncPolicy m_syncPolicy = SyncPolicy::STRICT;
+    size_t m_batchAtomicWriteSizeInBytes = 0;
+    size_t m_mirrorSizeLimitInBytes = 0;
+    ReadCacheStats m_readCacheStats;
+    FilePoolStats m_filePoolStats;
+    MemoryVFSStats m_memoryVFSStats;
+    char m_tierFilesystemName[MAX_FILESYSTEM_NAME + 1] = "";
+    size_t m_tierSizeInBytes = 0;
+    TierStats m_tierStats;
+    CompressionStats m_compressionStats;
+    LogStats m_logStats;
+    RawSectorStats m_rawSectorStats;
+    AllocationStats m_allocationStats;
+    void* m_hybridRAM1Buffer = nullptr;
+    size_t m_hybridRAM1SizeInBytes = 0;
+    size_t m_hybridRAM1MaxAllocationInBytes = 0;
+    size_t m_hybridRAM2MaxAllocationInBytes = 0;
+    bool m_useHybridMemory = false;
+    HybridMemoryStats m_hybridMemoryStats;
+    size_t m_pageCachePageSizeInBytes = 0;
+    int m_pageCachePageCount = 0;
+    MemoryRegion m_pageCacheRegion = MemoryRegion::RAM2;
+    void* m_pageCacheBuffer = nullptr;
+    void* m_twoTierFastBuffer = nullptr;
+    size_t m_twoTierFastSizeInBytes = 0;
+    size_t m_twoTierPageSizeInBytes = 0;
+    int m_twoTierPromotionHits = 0;
+    bool m_useTwoTierPageCache = false;
+    TwoTierPageCacheStats m_twoTierPageCacheStats;
 
   private:
     T41SQLite() = default;
     ~T41SQLite() = default;
 
+    int setDefaultFilesystem(FS* io_filesystem);
+
   public:
     T41SQLite(const T41SQLite&) = delete;
     T41SQLite& operator=(const T41SQLite&) = delete;
@@ -33,15 +228,149 @@ class T41SQLite
       return instance;
     }
 
-    int begin(FS* io_filesystem, bool in_useEXTMEM = false);
+    // in_readCacheSizeInBytes: size of the block cache attached to each opened main database file,
+    // allocated from EXTMEM (falls back to the RAM2/DMAMEM heap if no PSRAM is fitted), 0 disables it
+    // in_writeBufferSizeInBytes: size of the write-back buffer holding dirty pages of each opened main
+    // database file until it is synced, allocated like the read cache, 0 disables it
+    int begin(FS* io_filesystem, bool in_useEXTMEM = false, size_t in_readCacheSizeInBytes = 0, size_t in_writeBufferSizeInBytes = 0);
     int end();
     
     FS* getFilesystem();
+
+    // register io_filesystem under in_name (up to MAX_FILESYSTEM_NAME letters, digits or '_', e.g. "flash"), databases
+    // named "<in_name>:/dir/file.db" or opened with the URI parameter "vfs=<in_name>" (or that VFS name) are stored
+    // on it, also when ATTACHed to a connection whose main database lives elsewhere; their journals follow them;
+    // other names stay on the filesystem given to begin(); SQLITE_MISUSE if the name or filesystem is already taken
+    int addFilesystem(const char* in_name, FS* io_filesystem);
+    // nullptr if no filesystem was added with in_name
+    FS* getFilesystem(const char* in_name) const;
+
+    // characteristics presets for typical media, see ArduinoSQLite_impl.cpp for what they claim
+    static FilesystemCharacteristics getDefaultCharacteristics(StorageMedium in_medium);
+    // filesystems without characteristics report sector size 0 and no capabilities, which SQLite treats as worst case
+    int setFilesystemCharacteristics(FS* in_filesystem, const FilesystemCharacteristics& in_characteristics);
+    FilesystemCharacteristics getFilesystemCharacteristics(const FS* in_filesystem) const;
+
+    // io_sdfs is the SdFat volume behind in_filesystem (&SD.sdfs for SD), main databases on it whose clusters are
+    // contiguous read and write their pages with multi-sector calls to the card, bypassing File and the FAT layer;
+    // others, and the part of a file grown since its last sync, go through File; nullptr turns it off
+    int setRawSectorAccess(FS* in_filesystem, SdFs* io_sdfs);
+    SdFs* getRawSectorAccess(const FS* in_filesystem) const;
+    RawSectorStats& getRawSectorStats();
+    void resetRawSectorStats();
+
+    // what the VFS took from the heap; once a connection is open and has run its statements once, transactions
+    // (journal open/close/delete, read, write, sync, access, full pathname) take nothing, so counts that grow in
+    // steady state point at a regression (or at a growing memory VFS database, mirror or log)
+    AllocationStats& getAllocationStats();
+    void resetAllocationStats();
+
+    // must be called before begin(), which then ignores in_useEXTMEM: SQLite's allocations up to
+    // in_ram1MaxAllocationInBytes (at most 1024) come from slabs in io_ram1Buffer (a static array, so RAM1/DTCM),
+    // up to in_ram2MaxAllocationInBytes from the RAM2 heap, larger ones from EXTMEM; small allocations (Mem cells,
+    // parse objects, lookaside overflow) tend to be short lived, large ones (page cache, sorter and journal buffers)
+    // not; a full region passes the allocation on to the next slower one; io_ram1Buffer nullptr skips RAM1
+    void setHybridMemory(void* io_ram1Buffer, size_t in_ram1SizeInBytes, size_t in_ram1MaxAllocationInBytes = 256,
+                         size_t in_ram2MaxAllocationInBytes = 1024);
+    bool isHybridMemory() const;
+    HybridMemoryStats& getHybridMemoryStats();
+    // the peaks restart at the bytes in use
+    void resetHybridMemoryStats();
+
+    // must be called before begin(), which then takes in_pageCount slots for pages of up to in_pageSizeInBytes (plus
+    // SQLite's page header) from in_region in one block and hands it to SQLite as SQLITE_CONFIG_PAGECACHE, freed by
+    // end(); cache misses then take a slot instead of an allocation; pages of larger databases and pages beyond the
+    // slots (cache_size of all connections together above in_pageCount) come from the heap, see PageCacheStats;
+    // in_pageCount 0 (default) leaves the page cache to the allocator
+    void setPageCache(size_t in_pageSizeInBytes, int in_pageCount, MemoryRegion in_region = MemoryRegion::RAM2);
+    size_t getPageCachePageSize() const;
+    int getPageCachePageCount() const;
+    MemoryRegion getPageCacheRegion() const;
+    PageCacheStats getPageCacheStats() const;
+    // the peaks restart at the current values
+    void resetPageCacheStats();
+
+    // must be called before begin(), which then replaces SQLite's page cache (and with it setPageCache()): pages of up
+    // to in_pageSizeInBytes take a slot of io_fastBuffer (a static array, so RAM1/DTCM) while one is free, the others
+    // live in EXTMEM; a page in EXTMEM fetched in_promotionHits times is moved to the fast tier, dropping the least
+    // recently used fast page if no slot is free; SQLite loads a moved page again (from the VFS read cache or mirror,
+    // when configured), so a higher in_promotionHits moves fewer pages; cache_size counts the pages of both tiers
+    void setTwoTierPageCache(void* io_fastBuffer, size_t in_fastSizeInBytes, size_t in_pageSizeInBytes = 4096,
+                             int in_promotionHits = 4);
+    bool isTwoTierPageCache() const;
+    TwoTierPageCacheStats& getTwoTierPageCacheStats();
+    // the page counts stay
+    void resetTwoTierPageCacheStats();
     
+    // relative database names are resolved against this directory, on whichever filesystem they are stored
     void setDBDirFullPath(const String& in_dbDirFullpath);
     const String& getDBDirFullPath() const;
 
+    // leaving SyncPolicy::DEFERRED does all queued work first
+    void setSyncPolicy(SyncPolicy in_syncPolicy);
+    SyncPolicy getSyncPolicy() const;
+
+    // SyncPolicy::DEFERRED: do queued journal/database writes and flushes for about in_budgetMicros (at least one
+    // write of up to SQLITE_VFS_WRITE_BACK_MERGESZ bytes), call from loop(); SQLITE_OK if work is left,
+    // SQLITE_DONE if everything is on the medium, or an error code (the work stays queued); then cleans the logs of
+    // LOG_VFS_NAME databases, one page copy, segment removal or checkpoint per slice
+    int poll(uint32_t in_budgetMicros);
+    // do all queued work, for when the last commits must be durable (e.g. before power down)
+    int barrier();
+
+    // staging buffer for SQLITE_ENABLE_BATCH_ATOMIC_WRITE commits of each opened main database file, allocated like
+    // the read cache; transactions that do not fit fall back to the rollback journal, 0 (default) disables batch commits
+    void setBatchAtomicWriteSize(size_t in_sizeInBytes);
+    size_t getBatchAtomicWriteSize() const;
+
+    // main database files up to this size are mirrored in EXTMEM and served from there (also zero-copy via xFetch),
+    // must be set before begin(), which makes it SQLite's default mmap size; 0 (default) disables mirroring
+    void setMirrorSizeLimit(size_t in_sizeInBytes);
+    size_t getMirrorSizeLimit() const;
+
+    size_t getReadCacheSize() const;
+    size_t getWriteBufferSize() const;
+    ReadCacheStats& getReadCacheStats();
+    void resetReadCacheStats();
+    FilePoolStats& getFilePoolStats();
+    void resetFilePoolStats();
+
+    // write the dirty blocks of all databases opened with MEMORY_VFS_NAME to their backing files on the filesystem,
+    // SQLITE_BUSY if a database has an open write transaction (the others are flushed anyway)
+    int flushMemoryDatabases();
+    MemoryVFSStats& getMemoryVFSStats();
+    void resetMemoryVFSStats();
+
+    // main databases opened with TIER_VFS_NAME keep copies of their most frequently used pages, up to in_sizeInBytes,
+    // in a "-tier" file of the same path on the filesystem added as in_filesystemName (e.g. LittleFS on QSPI flash,
+    // the directory must exist there; "-tier-<name>" for databases on a filesystem added as <name>); the database
+    // file stays complete and authoritative, written pages are updated in both; applies to databases opened
+    // afterwards, in_sizeInBytes 0 (default) turns tiering off
+    void setTier(const char* in_filesystemName, size_t in_sizeInBytes);
+    const char* getTierFilesystemName() const;
+    size_t getTierSize() const;
+    TierStats& getTierStats();
+    void resetTierStats();
+
+    // main databases opened with COMPRESSED_VFS_NAME are stored like LOG_VFS_NAME ones (see below) with each page
+    // LZ4 compressed in its log record, records packed back to back; such files are only readable through that VFS,
+    // and their page size cannot change
+    CompressionStats& getCompressionStats();
+    void resetCompressionStats();
+
+    // main databases opened with LOG_VFS_NAME append every page written to "-seg<n>" segment files next to the
+    // database file, sequential writes only; poll() copies the live pages of mostly stale segments, removes freed
+    // segments and checkpoints the page map to "-map0"/"-map1"; the page size cannot change
+    LogStats& getLogStats();
+    void resetLogStats();
+
     int setLogCallback(LogCallback in_callback, void* in_forUseInCallback = nullptr);
+
+    // WAL mode (PRAGMA journal_mode=WAL) checkpoint control, in_schema nullptr means all attached databases
+    int checkpoint(sqlite3* io_db, CheckpointMode in_mode = CheckpointMode::PASSIVE, int* out_walFrames = nullptr,
+                   int* out_checkpointedFrames = nullptr, const char* in_schema = nullptr);
+    // checkpoint automatically (PASSIVE) once the WAL holds in_frames frames, 0 disables automatic checkpoints
+    int setAutoCheckpoint(sqlite3* io_db, int in_frames);
 };
 
 //#define TEENSY_41_SQLITE_DEBUG
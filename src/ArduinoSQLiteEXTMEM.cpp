@@ -1,55 +1,590 @@
 #include <Arduino.h> // for: Teensy extmem functions
 
-#include <smalloc.h> // for: sm_szalloc_pool(&extmem_smalloc_pool, in_pointer) /* get size of allocation */
+#include <new> // for: std::nothrow
+#include <stdlib.h> // for: malloc, free, realloc (RAM2 heap)
+#include <string.h> // for: memcpy
 
-#include "sqlite3.h" // for: SQLite related stuff
+#include "ArduinoSQLiteEXTMEM.hpp"
+
+// Slab allocator for SQLite in EXTMEM
+//
+// SQLite makes thousands of small allocations per prepare/step, and every one of them going through the general
+// purpose smalloc pool costs a search, splitting and merging of blocks in PSRAM. Requests up to the largest size
+// class are therefore served from slabs: the arena, one block of PSRAM taken from the pool at sqlite3_initialize(),
+// is divided into slab pages, each page holds blocks of one size class and has its own free list, and the pages of a
+// class with free blocks are linked. malloc pops a block from the first such page (or gives a free page to the class
+// and carves blocks from it as needed), free pushes it back and returns the page to the arena once it is empty, both
+// O(1). The page (and with it the size class) of a pointer follows from its offset in the arena, so size is O(1) too.
+// Larger requests, and small ones once the arena is full, go to the pool (big blocks), with their size in a header.
+// The page metadata lives in RAM, only the blocks and their free list links are in PSRAM.
+//
+// Hybrid mode (sqlite3_use_hybrid_memory()) puts the hottest objects in faster memory: requests up to the RAM1 limit
+// come from slabs in a buffer the application provides (a static array, which the linker places in RAM1/DTCM), up to
+// the RAM2 limit from the RAM2 heap (malloc), larger ones from PSRAM as above. SQLite's allocations cannot tell how
+// long they live, but size is a good hint: Mem cells, parse objects and lookaside overflow are small and short lived,
+// page cache lines, sorter and journal buffers are large. A full region passes the request on to the next slower one.
+// Blocks outside the slabs carry their size and region in a header.
+
+// size of the arena taken from EXTMEM, halved until the allocation succeeds (down to 16 slab pages), 0 disables slabs
+#ifndef SQLITE_EXTMEM_SLAB_ARENASZ
+  #define SQLITE_EXTMEM_SLAB_ARENASZ 1048576
+#endif
+
+// size of a slab page in EXTMEM, a multiple of the largest size class
+#ifndef SQLITE_EXTMEM_SLAB_PAGESZ
+  #define SQLITE_EXTMEM_SLAB_PAGESZ 8192
+#endif
+
+// size of a slab page in the RAM1 buffer of hybrid mode, small so a few KB already hold every class it serves
+#ifndef SQLITE_HYBRID_RAM1_PAGESZ
+  #define SQLITE_HYBRID_RAM1_PAGESZ 1024
+#endif
+
+// size classes, powers of two and the halves between them; SQLite needs 8 byte aligned memory
+static const uint16_t s_aClassSize[] = { 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+static const int CLASS_COUNT = sizeof(s_aClassSize) / sizeof(s_aClassSize[0]);
+static const int MAX_CLASS_SIZE = 1024;
+static const int BLOCK_HEADER = 8; // size and region of a block outside the slabs, keeps it 8 byte aligned
+
+static_assert(SQLITE_EXTMEM_SLAB_PAGESZ % MAX_CLASS_SIZE == 0, "slab pages must hold whole blocks of every class");
+
+enum Region
+{
+  REGION_RAM1,
+  REGION_RAM2,
+  REGION_PSRAM
+};
+
+struct SlabPage
+{
+  void* m_free = nullptr;         // first block on the free list of the page
+  uint16_t m_used = 0;            // blocks handed out
+  uint16_t m_carved = 0;          // blocks carved from the page so far, the rest was never used
+  int8_t m_class = -1;            // size class, -1 if the page is free
+  int m_prev = -1;                // previous page of the list the page is on (pages of a class with free blocks, or free pages)
+  int m_next = -1;                // next page of that list
+};
+
+struct SlabArena
+{
+  uint8_t* m_base = nullptr;      // first page, nullptr if the arena is not set up
+  int m_pageSize = 0;
+  int m_pageCount = 0;
+  SlabPage* m_pages = nullptr;    // metadata of each page
+  int m_freePages = -1;           // first free page
+  int m_classPages[CLASS_COUNT] = {}; // first page with free blocks of each class, or -1
+};
+
+static SlabArena s_psram;                     // slabs in the arena taken from EXTMEM
+static SlabArena s_ram1;                      // slabs in the buffer given to sqlite3_use_hybrid_memory()
+static void* s_ram1Buffer = nullptr;
+static size_t s_ram1BufferSize = 0;
+static int s_ram1MaxSize = 0;                 // requests up to this size go to RAM1 (hybrid mode only)
+static int s_ram2MaxSize = 0;                 // requests up to this size (and larger than s_ram1MaxSize) go to RAM2
+static T41SQLite::HybridMemoryStats s_unusedStats;
+static T41SQLite::HybridMemoryStats* s_stats = &s_unusedStats;
+static int8_t s_classOfSize[MAX_CLASS_SIZE / 8 + 1]; // size class of each request size, by (size + 7) / 8
+
+static int sqlite3_extmem_round8(int in_size)
+{
+  return (in_size + 7) & ~7;
+}
+
+static int sqlite3_extmem_class_of(int in_size)
+{
+  return s_classOfSize[(in_size + 7) / 8];
+}
+
+static void sqlite3_extmem_unlink(SlabArena& io_arena, int* io_head, int in_page)
+{
+  SlabPage& page = io_arena.m_pages[in_page];
+
+  if (page.m_prev >= 0)
+  {
+    io_arena.m_pages[page.m_prev].m_next = page.m_next;
+  }
+  else
+  {
+    *io_head = page.m_next;
+  }
+
+  if (page.m_next >= 0)
+  {
+    io_arena.m_pages[page.m_next].m_prev = page.m_prev;
+  }
+
+  page.m_prev = -1;
+  page.m_next = -1;
+}
+
+static void sqlite3_extmem_link(SlabArena& io_arena, int* io_head, int in_page)
+{
+  SlabPage& page = io_arena.m_pages[in_page];
+  page.m_prev = -1;
+  page.m_next = *io_head;
+
+  if (*io_head >= 0)
+  {
+    io_arena.m_pages[*io_head].m_prev = in_page;
+  }
+
+  *io_head = in_page;
+}
+
+// set up io_arena with in_pageCount pages of in_pageSize bytes at io_base, all free
+static void sqlite3_extmem_arena_init(SlabArena& io_arena, uint8_t* io_base, int in_pageSize, int in_pageCount, SlabPage* io_pages)
+{
+  io_arena.m_base = io_base;
+  io_arena.m_pageSize = in_pageSize;
+  io_arena.m_pageCount = in_pageCount;
+  io_arena.m_pages = io_pages;
+  io_arena.m_freePages = -1;
+
+  for (int& head : io_arena.m_classPages)
+  {
+    head = -1;
+  }
+
+  for (int index = in_pageCount - 1; index >= 0; index--)
+  {
+    io_arena.m_pages[index] = SlabPage();
+    sqlite3_extmem_link(io_arena, &io_arena.m_freePages, index);
+  }
+}
+
+// slab page of in_pointer in in_arena, or -1 if it is not in the arena
+static int sqlite3_extmem_page_of(const SlabArena& in_arena, const void* in_pointer)
+{
+  const uint8_t* pointer = static_cast<const uint8_t*>(in_pointer);
+
+  if (in_arena.m_base == nullptr || pointer < in_arena.m_base ||
+      pointer >= in_arena.m_base + static_cast<size_t>(in_arena.m_pageCount) * in_arena.m_pageSize)
+  {
+    return -1;
+  }
+
+  return static_cast<int>((pointer - in_arena.m_base) / in_arena.m_pageSize);
+}
+
+// block of size class in_class, nullptr if the arena has no page left for it
+static void* sqlite3_extmem_slab_malloc(SlabArena& io_arena, int in_class)
+{
+  if (io_arena.m_base == nullptr)
+  {
+    return nullptr;
+  }
+
+  int index = io_arena.m_classPages[in_class];
+
+  if (index < 0)
+  {
+    index = io_arena.m_freePages;
+
+    if (index < 0)
+    {
+      return nullptr;
+    }
+
+    sqlite3_extmem_unlink(io_arena, &io_arena.m_freePages, index);
+    SlabPage& fresh = io_arena.m_pages[index];
+    fresh.m_class = in_class;
+    fresh.m_free = nullptr;
+    fresh.m_used = 0;
+    fresh.m_carved = 0;
+    sqlite3_extmem_link(io_arena, &io_arena.m_classPages[in_class], index);
+  }
+
+  SlabPage& page = io_arena.m_pages[index];
+  int blockSize = s_aClassSize[in_class];
+  int blockCount = io_arena.m_pageSize / blockSize;
+  void* block = page.m_free;
+
+  if (block != nullptr)
+  {
+    page.m_free = *static_cast<void**>(block);
+  }
+  else
+  {
+    // carving on demand keeps taking a page O(1), no free list has to be built for it
+    block = io_arena.m_base + static_cast<size_t>(index) * io_arena.m_pageSize + static_cast<size_t>(page.m_carved) * blockSize;
+    page.m_carved++;
+  }
+
+  page.m_used++;
+
+  if (page.m_free == nullptr && page.m_carved == blockCount)
+  {
+    sqlite3_extmem_unlink(io_arena, &io_arena.m_classPages[in_class], index);
+  }
+
+  return block;
+}
+
+static void sqlite3_extmem_slab_free(SlabArena& io_arena, int in_page, void* in_pointer)
+{
+  SlabPage& page = io_arena.m_pages[in_page];
+  int blockCount = io_arena.m_pageSize / s_aClassSize[page.m_class];
+  bool wasFull = (page.m_free == nullptr && page.m_carved == blockCount);
+
+  *static_cast<void**>(in_pointer) = page.m_free;
+  page.m_free = in_pointer;
+  page.m_used--;
+
+  if (wasFull)
+  {
+    sqlite3_extmem_link(io_arena, &io_arena.m_classPages[page.m_class], in_page);
+  }
+
+  if (page.m_used == 0)
+  {
+    sqlite3_extmem_unlink(io_arena, &io_arena.m_classPages[page.m_class], in_page);
+    page.m_class = -1;
+    sqlite3_extmem_link(io_arena, &io_arena.m_freePages, in_page);
+  }
+}
+
+// block of in_size bytes outside the slabs, on the RAM2 heap or in the EXTMEM pool
+static void* sqlite3_extmem_block_malloc(Region in_region, int in_size)
+{
+  size_t size = static_cast<size_t>(in_size) + BLOCK_HEADER;
+  uint8_t* block = static_cast<uint8_t*>(in_region == REGION_RAM2 ? malloc(size) : extmem_malloc(size));
+
+  if (block == nullptr)
+  {
+    return nullptr;
+  }
+
+  int32_t header[2] = { in_size, in_region };
+  memcpy(block, header, sizeof(header));
+  return block + BLOCK_HEADER;
+}
+
+static void sqlite3_extmem_block_header(const void* in_pointer, int* out_size, Region* out_region)
+{
+  int32_t header[2];
+  memcpy(header, static_cast<const uint8_t*>(in_pointer) - BLOCK_HEADER, sizeof(header));
+  *out_size = header[0];
+  *out_region = static_cast<Region>(header[1]);
+}
+
+static void sqlite3_extmem_count(Region in_region, int in_size)
+{
+  T41SQLite::HybridMemoryStats& stats = *s_stats;
+
+  switch (in_region)
+  {
+    case REGION_RAM1:
+      stats.m_ram1Allocations++;
+      stats.m_ram1Used += in_size;
+      stats.m_ram1Peak = max(stats.m_ram1Peak, stats.m_ram1Used);
+      break;
+
+    case REGION_RAM2:
+      stats.m_ram2Allocations++;
+      stats.m_ram2Used += in_size;
+      stats.m_ram2Peak = max(stats.m_ram2Peak, stats.m_ram2Used);
+      break;
+
+    case REGION_PSRAM:
+    default:
+      stats.m_psramAllocations++;
+      stats.m_psramUsed += in_size;
+      stats.m_psramPeak = max(stats.m_psramPeak, stats.m_psramUsed);
+      break;
+  }
+}
+
+static void sqlite3_extmem_uncount(Region in_region, int in_size)
+{
+  T41SQLite::HybridMemoryStats& stats = *s_stats;
+
+  switch (in_region)
+  {
+    case REGION_RAM1:
+      stats.m_ram1Used -= in_size;
+      break;
+
+    case REGION_RAM2:
+      stats.m_ram2Used -= in_size;
+      break;
+
+    case REGION_PSRAM:
+    default:
+      stats.m_psramUsed -= in_size;
+      break;
+  }
+}
+
+// region a request of in_size bytes goes to first
+static Region sqlite3_extmem_region_for(int in_size)
+{
+  if (in_size <= 0)
+  {
+    return REGION_PSRAM;
+  }
+
+  if (in_size <= s_ram1MaxSize)
+  {
+    return REGION_RAM1;
+  }
+
+  return in_size <= s_ram2MaxSize ? REGION_RAM2 : REGION_PSRAM;
+}
+
+// Round up request size to allocation size
+static int sqlite3_extmem_roundup(int in_size)
+{
+  if (in_size <= 0 || in_size > MAX_CLASS_SIZE)
+  {
+    return sqlite3_extmem_round8(in_size);
+  }
+
+  switch (sqlite3_extmem_region_for(in_size))
+  {
+    case REGION_RAM1:
+      return s_aClassSize[sqlite3_extmem_class_of(in_size)];
+
+    case REGION_RAM2:
+      return sqlite3_extmem_round8(in_size);
+
+    case REGION_PSRAM:
+    default:
+      return s_psram.m_base != nullptr ? s_aClassSize[sqlite3_extmem_class_of(in_size)] : sqlite3_extmem_round8(in_size);
+  }
+}
 
 // SQLite malloc wrapper for EXTMEM
 static void* sqlite3_extmem_malloc(int in_size)
 {
   //Serial.println("sqlite3_extmem_malloc");
-  return extmem_malloc(in_size);
+  int size = sqlite3_extmem_roundup(in_size);
+  Region region = sqlite3_extmem_region_for(in_size);
+  void* block = nullptr;
+
+  if (region == REGION_RAM1)
+  {
+    if ((block = sqlite3_extmem_slab_malloc(s_ram1, sqlite3_extmem_class_of(in_size))) != nullptr)
+    {
+      sqlite3_extmem_count(REGION_RAM1, size);
+      return block;
+    }
+
+    s_stats->m_fallbacks++;
+    region = REGION_RAM2;
+  }
+
+  if (region == REGION_RAM2)
+  {
+    if ((block = sqlite3_extmem_block_malloc(REGION_RAM2, size)) != nullptr)
+    {
+      sqlite3_extmem_count(REGION_RAM2, size);
+      return block;
+    }
+
+    s_stats->m_fallbacks++;
+  }
+
+  if (s_psram.m_base != nullptr && in_size > 0 && in_size <= MAX_CLASS_SIZE)
+  {
+    int sizeClass = sqlite3_extmem_class_of(in_size);
+
+    if ((block = sqlite3_extmem_slab_malloc(s_psram, sizeClass)) != nullptr)
+    {
+      sqlite3_extmem_count(REGION_PSRAM, s_aClassSize[sizeClass]);
+      return block;
+    }
+
+    // arena full: a big block of the class size, so the size SQLite was told by roundup holds
+    size = max(size, static_cast<int>(s_aClassSize[sizeClass]));
+  }
+
+  if ((block = sqlite3_extmem_block_malloc(REGION_PSRAM, size)) != nullptr)
+  {
+    sqlite3_extmem_count(REGION_PSRAM, size);
+  }
+
+  return block;
+}
+
+// Return the size of an allocation, and its region
+static int sqlite3_extmem_size_in(const void* in_pointer, Region* out_region)
+{
+  if (int page = sqlite3_extmem_page_of(s_ram1, in_pointer); page >= 0)
+  {
+    *out_region = REGION_RAM1;
+    return s_aClassSize[s_ram1.m_pages[page].m_class];
+  }
+
+  if (int page = sqlite3_extmem_page_of(s_psram, in_pointer); page >= 0)
+  {
+    *out_region = REGION_PSRAM;
+    return s_aClassSize[s_psram.m_pages[page].m_class];
+  }
+
+  int size;
+  sqlite3_extmem_block_header(in_pointer, &size, out_region);
+  return size;
 }
 
 // SQLite free wrapper for EXTMEM
 static void sqlite3_extmem_free(void* in_pointer)
 {
   //Serial.println("sqlite3_extmem_free");
-  extmem_free(in_pointer);
-}
+  if (in_pointer == nullptr)
+  {
+    return;
+  }
 
-// SQLite realloc wrapper for EXTMEM
-static void* sqlite3_extmem_realloc(void* in_pointer, int in_newSize)
-{
-  //Serial.println("sqlite3_extmem_realloc");
-  return extmem_realloc(in_pointer, in_newSize);
+  Region region;
+  int size = sqlite3_extmem_size_in(in_pointer, &region);
+  sqlite3_extmem_uncount(region, size);
+
+  if (int page = sqlite3_extmem_page_of(s_ram1, in_pointer); page >= 0)
+  {
+    sqlite3_extmem_slab_free(s_ram1, page, in_pointer);
+  }
+  else if (int page = sqlite3_extmem_page_of(s_psram, in_pointer); page >= 0)
+  {
+    sqlite3_extmem_slab_free(s_psram, page, in_pointer);
+  }
+  else if (region == REGION_RAM2)
+  {
+    free(static_cast<uint8_t*>(in_pointer) - BLOCK_HEADER);
+  }
+  else
+  {
+    extmem_free(static_cast<uint8_t*>(in_pointer) - BLOCK_HEADER);
+  }
 }
 
 // Return the size of an allocation
 static int sqlite3_extmem_size(void* in_pointer)
 {
   //Serial.println("sqlite3_extmem_size");
-  return static_cast<int>(sm_szalloc_pool(&extmem_smalloc_pool, in_pointer));
+  if (in_pointer == nullptr)
+  {
+    return 0;
+  }
+
+  Region region;
+  return sqlite3_extmem_size_in(in_pointer, &region);
 }
 
-// Round up request size to allocation size
-static int sqlite3_extmem_roundup(int in_size)
+// SQLite realloc wrapper for EXTMEM
+static void* sqlite3_extmem_realloc(void* in_pointer, int in_newSize)
 {
-  //Serial.println("sqlite3_extmem_roundup");
-  return in_size;
+  //Serial.println("sqlite3_extmem_realloc");
+  if (in_pointer == nullptr)
+  {
+    return sqlite3_extmem_malloc(in_newSize);
+  }
+
+  Region region;
+  int oldSize = sqlite3_extmem_size_in(in_pointer, &region);
+  int newSize = sqlite3_extmem_roundup(in_newSize);
+
+  if (newSize == oldSize)
+  {
+    return in_pointer;
+  }
+
+  // a big PSRAM block staying big: the pool may grow the block in place
+  if (region == REGION_PSRAM && sqlite3_extmem_page_of(s_psram, in_pointer) < 0 &&
+      sqlite3_extmem_region_for(in_newSize) == REGION_PSRAM && newSize > MAX_CLASS_SIZE)
+  {
+    uint8_t* block = static_cast<uint8_t*>(extmem_realloc(static_cast<uint8_t*>(in_pointer) - BLOCK_HEADER,
+                                                          static_cast<size_t>(newSize) + BLOCK_HEADER));
+
+    if (block == nullptr)
+    {
+      return nullptr;
+    }
+
+    int32_t header[2] = { newSize, REGION_PSRAM };
+    memcpy(block, header, sizeof(header));
+    sqlite3_extmem_uncount(REGION_PSRAM, oldSize);
+    sqlite3_extmem_count(REGION_PSRAM, newSize);
+    return block + BLOCK_HEADER;
+  }
+
+  void* pointer = sqlite3_extmem_malloc(in_newSize);
+
+  if (pointer == nullptr)
+  {
+    return nullptr;
+  }
+
+  memcpy(pointer, in_pointer, static_cast<size_t>(oldSize < in_newSize ? oldSize : in_newSize));
+  sqlite3_extmem_free(in_pointer);
+  return pointer;
 }
 
 // Initialize the memory allocator
 static int sqlite3_extmem_init(void* in_appData)
 {
-  // is already initialized by Teensy
+  // the pool itself is already initialized by Teensy
+  // every class size is a multiple of 8, so the class of the largest size of each group of 8 fits the whole group
+  s_classOfSize[0] = 0;
+
+  for (int group = 1, sizeClass = 0; group <= MAX_CLASS_SIZE / 8; group++)
+  {
+    while (s_aClassSize[sizeClass] < group * 8)
+    {
+      sizeClass++;
+    }
+
+    s_classOfSize[group] = sizeClass;
+  }
+
+  for (size_t arenaSize = SQLITE_EXTMEM_SLAB_ARENASZ; arenaSize >= 16 * SQLITE_EXTMEM_SLAB_PAGESZ; arenaSize /= 2)
+  {
+    int pageCount = static_cast<int>(arenaSize / SQLITE_EXTMEM_SLAB_PAGESZ);
+    SlabPage* pages = new (std::nothrow) SlabPage[pageCount];
+    uint8_t* arena = static_cast<uint8_t*>(extmem_malloc(static_cast<size_t>(pageCount) * SQLITE_EXTMEM_SLAB_PAGESZ));
+
+    if (pages != nullptr && arena != nullptr)
+    {
+      sqlite3_extmem_arena_init(s_psram, arena, SQLITE_EXTMEM_SLAB_PAGESZ, pageCount, pages);
+      break;
+    }
+
+    delete[] pages;
+    extmem_free(arena);
+  }
+
+  // the page metadata of the RAM1 slabs takes the (aligned) front of the buffer, aligned pages follow
+  uintptr_t begin = (reinterpret_cast<uintptr_t>(s_ram1Buffer) + alignof(SlabPage) - 1) & ~static_cast<uintptr_t>(alignof(SlabPage) - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(s_ram1Buffer) + s_ram1BufferSize;
+
+  if (s_ram1Buffer != nullptr && begin < end)
+  {
+    int pageCount = static_cast<int>((end - begin) / (SQLITE_HYBRID_RAM1_PAGESZ + sizeof(SlabPage)));
+    uintptr_t first = (begin + pageCount * sizeof(SlabPage) + 7) & ~static_cast<uintptr_t>(7);
+
+    while (pageCount > 0 && first + static_cast<uintptr_t>(pageCount) * SQLITE_HYBRID_RAM1_PAGESZ > end)
+    {
+      pageCount--;
+    }
+
+    if (pageCount > 0)
+    {
+      sqlite3_extmem_arena_init(s_ram1, reinterpret_cast<uint8_t*>(first), SQLITE_HYBRID_RAM1_PAGESZ, pageCount,
+                                new (reinterpret_cast<void*>(begin)) SlabPage[pageCount]);
+    }
+  }
+
+  // without an arena every request is a block of its region
   return SQLITE_OK;
 }
 
 // Shutdown the memory allocator
 static void sqlite3_extmem_shutdown(void* in_appData)
 {
-  // Nothing to do - managed by Teensy
+  // SQLite has freed its allocations by now
+  extmem_free(s_psram.m_base);
+  delete[] s_psram.m_pages;
+  s_psram = SlabArena();
+  s_ram1 = SlabArena();
 }
 
 // SQLite memory methods structure
@@ -67,5 +602,23 @@ static const sqlite3_mem_methods sqlite3_extmem_methods = {
 // Function to configure SQLite to use EXTMEM allocators
 int sqlite3_use_extmem()
 {
+  s_ram1Buffer = nullptr;
+  s_ram1BufferSize = 0;
+  s_ram1MaxSize = 0;
+  s_ram2MaxSize = 0;
+  s_stats = &s_unusedStats;
+  return sqlite3_config(SQLITE_CONFIG_MALLOC, &sqlite3_extmem_methods);
+}
+
+// Function to configure SQLite to use RAM1, RAM2 and EXTMEM by allocation size
+int sqlite3_use_hybrid_memory(void* io_ram1Buffer, size_t in_ram1Size, int in_ram1MaxSize, int in_ram2MaxSize,
+                              T41SQLite::HybridMemoryStats* io_stats)
+{
+  s_ram1Buffer = io_ram1Buffer;
+  s_ram1BufferSize = io_ram1Buffer != nullptr ? in_ram1Size : 0;
+  // slabs serve up to the largest size class
+  s_ram1MaxSize = io_ram1Buffer != nullptr ? min(in_ram1MaxSize, MAX_CLASS_SIZE) : 0;
+  s_ram2MaxSize = max(in_ram2MaxSize, s_ram1MaxSize);
+  s_stats = io_stats != nullptr ? io_stats : &s_unusedStats;
   return sqlite3_config(SQLITE_CONFIG_MALLOC, &sqlite3_extmem_methods);
 }
@@ -1,4 +1,11 @@
 #pragma once
 
+#include "ArduinoSQLite.hpp"
+
 // Function to configure SQLite to use EXTMEM allocators
 int sqlite3_use_extmem();
+
+// Function to configure SQLite to use slabs in io_ram1Buffer for allocations up to in_ram1MaxSize, the RAM2 heap up to
+// in_ram2MaxSize and EXTMEM above, counting into io_stats (may be nullptr)
+int sqlite3_use_hybrid_memory(void* io_ram1Buffer, size_t in_ram1Size, int in_ram1MaxSize, int in_ram2MaxSize,
+                              T41SQLite::HybridMemoryStats* io_stats);
@@ -1,6 +1,7 @@
 #include <Arduino.h>
 
 #include "ArduinoSQLite.hpp"
+#include "ArduinoSQLiteHandler.h"
 #include "MemoryInfo.hpp"
 
 #include <SD.h>
@@ -10,6 +11,47 @@
 
 namespace memInfo = halvoe::memoryInfo;
 
+// lookaside slot size and slots per connection, the default needs 8 KB per connection; SQLite splits a buffer with
+// slots of 384 bytes or more into fewer slots of that size and many of 128 bytes
+#ifndef LOOKASIDE_SLOT_SIZE
+  #define LOOKASIDE_SLOT_SIZE 512
+#endif
+
+#ifndef LOOKASIDE_SLOT_COUNT
+  #define LOOKASIDE_SLOT_COUNT 16
+#endif
+
+// connections whose lookaside lives in DTCM, the buffers take that much DTCM from the stack
+#ifndef LOOKASIDE_DTCM_CONNECTIONS
+  #define LOOKASIDE_DTCM_CONNECTIONS 2
+#endif
+
+// connections tracked in total, further ones keep SQLite's default lookaside
+#ifndef LOOKASIDE_MAX_CONNECTIONS
+  #define LOOKASIDE_MAX_CONNECTIONS 8
+#endif
+
+// free stack below which the sizing helper warns that the DTCM buffers are too large
+#ifndef LOOKASIDE_STACK_RESERVE
+  #define LOOKASIDE_STACK_RESERVE 16384
+#endif
+
+// part of the free heap a lookaside buffer taken from it may use, 1/16
+#ifndef LOOKASIDE_HEAP_SHIFT
+  #define LOOKASIDE_HEAP_SHIFT 4
+#endif
+
+struct LookasideEntry {
+  sqlite3* connection = nullptr;
+  void* buffer = nullptr;
+  bool isDTCM = false;
+};
+
+// static arrays are placed in DTCM
+static uint8_t lookasideDTCMBuffers[LOOKASIDE_DTCM_CONNECTIONS][LOOKASIDE_SLOT_SIZE * LOOKASIDE_SLOT_COUNT] __attribute__((aligned(8)));
+static bool lookasideDTCMBufferInUse[LOOKASIDE_DTCM_CONNECTIONS];
+static LookasideEntry lookasideEntries[LOOKASIDE_MAX_CONNECTIONS];
+
 void setupSerial(long in_serialBaudrate, unsigned long in_timeoutInSeconds = 15)
 {
   Serial.begin(in_serialBaudrate);
@@ -96,11 +138,120 @@ void printMemoryInfo()
   //Serial.printf("getDynamicUsedPsramInBytes(): %d\n", memInfo::getDynamicUsedPsramInBytes()); // expensive opration
 }
 
+LookasideSize calculateLookasideSize() {
+  LookasideSize size;
+  size.slotSize = LOOKASIDE_SLOT_SIZE;
+
+  for (int i = 0; i < LOOKASIDE_DTCM_CONNECTIONS; i++) {
+    if (!lookasideDTCMBufferInUse[i]) {
+      // the DTCM buffers are static, a short stack can only be fixed by building with fewer or smaller ones
+      if (memInfo::getAvailableStackInBytes() < LOOKASIDE_STACK_RESERVE) {
+        Serial.printf("Warning: only %u bytes of stack left, lower LOOKASIDE_DTCM_CONNECTIONS or LOOKASIDE_SLOT_COUNT.\n", memInfo::getAvailableStackInBytes());
+      }
+
+      size.slotCount = LOOKASIDE_SLOT_COUNT;
+      size.isDTCM = true;
+      return size;
+    }
+  }
+
+  // no DTCM buffer left: take one from the heap, but no more than a small part of what is free
+  uint32_t heapShare = memInfo::getAvailableHeapInBytes() >> LOOKASIDE_HEAP_SHIFT;
+  size.slotCount = min(static_cast<int>(heapShare / LOOKASIDE_SLOT_SIZE), LOOKASIDE_SLOT_COUNT);
+  return size;
+}
+
+static void releaseLookaside(LookasideEntry& entry) {
+  if (entry.isDTCM) {
+    lookasideDTCMBufferInUse[(static_cast<uint8_t*>(entry.buffer) - lookasideDTCMBuffers[0]) / sizeof(lookasideDTCMBuffers[0])] = false;
+  }
+  else {
+    free(entry.buffer);
+  }
+
+  entry = LookasideEntry();
+}
+
+static void configureLookaside(sqlite3* sqliteConnection) {
+  LookasideEntry* entry = nullptr;
+
+  for (LookasideEntry& candidate : lookasideEntries) {
+    if (candidate.connection == nullptr) {
+      entry = &candidate;
+      break;
+    }
+  }
+
+  LookasideSize size = calculateLookasideSize();
+
+  if (entry == nullptr || size.slotCount == 0) {
+    Serial.println("Lookaside: keeping SQLite's default");
+    return;
+  }
+
+  if (size.isDTCM) {
+    for (int i = 0; i < LOOKASIDE_DTCM_CONNECTIONS; i++) {
+      if (!lookasideDTCMBufferInUse[i]) {
+        lookasideDTCMBufferInUse[i] = true;
+        entry->buffer = lookasideDTCMBuffers[i];
+        break;
+      }
+    }
+  }
+  else {
+    entry->buffer = malloc(static_cast<size_t>(size.slotSize) * size.slotCount);
+  }
+
+  if (entry->buffer == nullptr) {
+    Serial.println("Lookaside: keeping SQLite's default");
+    return;
+  }
+
+  entry->connection = sqliteConnection;
+  entry->isDTCM = size.isDTCM;
+
+  // fails with SQLITE_BUSY only while lookaside memory is in use, which a connection just opened has none of
+  int configResult = sqlite3_db_config(sqliteConnection, SQLITE_DBCONFIG_LOOKASIDE, entry->buffer, size.slotSize, size.slotCount);
+
+  if (configResult != SQLITE_OK) {
+    Serial.printf("Lookaside: configuration failed (%d)\n", configResult);
+    releaseLookaside(*entry);
+    return;
+  }
+
+  Serial.printf("Lookaside: %d slots of %d bytes in %s\n", size.slotCount, size.slotSize, size.isDTCM ? "DTCM" : "heap");
+}
+
+LookasideStats getLookasideStats(sqlite3* sqliteConnection, bool reset) {
+  LookasideStats stats;
+  int current = 0;
+  int highwater = 0;
+
+  sqlite3_db_status(sqliteConnection, SQLITE_DBSTATUS_LOOKASIDE_USED, &current, &highwater, reset);
+  stats.slotsUsed = current;
+  stats.slotsPeak = highwater;
+  sqlite3_db_status(sqliteConnection, SQLITE_DBSTATUS_LOOKASIDE_HIT, &current, &highwater, reset);
+  stats.hits = highwater;
+  sqlite3_db_status(sqliteConnection, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &current, &highwater, reset);
+  stats.missesSize = highwater;
+  sqlite3_db_status(sqliteConnection, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &current, &highwater, reset);
+  stats.missesFull = highwater;
+  return stats;
+}
+
+void printLookasideStats(sqlite3* sqliteConnection) {
+  LookasideStats stats = getLookasideStats(sqliteConnection);
+  Serial.printf("Lookaside: used %d (peak %d), hits %d, misses (size) %d, misses (full) %d\n", stats.slotsUsed, stats.slotsPeak, stats.hits, stats.missesSize, stats.missesFull);
+}
+
 sqlite3* createOpenSQLConnection(const char* dbName) {
   sqlite3* sqliteConnection;
   Serial.println("---- testSQLite - sqlite3_open - begin ----");
   int connectionResult = sqlite3_open(dbName, &sqliteConnection);
   checkSQLiteError(sqliteConnection, connectionResult);
+  if (connectionResult == SQLITE_OK) {
+    configureLookaside(sqliteConnection);
+  }
   printMemoryInfo();
   if (connectionResult == SQLITE_OK) {
     Serial.println("---- testSQLite - success ----");
@@ -114,7 +265,17 @@ sqlite3* createOpenSQLConnection(const char* dbName) {
 
 void closeSQLiteConnection(sqlite3* sqliteConnection) {
   Serial.println("---- testSQLite - sqlite3_close - begin ----");
-  sqlite3_close(sqliteConnection);
+  printLookasideStats(sqliteConnection);
+  int closeResult = sqlite3_close(sqliteConnection);
+
+  // a connection that could not close still uses its lookaside buffer
+  if (closeResult == SQLITE_OK) {
+    for (LookasideEntry& entry : lookasideEntries) {
+      if (entry.connection == sqliteConnection) {
+        releaseLookaside(entry);
+      }
+    }
+  }
   Serial.println("---- testSQLite - sqlite3_close - end ----");
 }
 
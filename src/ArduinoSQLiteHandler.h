@@ -9,7 +9,26 @@
 #include "dbTypes.h"
 #include "sqlite3.h"
 
+struct LookasideSize {
+    int slotSize = 0;
+    int slotCount = 0;       // 0 leaves the connection with SQLite's default lookaside
+    bool isDTCM = false;     // a DTCM buffer is free, otherwise the buffer comes from the heap
+};
+
+struct LookasideStats {
+    int slotsUsed = 0;
+    int slotsPeak = 0;
+    int hits = 0;            // allocations served from lookaside
+    int missesSize = 0;      // allocations larger than a slot
+    int missesFull = 0;      // allocations made while all slots were in use
+};
+
 void setupDatabase();
+// lookaside for the next connection: a DTCM buffer while one is free (warns if the stack runs short), else a part of
+// the free heap; createOpenSQLConnection() gives every connection its lookaside this way
+LookasideSize calculateLookasideSize();
+LookasideStats getLookasideStats(sqlite3* sqliteConnection, bool reset = false);
+void printLookasideStats(sqlite3* sqliteConnection);
 sqlite3* createOpenSQLConnection(const char* databaseName);
 void closeSQLiteConnection(sqlite3* sqliteConnection);
 bool createSQLTable(sqlite3* sqliteConnection, const DBTable& table);
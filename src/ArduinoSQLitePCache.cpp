@@ -0,0 +1,581 @@
+#include <Arduino.h> // for: Teensy extmem functions
+
+#include <new> // for: placement new
+#include <string.h> // for: memset
+
+#include "ArduinoSQLitePCache.hpp"
+
+// Two tier page cache for SQLite (SQLITE_CONFIG_PCACHE2)
+//
+// RAM1 is an order of magnitude faster than PSRAM but small, so a large page cache has to live in PSRAM, and then
+// every access to a B-tree root or interior page pays PSRAM latency. This cache keeps its pages in two tiers: slots of
+// a buffer the application provides (a static array, which the linker places in RAM1/DTCM), shared by all caches, and
+// buffers taken from EXTMEM one page at a time. New pages of purgeable caches take a free fast slot if there is one.
+// A page in the slow tier that is hit often enough is promoted to the fast tier, which demotes the least recently used
+// unpinned fast page if no slot is free (giving pages fetched again since the last demotion a second chance).
+//
+// SQLite keeps the buffer address of a cached page in the page's extra data (PgHdr, the B-tree MemPage), so a page
+// cannot move while it is cached. Promotion therefore gives the page a fast slot, clears its extra data and returns it
+// from xFetch at once, so SQLite takes it as a new page and reads it again (from the VFS read cache or mirror, when
+// configured); this is what pcache1 does with a page it recycles. A demoted page leaves the cache, its next fetch
+// loads it into the slow tier. Caches that are not purgeable (in-memory databases) keep their pages in the slow tier:
+// their pages are never unpinned for good, so fast slots given to them would not come back.
+//
+// Each cache has a hash table of its pages and a list of its unpinned slow pages in LRU order, the unpinned fast pages
+// of all caches are on one LRU list. A cache at its size takes the least recently used of its unpinned slow pages for
+// a new page, or of its unpinned fast pages if it has no slow ones.
+
+struct TwoTierCache;
+
+struct TwoTierPage
+{
+  sqlite3_pcache_page m_page;     // handed to SQLite, first so the page follows from it
+  unsigned m_key = 0;
+  TwoTierCache* m_cache = nullptr;
+  TwoTierPage* m_hashNext = nullptr;
+  TwoTierPage* m_lruPrev = nullptr; // on the fast LRU list or the slow LRU list of the cache while unpinned
+  TwoTierPage* m_lruNext = nullptr;
+  uint16_t m_hits = 0;            // slow: fetches since loaded, fast: 1 if fetched since demotion last passed it
+  bool m_isFast = false;
+  bool m_isPinned = false;
+};
+
+struct TwoTierLRU
+{
+  TwoTierPage* m_head = nullptr;  // least recently used
+  TwoTierPage* m_tail = nullptr;
+};
+
+struct TwoTierCache
+{
+  int m_pageSize = 0;
+  int m_extraSize = 0;
+  bool m_isPurgeable = false;
+  unsigned m_maxPages = 0;        // cache size asked for by SQLite
+  unsigned m_pageCount = 0;
+  unsigned m_hashSize = 0;        // buckets, a power of two
+  TwoTierPage** m_hash = nullptr;
+  TwoTierLRU m_slowLRU;
+};
+
+static uint8_t* s_fastBase = nullptr;
+static size_t s_fastSize = 0;
+static int s_slotSize = 0;
+static int s_slotCount = 0;
+static void* s_freeSlots = nullptr;           // free fast slots, linked through their first bytes
+static TwoTierLRU s_fastLRU;                  // unpinned fast pages of all purgeable caches
+static uint16_t s_promotionHits = 1;
+static T41SQLite::TwoTierPageCacheStats s_unusedStats;
+static T41SQLite::TwoTierPageCacheStats* s_stats = &s_unusedStats;
+
+static void sqlite3_twotier_lru_remove(TwoTierLRU& io_lru, TwoTierPage* io_page)
+{
+  if (io_page->m_lruPrev != nullptr)
+  {
+    io_page->m_lruPrev->m_lruNext = io_page->m_lruNext;
+  }
+  else
+  {
+    io_lru.m_head = io_page->m_lruNext;
+  }
+
+  if (io_page->m_lruNext != nullptr)
+  {
+    io_page->m_lruNext->m_lruPrev = io_page->m_lruPrev;
+  }
+  else
+  {
+    io_lru.m_tail = io_page->m_lruPrev;
+  }
+
+  io_page->m_lruPrev = nullptr;
+  io_page->m_lruNext = nullptr;
+}
+
+static void sqlite3_twotier_lru_append(TwoTierLRU& io_lru, TwoTierPage* io_page)
+{
+  io_page->m_lruPrev = io_lru.m_tail;
+  io_page->m_lruNext = nullptr;
+
+  if (io_lru.m_tail != nullptr)
+  {
+    io_lru.m_tail->m_lruNext = io_page;
+  }
+  else
+  {
+    io_lru.m_head = io_page;
+  }
+
+  io_lru.m_tail = io_page;
+}
+
+static TwoTierLRU& sqlite3_twotier_lru_of(TwoTierPage* in_page)
+{
+  return in_page->m_isFast ? s_fastLRU : in_page->m_cache->m_slowLRU;
+}
+
+// take io_page off its LRU list, it is about to be used
+static void sqlite3_twotier_pin(TwoTierPage* io_page)
+{
+  if (not io_page->m_isPinned)
+  {
+    if (io_page->m_cache->m_isPurgeable)
+    {
+      sqlite3_twotier_lru_remove(sqlite3_twotier_lru_of(io_page), io_page);
+    }
+
+    io_page->m_isPinned = true;
+  }
+}
+
+static void* sqlite3_twotier_slot_alloc()
+{
+  void* slot = s_freeSlots;
+
+  if (slot != nullptr)
+  {
+    s_freeSlots = *static_cast<void**>(slot);
+  }
+
+  return slot;
+}
+
+static void sqlite3_twotier_slot_free(void* in_slot)
+{
+  *static_cast<void**>(in_slot) = s_freeSlots;
+  s_freeSlots = in_slot;
+}
+
+static void sqlite3_twotier_buffer_free(TwoTierPage* in_page)
+{
+  if (in_page->m_isFast)
+  {
+    sqlite3_twotier_slot_free(in_page->m_page.pBuf);
+    s_stats->m_fastPages--;
+  }
+  else
+  {
+    extmem_free(in_page->m_page.pBuf);
+    s_stats->m_slowPages--;
+  }
+}
+
+static TwoTierPage** sqlite3_twotier_bucket(TwoTierCache* in_cache, unsigned in_key)
+{
+  return &in_cache->m_hash[in_key & (in_cache->m_hashSize - 1)];
+}
+
+static void sqlite3_twotier_hash_remove(TwoTierCache* io_cache, TwoTierPage* io_page, unsigned in_key)
+{
+  for (TwoTierPage** link = sqlite3_twotier_bucket(io_cache, in_key); *link != nullptr; link = &(*link)->m_hashNext)
+  {
+    if (*link == io_page)
+    {
+      *link = io_page->m_hashNext;
+      break;
+    }
+  }
+}
+
+static void sqlite3_twotier_hash_insert(TwoTierCache* io_cache, TwoTierPage* io_page, unsigned in_key)
+{
+  io_page->m_key = in_key;
+  io_page->m_hashNext = *sqlite3_twotier_bucket(io_cache, in_key);
+  *sqlite3_twotier_bucket(io_cache, in_key) = io_page;
+}
+
+// remove io_page from its cache and free it
+static void sqlite3_twotier_page_free(TwoTierPage* io_page)
+{
+  TwoTierCache* cache = io_page->m_cache;
+  sqlite3_twotier_hash_remove(cache, io_page, io_page->m_key);
+
+  if (not io_page->m_isPinned && cache->m_isPurgeable)
+  {
+    sqlite3_twotier_lru_remove(sqlite3_twotier_lru_of(io_page), io_page);
+  }
+
+  sqlite3_twotier_buffer_free(io_page);
+  cache->m_pageCount--;
+  sqlite3_free(io_page);
+}
+
+// double the buckets once there are as many pages, keeps chains short
+static void sqlite3_twotier_hash_grow(TwoTierCache* io_cache)
+{
+  unsigned hashSize = io_cache->m_hashSize == 0 ? 16 : io_cache->m_hashSize * 2;
+  TwoTierPage** hash = static_cast<TwoTierPage**>(sqlite3_malloc64(sizeof(TwoTierPage*) * hashSize));
+
+  if (hash == nullptr)
+  {
+    return; // longer chains, still correct
+  }
+
+  memset(hash, 0, sizeof(TwoTierPage*) * hashSize);
+
+  for (unsigned index = 0; index < io_cache->m_hashSize; index++)
+  {
+    TwoTierPage* page = io_cache->m_hash[index];
+
+    while (page != nullptr)
+    {
+      TwoTierPage* next = page->m_hashNext;
+      page->m_hashNext = hash[page->m_key & (hashSize - 1)];
+      hash[page->m_key & (hashSize - 1)] = page;
+      page = next;
+    }
+  }
+
+  sqlite3_free(io_cache->m_hash);
+  io_cache->m_hash = hash;
+  io_cache->m_hashSize = hashSize;
+}
+
+// fast slot for a page of io_cache, from the free slots or by demoting the least recently used unpinned fast page
+static void* sqlite3_twotier_fast_slot(TwoTierCache* io_cache, bool in_demote)
+{
+  if (io_cache->m_pageSize > s_slotSize)
+  {
+    return nullptr;
+  }
+
+  void* slot = sqlite3_twotier_slot_alloc();
+
+  // a fast page fetched again since it was last looked at here gets a second chance, so a small fast tier keeps the
+  // pages used over and over instead of trading them for each promotion; none left means no promotion this time
+  for (int tries = 0; slot == nullptr && in_demote && s_fastLRU.m_head != nullptr && tries < s_slotCount; tries++)
+  {
+    TwoTierPage* page = s_fastLRU.m_head;
+
+    if (page->m_hits > 0)
+    {
+      page->m_hits = 0;
+      sqlite3_twotier_lru_remove(s_fastLRU, page);
+      sqlite3_twotier_lru_append(s_fastLRU, page);
+      continue;
+    }
+
+    sqlite3_twotier_page_free(page);
+    s_stats->m_demotions++;
+    slot = sqlite3_twotier_slot_alloc();
+  }
+
+  return slot;
+}
+
+// give io_page a fast slot and clear its extra data, so SQLite loads it again; io_page is pinned
+static void sqlite3_twotier_promote(TwoTierPage* io_page)
+{
+  void* slot = sqlite3_twotier_fast_slot(io_page->m_cache, true);
+
+  if (slot == nullptr)
+  {
+    return;
+  }
+
+  sqlite3_twotier_buffer_free(io_page);
+  io_page->m_page.pBuf = slot;
+  io_page->m_isFast = true;
+  io_page->m_hits = 0;
+  memset(io_page->m_page.pExtra, 0, io_page->m_cache->m_extraSize);
+  s_stats->m_fastPages++;
+  s_stats->m_promotions++;
+}
+
+static int sqlite3_twotier_init(void* in_appData)
+{
+  s_freeSlots = nullptr;
+  s_fastLRU = TwoTierLRU();
+  s_slotCount = s_slotSize > 0 ? static_cast<int>(s_fastSize / s_slotSize) : 0;
+
+  for (int index = s_slotCount - 1; index >= 0; index--)
+  {
+    sqlite3_twotier_slot_free(s_fastBase + static_cast<size_t>(index) * s_slotSize);
+  }
+
+  s_stats->m_fastSlots = s_slotCount;
+  return SQLITE_OK;
+}
+
+static void sqlite3_twotier_shutdown(void* in_appData)
+{
+  // SQLite has destroyed its caches by now
+  s_freeSlots = nullptr;
+  s_fastLRU = TwoTierLRU();
+}
+
+static sqlite3_pcache* sqlite3_twotier_create(int in_pageSize, int in_extraSize, int in_isPurgeable)
+{
+  TwoTierCache* cache = static_cast<TwoTierCache*>(sqlite3_malloc(sizeof(TwoTierCache)));
+
+  if (cache == nullptr)
+  {
+    return nullptr;
+  }
+
+  new (cache) TwoTierCache();
+  cache->m_pageSize = in_pageSize;
+  cache->m_extraSize = in_extraSize;
+  cache->m_isPurgeable = in_isPurgeable != 0;
+  sqlite3_twotier_hash_grow(cache);
+
+  if (cache->m_hash == nullptr)
+  {
+    sqlite3_free(cache);
+    return nullptr;
+  }
+
+  return reinterpret_cast<sqlite3_pcache*>(cache);
+}
+
+static void sqlite3_twotier_cachesize(sqlite3_pcache* io_cache, int in_maxPages)
+{
+  TwoTierCache* cache = reinterpret_cast<TwoTierCache*>(io_cache);
+  cache->m_maxPages = in_maxPages > 0 ? static_cast<unsigned>(in_maxPages) : 0;
+
+  // a smaller cache gives up its unpinned pages beyond the new size, slow ones first
+  while (cache->m_isPurgeable && cache->m_pageCount > cache->m_maxPages && cache->m_slowLRU.m_head != nullptr)
+  {
+    sqlite3_twotier_page_free(cache->m_slowLRU.m_head);
+  }
+}
+
+static int sqlite3_twotier_pagecount(sqlite3_pcache* io_cache)
+{
+  return static_cast<int>(reinterpret_cast<TwoTierCache*>(io_cache)->m_pageCount);
+}
+
+// least recently used unpinned page of io_cache, slow pages first, for a new page
+static TwoTierPage* sqlite3_twotier_recyclable(TwoTierCache* io_cache)
+{
+  if (io_cache->m_slowLRU.m_head != nullptr)
+  {
+    return io_cache->m_slowLRU.m_head;
+  }
+
+  for (TwoTierPage* page = s_fastLRU.m_head; page != nullptr; page = page->m_lruNext)
+  {
+    if (page->m_cache == io_cache)
+    {
+      return page;
+    }
+  }
+
+  return nullptr;
+}
+
+static sqlite3_pcache_page* sqlite3_twotier_fetch(sqlite3_pcache* io_cache, unsigned in_key, int in_createFlag)
+{
+  TwoTierCache* cache = reinterpret_cast<TwoTierCache*>(io_cache);
+  TwoTierPage* page = *sqlite3_twotier_bucket(cache, in_key);
+
+  while (page != nullptr && page->m_key != in_key)
+  {
+    page = page->m_hashNext;
+  }
+
+  if (page != nullptr)
+  {
+    if (page->m_isFast)
+    {
+      s_stats->m_fastHits++;
+      page->m_hits = 1;
+    }
+    else
+    {
+      s_stats->m_slowHits++;
+
+      if (page->m_hits < s_promotionHits)
+      {
+        page->m_hits++;
+      }
+
+      // only a page fetched to be used may be promoted, and only while SQLite holds no reference to it
+      if (page->m_hits >= s_promotionHits && in_createFlag != 0 && not page->m_isPinned && cache->m_isPurgeable)
+      {
+        sqlite3_twotier_pin(page);
+        sqlite3_twotier_promote(page);
+      }
+    }
+
+    sqlite3_twotier_pin(page);
+    return &page->m_page;
+  }
+
+  if (in_createFlag == 0)
+  {
+    return nullptr;
+  }
+
+  // at its size the cache takes one of its unpinned pages, with its buffer, or creates a page only if it must
+  if (cache->m_isPurgeable && cache->m_maxPages > 0 && cache->m_pageCount >= cache->m_maxPages)
+  {
+    TwoTierPage* recycled = sqlite3_twotier_recyclable(cache);
+
+    if (recycled != nullptr)
+    {
+      sqlite3_twotier_hash_remove(cache, recycled, recycled->m_key);
+      sqlite3_twotier_pin(recycled);
+      sqlite3_twotier_hash_insert(cache, recycled, in_key);
+      recycled->m_hits = 0;
+      memset(recycled->m_page.pExtra, 0, cache->m_extraSize);
+      s_stats->m_misses++;
+      return &recycled->m_page;
+    }
+
+    if (in_createFlag == 1)
+    {
+      return nullptr;
+    }
+  }
+
+  page = static_cast<TwoTierPage*>(sqlite3_malloc64(sizeof(TwoTierPage) + cache->m_extraSize));
+
+  if (page == nullptr)
+  {
+    return nullptr;
+  }
+
+  new (page) TwoTierPage();
+  page->m_page.pExtra = page + 1;
+  page->m_page.pBuf = cache->m_isPurgeable ? sqlite3_twotier_fast_slot(cache, false) : nullptr;
+  page->m_isFast = (page->m_page.pBuf != nullptr);
+
+  if (not page->m_isFast)
+  {
+    page->m_page.pBuf = extmem_malloc(cache->m_pageSize);
+
+    if (page->m_page.pBuf == nullptr)
+    {
+      sqlite3_free(page);
+      return nullptr;
+    }
+  }
+
+  if (page->m_isFast)
+  {
+    s_stats->m_fastPages++;
+  }
+  else
+  {
+    s_stats->m_slowPages++;
+  }
+
+  if (cache->m_pageCount >= cache->m_hashSize)
+  {
+    sqlite3_twotier_hash_grow(cache);
+  }
+
+  memset(page->m_page.pExtra, 0, cache->m_extraSize);
+  page->m_cache = cache;
+  page->m_isPinned = true;
+  sqlite3_twotier_hash_insert(cache, page, in_key);
+  cache->m_pageCount++;
+  s_stats->m_misses++;
+  return &page->m_page;
+}
+
+static void sqlite3_twotier_unpin(sqlite3_pcache* io_cache, sqlite3_pcache_page* io_page, int in_discard)
+{
+  TwoTierCache* cache = reinterpret_cast<TwoTierCache*>(io_cache);
+  TwoTierPage* page = reinterpret_cast<TwoTierPage*>(io_page);
+
+  if (in_discard != 0 || (cache->m_isPurgeable && cache->m_pageCount > cache->m_maxPages))
+  {
+    sqlite3_twotier_page_free(page);
+    return;
+  }
+
+  page->m_isPinned = false;
+
+  if (cache->m_isPurgeable)
+  {
+    sqlite3_twotier_lru_append(sqlite3_twotier_lru_of(page), page);
+  }
+}
+
+static void sqlite3_twotier_rekey(sqlite3_pcache* io_cache, sqlite3_pcache_page* io_page, unsigned in_oldKey,
+                                  unsigned in_newKey)
+{
+  TwoTierCache* cache = reinterpret_cast<TwoTierCache*>(io_cache);
+  TwoTierPage* page = reinterpret_cast<TwoTierPage*>(io_page);
+  sqlite3_twotier_hash_remove(cache, page, in_oldKey);
+  sqlite3_twotier_hash_insert(cache, page, in_newKey);
+}
+
+static void sqlite3_twotier_truncate(sqlite3_pcache* io_cache, unsigned in_limit)
+{
+  TwoTierCache* cache = reinterpret_cast<TwoTierCache*>(io_cache);
+
+  for (unsigned index = 0; index < cache->m_hashSize; index++)
+  {
+    TwoTierPage* page = cache->m_hash[index];
+
+    while (page != nullptr)
+    {
+      TwoTierPage* next = page->m_hashNext;
+
+      if (page->m_key >= in_limit)
+      {
+        sqlite3_twotier_page_free(page);
+      }
+
+      page = next;
+    }
+  }
+}
+
+static void sqlite3_twotier_destroy(sqlite3_pcache* io_cache)
+{
+  TwoTierCache* cache = reinterpret_cast<TwoTierCache*>(io_cache);
+  sqlite3_twotier_truncate(io_cache, 0);
+  sqlite3_free(cache->m_hash);
+  sqlite3_free(cache);
+}
+
+static void sqlite3_twotier_shrink(sqlite3_pcache* io_cache)
+{
+  TwoTierCache* cache = reinterpret_cast<TwoTierCache*>(io_cache);
+
+  if (not cache->m_isPurgeable)
+  {
+    return;
+  }
+
+  while (TwoTierPage* page = sqlite3_twotier_recyclable(cache))
+  {
+    sqlite3_twotier_page_free(page);
+  }
+}
+
+// SQLite page cache methods structure
+static const sqlite3_pcache_methods2 sqlite3_twotier_methods = {
+    1,
+    nullptr, // pArg - not needed
+    sqlite3_twotier_init,
+    sqlite3_twotier_shutdown,
+    sqlite3_twotier_create,
+    sqlite3_twotier_cachesize,
+    sqlite3_twotier_pagecount,
+    sqlite3_twotier_fetch,
+    sqlite3_twotier_unpin,
+    sqlite3_twotier_rekey,
+    sqlite3_twotier_truncate,
+    sqlite3_twotier_destroy,
+    sqlite3_twotier_shrink
+};
+
+// Function to configure SQLite to use the two tier page cache
+int sqlite3_use_two_tier_pcache(void* io_fastBuffer, size_t in_fastSize, int in_slotSize, int in_promotionHits,
+                                T41SQLite::TwoTierPageCacheStats* io_stats)
+{
+  // slots hold a pointer while free and stay 8 byte aligned
+  uintptr_t begin = (reinterpret_cast<uintptr_t>(io_fastBuffer) + 7) & ~static_cast<uintptr_t>(7);
+  size_t skipped = begin - reinterpret_cast<uintptr_t>(io_fastBuffer);
+  s_fastBase = io_fastBuffer != nullptr ? reinterpret_cast<uint8_t*>(begin) : nullptr;
+  s_fastSize = io_fastBuffer != nullptr && in_fastSize > skipped ? in_fastSize - skipped : 0;
+  s_slotSize = in_slotSize >= static_cast<int>(sizeof(void*)) ? (in_slotSize + 7) & ~7 : 0;
+  s_promotionHits = static_cast<uint16_t>(min(max(in_promotionHits, 1), 65535));
+  s_stats = io_stats != nullptr ? io_stats : &s_unusedStats;
+  return sqlite3_config(SQLITE_CONFIG_PCACHE2, &sqlite3_twotier_methods);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "ArduinoSQLite.hpp"
+
+// Function to configure SQLite to cache pages in slots of in_slotSize bytes in io_fastBuffer (fast tier) and in
+// EXTMEM (slow tier), promoting pages hit in_promotionHits times, counting into io_stats (may be nullptr)
+int sqlite3_use_two_tier_pcache(void* io_fastBuffer, size_t in_fastSize, int in_slotSize, int in_promotionHits,
+                                T41SQLite::TwoTierPageCacheStats* io_stats);
@@ -1,9 +1,21 @@
 #include "ArduinoSQLite.hpp"
 #include "ArduinoSQLiteEXTMEM.hpp"
+#include "ArduinoSQLitePCache.hpp"
+#include "ArduinoSQLite_vfs.hpp"
 
-int T41SQLite::begin(FS* io_filesystem, bool in_useEXTMEM)
+int T41SQLite::begin(FS* io_filesystem, bool in_useEXTMEM, size_t in_readCacheSizeInBytes, size_t in_writeBufferSizeInBytes)
 {
-  if (in_useEXTMEM)
+  if (m_useHybridMemory)
+  {
+    if (int result = sqlite3_use_hybrid_memory(m_hybridRAM1Buffer, m_hybridRAM1SizeInBytes,
+                                               static_cast<int>(m_hybridRAM1MaxAllocationInBytes),
+                                               static_cast<int>(m_hybridRAM2MaxAllocationInBytes), &m_hybridMemoryStats);
+        result != SQLITE_OK)
+    {
+      return result;
+    }
+  }
+  else if (in_useEXTMEM)
   {
     if (int result = sqlite3_use_extmem(); result != SQLITE_OK)
     {
@@ -11,20 +23,351 @@ int T41SQLite::begin(FS* io_filesystem, bool in_useEXTMEM)
     }
   }
 
-  m_filesystem = io_filesystem;
-  return sqlite3_initialize();
+  if (m_useTwoTierPageCache)
+  {
+    if (int result = sqlite3_use_two_tier_pcache(m_twoTierFastBuffer, m_twoTierFastSizeInBytes,
+                                                 static_cast<int>(m_twoTierPageSizeInBytes), m_twoTierPromotionHits,
+                                                 &m_twoTierPageCacheStats);
+        result != SQLITE_OK)
+    {
+      return result;
+    }
+  }
+  else if (m_pageCachePageCount > 0 && m_pageCacheBuffer == nullptr)
+  {
+    int headerSize = 0;
+
+    if (int result = sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &headerSize); result != SQLITE_OK)
+    {
+      return result;
+    }
+
+    // slots stay 8 byte aligned
+    int slotSize = (static_cast<int>(m_pageCachePageSizeInBytes) + headerSize + 7) & ~7;
+    size_t bufferSize = static_cast<size_t>(slotSize) * static_cast<size_t>(m_pageCachePageCount);
+    m_pageCacheBuffer = m_pageCacheRegion == MemoryRegion::PSRAM ? extmem_malloc(bufferSize) : malloc(bufferSize);
+
+    if (m_pageCacheBuffer == nullptr)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    if (int result = sqlite3_config(SQLITE_CONFIG_PAGECACHE, m_pageCacheBuffer, slotSize, m_pageCachePageCount);
+        result != SQLITE_OK)
+    {
+      return result;
+    }
+  }
+
+  if (m_mirrorSizeLimitInBytes > 0)
+  {
+    sqlite3_int64 mmapSize = static_cast<sqlite3_int64>(m_mirrorSizeLimitInBytes);
+
+    if (int result = sqlite3_config(SQLITE_CONFIG_MMAP_SIZE, mmapSize, mmapSize); result != SQLITE_OK)
+    {
+      return result;
+    }
+  }
+
+  if (int result = setDefaultFilesystem(io_filesystem); result != SQLITE_OK)
+  {
+    return result;
+  }
+
+  m_readCacheSizeInBytes = in_readCacheSizeInBytes;
+  m_writeBufferSizeInBytes = in_writeBufferSizeInBytes;
+
+  if (int result = sqlite3_initialize(); result != SQLITE_OK)
+  {
+    return result;
+  }
+
+  m_isInitialized = true;
+
+  // filesystems added before begin() get their VFS now, sqlite3_vfs_register() must not run before sqlite3_config()
+  for (const FilesystemEntry& entry : m_filesystemEntries)
+  {
+    if (entry.m_name[0] != '\0')
+    {
+      if (int result = sqlite3_vfs_register(sqlite3_teensy_fs_vfs(entry.m_name), 0); result != SQLITE_OK)
+      {
+        return result;
+      }
+    }
+  }
+
+  return SQLITE_OK;
 }
 
 int T41SQLite::end()
 {
+  // sqlite3_shutdown() ignores errors of the deferred work it does last, so it is done here first
+  int barrierResult = sqlite3_teensy_barrier();
   int result = sqlite3_shutdown();
-  m_filesystem = nullptr;
-  return result;
+  m_isInitialized = false;
+
+  // SQLite holds no page in the region after shutdown, the next begin() sets it up again
+  if (result == SQLITE_OK && m_pageCacheBuffer != nullptr)
+  {
+    sqlite3_config(SQLITE_CONFIG_PAGECACHE, nullptr, 0, 0);
+
+    if (m_pageCacheRegion == MemoryRegion::PSRAM)
+    {
+      extmem_free(m_pageCacheBuffer);
+    }
+    else
+    {
+      free(m_pageCacheBuffer);
+    }
+
+    m_pageCacheBuffer = nullptr;
+  }
+
+  return result == SQLITE_OK ? barrierResult : result;
 }
 
 FS* T41SQLite::getFilesystem()
 {
-  return m_filesystem;
+  return m_isInitialized ? m_filesystemEntries[0].m_filesystem : nullptr;
+}
+
+int T41SQLite::setDefaultFilesystem(FS* io_filesystem)
+{
+  FilesystemEntry& defaultEntry = m_filesystemEntries[0];
+
+  if (defaultEntry.m_filesystem == io_filesystem)
+  {
+    return SQLITE_OK;
+  }
+
+  FilesystemEntry* fsEntry = nullptr;
+  FilesystemEntry* freeEntry = nullptr;
+
+  for (int i = 1; i < MAX_FILESYSTEMS; i++)
+  {
+    if (m_filesystemEntries[i].m_filesystem == io_filesystem)
+    {
+      fsEntry = &m_filesystemEntries[i];
+    }
+
+    if (m_filesystemEntries[i].m_filesystem == nullptr && freeEntry == nullptr)
+    {
+      freeEntry = &m_filesystemEntries[i];
+    }
+  }
+
+  // the previous filesystem of begin() keeps what was set for it in a slot of its own, unless nothing was
+  bool isDefaultKept = defaultEntry.m_filesystem != nullptr
+                       && (defaultEntry.m_name[0] != '\0' || defaultEntry.m_sdfs != nullptr
+                           || defaultEntry.m_characteristics.m_sectorSize != 0);
+  FilesystemEntry previousEntry = defaultEntry;
+  defaultEntry = FilesystemEntry();
+
+  // what was set for io_filesystem before comes along to entry 0
+  if (fsEntry != nullptr)
+  {
+    defaultEntry = *fsEntry;
+    *fsEntry = FilesystemEntry();
+    freeEntry = fsEntry;
+  }
+
+  if (isDefaultKept)
+  {
+    if (freeEntry == nullptr)
+    {
+      defaultEntry = previousEntry;
+      return SQLITE_FULL;
+    }
+
+    *freeEntry = previousEntry;
+  }
+
+  defaultEntry.m_filesystem = io_filesystem;
+  return SQLITE_OK;
+}
+
+int T41SQLite::addFilesystem(const char* in_name, FS* io_filesystem)
+{
+  size_t nameLength = strlen(in_name);
+
+  if (io_filesystem == nullptr || nameLength == 0 || nameLength > MAX_FILESYSTEM_NAME ||
+      strspn(in_name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_") != nameLength)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  FilesystemEntry* freeEntry = nullptr;
+  FilesystemEntry* fsEntry = nullptr;
+
+  for (FilesystemEntry& entry : m_filesystemEntries)
+  {
+    if (strcmp(entry.m_name, in_name) == 0)
+    {
+      return entry.m_filesystem == io_filesystem ? SQLITE_OK : SQLITE_MISUSE;
+    }
+
+    if (entry.m_filesystem == io_filesystem)
+    {
+      fsEntry = &entry;
+    }
+
+    if (entry.m_filesystem == nullptr && freeEntry == nullptr && &entry != &m_filesystemEntries[0])
+    {
+      freeEntry = &entry;
+    }
+  }
+
+  if (fsEntry != nullptr && fsEntry->m_name[0] != '\0')
+  {
+    return SQLITE_MISUSE;
+  }
+
+  FilesystemEntry* entry = fsEntry != nullptr ? fsEntry : freeEntry;
+
+  if (entry == nullptr)
+  {
+    return SQLITE_FULL;
+  }
+
+  // after begin() the VFS is registered right away
+  if (m_isInitialized)
+  {
+    sqlite3_vfs* vfs = sqlite3_teensy_fs_vfs(in_name);
+
+    if (vfs == nullptr)
+    {
+      return SQLITE_FULL;
+    }
+
+    if (int result = sqlite3_vfs_register(vfs, 0); result != SQLITE_OK)
+    {
+      return result;
+    }
+  }
+
+  entry->m_filesystem = io_filesystem;
+  strcpy(entry->m_name, in_name);
+  return SQLITE_OK;
+}
+
+FS* T41SQLite::getFilesystem(const char* in_name) const
+{
+  for (const FilesystemEntry& entry : m_filesystemEntries)
+  {
+    if (entry.m_name[0] != '\0' && strcmp(entry.m_name, in_name) == 0)
+    {
+      return entry.m_filesystem;
+    }
+  }
+
+  return nullptr;
+}
+
+T41SQLite::FilesystemCharacteristics T41SQLite::getDefaultCharacteristics(StorageMedium in_medium)
+{
+  switch (in_medium)
+  {
+    // SdFat writes synchronously and only updates the directory entry (file size)
+    // after the data, so appends are safe. Not POWERSAFE_OVERWRITE: the card's FTL rewrites
+    // whole erase blocks, so a power loss during a write can damage neighbouring sectors and
+    // SQLite has to pad journal writes. Not SEQUENTIAL: journal data sits in the VFS
+    // write buffer until xSync, so writes to different files can reach the card out of order.
+    case StorageMedium::SD_CARD:
+      return { 512, SQLITE_IOCAP_SAFE_APPEND };
+
+    // LittleFS is copy-on-write, data is never overwritten in place. The sector size is the
+    // 4 KiB erase block of the NOR flash chips used with Teensy 4.1.
+    case StorageMedium::LITTLEFS_FLASH:
+      return { 4096, SQLITE_IOCAP_SAFE_APPEND | SQLITE_IOCAP_POWERSAFE_OVERWRITE };
+
+    // contents do not survive a power loss anyway, so write ordering does not matter
+    case StorageMedium::RAM_DISK:
+      return { 512, SQLITE_IOCAP_SAFE_APPEND | SQLITE_IOCAP_SEQUENTIAL | SQLITE_IOCAP_POWERSAFE_OVERWRITE };
+  }
+
+  return { 0, 0 };
+}
+
+int T41SQLite::setFilesystemCharacteristics(FS* in_filesystem, const FilesystemCharacteristics& in_characteristics)
+{
+  FilesystemEntry* freeEntry = nullptr;
+
+  for (FilesystemEntry& entry : m_filesystemEntries)
+  {
+    if (entry.m_filesystem == in_filesystem)
+    {
+      entry.m_characteristics = in_characteristics;
+      return SQLITE_OK;
+    }
+
+    if (entry.m_filesystem == nullptr && freeEntry == nullptr && &entry != &m_filesystemEntries[0])
+    {
+      freeEntry = &entry;
+    }
+  }
+
+  if (freeEntry == nullptr)
+  {
+    return SQLITE_FULL;
+  }
+
+  freeEntry->m_filesystem = in_filesystem;
+  freeEntry->m_characteristics = in_characteristics;
+  return SQLITE_OK;
+}
+
+T41SQLite::FilesystemCharacteristics T41SQLite::getFilesystemCharacteristics(const FS* in_filesystem) const
+{
+  for (const FilesystemEntry& entry : m_filesystemEntries)
+  {
+    if (entry.m_filesystem == in_filesystem)
+    {
+      return entry.m_characteristics;
+    }
+  }
+
+  return { 0, 0 };
+}
+
+int T41SQLite::setRawSectorAccess(FS* in_filesystem, SdFs* io_sdfs)
+{
+  FilesystemEntry* freeEntry = nullptr;
+
+  for (FilesystemEntry& entry : m_filesystemEntries)
+  {
+    if (entry.m_filesystem == in_filesystem)
+    {
+      entry.m_sdfs = io_sdfs;
+      return SQLITE_OK;
+    }
+
+    if (entry.m_filesystem == nullptr && freeEntry == nullptr && &entry != &m_filesystemEntries[0])
+    {
+      freeEntry = &entry;
+    }
+  }
+
+  if (freeEntry == nullptr)
+  {
+    return SQLITE_FULL;
+  }
+
+  freeEntry->m_filesystem = in_filesystem;
+  freeEntry->m_sdfs = io_sdfs;
+  return SQLITE_OK;
+}
+
+SdFs* T41SQLite::getRawSectorAccess(const FS* in_filesystem) const
+{
+  for (const FilesystemEntry& entry : m_filesystemEntries)
+  {
+    if (entry.m_filesystem == in_filesystem)
+    {
+      return entry.m_sdfs;
+    }
+  }
+
+  return nullptr;
 }
 
 void T41SQLite::setDBDirFullPath(const String& in_dbDirFullpath)
@@ -37,7 +380,285 @@ const String& T41SQLite::getDBDirFullPath() const
   return m_dbDirFullpath;
 }
 
+void T41SQLite::setSyncPolicy(SyncPolicy in_syncPolicy)
+{
+  if (m_syncPolicy == SyncPolicy::DEFERRED && in_syncPolicy != SyncPolicy::DEFERRED)
+  {
+    sqlite3_teensy_barrier();
+  }
+
+  m_syncPolicy = in_syncPolicy;
+}
+
+T41SQLite::SyncPolicy T41SQLite::getSyncPolicy() const
+{
+  return m_syncPolicy;
+}
+
+int T41SQLite::poll(uint32_t in_budgetMicros)
+{
+  return sqlite3_teensy_poll(in_budgetMicros);
+}
+
+int T41SQLite::barrier()
+{
+  return sqlite3_teensy_barrier();
+}
+
+void T41SQLite::setBatchAtomicWriteSize(size_t in_sizeInBytes)
+{
+  m_batchAtomicWriteSizeInBytes = in_sizeInBytes;
+}
+
+size_t T41SQLite::getBatchAtomicWriteSize() const
+{
+  return m_batchAtomicWriteSizeInBytes;
+}
+
+void T41SQLite::setMirrorSizeLimit(size_t in_sizeInBytes)
+{
+  m_mirrorSizeLimitInBytes = in_sizeInBytes;
+}
+
+size_t T41SQLite::getMirrorSizeLimit() const
+{
+  return m_mirrorSizeLimitInBytes;
+}
+
+void T41SQLite::setPageCache(size_t in_pageSizeInBytes, int in_pageCount, MemoryRegion in_region)
+{
+  m_pageCachePageSizeInBytes = in_pageSizeInBytes;
+  m_pageCachePageCount = in_pageCount > 0 ? in_pageCount : 0;
+  m_pageCacheRegion = in_region;
+}
+
+size_t T41SQLite::getPageCachePageSize() const
+{
+  return m_pageCachePageSizeInBytes;
+}
+
+int T41SQLite::getPageCachePageCount() const
+{
+  return m_pageCachePageCount;
+}
+
+T41SQLite::MemoryRegion T41SQLite::getPageCacheRegion() const
+{
+  return m_pageCacheRegion;
+}
+
+T41SQLite::PageCacheStats T41SQLite::getPageCacheStats() const
+{
+  PageCacheStats stats;
+  int current = 0;
+  int peak = 0;
+
+  if (m_pageCacheBuffer != nullptr)
+  {
+    stats.m_slots = static_cast<uint32_t>(m_pageCachePageCount);
+  }
+
+  sqlite3_status(SQLITE_STATUS_PAGECACHE_USED, &current, &peak, 0);
+  stats.m_slotsUsed = static_cast<uint32_t>(current);
+  stats.m_slotsPeak = static_cast<uint32_t>(peak);
+  sqlite3_status(SQLITE_STATUS_PAGECACHE_OVERFLOW, &current, &peak, 0);
+  stats.m_overflowBytes = static_cast<uint32_t>(current);
+  stats.m_overflowPeak = static_cast<uint32_t>(peak);
+  sqlite3_status(SQLITE_STATUS_PAGECACHE_SIZE, &current, &peak, 0);
+  stats.m_largestRequest = static_cast<uint32_t>(peak);
+  return stats;
+}
+
+void T41SQLite::setTwoTierPageCache(void* io_fastBuffer, size_t in_fastSizeInBytes, size_t in_pageSizeInBytes,
+                                    int in_promotionHits)
+{
+  m_twoTierFastBuffer = io_fastBuffer;
+  m_twoTierFastSizeInBytes = in_fastSizeInBytes;
+  m_twoTierPageSizeInBytes = in_pageSizeInBytes;
+  m_twoTierPromotionHits = in_promotionHits;
+  m_useTwoTierPageCache = true;
+}
+
+bool T41SQLite::isTwoTierPageCache() const
+{
+  return m_useTwoTierPageCache;
+}
+
+T41SQLite::TwoTierPageCacheStats& T41SQLite::getTwoTierPageCacheStats()
+{
+  return m_twoTierPageCacheStats;
+}
+
+void T41SQLite::resetTwoTierPageCacheStats()
+{
+  TwoTierPageCacheStats stats;
+  stats.m_fastSlots = m_twoTierPageCacheStats.m_fastSlots;
+  stats.m_fastPages = m_twoTierPageCacheStats.m_fastPages;
+  stats.m_slowPages = m_twoTierPageCacheStats.m_slowPages;
+  m_twoTierPageCacheStats = stats;
+}
+
+void T41SQLite::resetPageCacheStats()
+{
+  int current = 0;
+  int peak = 0;
+  sqlite3_status(SQLITE_STATUS_PAGECACHE_USED, &current, &peak, 1);
+  sqlite3_status(SQLITE_STATUS_PAGECACHE_OVERFLOW, &current, &peak, 1);
+  sqlite3_status(SQLITE_STATUS_PAGECACHE_SIZE, &current, &peak, 1);
+}
+
+size_t T41SQLite::getReadCacheSize() const
+{
+  return m_readCacheSizeInBytes;
+}
+
+size_t T41SQLite::getWriteBufferSize() const
+{
+  return m_writeBufferSizeInBytes;
+}
+
+T41SQLite::ReadCacheStats& T41SQLite::getReadCacheStats()
+{
+  return m_readCacheStats;
+}
+
+void T41SQLite::resetReadCacheStats()
+{
+  m_readCacheStats = ReadCacheStats();
+}
+
+T41SQLite::FilePoolStats& T41SQLite::getFilePoolStats()
+{
+  return m_filePoolStats;
+}
+
+void T41SQLite::resetFilePoolStats()
+{
+  m_filePoolStats = FilePoolStats();
+}
+
+int T41SQLite::flushMemoryDatabases()
+{
+  return sqlite3_teensy_mem_flush();
+}
+
+T41SQLite::MemoryVFSStats& T41SQLite::getMemoryVFSStats()
+{
+  return m_memoryVFSStats;
+}
+
+void T41SQLite::resetMemoryVFSStats()
+{
+  m_memoryVFSStats = MemoryVFSStats();
+}
+
+void T41SQLite::setTier(const char* in_filesystemName, size_t in_sizeInBytes)
+{
+  strncpy(m_tierFilesystemName, in_filesystemName, MAX_FILESYSTEM_NAME);
+  m_tierFilesystemName[MAX_FILESYSTEM_NAME] = '\0';
+  m_tierSizeInBytes = in_sizeInBytes;
+}
+
+const char* T41SQLite::getTierFilesystemName() const
+{
+  return m_tierFilesystemName;
+}
+
+size_t T41SQLite::getTierSize() const
+{
+  return m_tierSizeInBytes;
+}
+
+T41SQLite::TierStats& T41SQLite::getTierStats()
+{
+  return m_tierStats;
+}
+
+void T41SQLite::resetTierStats()
+{
+  m_tierStats = TierStats();
+}
+
+T41SQLite::CompressionStats& T41SQLite::getCompressionStats()
+{
+  return m_compressionStats;
+}
+
+void T41SQLite::resetCompressionStats()
+{
+  m_compressionStats = CompressionStats();
+}
+
+T41SQLite::LogStats& T41SQLite::getLogStats()
+{
+  return m_logStats;
+}
+
+void T41SQLite::resetLogStats()
+{
+  m_logStats = LogStats();
+}
+
+T41SQLite::RawSectorStats& T41SQLite::getRawSectorStats()
+{
+  return m_rawSectorStats;
+}
+
+void T41SQLite::resetRawSectorStats()
+{
+  m_rawSectorStats = RawSectorStats();
+}
+
+T41SQLite::AllocationStats& T41SQLite::getAllocationStats()
+{
+  return m_allocationStats;
+}
+
+void T41SQLite::resetAllocationStats()
+{
+  m_allocationStats = AllocationStats();
+}
+
+void T41SQLite::setHybridMemory(void* io_ram1Buffer, size_t in_ram1SizeInBytes, size_t in_ram1MaxAllocationInBytes,
+                                size_t in_ram2MaxAllocationInBytes)
+{
+  m_hybridRAM1Buffer = io_ram1Buffer;
+  m_hybridRAM1SizeInBytes = in_ram1SizeInBytes;
+  m_hybridRAM1MaxAllocationInBytes = in_ram1MaxAllocationInBytes;
+  m_hybridRAM2MaxAllocationInBytes = in_ram2MaxAllocationInBytes;
+  m_useHybridMemory = true;
+}
+
+bool T41SQLite::isHybridMemory() const
+{
+  return m_useHybridMemory;
+}
+
+T41SQLite::HybridMemoryStats& T41SQLite::getHybridMemoryStats()
+{
+  return m_hybridMemoryStats;
+}
+
+void T41SQLite::resetHybridMemoryStats()
+{
+  HybridMemoryStats stats;
+  stats.m_ram1Used = stats.m_ram1Peak = m_hybridMemoryStats.m_ram1Used;
+  stats.m_ram2Used = stats.m_ram2Peak = m_hybridMemoryStats.m_ram2Used;
+  stats.m_psramUsed = stats.m_psramPeak = m_hybridMemoryStats.m_psramUsed;
+  m_hybridMemoryStats = stats;
+}
+
 int T41SQLite::setLogCallback(LogCallback in_callback, void* in_forUseInCallback)
 {
   return sqlite3_config(SQLITE_CONFIG_LOG, in_callback, in_forUseInCallback);
 }
+
+int T41SQLite::checkpoint(sqlite3* io_db, CheckpointMode in_mode, int* out_walFrames, int* out_checkpointedFrames, const char* in_schema)
+{
+  return sqlite3_wal_checkpoint_v2(io_db, in_schema, static_cast<int>(in_mode), out_walFrames, out_checkpointedFrames);
+}
+
+int T41SQLite::setAutoCheckpoint(sqlite3* io_db, int in_frames)
+{
+  return sqlite3_wal_autocheckpoint(io_db, in_frames);
+}
@@ -28,10 +28,13 @@
 **
 **   The following VFS features are omitted:
 **
-**     1. File locking. The user must ensure that there is at most one
-**        connection to each database when using this VFS. Multiple
-**        connections to a single shared-cache count as a single connection
-**        for the purposes of the previous statement.
+**     1. File locking. In rollback journal mode the user must ensure that
+**        there is at most one connection to each database when using this
+**        VFS, or that connections to the same database do not overlap
+**        their transactions. Multiple connections to a single shared-cache
+**        count as a single connection for the purposes of the previous
+**        statement. In WAL mode the wal-index locks (see WAL MODE) let
+**        connections of this program share a database.
 **
 **     2. The loading of dynamic extensions (shared libraries).
 **
@@ -106,14 +109,410 @@
 **
 **   Much more efficient if the underlying OS is not caching write 
 **   operations.
+**
+** MAIN DATABASE READ-CACHING
+**
+**   SQLite re-reads the same few pages (the schema page, B-tree roots
+**   and interior nodes) for nearly every statement. Without OS caching
+**   each of those reads is a seek and a read on the sd card.
+**
+**   If T41SQLite::begin() is given a non-zero read cache size, every
+**   main database file gets a cache of SQLITE_VFS_READ_CACHE_BLOCKSZ
+**   byte blocks, aligned to multiples of the block size in the file.
+**   The block data is allocated with extmem_malloc(), i.e. in PSRAM, or
+**   in the RAM2 (DMAMEM) heap if no PSRAM is fitted. Blocks are evicted
+**   in least recently used order. Writes and truncates update the cached
+**   blocks, so the cache never has to be flushed. Hits, misses and
+**   evictions are counted in T41SQLite::getReadCacheStats().
+**
+**   Each connection opens a database file of its own, with a cache of its
+**   own. A write or truncate through one of them marks the caches of the
+**   others open on the same path stale, and a stale cache is dropped when
+**   its connection takes the SHARED lock of its next transaction.
+**
+** READ-AHEAD
+**
+**   Full table scans and exports read a file front to back, one page (or
+**   read cache block) at a time. Each of those reads is a seek and a short
+**   read on the card. Every file therefore watches whether its reads
+**   continue where the previous one ended. After a few sequential reads,
+**   the next read fetches a whole window of the file with one multi-sector
+**   read into a read-ahead buffer, and following reads are copied from
+**   there. The window starts at four times the read size (at least four
+**   sectors) and doubles with every refill while the reads stay
+**   sequential, up to SQLITE_VFS_READ_AHEAD_MAXSZ. The buffer is only
+**   allocated (with extmem_malloc()) once a file is read sequentially,
+**   stays with the file handle pool slot for the files opened in it later
+**   and is kept coherent with writes like the read cache, including writes
+**   of other connections. Refills and hits are counted in
+**   T41SQLite::getReadCacheStats() as well.
+**
+** MAIN DATABASE WRITE-BACK BUFFERING
+**
+**   When committing a transaction SQLite writes every dirty page to the
+**   database file with a separate xWrite() call, followed by one xSync().
+**   Written through one by one, every page costs a seek, a write and a
+**   flush on the sd card.
+**
+**   If T41SQLite::begin() is given a non-zero write buffer size, the
+**   pages written to a main database file are kept in an EXTMEM buffer
+**   (sorted by file offset) until xSync() or xClose() is called, or until
+**   the buffer is full. They are then written out in ascending offset
+**   order with a single flush at the end. Runs of adjacent pages are
+**   written with one call of up to SQLITE_VFS_WRITE_BACK_MERGESZ bytes,
+**   so the card sees multi-sector writes instead of single pages. Reads
+**   and the reported file size take the buffered pages into account.
+**   Another connection to the same database writes out the buffer when it
+**   takes its SHARED lock, e.g. after a commit with PRAGMA synchronous=OFF,
+**   which never calls xSync().
+**
+**   This does not weaken the rollback journal: SQLite syncs the journal
+**   before it writes the first page to the database file, and it syncs
+**   the database file before it deletes the journal.
+**
+** SYNC POLICY
+**
+**   SQLite tells the VFS when data must reach the media by calling
+**   xSync(), how often depends on PRAGMA synchronous. By default
+**   (T41SQLite::SyncPolicy::STRICT) this VFS additionally flushes the
+**   file after every single write. COMMIT_ONLY only flushes in xSync(),
+**   so the journal and the database (or the WAL) are flushed exactly where
+**   SQLite needs them on the media; fewer syncs are a matter of PRAGMA
+**   synchronous.
+**
+**   DEFERRED keeps commits from stalling loop(): xSync() of a database,
+**   journal or WAL file only queues the file. T41SQLite::poll() then
+**   writes the journal buffer, the database write-back buffer (one merged
+**   run at a time) and flushes, in the order SQLite synced the files,
+**   until its time budget is used up. Deleting a journal kept open by the
+**   file handle pool is deferred until the queue is empty, so after a
+**   power loss the journal rolls back whatever commits had not reached
+**   the database yet. Any operation that would break that order (the
+**   next transaction opening the journal, PERSIST/TRUNCATE journal
+**   resets, a WAL write after a checkpoint, a full write-back buffer)
+**   does the queued work first, as does T41SQLite::barrier(). Closing a
+**   queued file does the work queued up to it, and so does another
+**   connection to the same database starting a read transaction.
+**   Database writes are only deferred if T41SQLite::begin() was given a
+**   write buffer.
+**
+** WAL MODE
+**
+**   The io methods are version 2, so PRAGMA journal_mode=WAL can be used
+**   (the library must be built without SQLITE_OMIT_WAL). There is only one
+**   process, so the wal-index ("shared memory") is not backed by a -shm
+**   file: its regions are allocated with sqlite3_malloc() and shared by all
+**   connections in the program that open the same database path. The WAL
+**   file gets the same write buffer as rollback journals, so each frame
+**   header and page are appended with one write; the buffer is written
+**   out when the writer releases the write lock of the wal-index, so that
+**   other connections can read the frames of every commit. PRAGMA
+**   locking_mode=EXCLUSIVE works as well, SQLite then keeps the wal-index
+**   in heap memory itself. Checkpoints can be driven with
+**   T41SQLite::checkpoint().
+**
+** PREALLOCATION
+**
+**   Growing the database one page at a time lets the FAT layer allocate
+**   clusters one by one, interleaved with those of the journal, which
+**   fragments the file. SQLITE_FCNTL_CHUNK_SIZE and SQLITE_FCNTL_SIZE_HINT
+**   are therefore implemented by extending the file with zeros up to the
+**   hinted size, rounded up to a multiple of the chunk size, in large
+**   sequential writes. As in the unix VFS, size hints are only acted on
+**   once a chunk size is set (sqlite3_file_control() with
+**   SQLITE_FCNTL_CHUNK_SIZE), otherwise zero-filling would just double the
+**   bytes written for pages SQLite is about to write anyway. The FS API has
+**   no way to reserve clusters without writing them (SdFat's preAllocate()
+**   is hidden behind File), but the clusters of one large write are
+**   allocated together. Like the unix VFS, xTruncate() also rounds up to
+**   the chunk size.
+**
+** BATCH ATOMIC WRITE
+**
+**   If the library is built with SQLITE_ENABLE_BATCH_ATOMIC_WRITE and
+**   T41SQLite::setBatchAtomicWriteSize() is given a non-zero size, main
+**   database files report SQLITE_IOCAP_BATCH_ATOMIC. SQLite then keeps the
+**   rollback journal in memory and commits small transactions by writing
+**   all dirty pages between SQLITE_FCNTL_BEGIN_ATOMIC_WRITE and
+**   SQLITE_FCNTL_COMMIT_ATOMIC_WRITE, so no journal file is created,
+**   synced and deleted on the card.
+**
+**   The pages of a batch are staged in an EXTMEM buffer of the configured
+**   size. On commit they are written, with a checksum, to a "-batch" log
+**   file next to the database, which is flushed before the pages are
+**   written to the database itself. If power is lost before the log is
+**   complete, the database is untouched; if it is lost afterwards, the
+**   log is replayed when the database is opened again. The log is retired
+**   (its header cleared) before the database is written any other way,
+**   and deleted when the database is closed. A batch that does not fit
+**   the staging buffer fails with SQLITE_IOERR_WRITE, which makes SQLite
+**   fall back to an ordinary journal for that transaction.
+**
+** MEMORY-MAPPED PAGES
+**
+**   The io methods are version 3. If T41SQLite::setMirrorSizeLimit() is
+**   given a non-zero size before T41SQLite::begin(), every main database
+**   file that is not larger than the limit is read completely into an
+**   EXTMEM mirror when it is opened. Writes update the mirror as well, so
+**   it always holds the current contents. Reads are served from the
+**   mirror, and xFetch() hands SQLite pointers straight into it, so pages
+**   of read-mostly databases such as lookup tables are used without being
+**   copied at all. Mirrored files do not get a read cache. Like the
+**   wal-index, the mirror is shared by all connections that open the same
+**   database path, so it stays coherent when one of them writes.
+**
+**   begin() sets SQLite's default mmap size to the limit (the library is
+**   built with SQLITE_MAX_MMAP_SIZE for that), PRAGMA mmap_size can lower
+**   it while the connection is the only one using the mirror; 0 drops the
+**   mirror. With other connections on the same database the limit stays,
+**   so one connection cannot drop or reload the mirror under the others.
+**   A mirror that cannot grow any further (limit reached, out of memory,
+**   or pages handed out by xFetch() at the time) keeps mirroring the start
+**   of the file only.
+**
+** FILE HANDLE POOL
+**
+**   File handles come from a static pool of SQLITE_VFS_FILE_POOL_SIZE
+**   slots instead of the heap; only if every slot is busy is a handle
+**   allocated with new (counted in T41SQLite::getFilePoolStats()).
+**
+**   In rollback journal mode every write transaction opens, writes,
+**   closes and deletes the "-journal" file, and the next one creates it
+**   again. Each of these walks the directory on the card. A main journal
+**   closed without error therefore stays open in its slot, together with
+**   its write buffer. When SQLite deletes it, the kept handle truncates
+**   the file to zero bytes and flushes it instead (a journal of zero bytes
+**   is never hot, as with PRAGMA journal_mode=TRUNCATE), and xAccess()
+**   reports it as deleted. The next transaction reuses the open handle.
+**   The file is only closed (and removed, if it was deleted) when its
+**   slot is needed for another file, or in sqlite3_os_end().
+**
+**   A main database or WAL file opened by a second connection shares the
+**   open File of the first one (if that one is writable, or the second is
+**   read-only), so both see the same file size, and the handle is only
+**   closed with the last of them. Shared handles seek before every access.
+**
+** EXISTENCE CACHE
+**
+**   SQLite calls xAccess() for the "-journal" (or "-wal") file at the
+**   start of nearly every read transaction to look for a hot journal,
+**   and FS::exists() walks the directory each time. xAccess() therefore
+**   remembers the answer for the last SQLITE_VFS_EXISTS_CACHE_SIZE paths
+**   it was asked about. xOpen() and xDelete() keep the entries current,
+**   so only the first check of a path walks the directory. Files created
+**   or removed behind the VFS's back (not through SQLite) while the
+**   library is initialized are not noticed; T41SQLite::end() clears the
+**   cache. Answers given without a directory walk (by the cache or by a
+**   kept journal handle) are counted in T41SQLite::getFilePoolStats().
+**
+** MEMORY VFS
+**
+**   A second VFS, T41SQLite::MEMORY_VFS_NAME ("T41_MEMVFS"), keeps files
+**   entirely in EXTMEM. It is registered next to T41_VFS and selected per
+**   connection, with sqlite3_open_v2() or the "vfs=" URI parameter.
+**   Journals and temp files only ever live in memory. A main database is
+**   read from the file of the same path on the configured filesystem when
+**   it is opened for the first time, and stays in memory until
+**   T41SQLite::end(), so transactions run at RAM speed without touching
+**   the card.
+**
+**   Writes mark SQLITE_VFS_MEM_BLOCKSZ blocks dirty.
+**   T41SQLite::flushMemoryDatabases(), called on demand or from a timer,
+**   writes only the dirty blocks back, in runs of up to
+**   SQLITE_VFS_WRITE_BACK_MERGESZ bytes. A flush is committed like a
+**   batch atomic write (see above): the blocks go to the "-batch" log
+**   first, which is replayed when the database is loaded, so a power loss
+**   during a flush leaves the backing file at the previous flush, never
+**   in between. Databases with an open write transaction are not flushed
+**   (SQLITE_BUSY), so the backing file only ever holds committed
+**   transactions. T41SQLite::end() flushes once more.
+**
+**   Transactions committed after the last flush are lost on power loss.
+**   WAL mode is not supported (the io methods are version 1), and a
+**   backing file must not be opened with T41_VFS at the same time.
+**
+** MULTIPLE FILESYSTEMS
+**
+**   Besides the filesystem given to T41SQLite::begin(), which takes the
+**   first of the T41SQLite::MAX_FILESYSTEMS entries, up to
+**   T41SQLite::MAX_FILESYSTEMS - 1 filesystems can be added by name with
+**   T41SQLite::addFilesystem(), e.g. LittleFS on the QSPI flash as
+**   "flash". A database is stored on such a filesystem if its name
+**   starts with the filesystem name and a colon ("flash:/index.db"), or
+**   if it is opened with the VFS of the same name, which is registered
+**   for each added filesystem ("file:/index.db?vfs=flash" as a URI). Both
+**   work for ATTACH, so one connection can join a database on the flash
+**   with one on the SD card.
+**
+**   xFullPathname() puts the prefix in front of the full path of every
+**   file that is not on the default filesystem. Journals, WAL and batch
+**   logs are named after their database by SQLite and the VFS, so they
+**   stay on the same filesystem, and files of the same path on different
+**   filesystems never share a pool slot, cache entry, wal-index or
+**   mirror. The prefix is stripped only where the VFS calls the
+**   filesystem. Names with a prefix that is not a registered filesystem
+**   name are ordinary paths on the default filesystem. The memory VFS
+**   routes the backing files of its databases the same way.
+**
+** TIERED STORAGE
+**
+**   A third VFS, T41SQLite::TIER_VFS_NAME ("T41_TIERVFS"), is T41_VFS with
+**   a second tier for main databases: T41SQLite::setTier() names a fast
+**   filesystem added with T41SQLite::addFilesystem() (LittleFS on the
+**   QSPI flash, or a PSRAM disk) and how much of it to use. Copies of the
+**   most frequently used pages of each database opened with this VFS are
+**   kept in a "-tier" file of the same path there ("-tier-<name>" for a
+**   database on a filesystem added as <name>, so databases of the same
+**   path on two filesystems do not share it), and page reads are served
+**   from it when possible. The database file on the card stays
+**   complete and authoritative: every write goes to it first, and then
+**   to the copy of the page in the tier file, if there is one. Tiering
+**   therefore speeds up reads of the working set; written hot pages cost
+**   a write on both media.
+**
+**   Reads and writes of pages count accesses, per slot for pages in the
+**   tier file and in SQLITE_VFS_TIER_SKETCHSZ shared counters for the
+**   others; all counts are halved from time to time. A page that is not
+**   in the tier file is promoted once it was used
+**   SQLITE_VFS_TIER_PROMOTE_MIN times and more often than the coldest of
+**   the next SQLITE_VFS_TIER_SAMPLE slots, whose page is demoted (just
+**   dropped, the database file has it). Hits, misses, promotions and
+**   demotions are counted in T41SQLite::getTierStats().
+**
+**   The tier file starts with a copy of the database header, followed by
+**   the page map (page number and checksum of each slot) and the slots.
+**   It survives restarts: it is only used again if its copy of the
+**   header matches the database file, whose change counter moves with
+**   every transaction, and a page loaded from it is checked against its
+**   checksum on first use. The tier file is flushed before the database
+**   file is synced. Pages of a transaction that is rolled back, also
+**   after a power loss, are rolled back in the tier file too, as SQLite
+**   writes them through this VFS. A tier file that fails to read or write
+**   is removed and tiering stops for the database until it is opened
+**   again. Databases opened with this VFS must not be written through
+**   another VFS while they are tiered, and batch atomic writes are not
+**   available for them.
+**
+** PAGE COMPRESSION
+**
+**   A fourth VFS, T41SQLite::COMPRESSED_VFS_NAME ("T41_LZ4VFS"), is the
+**   log VFS (see LOG-STRUCTURED STORAGE below) storing the page of each
+**   record LZ4 compressed (the LZ4 block format, compressed greedily with
+**   one hash table, which is fast on the Cortex-M7). The data of a page
+**   record starts with a 4 byte word telling how the page is stored
+**   (compressed, or as it is because it did not compress) and how many
+**   bytes follow, and the next record starts right after them. Records
+**   are packed back to back in the append buffer and written in large
+**   pieces, so a page that compresses to a quarter of its size costs a
+**   quarter of the card writes, and no byte is written for padding. The
+**   page map of the log tells where the record of each page is, reading
+**   a page reads its word and the stored bytes. Everything else works as
+**   for the log VFS: replay after a power loss, the segment cleaning and
+**   map checkpoints of T41SQLite::poll() (which count a live compressed
+**   page as a whole one, so segments are cleaned later than needed rather
+**   than too early), and the files next to the database. The database
+**   file and the segments have magics of their own, so a database is
+**   only opened with the VFS it was created with. Pages, stored pages and
+**   the bytes of their records are counted in
+**   T41SQLite::getCompressionStats(), the log in
+**   T41SQLite::getLogStats().
+**
+** LOG-STRUCTURED STORAGE
+**
+**   A fifth VFS, T41SQLite::LOG_VFS_NAME ("T41_LOGVFS"), is T41_VFS storing
+**   the pages of main databases in a log: every page written is appended,
+**   as a record with its page number and a checksum, to the newest
+**   segment file ("-seg1", "-seg2", ... next to the database file, each
+**   up to SQLITE_VFS_LOG_SEGMENTSZ bytes). Records are collected in a
+**   buffer in PSRAM and written in SQLITE_VFS_LOG_BUFFERSZ pieces, so
+**   inserts and updates alike write the card sequentially and never
+**   rewrite a sector in place. The database file itself only holds a
+**   header with the page size.
+**
+**   The page map (in PSRAM) has the location of the newest record of each
+**   page. It is checkpointed to one of two map files ("-map0", "-map1",
+**   taken in turns so the older one survives a power loss during a
+**   checkpoint), together with the position of the log it covers. Opening
+**   a database loads the newest intact map file and replays the log from
+**   that position, up to its end or the first record whose checksum does
+**   not match, where power was lost while it was written. Such records
+**   belong to a transaction that was not committed: its journal restores
+**   the pages, through this VFS. xSync() writes and flushes the buffered
+**   records, whatever the sync policy.
+**
+**   The log is cleaned by T41SQLite::poll(), in the same slices as the
+**   work of SyncPolicy::DEFERRED (which comes first): a segment whose live
+**   pages (pages the map points into it) fill less than
+**   SQLITE_VFS_LOG_GC_PERCENT percent of it has them appended to the log
+**   again, one page per slice, and a segment without live pages is
+**   removed once a checkpoint no longer needs it for the replay. poll()
+**   checkpoints the map when SQLITE_VFS_LOG_CHECKPOINTSZ bytes were
+**   appended since the last checkpoint, or when that frees segments, and
+**   closing the database checkpoints it as well. Without calls of poll()
+**   the log only grows. Appended bytes, segments, copied pages and
+**   checkpoints are counted in T41SQLite::getLogStats().
+**
+**   The segment and map files belong to the database and must be copied
+**   or removed with it. The page size is fixed when the database is
+**   created. Journal and WAL files are plain T41_VFS files, pages cannot
+**   be memory mapped and batch atomic writes are not available.
+**
+** RAW SECTOR I/O
+**
+**   For a filesystem registered with T41SQLite::setRawSectorAccess(), the
+**   VFS asks SdFat at open whether the clusters of a main database file
+**   are contiguous (FsFile::contiguousRange()). If they are, the whole
+**   sectors of the file up to its size are read and written with
+**   readSectors()/writeSectors() calls on the card, one call per access,
+**   without the cluster chain walk, the sector cache copy and the
+**   per-sector loop of File. Unaligned parts of an access (SQLite reads
+**   the 100 byte header on its own) go through a one sector bounce
+**   buffer. Everything beyond, appends included, goes through File as
+**   before; after such growth the range is looked up again at the next
+**   xSync(), once File has written the new clusters and directory entry.
+**   A fragmented file simply stays with File. Contiguous files are best
+**   obtained by setting a chunk size (see PREALLOCATION above), whose
+**   large zero-filled extensions take their clusters in one piece.
+**
+**   Database pages are whole sectors, so File only ever writes whole
+**   sectors of a database file, which SdFat does not keep in its sector
+**   cache, and File does not touch a sector of the raw range again
+**   unless the file is truncated below it. A file that grows fragmented
+**   keeps the range it had. The card is still synced through File at
+**   xSync(). Raw writes do not
+**   update the modification time of the file. Raw sectors and bounce
+**   reads are counted in T41SQLite::getRawSectorStats().
+**
+** ALLOCATIONS
+**
+**   Heap fragmentation is what eventually breaks long running firmware,
+**   so the calls SQLite makes for every transaction allocate nothing:
+**   xFullPathname() formats into SQLite's buffer, journal handles and
+**   their buffers are pooled (see FILE HANDLE POOL above), read-ahead
+**   buffers stay with the pool slots, the existence cache holds its paths
+**   in fixed entries, batch log paths are formatted on the stack, and
+**   xRead(), xWrite(), xSync() and xAccess() work in the buffers set up
+**   at open. What remains is set up once per open main database (caches,
+**   buffers, wal-index, tier and log state), grows with the data (memory
+**   VFS databases, mirrors, log maps) or is an open on the filesystem,
+**   whose library allocates a file object on the heap each time.
+**
+**   All heap allocations of the VFS go through teensyMalloc() and the
+**   related helpers, File handles allocated with new and FS::open() calls
+**   are counted as well, in T41SQLite::getAllocationStats(). Resetting
+**   the counters once the connections are open and have run their
+**   statements, and checking them later, shows regressions.
 */
 
 #include <Arduino.h>
 
 #include <assert.h>
+#include <stdarg.h>
 #include <TimeLib.h>
+#include <SdFat.h>
 
 #include "ArduinoSQLite.hpp"
+#include "ArduinoSQLite_vfs.hpp"
 
 // define TeensyFile type, which actually interfaces with the storage hardware (e.g. a sd card)
 using TeensyFile = File;
@@ -127,560 +526,7370 @@ using TeensyFile = File;
   #define SQLITE_VFS_JOURNAL_BUFFERSZ 8192
 #endif
 
+/*
+** Size of the blocks held by the main database read cache in bytes. Must
+** be a multiple of the sector size (512).
+*/
+#ifndef SQLITE_VFS_READ_CACHE_BLOCKSZ
+  #define SQLITE_VFS_READ_CACHE_BLOCKSZ 4096
+#endif
+
+/*
+** Largest single write the main database write-back buffer issues when
+** merging adjacent pages.
+*/
+#ifndef SQLITE_VFS_WRITE_BACK_MERGESZ
+  #define SQLITE_VFS_WRITE_BACK_MERGESZ 32768
+#endif
+
+/*
+** Largest read-ahead window in bytes, 0 disables read-ahead. Read-ahead
+** starts after SQLITE_VFS_READ_AHEAD_TRIGGER sequential reads.
+*/
+#ifndef SQLITE_VFS_READ_AHEAD_MAXSZ
+  #define SQLITE_VFS_READ_AHEAD_MAXSZ 32768
+#endif
+
+#ifndef SQLITE_VFS_READ_AHEAD_TRIGGER
+  #define SQLITE_VFS_READ_AHEAD_TRIGGER 2
+#endif
+
+/*
+** Number of file handles in the pool, see FILE HANDLE POOL above. Each
+** slot costs about MAXPATHNAME bytes of static RAM, plus a journal buffer
+** once it has held a journal or WAL file.
+*/
+#ifndef SQLITE_VFS_FILE_POOL_SIZE
+  #define SQLITE_VFS_FILE_POOL_SIZE 8
+#endif
+
+/*
+** Number of paths the existence cache remembers, at least 1.
+*/
+#ifndef SQLITE_VFS_EXISTS_CACHE_SIZE
+  #define SQLITE_VFS_EXISTS_CACHE_SIZE 16
+#endif
+
+/*
+** Granularity of the dirty tracking of the memory VFS in bytes. Flushes
+** write whole blocks.
+*/
+#ifndef SQLITE_VFS_MEM_BLOCKSZ
+  #define SQLITE_VFS_MEM_BLOCKSZ 4096
+#endif
+
+/*
+** Number of shared access counters of the tier VFS for pages that are not
+** in the tier file, a power of two.
+*/
+#ifndef SQLITE_VFS_TIER_SKETCHSZ
+  #define SQLITE_VFS_TIER_SKETCHSZ 4096
+#endif
+
+/*
+** Number of tier file slots compared to find the coldest page when one is
+** promoted, and number of accesses a page needs before it is promoted.
+*/
+#ifndef SQLITE_VFS_TIER_SAMPLE
+  #define SQLITE_VFS_TIER_SAMPLE 8
+#endif
+
+#ifndef SQLITE_VFS_TIER_PROMOTE_MIN
+  #define SQLITE_VFS_TIER_PROMOTE_MIN 2
+#endif
+
+/*
+** Largest size of a segment file of the log VFS and size of its append
+** buffer in bytes, see LOG-STRUCTURED STORAGE above.
+*/
+#ifndef SQLITE_VFS_LOG_SEGMENTSZ
+  #define SQLITE_VFS_LOG_SEGMENTSZ 1048576
+#endif
+
+#ifndef SQLITE_VFS_LOG_BUFFERSZ
+  #define SQLITE_VFS_LOG_BUFFERSZ 32768
+#endif
+
+/*
+** Bytes appended to a log before poll() checkpoints its page map, and
+** share of a segment (percent) below which the live pages of the segment
+** are copied by poll() to free it.
+*/
+#ifndef SQLITE_VFS_LOG_CHECKPOINTSZ
+  #define SQLITE_VFS_LOG_CHECKPOINTSZ 262144
+#endif
+
+#ifndef SQLITE_VFS_LOG_GC_PERCENT
+  #define SQLITE_VFS_LOG_GC_PERCENT 50
+#endif
+
+/*
+** Size of the header of a tier file, see TIERED STORAGE above: an 8 byte
+** magic, the page size, the number of slots and a copy of the 100 byte
+** database header. Each entry of the page map that follows is a 4 byte
+** page number (0 for a free slot) and a 4 byte checksum.
+*/
+#define TEENSY_TIER_MAGIC "T41TIER1"
+#define TEENSY_TIER_HEADERSZ 128
+#define TEENSY_TIER_ENTRYSZ 8
+
+/*
+** Magics of the database file and the segments of a compressed database,
+** laid out as a log-structured one, see PAGE COMPRESSION above. The data
+** of a page record starts with a word whose high byte is one of the
+** TEENSY_LZ4_ storage methods and whose low 24 bits are the stored size.
+** The compressor hash table has 2^TEENSY_LZ4_HASH_LOG entries.
+*/
+#define TEENSY_LZ4_DB_MAGIC "T41LZ4DB"
+#define TEENSY_LZ4_SEG_MAGIC "T41LZ4S1"
+#define TEENSY_LZ4_BLOCK 1
+#define TEENSY_LZ4_RAW 2
+#define TEENSY_LZ4_HASH_LOG 12
+
+/*
+** Headers of the files of a log-structured database, see LOG-STRUCTURED
+** STORAGE above. The database file: an 8 byte magic and the page size,
+** padded to a sector. A segment: an 8 byte magic, the page size and the
+** segment number. A map file: an 8 byte magic, the generation, the page
+** size, the number of pages, the log position it covers (segment and
+** offset) and a checksum, followed by one TeensyLogEntry per page. Each
+** record of a segment starts with the page number (0 for a truncation),
+** the number of pages of the database after it, the segment number and
+** the checksum of the record.
+*/
+#define TEENSY_LOG_DB_MAGIC "T41LOGDB"
+#define TEENSY_LOG_DB_HEADERSZ 512
+#define TEENSY_LOG_SEG_MAGIC "T41LOGS1"
+#define TEENSY_LOG_SEG_HEADERSZ 16
+#define TEENSY_LOG_MAP_MAGIC "T41LOGM1"
+#define TEENSY_LOG_RECORD_HEADERSZ 16
+
+/*
+** Size of the header of a batch log, see BATCH ATOMIC WRITE above: an
+** 8 byte magic, the number of records, the number of data bytes and the
+** checksum of all records. Each record is an 8 byte file offset and a
+** 4 byte size followed by the data.
+*/
+#define TEENSY_BATCH_LOG_MAGIC "T41BATCH"
+#define TEENSY_BATCH_LOG_HEADERSZ 24
+#define TEENSY_BATCH_LOG_RECORDSZ 12
+
+/*
+** Sector size of SdFat volumes, the unit of raw sector I/O, see RAW
+** SECTOR I/O above.
+*/
+#define TEENSY_RAW_SECTORSZ 512
+
+/*
+** The wal-index lock held by the writer, numbered as in SQLite's wal.c.
+*/
+#define TEENSY_WAL_WRITE_LOCK 0
+
 /*
 ** The maximum pathname length supported by this VFS.
 */
 #define MAXPATHNAME 512
 
 /*
-** When using this VFS, the sqlite3_file* handles that SQLite uses are
-** actually pointers to instances of type TeensyVFSFile.
+** Size of the buffer holding the path of a batch log, "-batch" appended.
 */
-typedef struct TeensyVFSFile TeensyVFSFile;
-struct TeensyVFSFile
+#define TEENSY_BATCH_LOG_PATHSZ (MAXPATHNAME + 7)
+
+/*
+** One block of the main database read cache. Slots are linked into a
+** hash chain (by block number) and into the LRU list.
+*/
+typedef struct TeensyReadCacheSlot TeensyReadCacheSlot;
+struct TeensyReadCacheSlot
 {
-  sqlite3_file sqliteFile;        /* Base class. Must be first. */
-  TeensyFile* teensyFile;         /* File descriptor */
+  sqlite3_int64 iBlock;           /* Block number in the file, or -1 if unused */
+  int nValid;                     /* Bytes of the block that exist in the file */
+  int iHashNext;                  /* Next slot in the same hash bucket, or -1 */
+  int iPrev;                      /* Previous (more recently used) slot, or -1 */
+  int iNext;                      /* Next (less recently used) slot, or -1 */
+};
 
-  char* aBuffer;                  /* Pointer to malloc'd buffer */
-  int nBuffer;                    /* Valid bytes of data in zBuffer */
-  sqlite3_int64 iBufferOfst;      /* Offset in file of zBuffer[0] */
+typedef struct TeensyReadCache TeensyReadCache;
+struct TeensyReadCache
+{
+  int nSlot;                      /* Number of blocks in the cache */
+  int nHash;                      /* Number of hash buckets, a power of two */
+  int iLruHead;                   /* Most recently used slot */
+  int iLruTail;                   /* Least recently used slot */
+  int* aHash;                     /* First slot of each hash bucket, or -1 */
+  TeensyReadCacheSlot* aSlot;     /* Slot metadata */
+  char* aData;                    /* nSlot blocks of data (extmem_malloc'd) */
 };
 
 /*
-** Write directly to the file passed as the first argument. Even if the
-** file has a write-buffer (TeensyVFSFile.aBuffer), ignore it.
+** Sequential read detection and read-ahead buffer of a file.
 */
-static int teensyDirectWrite(
-  TeensyVFSFile* p,               /* File handle */
-  const void* zBuf,               /* Buffer containing data to write */
-  int iAmt,                       /* Size of data to write in bytes */
-  sqlite_int64 iOfst              /* File offset to write to */
-){
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_DIRECT_WRITE");
+typedef struct TeensyReadAhead TeensyReadAhead;
+struct TeensyReadAhead
+{
+  sqlite3_int64 iNextOfst;        /* Offset following the previous read */
+  int nSequential;                /* Number of consecutive sequential reads */
+  int nWindow;                    /* Size of the previous refill, 0 after a non-sequential read */
+  sqlite3_int64 iOfst;            /* File offset of aData[0] */
+  int nValid;                     /* Bytes of aData that hold file data */
+  char* aData;                    /* SQLITE_VFS_READ_AHEAD_MAXSZ bytes (extmem_malloc'd), or NULL */
+};
 
-  if (iAmt < 0) // is a size type, must not be less than zero
-  {
-    return SQLITE_IOERR_WRITE;
-  }
+/*
+** A region of the main database file held by the write-back buffer.
+*/
+typedef struct TeensyWriteBackExtent TeensyWriteBackExtent;
+struct TeensyWriteBackExtent
+{
+  sqlite3_int64 iOfst;            /* Offset of the data in the file */
+  int nAmt;                       /* Size of the data in bytes */
+  int iData;                      /* Offset of the data in TeensyWriteBack.aData */
+};
 
-  if (not p->teensyFile->seek(iOfst, SeekSet))
-  {
-    return SQLITE_IOERR_WRITE;
-  }
+typedef struct TeensyWriteBack TeensyWriteBack;
+struct TeensyWriteBack
+{
+  int nExtent;                    /* Number of buffered extents */
+  int mxExtent;                   /* Capacity of aExtent */
+  TeensyWriteBackExtent* aExtent; /* Buffered extents, sorted by iOfst, non-overlapping */
+  int nData;                      /* Bytes of aData in use */
+  int mxData;                     /* Size of aData in bytes */
+  char* aData;                    /* Buffered data (extmem_malloc'd) */
+  char* aMerge;                   /* SQLITE_VFS_WRITE_BACK_MERGESZ staging buffer (extmem_malloc'd) */
+};
+
+/*
+** The wal-index of one database. All files that map it (one per
+** connection) share the node. aLock[] counts the shared holders of each
+** lock, or is -1 if the lock is held exclusively.
+*/
+typedef struct TeensyShmNode TeensyShmNode;
+struct TeensyShmNode
+{
+  char* zPath;                    /* Database path (sqlite3_malloc'd) */
+  int nRef;                       /* Number of files mapping this node */
+  int szRegion;                   /* Size of each region in bytes */
+  int nRegion;                    /* Number of entries in apRegion */
+  char** apRegion;                /* Regions (sqlite3_malloc'd) */
+  int aLock[SQLITE_SHM_NLOCK];    /* Lock state, see above */
+  TeensyShmNode* pNext;           /* Next node in s_pShmNodeList */
+};
 
-  size_t toWrite = static_cast<size_t>(iAmt);
-  size_t nWrite = p->teensyFile->write(zBuf, toWrite);
+/*
+** All wal-indexes currently mapped.
+*/
+static TeensyShmNode* s_pShmNodeList = nullptr;
 
-  if (nWrite != toWrite)
-  {
-    return SQLITE_IOERR_WRITE;
-  }
+/*
+** The mirror of a main database file, shared by all files (one per
+** connection) that open the same path.
+*/
+typedef struct TeensyMirror TeensyMirror;
+struct TeensyMirror
+{
+  char* zPath;                    /* Database path (sqlite3_malloc'd) */
+  int nRef;                       /* Number of files using this mirror */
+  char* aData;                    /* Copy of the file contents (extmem_malloc'd), or NULL */
+  sqlite3_int64 nData;            /* Bytes at the start of the file held by aData */
+  sqlite3_int64 szData;           /* Allocated size of aData */
+  sqlite3_int64 mxData;           /* Limit for szData, 0 if the file is not mirrored */
+  int nFetchOut;                  /* Pages of aData currently handed out by xFetch() */
+  TeensyMirror* pNext;            /* Next mirror in s_pMirrorList */
+};
 
-  p->teensyFile->flush();
+/*
+** All mirrors currently in use.
+*/
+static TeensyMirror* s_pMirrorList = nullptr;
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_DIRECT_WRITE_SIZE: ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->size());
+/*
+** A slot of the file handle pool. A slot is either free, used by an open
+** file, or keeps the handle of a closed journal open for the next
+** transaction.
+*/
+typedef struct TeensyFileSlot TeensyFileSlot;
+struct TeensyFileSlot
+{
+  TeensyFile file;                /* File descriptor */
+  bool isInUse;                   /* True while a TeensyVFSFile uses this slot */
+  bool isKept;                    /* True if file is a closed journal kept open */
+  bool isDeleted;                 /* True if SQLite deleted the kept journal (it was truncated instead) */
+  bool isWritable;                /* True if file was opened for writing */
+  bool isDeletePending;           /* True if SQLite deleted the kept journal while syncs were deferred */
+  uint32_t iKept;                 /* Value of s_iFilePoolClock when the journal was kept */
+  char* aBuffer;                  /* Journal buffer (sqlite3_malloc'd) kept with the slot, or NULL */
+  char* aReadAhead;               /* Read-ahead buffer (extmem_malloc'd) kept with the slot, or NULL */
+  char zPath[MAXPATHNAME + 1];    /* Path file was opened with */
+};
 
-  return SQLITE_OK;
-}
+/*
+** The file handle pool.
+*/
+static TeensyFileSlot s_aFileSlot[SQLITE_VFS_FILE_POOL_SIZE];
+static uint32_t s_iFilePoolClock = 0;
 
 /*
-** Flush the contents of the TeensyVFSFile.aBuffer buffer to disk. This is a
-** no-op if this particular file does not have a buffer (i.e. it is not
-** a journal file) or if the buffer is currently empty.
+** An entry of the existence cache.
 */
-static int teensyFlushBuffer(TeensyVFSFile *p)
+typedef struct TeensyExistsEntry TeensyExistsEntry;
+struct TeensyExistsEntry
 {
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_FLUSH_BUFFER ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->nBuffer);
+  char zPath[MAXPATHNAME + 1];    /* Path, empty if the entry is unused */
+  bool isExisting;                /* True if the file exists */
+  uint32_t iUsed;                 /* Value of s_iExistsClock when the entry was last used */
+};
 
-  if (p->nBuffer)
-  {
-    int rc = teensyDirectWrite(p, p->aBuffer, p->nBuffer, p->iBufferOfst);
-    p->nBuffer = 0;
+/*
+** The existence cache.
+*/
+static TeensyExistsEntry s_aExists[SQLITE_VFS_EXISTS_CACHE_SIZE];
+static uint32_t s_iExistsClock = 0;
 
-    if (rc != SQLITE_OK)
-    {
-      return rc;
-    }
-  }
+/*
+** A file of the memory VFS, shared by all its opens. Main databases are
+** backed by the file at zPath on the filesystem.
+*/
+typedef struct TeensyMemNode TeensyMemNode;
+struct TeensyMemNode
+{
+  char* zPath;                    /* Path (sqlite3_malloc'd), empty for temp files */
+  int nRef;                       /* Number of open TeensyMemFiles */
+  bool isBacked;                  /* True for main databases */
+  bool isDeleteOnClose;           /* True to free the node when the last open is closed */
+  char* aData;                    /* File contents (extmem_malloc'd), or NULL */
+  sqlite3_int64 nData;            /* Size of the file */
+  sqlite3_int64 szData;           /* Allocated size of aData, a multiple of SQLITE_VFS_MEM_BLOCKSZ */
+  uint8_t* aDirty;                /* One bit per block written since the last flush (extmem_malloc'd, backed only) */
+  bool isDirty;                   /* True if the backing file is out of date */
+  int nWriter;                    /* Opens holding a RESERVED or stronger lock */
+  TeensyMemNode* pNext;           /* Next node in s_pMemNodeList */
+};
 
-  return SQLITE_OK;
-}
+/*
+** All named memory VFS files.
+*/
+static TeensyMemNode* s_pMemNodeList = nullptr;
 
 /*
-** Close a file.
+** When using the memory VFS, the sqlite3_file* handles that SQLite uses
+** are actually pointers to instances of type TeensyMemFile.
 */
-static int teensyClose(sqlite3_file *pFile)
+typedef struct TeensyMemFile TeensyMemFile;
+struct TeensyMemFile
 {
-  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
-  int rc = teensyFlushBuffer(p);
-  sqlite3_free(p->aBuffer);
+  sqlite3_file base;              /* Base class. Must be first. */
+  TeensyMemNode* pNode;           /* File contents */
+  int eLock;                      /* SQLITE_LOCK_XXX held by this open */
+};
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_CLOSE");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_CLOSE_FILE ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->name());
+/*
+** A page of a tier file.
+*/
+typedef struct TeensyTierSlot TeensyTierSlot;
+struct TeensyTierSlot
+{
+  uint32_t iPage;                 /* Page number, or 0 if the slot is free */
+  uint32_t checksum;              /* Checksum of the page data, as in the page map */
+  int iHashNext;                  /* Next slot in the same hash bucket, or -1 */
+  uint8_t nAccess;                /* Access count */
+  bool isVerified;                /* True once the data is known to match checksum */
+};
 
-  p->teensyFile->close();
+/*
+** The tier file of a main database opened with the tier VFS, shared by
+** all its opens.
+*/
+typedef struct TeensyTierNode TeensyTierNode;
+struct TeensyTierNode
+{
+  char* zPath;                    /* Database full path (sqlite3_malloc'd) */
+  int nRef;                       /* Number of open TeensyTierFiles */
+  TeensyFile* pFile;              /* Tier file, or NULL while the database is not tiered */
+  int szPage;                     /* Page size of the database, 0 until known */
+  int nSlot;                      /* Number of pages the tier file holds */
+  int nFree;                      /* Number of free slots */
+  int nHash;                      /* Number of hash buckets, a power of two */
+  int* aHash;                     /* First slot of each hash bucket, or -1 */
+  TeensyTierSlot* aSlot;          /* Page map */
+  uint8_t* aSketch;               /* Shared access counters of pages not in the tier file */
+  uint32_t nAccessTotal;          /* Accesses since the counts were last halved */
+  int iHand;                      /* Next slot to look at for promotions */
+  sqlite3_int64 iDataOfst;        /* Offset of the data of slot 0 in the tier file */
+  bool isDirty;                   /* True if the tier file was written since it was last flushed */
+  TeensyTierNode* pNext;          /* Next node in s_pTierList */
+};
 
-  return rc;
-}
+/*
+** All tiered databases that are open.
+*/
+static TeensyTierNode* s_pTierList = nullptr;
 
 /*
-** Read data from a file.
+** When using the tier VFS, the sqlite3_file* handles of main databases
+** are actually pointers to instances of type TeensyTierFile, followed by
+** the TeensyVFSFile they wrap.
 */
-static int teensyRead(
-  sqlite3_file *pFile, 
-  void *zBuf, 
-  int iAmt, 
-  sqlite_int64 iOfst
-)
+typedef struct TeensyTierFile TeensyTierFile;
+struct TeensyTierFile
 {
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - BEGIN");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_iAMT ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(iAmt);
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_OFFSET ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(iOfst);
+  sqlite3_file base;              /* Base class. Must be first. */
+  sqlite3_file* pReal;            /* The wrapped T41_VFS file */
+  TeensyTierNode* pNode;          /* Tier state, or NULL if out of memory */
+};
 
-  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+/*
+** Hash table of the LZ4 compressor, positions in the page being
+** compressed.
+*/
+static uint16_t s_aLz4Hash[1 << TEENSY_LZ4_HASH_LOG];
 
-  /* Flush any data in the write buffer to disk in case this operation
-  ** is trying to read data the file-region currently cached in the buffer.
-  ** It would be possible to detect this case and possibly save an 
-  ** unnecessary write here, but in practice SQLite will rarely read from
-  ** a journal file when there is data cached in the write-buffer.
-  */
-  int rc = teensyFlushBuffer(p);
+/*
+** Location of the newest record of a page of a log-structured database.
+*/
+typedef struct TeensyLogEntry TeensyLogEntry;
+struct TeensyLogEntry
+{
+  uint32_t iSegment;              /* Segment of the record, 0 if the page was never written */
+  uint32_t iOfst;                 /* Offset of the record in the segment */
+};
+
+typedef struct TeensyLogSegment TeensyLogSegment;
+struct TeensyLogSegment
+{
+  uint32_t nLive;                 /* Pages the page map points into the segment */
+  bool isRemoved;                 /* True once the segment file was removed */
+};
+
+/*
+** The log of a log-structured database, shared by all TeensyLogFiles of
+** the database.
+*/
+typedef struct TeensyLogNode TeensyLogNode;
+struct TeensyLogNode
+{
+  char* zPath;                    /* Database full path (sqlite3_malloc'd) */
+  int nRef;                       /* Number of open TeensyLogFiles */
+  bool isCompressed;              /* True for a database of the compressed VFS, see PAGE COMPRESSION above */
+  int szPage;                     /* Page size, 0 until the first page of a new database is written */
+  uint32_t nPage;                 /* Database size in pages */
+  TeensyLogEntry* aMap;           /* Page map, entry i is page i + 1 (extmem_malloc'd) */
+  uint32_t nMap;                  /* Number of entries aMap has room for */
+  TeensyLogSegment* aSegment;     /* Segments iSegmentLow to iSegment (sqlite3_malloc'd) */
+  uint32_t nSegment;              /* Number of entries in aSegment */
+  uint32_t iSegmentLow;           /* Oldest segment that may exist */
+  uint32_t iSegment;              /* Segment appended to, 0 if none yet */
+  TeensyFile* pHead;              /* Segment iSegment, or NULL */
+  TeensyFile* pRead;              /* Segment iReadSegment opened for reading, or NULL */
+  uint32_t iReadSegment;
+  char* aBuf;                     /* Records not written to pHead yet (extmem_malloc'd) */
+  int mxBuf;                      /* Size of aBuf */
+  int nBuf;                       /* Bytes in aBuf */
+  uint32_t iBufOfst;              /* Offset of aBuf in segment iSegment, its size without aBuf */
+  bool isUnsynced;                /* True if pHead was written since it was last flushed */
+  uint8_t* aPage;                 /* One page (sqlite3_malloc'd) */
+  uint8_t* aStored;               /* One compressed page read back, if isCompressed (sqlite3_malloc'd) */
+  uint32_t iGeneration;           /* Generation of the newest map file, 0 if none */
+  uint32_t iCheckpointSegment;    /* Log position the newest map file covers, segment ... */
+  uint32_t iCheckpointOfst;       /* ... and offset */
+  uint32_t nSinceCheckpoint;      /* Bytes of log after that position */
+  uint32_t iGcSegment;            /* Segment whose live pages are being copied, 0 if none */
+  uint32_t iGcPage;               /* Next entry of aMap to look at for it */
+  TeensyLogNode* pNext;           /* Next node in s_pLogList */
+};
+
+/*
+** All log-structured databases that are open.
+*/
+static TeensyLogNode* s_pLogList = nullptr;
+
+/*
+** When using the log or the compressed VFS, the sqlite3_file* handles of
+** main databases are actually pointers to instances of type TeensyLogFile,
+** followed by the TeensyVFSFile they wrap.
+*/
+typedef struct TeensyLogFile TeensyLogFile;
+struct TeensyLogFile
+{
+  sqlite3_file base;              /* Base class. Must be first. */
+  sqlite3_file* pReal;            /* The wrapped T41_VFS file, holding the header */
+  TeensyLogNode* pNode;           /* The log of the database */
+};
+
+/*
+** The VFS of a filesystem added with T41SQLite::addFilesystem(): T41_VFS
+** registered under the filesystem name, which is also its pAppData.
+*/
+typedef struct TeensyFsVfs TeensyFsVfs;
+struct TeensyFsVfs
+{
+  sqlite3_vfs base;               /* Base class. Must be first. */
+  char zName[T41SQLite::MAX_FILESYSTEM_NAME + 1]; /* Filesystem name, empty if unused */
+};
+
+/*
+** The per-filesystem VFSes.
+*/
+static TeensyFsVfs s_aFsVfs[T41SQLite::MAX_FILESYSTEMS];
+
+/*
+** When using this VFS, the sqlite3_file* handles that SQLite uses are
+** actually pointers to instances of type TeensyVFSFile.
+*/
+typedef struct TeensyVFSFile TeensyVFSFile;
+struct TeensyVFSFile
+{
+  sqlite3_file sqliteFile;        /* Base class. Must be first. */
+  TeensyFile* teensyFile;         /* File descriptor */
+  TeensyFileSlot* pSlot;          /* Pool slot holding teensyFile, or NULL if it is heap allocated */
+  sqlite3_int64 nFileSize;        /* Size of teensyFile, or -1 if it is not tracked */
+  sqlite3_int64 iFilePos;         /* Position of teensyFile, or -1 if unknown */
+
+  char* aBuffer;                  /* Pointer to malloc'd buffer */
+  int nBuffer;                    /* Valid bytes of data in zBuffer */
+  sqlite3_int64 iBufferOfst;      /* Offset in file of zBuffer[0] */
+
+  TeensyReadCache* pReadCache;    /* Block cache (main database only), or NULL */
+  TeensyReadAhead readAhead;      /* Read-ahead state */
+  TeensyWriteBack* pWriteBack;    /* Write-back buffer (main database only), or NULL */
+  int openFlags;                  /* SQLITE_OPEN_XXX flags passed to xOpen() */
+  const char* zPath;              /* Full path as passed to xOpen() */
+  TeensyShmNode* pShmNode;        /* Wal-index this file is mapped to, or NULL */
+  uint16_t shmSharedMask;         /* Wal-index locks held shared by this file */
+  uint16_t shmExclMask;           /* Wal-index locks held exclusively by this file */
+  int szChunk;                    /* Chunk size set by SQLITE_FCNTL_CHUNK_SIZE, or 0 */
+  int sectorSize;                 /* Reported by xSectorSize() */
+  int deviceCharacteristics;      /* Reported by xDeviceCharacteristics() */
+  TeensyWriteBack* pBatch;        /* Batch atomic write staging buffer (main database only), or NULL */
+  bool isBatchActive;             /* True between BEGIN_ATOMIC_WRITE and COMMIT/ROLLBACK_ATOMIC_WRITE */
+  TeensyFile* pBatchLog;          /* Batch log file, or NULL if it has not been opened */
+  bool isBatchLogLive;            /* True if the batch log holds a committed batch */
+  TeensyMirror* pMirror;          /* Mirror (main database only), or NULL */
+  bool isSyncPending;             /* True while a deferred xSync() is queued in s_pSyncQueue */
+  int iDrainExtent;               /* First write-back extent a deferred sync has not written yet */
+  TeensyVFSFile* pNextSync;       /* Next file in s_pSyncQueue */
+  SdFs* pRawSd;                   /* Volume for raw sector I/O (main database only), or NULL */
+  uint32_t iRawSector;            /* First sector of the file if nRaw > 0 */
+  sqlite3_int64 nRaw;             /* Bytes at the start of the file read and written as raw sectors */
+  bool isRawStale;                /* True if the file grew through File since nRaw was looked up */
+  bool isCacheStale;              /* True if another file open on zPath changed it since the caches were filled */
+  bool isFileShared;              /* True if teensyFile is shared with other files open on zPath */
+  TeensyVFSFile* pNextOpen;       /* Next file in s_pOpenList */
+};
+
+/*
+** Bounce buffer of raw sector I/O for the unaligned parts of a read or
+** write.
+*/
+static uint8_t s_aRawSector[TEENSY_RAW_SECTORSZ] __attribute__((aligned(4)));
+
+/*
+** Files with a deferred sync (T41SQLite::SyncPolicy::DEFERRED), in the
+** order SQLite synced them, and the number of journal deletes deferred
+** until they are done.
+*/
+static TeensyVFSFile* s_pSyncQueue = nullptr;
+static int s_nDeletePending = 0;
+
+/*
+** All open files, so that a change made through one file reaches the
+** caches of the other files (one per connection) open on the same path.
+*/
+static TeensyVFSFile* s_pOpenList = nullptr;
+
+/*
+** If zPath starts with "<name>:" and a filesystem was added with that
+** name, return the filesystem and set *pnPrefix to the length of the
+** prefix, colon included. Otherwise return NULL.
+*/
+static FS* teensyFilesystemOfPrefix(const char* zPath, int* pnPrefix)
+{
+  char zName[T41SQLite::MAX_FILESYSTEM_NAME + 1];
+  int nName = 0;
+
+  while (nName < T41SQLite::MAX_FILESYSTEM_NAME && zPath[nName] && zPath[nName] != ':' && zPath[nName] != '/')
+  {
+    zName[nName] = zPath[nName];
+    nName++;
+  }
+
+  if (nName == 0 || zPath[nName] != ':')
+  {
+    return nullptr;
+  }
+
+  zName[nName] = '\0';
+  FS* filesystem = T41SQLite::getInstance().getFilesystem(zName);
+
+  if (filesystem)
+  {
+    *pnPrefix = nName + 1;
+  }
+
+  return filesystem;
+}
+
+/*
+** Return the filesystem a full path made by xFullPathname() is stored
+** on, and set *pzFsPath to the path on that filesystem (see MULTIPLE
+** FILESYSTEMS above).
+*/
+static FS* teensyFilesystem(const char* zPath, const char** pzFsPath)
+{
+  int nPrefix = 0;
+  FS* filesystem = teensyFilesystemOfPrefix(zPath, &nPrefix);
+
+  *pzFsPath = &zPath[nPrefix];
+
+  return filesystem ? filesystem : T41SQLite::getInstance().getFilesystem();
+}
+
+/*
+** Count a heap allocation of nByte bytes made by the VFS, see ALLOCATIONS
+** above.
+*/
+static void teensyAllocationCount(size_t nByte)
+{
+  T41SQLite::AllocationStats& stats = T41SQLite::getInstance().getAllocationStats();
+  stats.m_allocations++;
+  stats.m_bytes += nByte;
+}
+
+/*
+** sqlite3_malloc(), sqlite3_realloc(), sqlite3_mprintf(), extmem_malloc()
+** and extmem_realloc(), counted by teensyAllocationCount(). The VFS
+** allocates only through these.
+*/
+static void* teensyMalloc(int nByte)
+{
+  teensyAllocationCount(static_cast<size_t>(max(nByte, 0)));
+  return sqlite3_malloc(nByte);
+}
+
+static void* teensyRealloc(void* pOld, int nByte)
+{
+  teensyAllocationCount(static_cast<size_t>(max(nByte, 0)));
+  return sqlite3_realloc(pOld, nByte);
+}
+
+static char* teensyMprintf(const char* zFormat, ...)
+{
+  va_list ap;
+  va_start(ap, zFormat);
+  char* z = sqlite3_vmprintf(zFormat, ap);
+  va_end(ap);
+
+  teensyAllocationCount(z ? strlen(z) + 1 : 0);
+
+  return z;
+}
+
+static void* teensyExtmemMalloc(size_t nByte)
+{
+  teensyAllocationCount(nByte);
+  return extmem_malloc(nByte);
+}
+
+static void* teensyExtmemRealloc(void* pOld, size_t nByte)
+{
+  teensyAllocationCount(nByte);
+  return extmem_realloc(pOld, nByte);
+}
+
+/*
+** FS::open(), counted in T41SQLite::getAllocationStats() because the
+** filesystem library allocates a file object on the heap for each open.
+*/
+static TeensyFile teensyFsOpen(FS* filesystem, const char* zPath, uint8_t mode)
+{
+  T41SQLite::getInstance().getAllocationStats().m_fileOpens++;
+  return filesystem->open(zPath, mode);
+}
+
+/*
+** Allocate a read cache of (at most) nByte bytes of block data. Returns
+** NULL if nByte is too small to hold a single block or if the memory
+** cannot be allocated.
+*/
+static TeensyReadCache* teensyReadCacheCreate(size_t nByte)
+{
+  int nSlot = static_cast<int>(nByte / SQLITE_VFS_READ_CACHE_BLOCKSZ);
+
+  if (nSlot <= 0)
+  {
+    return nullptr;
+  }
+
+  int nHash = 1;
+  while (nHash < nSlot)
+  {
+    nHash <<= 1;
+  }
+
+  TeensyReadCache* c = (TeensyReadCache*)teensyMalloc(sizeof(TeensyReadCache));
+  if (not c)
+  {
+    return nullptr;
+  }
+
+  c->aHash = (int*)teensyMalloc(nHash * sizeof(int));
+  c->aSlot = (TeensyReadCacheSlot*)teensyMalloc(nSlot * sizeof(TeensyReadCacheSlot));
+  c->aData = (char*)teensyExtmemMalloc(static_cast<size_t>(nSlot) * SQLITE_VFS_READ_CACHE_BLOCKSZ);
+
+  if (not c->aHash || not c->aSlot || not c->aData)
+  {
+    sqlite3_free(c->aHash);
+    sqlite3_free(c->aSlot);
+    extmem_free(c->aData);
+    sqlite3_free(c);
+    return nullptr;
+  }
+
+  c->nSlot = nSlot;
+  c->nHash = nHash;
+
+  for (int i = 0; i < nHash; i++)
+  {
+    c->aHash[i] = -1;
+  }
+
+  /* All slots start out unused, linked into the LRU list in index order. */
+  for (int i = 0; i < nSlot; i++)
+  {
+    c->aSlot[i].iBlock = -1;
+    c->aSlot[i].nValid = 0;
+    c->aSlot[i].iHashNext = -1;
+    c->aSlot[i].iPrev = i - 1;
+    c->aSlot[i].iNext = (i + 1 < nSlot) ? i + 1 : -1;
+  }
+
+  c->iLruHead = 0;
+  c->iLruTail = nSlot - 1;
+
+  return c;
+}
+
+static void teensyReadCacheDestroy(TeensyReadCache* c)
+{
+  if (c)
+  {
+    sqlite3_free(c->aHash);
+    sqlite3_free(c->aSlot);
+    extmem_free(c->aData);
+    sqlite3_free(c);
+  }
+}
+
+static char* teensyReadCacheBlockData(TeensyReadCache* c, int iSlot)
+{
+  return &c->aData[static_cast<size_t>(iSlot) * SQLITE_VFS_READ_CACHE_BLOCKSZ];
+}
+
+static int teensyReadCacheBucket(TeensyReadCache* c, sqlite3_int64 iBlock)
+{
+  return static_cast<int>(iBlock & (c->nHash - 1));
+}
+
+/*
+** Return the slot holding block iBlock, or -1 if it is not cached.
+*/
+static int teensyReadCacheFind(TeensyReadCache* c, sqlite3_int64 iBlock)
+{
+  int iSlot = c->aHash[teensyReadCacheBucket(c, iBlock)];
+
+  while (iSlot >= 0 && c->aSlot[iSlot].iBlock != iBlock)
+  {
+    iSlot = c->aSlot[iSlot].iHashNext;
+  }
+
+  return iSlot;
+}
+
+static void teensyReadCacheUnlink(TeensyReadCache* c, int iSlot)
+{
+  TeensyReadCacheSlot* pSlot = &c->aSlot[iSlot];
+
+  if (pSlot->iPrev >= 0) { c->aSlot[pSlot->iPrev].iNext = pSlot->iNext; } else { c->iLruHead = pSlot->iNext; }
+  if (pSlot->iNext >= 0) { c->aSlot[pSlot->iNext].iPrev = pSlot->iPrev; } else { c->iLruTail = pSlot->iPrev; }
+}
+
+/*
+** Move slot iSlot to the most recently used end of the LRU list.
+*/
+static void teensyReadCacheTouch(TeensyReadCache* c, int iSlot)
+{
+  if (c->iLruHead == iSlot)
+  {
+    return;
+  }
+
+  teensyReadCacheUnlink(c, iSlot);
+  c->aSlot[iSlot].iPrev = -1;
+  c->aSlot[iSlot].iNext = c->iLruHead;
+  c->aSlot[c->iLruHead].iPrev = iSlot;
+  c->iLruHead = iSlot;
+}
+
+/*
+** Remove slot iSlot from its hash chain, mark it unused and move it to the
+** least recently used end of the LRU list so it is reused first.
+*/
+static void teensyReadCacheDrop(TeensyReadCache* c, int iSlot)
+{
+  TeensyReadCacheSlot* pSlot = &c->aSlot[iSlot];
+  int* piSlot = &c->aHash[teensyReadCacheBucket(c, pSlot->iBlock)];
+
+  while (*piSlot != iSlot)
+  {
+    piSlot = &c->aSlot[*piSlot].iHashNext;
+  }
+  *piSlot = pSlot->iHashNext;
+
+  pSlot->iBlock = -1;
+  pSlot->nValid = 0;
+  pSlot->iHashNext = -1;
+
+  if (c->iLruTail != iSlot)
+  {
+    teensyReadCacheUnlink(c, iSlot);
+    pSlot->iNext = -1;
+    pSlot->iPrev = c->iLruTail;
+    c->aSlot[c->iLruTail].iNext = iSlot;
+    c->iLruTail = iSlot;
+  }
+}
+
+/*
+** Take the least recently used slot (evicting its block if necessary),
+** assign it to block iBlock and make it the most recently used slot.
+*/
+static int teensyReadCacheClaim(TeensyReadCache* c, sqlite3_int64 iBlock)
+{
+  int iSlot = c->iLruTail;
+
+  if (c->aSlot[iSlot].iBlock >= 0)
+  {
+    teensyReadCacheDrop(c, iSlot);
+    T41SQLite::getInstance().getReadCacheStats().m_evictions++;
+  }
+
+  int iBucket = teensyReadCacheBucket(c, iBlock);
+  c->aSlot[iSlot].iBlock = iBlock;
+  c->aSlot[iSlot].nValid = 0;
+  c->aSlot[iSlot].iHashNext = c->aHash[iBucket];
+  c->aHash[iBucket] = iSlot;
+  teensyReadCacheTouch(c, iSlot);
+
+  return iSlot;
+}
+
+/*
+** Copy data written to the file into any cached blocks it overlaps. A
+** block is only extended if the write continues its valid data, otherwise
+** the block would contain a hole and it is dropped instead.
+*/
+static void teensyReadCacheWrite(TeensyReadCache* c, const void* zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+  const char* z = (const char*)zBuf;
+
+  while (iAmt > 0)
+  {
+    sqlite3_int64 iBlock = iOfst / SQLITE_VFS_READ_CACHE_BLOCKSZ;
+    int iInBlock = static_cast<int>(iOfst % SQLITE_VFS_READ_CACHE_BLOCKSZ);
+    int nCopy = min(iAmt, SQLITE_VFS_READ_CACHE_BLOCKSZ - iInBlock);
+    int iSlot = teensyReadCacheFind(c, iBlock);
+
+    if (iSlot >= 0)
+    {
+      TeensyReadCacheSlot* pSlot = &c->aSlot[iSlot];
+
+      if (iInBlock <= pSlot->nValid)
+      {
+        memcpy(teensyReadCacheBlockData(c, iSlot) + iInBlock, z, nCopy);
+        pSlot->nValid = max(pSlot->nValid, iInBlock + nCopy);
+      }
+      else
+      {
+        teensyReadCacheDrop(c, iSlot);
+      }
+    }
+
+    iAmt -= nCopy;
+    iOfst += nCopy;
+    z += nCopy;
+  }
+}
+
+/*
+** Forget everything cached beyond the new end of file.
+*/
+static void teensyReadCacheTruncate(TeensyReadCache* c, sqlite3_int64 size)
+{
+  for (int iSlot = 0; iSlot < c->nSlot; iSlot++)
+  {
+    TeensyReadCacheSlot* pSlot = &c->aSlot[iSlot];
+
+    if (pSlot->iBlock < 0)
+    {
+      continue;
+    }
+
+    sqlite3_int64 iBlockOfst = pSlot->iBlock * SQLITE_VFS_READ_CACHE_BLOCKSZ;
+
+    if (iBlockOfst >= size)
+    {
+      teensyReadCacheDrop(c, iSlot);
+    }
+    else if (iBlockOfst + pSlot->nValid > size)
+    {
+      pSlot->nValid = static_cast<int>(size - iBlockOfst);
+    }
+  }
+}
+
+/*
+** Allocate a write-back buffer holding (at most) nByte bytes of data.
+** Returns NULL if nByte is zero or the memory cannot be allocated.
+*/
+static TeensyWriteBack* teensyWriteBackCreate(size_t nByte)
+{
+  if (nByte == 0 || nByte > 0x7fffffff)
+  {
+    return nullptr;
+  }
+
+  TeensyWriteBack* w = (TeensyWriteBack*)teensyMalloc(sizeof(TeensyWriteBack));
+  if (not w)
+  {
+    return nullptr;
+  }
+
+  /* Main database writes are whole pages of at least 512 bytes. */
+  w->mxExtent = max(16, static_cast<int>(nByte / 512));
+  w->aExtent = (TeensyWriteBackExtent*)teensyMalloc(w->mxExtent * sizeof(TeensyWriteBackExtent));
+  w->aData = (char*)teensyExtmemMalloc(nByte);
+  w->aMerge = (char*)teensyExtmemMalloc(SQLITE_VFS_WRITE_BACK_MERGESZ);
+
+  if (not w->aExtent || not w->aData || not w->aMerge)
+  {
+    sqlite3_free(w->aExtent);
+    extmem_free(w->aData);
+    extmem_free(w->aMerge);
+    sqlite3_free(w);
+    return nullptr;
+  }
+
+  w->nExtent = 0;
+  w->nData = 0;
+  w->mxData = static_cast<int>(nByte);
+
+  return w;
+}
+
+static void teensyWriteBackDestroy(TeensyWriteBack* w)
+{
+  if (w)
+  {
+    sqlite3_free(w->aExtent);
+    extmem_free(w->aData);
+    extmem_free(w->aMerge);
+    sqlite3_free(w);
+  }
+}
+
+/*
+** Return the index of the first buffered extent that starts at or after
+** iOfst (w->nExtent if there is none).
+*/
+static int teensyWriteBackSeek(TeensyWriteBack* w, sqlite3_int64 iOfst)
+{
+  int iLo = 0;
+  int iHi = w->nExtent;
+
+  while (iLo < iHi)
+  {
+    int iMid = (iLo + iHi) / 2;
+
+    if (w->aExtent[iMid].iOfst < iOfst)
+    {
+      iLo = iMid + 1;
+    }
+    else
+    {
+      iHi = iMid;
+    }
+  }
+
+  return iLo;
+}
+
+/*
+** Return the offset one past the last byte held by the write-back buffer,
+** or 0 if it is empty.
+*/
+static sqlite3_int64 teensyWriteBackEnd(TeensyWriteBack* w)
+{
+  if (w->nExtent == 0)
+  {
+    return 0;
+  }
+
+  TeensyWriteBackExtent* pLast = &w->aExtent[w->nExtent - 1];
+  return pLast->iOfst + pLast->nAmt;
+}
+
+/*
+** Drop everything buffered beyond the new end of file.
+*/
+static void teensyWriteBackTruncate(TeensyWriteBack* w, sqlite3_int64 size)
+{
+  w->nExtent = teensyWriteBackSeek(w, size);
+
+  if (w->nExtent > 0)
+  {
+    TeensyWriteBackExtent* pLast = &w->aExtent[w->nExtent - 1];
+
+    if (pLast->iOfst + pLast->nAmt > size)
+    {
+      pLast->nAmt = static_cast<int>(size - pLast->iOfst);
+    }
+  }
+  else
+  {
+    w->nData = 0;
+  }
+}
+
+/*
+** Return the size of the file on the filesystem (without data buffered
+** by the VFS). It is tracked in TeensyVFSFile.nFileSize, as asking the FS
+** is not free. WAL files are appended to by every connection, so their
+** size is always asked from the FS.
+*/
+static sqlite3_int64 teensyStoredSize(TeensyVFSFile* p)
+{
+  if (p->nFileSize >= 0)
+  {
+    return p->nFileSize;
+  }
+
+  return static_cast<sqlite3_int64>(p->teensyFile->size());
+}
+
+/*
+** Move the file to offset iOfst, unless it is already positioned there.
+*/
+static bool teensySeek(TeensyVFSFile* p, sqlite3_int64 iOfst)
+{
+  if (p->iFilePos == iOfst && not p->isFileShared)
+  {
+    return true;
+  }
+
+  if (not p->teensyFile->seek(iOfst, SeekSet))
+  {
+    p->iFilePos = -1;
+    return false;
+  }
+
+  p->iFilePos = iOfst;
+
+  return true;
+}
+
+/*
+** Read up to nByte bytes at the current position. Returns the number of
+** bytes read, or a value larger than nByte on error.
+*/
+static size_t teensyReadHere(TeensyVFSFile* p, void* zBuf, size_t nByte)
+{
+  size_t nRead = p->teensyFile->read(zBuf, nByte);
+  p->iFilePos = (nRead <= nByte) ? p->iFilePos + static_cast<sqlite3_int64>(nRead) : -1;
+
+  return nRead;
+}
+
+/*
+** Look up the sectors of the file for raw sector I/O, see RAW SECTOR I/O
+** above. SdFat finds the first cluster in the directory entry, so what
+** File wrote must have been flushed. If the clusters of the file are not
+** contiguous, the raw range stays as it was: 0 at open, the part that
+** was contiguous before if the file grew fragmented (those sectors must
+** not be read through File again, SdFat may still cache older data).
+*/
+static void teensyRawLookup(TeensyVFSFile* p)
+{
+  const char* zFsPath;
+  teensyFilesystem(p->zPath, &zFsPath);
+  FsFile file = p->pRawSd->open(zFsPath, O_RDONLY);
+  uint32_t iBgnSector = 0;
+  uint32_t iEndSector = 0;
+  bool isContiguous = file && file.contiguousRange(&iBgnSector, &iEndSector);
+
+  file.close();
+  p->isRawStale = false;
+
+  if (isContiguous)
+  {
+    sqlite3_int64 nSector = static_cast<sqlite3_int64>(iEndSector - iBgnSector) + 1;
+    p->iRawSector = iBgnSector;
+    p->nRaw = min(nSector * TEENSY_RAW_SECTORSZ, p->nFileSize);
+    p->nRaw -= p->nRaw % TEENSY_RAW_SECTORSZ;
+    T41SQLite::getInstance().getRawSectorStats().m_contiguousFiles++;
+  }
+  else if (p->nFileSize >= TEENSY_RAW_SECTORSZ)
+  {
+    T41SQLite::getInstance().getRawSectorStats().m_fragmentedFiles++;
+  }
+}
+
+/*
+** Look up the sectors of the file again if it grew through File since
+** they were looked up. Called after the file was flushed.
+*/
+static void teensyRawRefresh(TeensyVFSFile* p)
+{
+  if (p->pRawSd && p->isRawStale)
+  {
+    teensyRawLookup(p);
+  }
+}
+
+/*
+** Read nByte bytes at offset iOfst, which lie in the raw range of the
+** file, from the card: the aligned whole sectors with one call, the
+** unaligned parts through the bounce buffer. Returns false on error.
+*/
+static bool teensyRawRead(TeensyVFSFile* p, uint8_t* zBuf, size_t nByte, sqlite3_int64 iOfst)
+{
+  T41SQLite::RawSectorStats& stats = T41SQLite::getInstance().getRawSectorStats();
+  SdCard* card = p->pRawSd->card();
+
+  while (nByte > 0)
+  {
+    uint32_t iSector = p->iRawSector + static_cast<uint32_t>(iOfst / TEENSY_RAW_SECTORSZ);
+    size_t iSkip = static_cast<size_t>(iOfst % TEENSY_RAW_SECTORSZ);
+    size_t nDone;
+
+    if (iSkip == 0 && nByte >= TEENSY_RAW_SECTORSZ)
+    {
+      size_t nSector = nByte / TEENSY_RAW_SECTORSZ;
+
+      if (not card->readSectors(iSector, zBuf, nSector))
+      {
+        return false;
+      }
+
+      stats.m_sectorsRead += nSector;
+      nDone = nSector * TEENSY_RAW_SECTORSZ;
+    }
+    else
+    {
+      if (not card->readSectors(iSector, s_aRawSector, 1))
+      {
+        return false;
+      }
+
+      stats.m_sectorsRead++;
+      stats.m_partialSectors++;
+      nDone = min(nByte, TEENSY_RAW_SECTORSZ - iSkip);
+      memcpy(zBuf, &s_aRawSector[iSkip], nDone);
+    }
+
+    zBuf += nDone;
+    nByte -= nDone;
+    iOfst += nDone;
+  }
+
+  return true;
+}
+
+/*
+** Write nByte bytes at offset iOfst, which lie in the raw range of the
+** file, to the card: the aligned whole sectors with one call, the
+** unaligned parts by reading the sector into the bounce buffer first.
+** Returns false on error.
+*/
+static bool teensyRawWrite(TeensyVFSFile* p, const uint8_t* zBuf, size_t nByte, sqlite3_int64 iOfst)
+{
+  T41SQLite::RawSectorStats& stats = T41SQLite::getInstance().getRawSectorStats();
+  SdCard* card = p->pRawSd->card();
+
+  while (nByte > 0)
+  {
+    uint32_t iSector = p->iRawSector + static_cast<uint32_t>(iOfst / TEENSY_RAW_SECTORSZ);
+    size_t iSkip = static_cast<size_t>(iOfst % TEENSY_RAW_SECTORSZ);
+    size_t nDone;
+
+    if (iSkip == 0 && nByte >= TEENSY_RAW_SECTORSZ)
+    {
+      size_t nSector = nByte / TEENSY_RAW_SECTORSZ;
+
+      if (not card->writeSectors(iSector, zBuf, nSector))
+      {
+        return false;
+      }
+
+      stats.m_sectorsWritten += nSector;
+      nDone = nSector * TEENSY_RAW_SECTORSZ;
+    }
+    else
+    {
+      if (not card->readSectors(iSector, s_aRawSector, 1))
+      {
+        return false;
+      }
+
+      nDone = min(nByte, TEENSY_RAW_SECTORSZ - iSkip);
+      memcpy(&s_aRawSector[iSkip], zBuf, nDone);
+
+      if (not card->writeSectors(iSector, s_aRawSector, 1))
+      {
+        return false;
+      }
+
+      stats.m_sectorsRead++;
+      stats.m_sectorsWritten++;
+      stats.m_partialSectors++;
+    }
+
+    zBuf += nDone;
+    nByte -= nDone;
+    iOfst += nDone;
+  }
+
+  return true;
+}
+
+/*
+** Read up to nByte bytes at offset iOfst of the file, from the card for
+** the part in the raw range and through File for the rest. Returns the
+** number of bytes read, or a value larger than nByte on error.
+*/
+static size_t teensyReadDevice(TeensyVFSFile* p, void* zBuf, size_t nByte, sqlite3_int64 iOfst)
+{
+  size_t nRaw = 0;
+
+  if (iOfst < p->nRaw)
+  {
+    nRaw = static_cast<size_t>(min(static_cast<sqlite3_int64>(nByte), p->nRaw - iOfst));
+
+    if (not teensyRawRead(p, (uint8_t*)zBuf, nRaw, iOfst))
+    {
+      return nByte + 1;
+    }
+
+    if (nRaw == nByte)
+    {
+      return nByte;
+    }
+  }
+
+  if (not teensySeek(p, iOfst + static_cast<sqlite3_int64>(nRaw)))
+  {
+    return nByte + 1;
+  }
+
+  size_t nRead = teensyReadHere(p, (char*)zBuf + nRaw, nByte - nRaw);
+
+  return (nRead <= nByte - nRaw) ? nRaw + nRead : nByte + 1;
+}
+
+/*
+** Update the read-ahead buffer after data was written to the file.
+*/
+static void teensyReadAheadWrite(TeensyReadAhead* r, const void* zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+  sqlite3_int64 iStart = max(iOfst, r->iOfst);
+  sqlite3_int64 iEnd = min(iOfst + iAmt, r->iOfst + r->nValid);
+
+  if (iStart < iEnd)
+  {
+    memcpy(&r->aData[iStart - r->iOfst], (const char*)zBuf + (iStart - iOfst), iEnd - iStart);
+  }
+}
+
+/*
+** Drop read-ahead data beyond the new end of file.
+*/
+static void teensyReadAheadTruncate(TeensyReadAhead* r, sqlite3_int64 size)
+{
+  if (r->iOfst + r->nValid > size)
+  {
+    r->nValid = static_cast<int>(max(static_cast<sqlite3_int64>(0), size - r->iOfst));
+  }
+}
+
+/*
+** Return the read-ahead buffer for p: the one kept with its pool slot,
+** allocated when a file in the slot reads ahead for the first time, or
+** one of its own if p has no slot. Returns NULL if out of memory.
+*/
+static char* teensyReadAheadBuffer(TeensyVFSFile* p)
+{
+  TeensyFileSlot* s = p->pSlot;
+
+  if (not s)
+  {
+    return (char*)teensyExtmemMalloc(SQLITE_VFS_READ_AHEAD_MAXSZ);
+  }
+
+  if (not s->aReadAhead)
+  {
+    s->aReadAhead = (char*)teensyExtmemMalloc(SQLITE_VFS_READ_AHEAD_MAXSZ);
+  }
+
+  return s->aReadAhead;
+}
+
+/*
+** Read up to iAmt bytes at offset iOfst of the file, bypassing the read
+** cache and the write buffers, but using (and refilling) the read-ahead
+** buffer once the reads of the file are sequential. Returns the number of
+** bytes read, which is less than iAmt at the end of the file, or -1 if
+** the file cannot be read.
+*/
+static int teensyReadAt(TeensyVFSFile* p, void* zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+  TeensyReadAhead* r = &p->readAhead;
+  bool isSequential = (iOfst == r->iNextOfst);
+
+  r->nSequential = isSequential ? r->nSequential + 1 : 0;
+  r->iNextOfst = iOfst + iAmt;
+
+  if (iOfst >= r->iOfst && iOfst + iAmt <= r->iOfst + r->nValid)
+  {
+    T41SQLite::getInstance().getReadCacheStats().m_readAheadHits++;
+    memcpy(zBuf, &r->aData[iOfst - r->iOfst], iAmt);
+    return iAmt;
+  }
+
+  if (not isSequential)
+  {
+    r->nWindow = 0;
+  }
+
+  if (iOfst >= teensyStoredSize(p))
+  {
+    return 0;
+  }
+
+  if (r->nSequential >= SQLITE_VFS_READ_AHEAD_TRIGGER && iAmt < SQLITE_VFS_READ_AHEAD_MAXSZ)
+  {
+    if (not r->aData)
+    {
+      r->aData = teensyReadAheadBuffer(p);
+    }
+
+    if (r->aData)
+    {
+      r->nWindow = (r->nWindow > 0) ? 2 * r->nWindow : 4 * max(iAmt, 512);
+      r->nWindow = min(max(r->nWindow, iAmt), SQLITE_VFS_READ_AHEAD_MAXSZ);
+      r->nValid = 0;
+
+      size_t nRead = teensyReadDevice(p, r->aData, r->nWindow, iOfst);
+
+      if (nRead > static_cast<size_t>(r->nWindow))
+      {
+        return -1;
+      }
+
+      T41SQLite::getInstance().getReadCacheStats().m_readAheads++;
+      r->iOfst = iOfst;
+      r->nValid = static_cast<int>(nRead);
+
+      int nCopy = min(iAmt, r->nValid);
+      memcpy(zBuf, r->aData, nCopy);
+      return nCopy;
+    }
+  }
+
+  size_t nRead = teensyReadDevice(p, zBuf, static_cast<size_t>(iAmt), iOfst);
+
+  return (nRead <= static_cast<size_t>(iAmt)) ? static_cast<int>(nRead) : -1;
+}
+
+/*
+** Mark the caches of the other files open on the same path as p stale,
+** after p changed the file.
+*/
+static void teensyCachesInvalidate(TeensyVFSFile* p)
+{
+  for (TeensyVFSFile* q = s_pOpenList; q; q = q->pNextOpen)
+  {
+    if (q != p && strcmp(q->zPath, p->zPath) == 0)
+    {
+      q->isCacheStale = true;
+    }
+  }
+}
+
+/*
+** Drop the caches of p if another file changed the file since they were
+** filled.
+*/
+static void teensyCachesRefresh(TeensyVFSFile* p)
+{
+  if (not p->isCacheStale)
+  {
+    return;
+  }
+
+  if (p->pReadCache)
+  {
+    teensyReadCacheTruncate(p->pReadCache, 0);
+  }
+
+  teensyReadAheadTruncate(&p->readAhead, 0);
+  p->isCacheStale = false;
+}
+
+/*
+** Write to the file passed as the first argument without flushing it
+** afterwards. Even if the file has a write-buffer (TeensyVFSFile.aBuffer)
+** or a write-back buffer, ignore it.
+*/
+static int teensyWriteAt(
+  TeensyVFSFile* p,               /* File handle */
+  const void* zBuf,               /* Buffer containing data to write */
+  int iAmt,                       /* Size of data to write in bytes */
+  sqlite_int64 iOfst              /* File offset to write to */
+){
+  if (iAmt < 0) // is a size type, must not be less than zero
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  /* The part in the raw range goes to the card, see RAW SECTOR I/O. */
+  int nRaw = 0;
+
+  if (iOfst < p->nRaw)
+  {
+    nRaw = static_cast<int>(min(static_cast<sqlite3_int64>(iAmt), p->nRaw - iOfst));
+
+    if (not teensyRawWrite(p, (const uint8_t*)zBuf, static_cast<size_t>(nRaw), iOfst))
+    {
+      return SQLITE_IOERR_WRITE;
+    }
+  }
+
+  if (nRaw < iAmt)
+  {
+    if (not teensySeek(p, iOfst + nRaw))
+    {
+      return SQLITE_IOERR_WRITE;
+    }
+
+    size_t toWrite = static_cast<size_t>(iAmt - nRaw);
+    size_t nWrite = p->teensyFile->write((const char*)zBuf + nRaw, toWrite);
+
+    if (nWrite != toWrite)
+    {
+      p->iFilePos = -1;
+
+      if (p->nFileSize >= 0)
+      {
+        p->nFileSize = static_cast<sqlite3_int64>(p->teensyFile->size());
+      }
+
+      return SQLITE_IOERR_WRITE;
+    }
+
+    p->iFilePos = iOfst + iAmt;
+    p->isRawStale = true;
+
+    if (p->nFileSize >= 0)
+    {
+      p->nFileSize = max(p->nFileSize, p->iFilePos);
+    }
+  }
+
+  if (p->pReadCache)
+  {
+    teensyReadCacheWrite(p->pReadCache, zBuf, iAmt, iOfst);
+  }
+
+  teensyReadAheadWrite(&p->readAhead, zBuf, iAmt, iOfst);
+  teensyCachesInvalidate(p);
+
+  return SQLITE_OK;
+}
+
+/*
+** Write directly to the file passed as the first argument. Even if the
+** file has a write-buffer (TeensyVFSFile.aBuffer), ignore it. The file is
+** only flushed afterwards with T41SQLite::SyncPolicy::STRICT.
+*/
+static int teensyDirectWrite(
+  TeensyVFSFile* p,               /* File handle */
+  const void* zBuf,               /* Buffer containing data to write */
+  int iAmt,                       /* Size of data to write in bytes */
+  sqlite_int64 iOfst              /* File offset to write to */
+){
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_DIRECT_WRITE");
+
+  int rc = teensyWriteAt(p, zBuf, iAmt, iOfst);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  if (T41SQLite::getInstance().getSyncPolicy() == T41SQLite::SyncPolicy::STRICT)
+  {
+    p->teensyFile->flush();
+  }
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_DIRECT_WRITE_SIZE: ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(teensyStoredSize(p));
+
+  return SQLITE_OK;
+}
+
+/*
+** Flush the contents of the TeensyVFSFile.aBuffer buffer to disk. This is a
+** no-op if this particular file does not have a buffer (i.e. it is not
+** a journal file) or if the buffer is currently empty.
+*/
+static int teensyFlushBuffer(TeensyVFSFile *p)
+{
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_FLUSH_BUFFER ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->nBuffer);
+
+  if (p->nBuffer)
+  {
+    int rc = teensyDirectWrite(p, p->aBuffer, p->nBuffer, p->iBufferOfst);
+    p->nBuffer = 0;
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Write the run of adjacent extents of write-back buffer w that starts
+** with extent i to the file, as a single write of up to
+** SQLITE_VFS_WRITE_BACK_MERGESZ bytes. *piNext is set to the extent
+** following the run.
+*/
+static int teensyWriteBackApplyRun(TeensyVFSFile* p, TeensyWriteBack* w, int i, int* piNext)
+{
+  int rc;
+  TeensyWriteBackExtent* pFirst = &w->aExtent[i];
+  bool isDataContiguous = true;
+  int nRun = pFirst->nAmt;
+  int j = i + 1;
+
+  while (j < w->nExtent &&
+         w->aExtent[j - 1].iOfst + w->aExtent[j - 1].nAmt == w->aExtent[j].iOfst &&
+         nRun + w->aExtent[j].nAmt <= SQLITE_VFS_WRITE_BACK_MERGESZ)
+  {
+    isDataContiguous = isDataContiguous && (w->aExtent[j - 1].iData + w->aExtent[j - 1].nAmt == w->aExtent[j].iData);
+    nRun += w->aExtent[j].nAmt;
+    j++;
+  }
+
+  if (j == i + 1 || isDataContiguous)
+  {
+    rc = teensyWriteAt(p, &w->aData[pFirst->iData], nRun, pFirst->iOfst);
+  }
+  else
+  {
+    int nCopied = 0;
+
+    for (int k = i; k < j; k++)
+    {
+      memcpy(&w->aMerge[nCopied], &w->aData[w->aExtent[k].iData], w->aExtent[k].nAmt);
+      nCopied += w->aExtent[k].nAmt;
+    }
+
+    rc = teensyWriteAt(p, w->aMerge, nRun, pFirst->iOfst);
+  }
+
+  *piNext = j;
+
+  return rc;
+}
+
+/*
+** Write the contents of write-back buffer w to the file in ascending
+** offset order, without flushing it (that is left to xSync()), and empty
+** the buffer. Adjacent extents are merged into single writes of up to
+** SQLITE_VFS_WRITE_BACK_MERGESZ bytes.
+*/
+static int teensyWriteBackApply(TeensyVFSFile* p, TeensyWriteBack* w)
+{
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_FLUSH_WRITE_BACK ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(w->nExtent);
+
+  int rc = SQLITE_OK;
+  int i = 0;
+
+  while (i < w->nExtent && rc == SQLITE_OK)
+  {
+    rc = teensyWriteBackApplyRun(p, w, i, &i);
+  }
+
+  w->nExtent = 0;
+  w->nData = 0;
+
+  return rc;
+}
+
+/*
+** Write the contents of the write-back buffer to the file, see
+** teensyWriteBackApply(). This is a no-op if the file has no write-back
+** buffer or if it is empty.
+*/
+static int teensyFlushWriteBack(TeensyVFSFile* p)
+{
+  if (not p->pWriteBack || p->pWriteBack->nExtent == 0)
+  {
+    return SQLITE_OK;
+  }
+
+  return teensyWriteBackApply(p, p->pWriteBack);
+}
+
+/*
+** Return true if a deferred sync of a main database file is still queued.
+*/
+static bool teensySyncIsDrainPending()
+{
+  for (TeensyVFSFile* q = s_pSyncQueue; q; q = q->pNextSync)
+  {
+    if (q->openFlags & SQLITE_OPEN_MAIN_DB)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+** Queue the sync of p at the end of s_pSyncQueue, unless it is queued
+** already.
+*/
+static void teensySyncEnqueue(TeensyVFSFile* p)
+{
+  if (p->isSyncPending)
+  {
+    return;
+  }
+
+  TeensyVFSFile** pp = &s_pSyncQueue;
+
+  while (*pp)
+  {
+    pp = &(*pp)->pNextSync;
+  }
+
+  p->isSyncPending = true;
+  p->iDrainExtent = 0;
+  p->pNextSync = nullptr;
+  *pp = p;
+}
+
+/*
+** Remove p from s_pSyncQueue.
+*/
+static void teensySyncDequeue(TeensyVFSFile* p)
+{
+  for (TeensyVFSFile** pp = &s_pSyncQueue; *pp; pp = &(*pp)->pNextSync)
+  {
+    if (*pp == p)
+    {
+      *pp = p->pNextSync;
+      break;
+    }
+  }
+
+  p->isSyncPending = false;
+  p->pNextSync = nullptr;
+}
+
+/*
+** Do one bounded piece of the deferred work: write the journal buffer of
+** the first queued file, one run of its write-back buffer, or flush it.
+** Once the queue is empty, one deferred journal delete is performed.
+** Returns SQLITE_DONE if nothing is left to do.
+*/
+static int teensySyncStep()
+{
+  TeensyVFSFile* p = s_pSyncQueue;
+
+  if (p)
+  {
+    TeensyWriteBack* w = p->pWriteBack;
+
+    if (p->nBuffer > 0)
+    {
+      return teensyFlushBuffer(p);
+    }
+
+    if (w && p->iDrainExtent < w->nExtent)
+    {
+      int rc = teensyWriteBackApplyRun(p, w, p->iDrainExtent, &p->iDrainExtent);
+
+      /* The extents stay readable until all of them are in the file. */
+      if (rc == SQLITE_OK && p->iDrainExtent == w->nExtent)
+      {
+        w->nExtent = 0;
+        w->nData = 0;
+        p->iDrainExtent = 0;
+      }
+
+      return rc;
+    }
+
+    p->teensyFile->flush();
+    teensyRawRefresh(p);
+    teensySyncDequeue(p);
+
+    return SQLITE_OK;
+  }
+
+  for (int i = 0; i < SQLITE_VFS_FILE_POOL_SIZE && s_nDeletePending > 0; i++)
+  {
+    TeensyFileSlot* s = &s_aFileSlot[i];
+
+    if (s->isDeletePending)
+    {
+      if (s->file.truncate(0))
+      {
+        s->file.flush();
+        s->isDeleted = true;
+      }
+      else
+      {
+        /* A failed remove leaves the slot kept (with its handle closed)
+        ** and the delete pending, so the next step tries it again.
+        */
+        s->file.close();
+
+        const char* zFsPath;
+        FS* filesystem = teensyFilesystem(s->zPath, &zFsPath);
+
+        if (not filesystem->remove(zFsPath))
+        {
+          return SQLITE_IOERR_DELETE;
+        }
+
+        s->isKept = false;
+      }
+
+      s->isDeletePending = false;
+      s_nDeletePending--;
+
+      return SQLITE_OK;
+    }
+  }
+
+  return SQLITE_DONE;
+}
+
+/*
+** Do all deferred work.
+*/
+static int teensySyncBarrier()
+{
+  int rc;
+
+  do
+  {
+    rc = teensySyncStep();
+  }
+  while (rc == SQLITE_OK);
+
+  return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+/*
+** Do the deferred work up to and including the sync of p, if p is
+** queued.
+*/
+static int teensySyncBarrierTo(TeensyVFSFile* p)
+{
+  int rc = SQLITE_OK;
+
+  while (p->isSyncPending && rc == SQLITE_OK)
+  {
+    rc = teensySyncStep();
+  }
+
+  return rc;
+}
+
+/*
+** Do all deferred work, if there is any.
+*/
+static int teensySyncBarrierIfPending()
+{
+  if (not s_pSyncQueue && s_nDeletePending == 0)
+  {
+    return SQLITE_OK;
+  }
+
+  return teensySyncBarrier();
+}
+
+/*
+** Write the write-back buffers of the other files open on the same path
+** as p to the file, so that p reads what their connections committed.
+** Files with a queued deferred sync have to be written in order, so the
+** deferred work is done up to them instead.
+*/
+static int teensySiblingsFlush(TeensyVFSFile* p)
+{
+  for (TeensyVFSFile* q = s_pOpenList; q; q = q->pNextOpen)
+  {
+    if (q != p && strcmp(q->zPath, p->zPath) == 0)
+    {
+      int rc = q->isSyncPending ? teensySyncBarrierTo(q) : teensyFlushWriteBack(q);
+
+      if (rc != SQLITE_OK)
+      {
+        return rc;
+      }
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyLogStep();
+
+/*
+** Do deferred work, then clean the logs of log-structured databases, for
+** at most nMicro microseconds (but at least one piece). Returns SQLITE_OK
+** if work is left, SQLITE_DONE if everything is done, or an error code.
+*/
+int sqlite3_teensy_poll(uint32_t nMicro)
+{
+  uint32_t iStart = micros();
+  int rc;
+
+  do
+  {
+    rc = teensySyncStep();
+
+    if (rc == SQLITE_DONE)
+    {
+      rc = teensyLogStep();
+    }
+  }
+  while (rc == SQLITE_OK && micros() - iStart < nMicro);
+
+  return rc;
+}
+
+/*
+** Do all deferred work.
+*/
+int sqlite3_teensy_barrier(void)
+{
+  return teensySyncBarrierIfPending();
+}
+
+/*
+** Store data in write-back buffer w, keeping the extents sorted. An extent
+** that is rewritten with the same offset and size is updated in place.
+** Returns false (and stores nothing) if the data overlaps buffered data in
+** any other way or if the buffer is full.
+*/
+static bool teensyWriteBackInsert(TeensyWriteBack* w, const void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  int i = teensyWriteBackSeek(w, iOfst);
+
+  if (i < w->nExtent && w->aExtent[i].iOfst == iOfst && w->aExtent[i].nAmt == iAmt)
+  {
+    memcpy(&w->aData[w->aExtent[i].iData], zBuf, iAmt);
+    return true;
+  }
+
+  bool overlapsPrevious = (i > 0 && w->aExtent[i - 1].iOfst + w->aExtent[i - 1].nAmt > iOfst);
+  bool overlapsNext = (i < w->nExtent && w->aExtent[i].iOfst < iOfst + iAmt);
+  bool isFull = (w->nExtent == w->mxExtent || w->nData + iAmt > w->mxData);
+
+  if (overlapsPrevious || overlapsNext || isFull)
+  {
+    return false;
+  }
+
+  memmove(&w->aExtent[i + 1], &w->aExtent[i], (w->nExtent - i) * sizeof(TeensyWriteBackExtent));
+  w->aExtent[i].iOfst = iOfst;
+  w->aExtent[i].nAmt = iAmt;
+  w->aExtent[i].iData = w->nData;
+  w->nExtent++;
+
+  memcpy(&w->aData[w->nData], zBuf, iAmt);
+  w->nData += iAmt;
+
+  return true;
+}
+
+/*
+** Add data written to a main database file to its write-back buffer. If
+** it cannot be stored (see teensyWriteBackInsert()), the buffer is
+** flushed first. Data larger than the whole buffer is written directly.
+*/
+static int teensyWriteBackWrite(TeensyVFSFile* p, const void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyWriteBack* w = p->pWriteBack;
+
+  if (iAmt > w->mxData)
+  {
+    int rc = teensySyncBarrierIfPending();
+
+    if (rc == SQLITE_OK)
+    {
+      rc = teensyFlushWriteBack(p);
+    }
+
+    return (rc == SQLITE_OK) ? teensyDirectWrite(p, zBuf, iAmt, iOfst) : rc;
+  }
+
+  if (not teensyWriteBackInsert(w, zBuf, iAmt, iOfst))
+  {
+    int rc = teensySyncBarrierIfPending();
+
+    if (rc == SQLITE_OK)
+    {
+      rc = teensyFlushWriteBack(p);
+    }
+
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    teensyWriteBackInsert(w, zBuf, iAmt, iOfst);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Release the data of a mirror. It is not rebuilt before the next
+** teensyMirrorLoad().
+*/
+static void teensyMirrorDrop(TeensyMirror* m)
+{
+  extmem_free(m->aData);
+  m->aData = nullptr;
+  m->nData = 0;
+  m->szData = 0;
+}
+
+/*
+** Make the mirror at least nByte bytes large, and grow it geometrically
+** up to the limit. Returns false if that is not possible right now.
+*/
+static bool teensyMirrorGrow(TeensyMirror* m, sqlite3_int64 nByte)
+{
+  if (nByte <= m->szData)
+  {
+    return true;
+  }
+
+  /* Moving the mirror would invalidate pages handed out by xFetch(). */
+  if (nByte > m->mxData || m->nFetchOut > 0)
+  {
+    return false;
+  }
+
+  sqlite3_int64 szNew = min(m->mxData, max(nByte, 2 * m->szData));
+  char* aNew = (char*)teensyExtmemRealloc(m->aData, static_cast<size_t>(szNew));
+
+  if (not aNew)
+  {
+    return false;
+  }
+
+  m->aData = aNew;
+  m->szData = szNew;
+
+  return true;
+}
+
+/*
+** Read the whole file into the mirror of p. If the file is larger than
+** the limit or the mirror cannot be filled, the file is not mirrored.
+*/
+static void teensyMirrorLoad(TeensyVFSFile* p)
+{
+  TeensyMirror* m = p->pMirror;
+  sqlite3_int64 nFile = teensyStoredSize(p);
+
+  if (p->pWriteBack)
+  {
+    nFile = max(nFile, teensyWriteBackEnd(p->pWriteBack));
+  }
+
+  if (m->mxData <= 0 || nFile > m->mxData || not teensyMirrorGrow(m, nFile))
+  {
+    teensyMirrorDrop(m);
+    m->mxData = 0;
+    return;
+  }
+
+  size_t nRead = 0;
+
+  if (nFile > 0)
+  {
+    nRead = teensyReadDevice(p, m->aData, static_cast<size_t>(nFile), 0);
+  }
+
+  /* Only pages written beyond the end of the file can be missing. */
+  if (p->pWriteBack)
+  {
+    TeensyWriteBack* w = p->pWriteBack;
+
+    for (int i = 0; i < w->nExtent; i++)
+    {
+      memcpy(&m->aData[w->aExtent[i].iOfst], &w->aData[w->aExtent[i].iData], w->aExtent[i].nAmt);
+      nRead = max(nRead, static_cast<size_t>(w->aExtent[i].iOfst + w->aExtent[i].nAmt));
+    }
+  }
+
+  if (nRead != static_cast<size_t>(nFile))
+  {
+    teensyMirrorDrop(m);
+    m->mxData = 0;
+    return;
+  }
+
+  m->nData = nFile;
+}
+
+/*
+** Attach the mirror of its path to a main database file that is being
+** opened, loading it if no other file uses it yet. The file stays
+** without a mirror if mirroring is disabled or out of memory.
+*/
+static void teensyMirrorAcquire(TeensyVFSFile* p)
+{
+  sqlite3_int64 mxData = static_cast<sqlite3_int64>(T41SQLite::getInstance().getMirrorSizeLimit());
+
+  if (mxData <= 0)
+  {
+    return;
+  }
+
+  for (TeensyMirror* m = s_pMirrorList; m; m = m->pNext)
+  {
+    if (strcmp(m->zPath, p->zPath) == 0)
+    {
+      m->nRef++;
+      p->pMirror = m;
+      return;
+    }
+  }
+
+  TeensyMirror* m = (TeensyMirror*)teensyMalloc(sizeof(TeensyMirror));
+  if (not m)
+  {
+    return;
+  }
+
+  memset(m, 0, sizeof(TeensyMirror));
+  m->zPath = teensyMprintf("%s", p->zPath);
+
+  if (not m->zPath)
+  {
+    sqlite3_free(m);
+    return;
+  }
+
+  m->nRef = 1;
+  m->mxData = mxData;
+  m->pNext = s_pMirrorList;
+  s_pMirrorList = m;
+  p->pMirror = m;
+
+  teensyMirrorLoad(p);
+}
+
+static void teensyMirrorRelease(TeensyMirror* m)
+{
+  if (not m || --m->nRef > 0)
+  {
+    return;
+  }
+
+  TeensyMirror** ppMirror = &s_pMirrorList;
+  while (*ppMirror != m)
+  {
+    ppMirror = &(*ppMirror)->pNext;
+  }
+  *ppMirror = m->pNext;
+
+  teensyMirrorDrop(m);
+  sqlite3_free(m->zPath);
+  sqlite3_free(m);
+}
+
+/*
+** Apply a write to a mirror. Only data that extends the mirrored range
+** without a gap is added, so the mirror is always an exact copy of the
+** start of the file.
+*/
+static void teensyMirrorWrite(TeensyMirror* m, const void* zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+  if (m->mxData <= 0 || iOfst > m->nData)
+  {
+    return;
+  }
+
+  if (not teensyMirrorGrow(m, iOfst + iAmt))
+  {
+    /* Keep what still fits into the allocated mirror. */
+    iAmt = static_cast<int>(max(static_cast<sqlite3_int64>(0), min(static_cast<sqlite3_int64>(iAmt), m->szData - iOfst)));
+  }
+
+  if (iAmt > 0)
+  {
+    memcpy(&m->aData[iOfst], zBuf, iAmt);
+    m->nData = max(m->nData, iOfst + iAmt);
+  }
+}
+
+/*
+** Continue the FNV-1a hash h over n bytes at z.
+*/
+static uint32_t teensyChecksum(uint32_t h, const void* z, int n)
+{
+  const unsigned char* a = (const unsigned char*)z;
+
+  for (int i = 0; i < n; i++)
+  {
+    h = (h ^ a[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+/*
+** Write the path of the batch log of a main database file to zLog, which
+** holds TEENSY_BATCH_LOG_PATHSZ bytes.
+*/
+static void teensyBatchLogPath(TeensyVFSFile* p, char* zLog)
+{
+  sqlite3_snprintf(TEENSY_BATCH_LOG_PATHSZ, zLog, "%s-batch", p->zPath);
+}
+
+/*
+** Open the batch log of a main database file for writing, unless it is
+** already open.
+*/
+static int teensyBatchLogOpen(TeensyVFSFile* p)
+{
+  if (p->pBatchLog)
+  {
+    return SQLITE_OK;
+  }
+
+  char zLog[TEENSY_BATCH_LOG_PATHSZ];
+  teensyBatchLogPath(p, zLog);
+
+  const char* zFsLog;
+  FS* filesystem = teensyFilesystem(zLog, &zFsLog);
+  TeensyFile log = teensyFsOpen(filesystem, zFsLog, FILE_WRITE);
+
+  if (not log)
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  T41SQLite::getInstance().getAllocationStats().m_fileHandles++;
+  p->pBatchLog = new TeensyFile(log);
+
+  return SQLITE_OK;
+}
+
+/*
+** Clear the header of a live batch log so it is not replayed anymore. The
+** database file is flushed first, as the log is the only durable copy of
+** the batch until then. Must be called before the database is modified
+** other than by a batch.
+*/
+static int teensyBatchLogRetire(TeensyVFSFile* p)
+{
+  static const char aZero[TEENSY_BATCH_LOG_HEADERSZ] = { 0 };
+
+  if (not p->isBatchLogLive)
+  {
+    return SQLITE_OK;
+  }
+
+  p->teensyFile->flush();
+
+  if (not p->pBatchLog->seek(0, SeekSet) ||
+      p->pBatchLog->write(aZero, sizeof(aZero)) != sizeof(aZero))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  p->pBatchLog->flush();
+  p->isBatchLogLive = false;
+
+  return SQLITE_OK;
+}
+
+/*
+** Start writing a new batch to the batch log: open the log and position
+** it at the first record. *pChecksum is set to the initial checksum.
+*/
+static int teensyBatchLogBegin(TeensyVFSFile* p, uint32_t* pChecksum)
+{
+  int rc = teensyBatchLogOpen(p);
+
+  /* The previous batch must be in the database before its log is
+  ** overwritten.
+  */
+  if (rc == SQLITE_OK && p->isBatchLogLive)
+  {
+    p->teensyFile->flush();
+    p->isBatchLogLive = false;
+  }
+
+  if (rc == SQLITE_OK && not p->pBatchLog->seek(TEENSY_BATCH_LOG_HEADERSZ, SeekSet))
+  {
+    rc = SQLITE_IOERR_WRITE;
+  }
+
+  *pChecksum = 2166136261u;
+
+  return rc;
+}
+
+/*
+** Append a record for nAmt bytes at file offset iOfst to the batch log.
+*/
+static int teensyBatchLogAppend(
+  TeensyVFSFile* p,               /* Main database file */
+  const void* zBuf,               /* Data of the record */
+  int nAmt,                       /* Size of the data in bytes */
+  sqlite3_int64 iOfst,            /* Database file offset of the data */
+  uint32_t* pChecksum             /* IN/OUT: Checksum of the records */
+){
+  char aRecord[TEENSY_BATCH_LOG_RECORDSZ];
+  memcpy(&aRecord[0], &iOfst, 8);
+  memcpy(&aRecord[8], &nAmt, 4);
+
+  *pChecksum = teensyChecksum(*pChecksum, aRecord, sizeof(aRecord));
+  *pChecksum = teensyChecksum(*pChecksum, zBuf, nAmt);
+
+  if (p->pBatchLog->write(aRecord, sizeof(aRecord)) != sizeof(aRecord) ||
+      p->pBatchLog->write(zBuf, nAmt) != static_cast<size_t>(nAmt))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Write the header of the batch log and flush it. From then on the batch
+** is committed and will be replayed after a power loss.
+*/
+static int teensyBatchLogSeal(TeensyVFSFile* p, uint32_t nExtent, uint32_t nData, uint32_t checksum)
+{
+  char aHeader[TEENSY_BATCH_LOG_HEADERSZ] = { 0 };
+  memcpy(&aHeader[0], TEENSY_BATCH_LOG_MAGIC, 8);
+  memcpy(&aHeader[8], &nExtent, 4);
+  memcpy(&aHeader[12], &nData, 4);
+  memcpy(&aHeader[16], &checksum, 4);
+
+  if (not p->pBatchLog->seek(0, SeekSet) ||
+      p->pBatchLog->write(aHeader, sizeof(aHeader)) != sizeof(aHeader))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  p->pBatchLog->flush();
+  p->isBatchLogLive = true;
+
+  return SQLITE_OK;
+}
+
+/*
+** Close the batch log, if it is open. If isRemove is true, the log file
+** is deleted as well.
+*/
+static void teensyBatchLogClose(TeensyVFSFile* p, bool isRemove)
+{
+  if (not p->pBatchLog)
+  {
+    return;
+  }
+
+  p->pBatchLog->close();
+  delete p->pBatchLog;
+  p->pBatchLog = nullptr;
+
+  if (isRemove)
+  {
+    char zLog[TEENSY_BATCH_LOG_PATHSZ];
+    teensyBatchLogPath(p, zLog);
+
+    const char* zFsLog;
+    FS* filesystem = teensyFilesystem(zLog, &zFsLog);
+    filesystem->remove(zFsLog);
+  }
+}
+
+/*
+** Commit the staged batch: write it to the batch log and flush the log,
+** then write the pages to the database file. The database file itself is
+** flushed by the xSync() SQLite issues right after the commit. The staging
+** buffer is empty afterwards, whether the commit succeeded or not.
+*/
+static int teensyBatchCommit(TeensyVFSFile* p)
+{
+  TeensyWriteBack* w = p->pBatch;
+  p->isBatchActive = false;
+
+  if (w->nExtent == 0)
+  {
+    return SQLITE_OK;
+  }
+
+  uint32_t checksum;
+  int rc = teensySyncBarrierIfPending();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyBatchLogBegin(p, &checksum);
+  }
+
+  for (int i = 0; i < w->nExtent && rc == SQLITE_OK; i++)
+  {
+    TeensyWriteBackExtent* pExtent = &w->aExtent[i];
+    rc = teensyBatchLogAppend(p, &w->aData[pExtent->iData], pExtent->nAmt, pExtent->iOfst, &checksum);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyBatchLogSeal(p, static_cast<uint32_t>(w->nExtent), static_cast<uint32_t>(w->nData), checksum);
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    w->nExtent = 0;
+    w->nData = 0;
+    return rc;
+  }
+
+  if (p->pMirror)
+  {
+    for (int i = 0; i < w->nExtent; i++)
+    {
+      teensyMirrorWrite(p->pMirror, &w->aData[w->aExtent[i].iData], w->aExtent[i].nAmt, w->aExtent[i].iOfst);
+    }
+  }
+
+  return teensyWriteBackApply(p, w);
+}
+
+/*
+** Read the records of a batch log (positioned at the first record) and
+** compute their checksum. If isApply is true, the data is also written to
+** the database file. Returns SQLITE_CORRUPT if the records do not match
+** the header.
+*/
+static int teensyBatchLogScan(
+  TeensyVFSFile* p,               /* Main database file */
+  TeensyFile& log,                /* Batch log */
+  uint32_t nExtent,               /* Number of records according to the header */
+  uint32_t nData,                 /* Data bytes according to the header */
+  bool isApply,                   /* True to write the data to the database */
+  uint32_t* pChecksum             /* OUT: Checksum of the records */
+){
+  char* aChunk = (char*)teensyMalloc(SQLITE_VFS_READ_CACHE_BLOCKSZ);
+
+  if (not aChunk)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = SQLITE_OK;
+  uint32_t checksum = 2166136261u;
+  uint32_t nDataSeen = 0;
+
+  for (uint32_t i = 0; i < nExtent && rc == SQLITE_OK; i++)
+  {
+    char aRecord[TEENSY_BATCH_LOG_RECORDSZ];
+    sqlite3_int64 iOfst;
+    int32_t nAmt;
+
+    if (log.read(aRecord, sizeof(aRecord)) != sizeof(aRecord))
+    {
+      rc = SQLITE_CORRUPT;
+      break;
+    }
+
+    memcpy(&iOfst, &aRecord[0], 8);
+    memcpy(&nAmt, &aRecord[8], 4);
+    checksum = teensyChecksum(checksum, aRecord, sizeof(aRecord));
+
+    if (iOfst < 0 || nAmt <= 0 || static_cast<uint32_t>(nAmt) > nData - nDataSeen)
+    {
+      rc = SQLITE_CORRUPT;
+      break;
+    }
+
+    nDataSeen += nAmt;
+
+    for (int nDone = 0; nDone < nAmt && rc == SQLITE_OK; )
+    {
+      int nChunk = min(nAmt - nDone, SQLITE_VFS_READ_CACHE_BLOCKSZ);
+
+      if (log.read(aChunk, nChunk) != nChunk)
+      {
+        rc = SQLITE_CORRUPT;
+        break;
+      }
+
+      checksum = teensyChecksum(checksum, aChunk, nChunk);
+
+      if (isApply)
+      {
+        rc = teensyWriteAt(p, aChunk, nChunk, iOfst + nDone);
+      }
+
+      nDone += nChunk;
+    }
+  }
+
+  sqlite3_free(aChunk);
+  *pChecksum = checksum;
+
+  return rc;
+}
+
+/*
+** Replay the batch log of a main database file that is being opened, if a
+** committed batch was left behind by a power loss. Logs that are
+** incomplete (bad checksum) are ignored, as the database was not touched
+** by their batch. The log is deleted afterwards.
+*/
+static int teensyBatchLogRecover(TeensyVFSFile* p)
+{
+  char zLog[TEENSY_BATCH_LOG_PATHSZ];
+  teensyBatchLogPath(p, zLog);
+
+  const char* zFsLog;
+  FS* filesystem = teensyFilesystem(zLog, &zFsLog);
+
+  if (not filesystem->exists(zFsLog))
+  {
+    return SQLITE_OK;
+  }
+
+  int rc = SQLITE_OK;
+  TeensyFile log = teensyFsOpen(filesystem, zFsLog, FILE_READ);
+  char aHeader[TEENSY_BATCH_LOG_HEADERSZ];
+
+  if (log && log.read(aHeader, sizeof(aHeader)) == sizeof(aHeader) &&
+      memcmp(aHeader, TEENSY_BATCH_LOG_MAGIC, 8) == 0)
+  {
+    uint32_t nExtent, nData, checksum, checksumRead;
+    memcpy(&nExtent, &aHeader[8], 4);
+    memcpy(&nData, &aHeader[12], 4);
+    memcpy(&checksum, &aHeader[16], 4);
+
+    rc = teensyBatchLogScan(p, log, nExtent, nData, false, &checksumRead);
+
+    if (rc == SQLITE_OK && checksumRead == checksum)
+    {
+      if (p->openFlags & SQLITE_OPEN_READONLY)
+      {
+        rc = SQLITE_CANTOPEN;
+      }
+      else if (log.seek(TEENSY_BATCH_LOG_HEADERSZ, SeekSet))
+      {
+        TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_BATCH_LOG_REPLAY");
+        rc = teensyBatchLogScan(p, log, nExtent, nData, true, &checksumRead);
+        p->teensyFile->flush();
+      }
+      else
+      {
+        rc = SQLITE_IOERR_READ;
+      }
+    }
+    else if (rc == SQLITE_CORRUPT)
+    {
+      rc = SQLITE_OK;
+    }
+  }
+
+  if (log)
+  {
+    log.close();
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    filesystem->remove(zFsLog);
+  }
+
+  return rc;
+}
+
+/*
+** Return the existence cache entry of zPath, or NULL.
+*/
+static TeensyExistsEntry* teensyExistsFind(const char* zPath)
+{
+  for (int i = 0; i < SQLITE_VFS_EXISTS_CACHE_SIZE; i++)
+  {
+    TeensyExistsEntry* e = &s_aExists[i];
+
+    if (e->zPath[0] && strcmp(e->zPath, zPath) == 0)
+    {
+      e->iUsed = ++s_iExistsClock;
+      return e;
+    }
+  }
+
+  return nullptr;
+}
+
+/*
+** Remember whether zPath exists. The least recently used entry is
+** replaced if the cache is full. Paths longer than MAXPATHNAME are not
+** remembered.
+*/
+static void teensyExistsSet(const char* zPath, bool isExisting)
+{
+  TeensyExistsEntry* e = teensyExistsFind(zPath);
+
+  if (not e)
+  {
+    if (strlen(zPath) > MAXPATHNAME)
+    {
+      return;
+    }
+
+    e = &s_aExists[0];
+
+    for (int i = 1; i < SQLITE_VFS_EXISTS_CACHE_SIZE && e->zPath[0]; i++)
+    {
+      if (not s_aExists[i].zPath[0] || (int32_t)(s_aExists[i].iUsed - e->iUsed) < 0)
+      {
+        e = &s_aExists[i];
+      }
+    }
+
+    sqlite3_snprintf(sizeof(e->zPath), e->zPath, "%s", zPath);
+    e->iUsed = ++s_iExistsClock;
+  }
+
+  e->isExisting = isExisting;
+}
+
+/*
+** Forget whether zPath exists, the next xAccess() asks the filesystem.
+*/
+static void teensyExistsForget(const char* zPath)
+{
+  TeensyExistsEntry* e = teensyExistsFind(zPath);
+
+  if (e)
+  {
+    e->zPath[0] = '\0';
+  }
+}
+
+/*
+** Return the journal handle kept open for zPath, or NULL.
+*/
+static TeensyFileSlot* teensyFilePoolFindKept(const char* zPath)
+{
+  for (int i = 0; i < SQLITE_VFS_FILE_POOL_SIZE; i++)
+  {
+    TeensyFileSlot* s = &s_aFileSlot[i];
+
+    if (s->isKept && strcmp(s->zPath, zPath) == 0)
+    {
+      return s;
+    }
+  }
+
+  return nullptr;
+}
+
+/*
+** Close the journal handle kept by slot s. If SQLite deleted the journal
+** in the meantime, the (truncated) file is removed now.
+*/
+static void teensyFilePoolEvict(TeensyFileSlot* s)
+{
+  if (s->isDeletePending)
+  {
+    teensySyncBarrier();
+  }
+
+  s->file.close();
+
+  /* The slot is about to be reused, so this is the last try of a delete
+  ** that keeps failing.
+  */
+  if (s->isDeletePending)
+  {
+    s->isDeletePending = false;
+    s_nDeletePending--;
+    s->isDeleted = true;
+  }
+
+  if (s->isDeleted)
+  {
+    const char* zFsPath;
+    FS* filesystem = teensyFilesystem(s->zPath, &zFsPath);
+    filesystem->remove(zFsPath);
+  }
+
+  s->isKept = false;
+  s->isDeleted = false;
+}
+
+/*
+** Claim a free slot of the pool. If there is none, the journal handle
+** that has been kept the longest is closed to free its slot. Returns NULL
+** if every slot is used by an open file.
+*/
+static TeensyFileSlot* teensyFilePoolClaim()
+{
+  TeensyFileSlot* pOldest = nullptr;
+
+  for (int i = 0; i < SQLITE_VFS_FILE_POOL_SIZE; i++)
+  {
+    TeensyFileSlot* s = &s_aFileSlot[i];
+
+    if (s->isInUse)
+    {
+      continue;
+    }
+
+    if (not s->isKept)
+    {
+      return s;
+    }
+
+    if (not pOldest || (int32_t)(s->iKept - pOldest->iKept) < 0)
+    {
+      pOldest = s;
+    }
+  }
+
+  if (pOldest)
+  {
+    teensyFilePoolEvict(pOldest);
+  }
+
+  return pOldest;
+}
+
+/*
+** Detach the file handle from p. If isKeep is true and p is a main
+** journal opened for writing, the handle stays open in its pool slot for
+** the next transaction, otherwise it is closed. Journal buffers stay with
+** their pool slot. Read-only opens of a kept journal (SQLite checking
+** for a hot journal) reuse the writable handle and keep it as well.
+*/
+static void teensyFileRelease(TeensyVFSFile* p, bool isKeep)
+{
+  TeensyFileSlot* s = p->pSlot;
+
+  if (not s)
+  {
+    if (not p->isFileShared)
+    {
+      p->teensyFile->close();
+    }
+
+    delete p->teensyFile;
+    sqlite3_free(p->aBuffer);
+  }
+  else if (isKeep && s->isWritable && (p->openFlags & SQLITE_OPEN_MAIN_JOURNAL))
+  {
+    s->file.flush(); // as close() would
+    s->isKept = true;
+    s->iKept = ++s_iFilePoolClock;
+    s->isInUse = false;
+  }
+  else
+  {
+    /* A shared handle stays open for the other files, it is closed when
+    ** the last reference is dropped.
+    */
+    if (p->isFileShared)
+    {
+      s->file = TeensyFile();
+    }
+    else
+    {
+      s->file.close();
+    }
+
+    s->isInUse = false;
+  }
+
+  p->pSlot = nullptr;
+  p->teensyFile = nullptr;
+  p->aBuffer = nullptr;
+}
+
+/*
+** Return an open main database or WAL file (as given by flags) on zPath
+** whose handle a new file opened with flags can share, or NULL. A
+** read-only handle is only shared with read-only files.
+*/
+static TeensyVFSFile* teensyFileFindShareable(const char* zPath, int flags)
+{
+  for (TeensyVFSFile* q = s_pOpenList; q; q = q->pNextOpen)
+  {
+    if ((q->openFlags & flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_WAL)) && strcmp(q->zPath, zPath) == 0
+        && (not (q->openFlags & SQLITE_OPEN_READONLY) || (flags & SQLITE_OPEN_READONLY)))
+    {
+      return q;
+    }
+  }
+
+  return nullptr;
+}
+
+/*
+** Attach a file handle (and, for journal and WAL files, a buffer) to p
+** and open zName with it. A main journal kept open by the pool is reused
+** without touching the filesystem.
+*/
+static int teensyFileAcquire(TeensyVFSFile* p, const char* zName, int flags)
+{
+  T41SQLite& instance = T41SQLite::getInstance();
+  TeensyFileSlot* s = nullptr;
+  bool isReused = false;
+
+  if (flags & SQLITE_OPEN_MAIN_JOURNAL)
+  {
+    s = teensyFilePoolFindKept(zName);
+
+    /* The journal of the next transaction must not be written before the
+    ** previous transaction is in the database file.
+    */
+    if (s && s->isDeletePending)
+    {
+      int rc = teensySyncBarrier();
+
+      if (rc != SQLITE_OK)
+      {
+        return rc;
+      }
+
+      s = teensyFilePoolFindKept(zName);
+    }
+
+    if (s && s->isDeleted && not (flags & SQLITE_OPEN_CREATE))
+    {
+      return SQLITE_CANTOPEN;
+    }
+
+    isReused = (s != nullptr);
+  }
+
+  if (not s)
+  {
+    s = teensyFilePoolClaim();
+  }
+
+  if (s)
+  {
+    s->isInUse = true;
+    s->isKept = false;
+    s->isDeleted = false;
+    p->pSlot = s;
+    p->teensyFile = &s->file;
+  }
+  else
+  {
+    instance.getFilePoolStats().m_poolExhausted++;
+    instance.getAllocationStats().m_fileHandles++;
+    p->teensyFile = new TeensyFile();
+  }
+
+  if (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL))
+  {
+    if (not s)
+    {
+      p->aBuffer = (char*)teensyMalloc(SQLITE_VFS_JOURNAL_BUFFERSZ);
+    }
+    else
+    {
+      if (not s->aBuffer)
+      {
+        s->aBuffer = (char*)teensyMalloc(SQLITE_VFS_JOURNAL_BUFFERSZ);
+      }
+
+      p->aBuffer = s->aBuffer;
+    }
+
+    if (not p->aBuffer)
+    {
+      teensyFileRelease(p, false);
+      return SQLITE_NOMEM;
+    }
+  }
+
+  if (isReused)
+  {
+    instance.getFilePoolStats().m_opensAvoided++;
+    return SQLITE_OK;
+  }
+
+  const char* zFsName;
+  FS* filesystem = teensyFilesystem(zName, &zFsName);
+  uint8_t openMode = (flags & SQLITE_OPEN_READONLY) ? FILE_READ : FILE_WRITE;
+  TeensyVFSFile* pShared = teensyFileFindShareable(zName, flags);
+
+  if (pShared)
+  {
+    instance.getFilePoolStats().m_opensAvoided++;
+    openMode = (pShared->openFlags & SQLITE_OPEN_READONLY) ? FILE_READ : FILE_WRITE;
+    *p->teensyFile = *pShared->teensyFile;
+    p->isFileShared = true;
+    pShared->isFileShared = true;
+  }
+  else
+  {
+    *p->teensyFile = teensyFsOpen(filesystem, zFsName, openMode);
+  }
+
+  if (not *p->teensyFile) // check if file is open
+  {
+    teensyFileRelease(p, false);
+    return SQLITE_CANTOPEN;
+  }
+
+  if (s)
+  {
+    s->isWritable = (openMode == FILE_WRITE);
+    sqlite3_snprintf(sizeof(s->zPath), s->zPath, "%s", zName);
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyShmUnmap(sqlite3_file *pFile, int deleteFlag);
+
+/*
+** Close a file.
+*/
+static int teensyClose(sqlite3_file *pFile)
+{
+  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+  teensyShmUnmap(pFile, 0);
+  int rcBarrier = teensySyncBarrierTo(p);
+
+  for (TeensyVFSFile** pp = &s_pOpenList; *pp; pp = &(*pp)->pNextOpen)
+  {
+    if (*pp == p)
+    {
+      *pp = p->pNextOpen;
+      break;
+    }
+  }
+
+  if (p->isSyncPending)
+  {
+    teensySyncDequeue(p);
+  }
+
+  int rc = teensyFlushBuffer(p);
+  int rcWriteBack = teensyFlushWriteBack(p);
+  if (rc == SQLITE_OK)
+  {
+    rc = rcWriteBack;
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = rcBarrier;
+  }
+  teensyReadCacheDestroy(p->pReadCache);
+  if (not p->pSlot)
+  {
+    extmem_free(p->readAhead.aData);
+  }
+
+  teensyWriteBackDestroy(p->pWriteBack);
+  teensyWriteBackDestroy(p->pBatch);
+  teensyMirrorRelease(p->pMirror);
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_CLOSE");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_CLOSE_FILE ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->name());
+
+  /* Main journals are kept open for the next transaction, unless
+  ** something went wrong.
+  */
+  teensyFileRelease(p, rc == SQLITE_OK);
+
+  /* Closing flushed the database file, so the batch log is not needed
+  ** anymore.
+  */
+  teensyBatchLogClose(p, rc == SQLITE_OK);
+
+  return rc;
+}
+
+/*
+** Read a whole block of the file into the read cache. Returns the slot
+** holding the block, or -1 if the block lies completely beyond the end of
+** the file (nothing is cached in that case). *pRc is set to an error
+** code if the file could not be read.
+*/
+static int teensyReadCacheLoad(TeensyVFSFile* p, sqlite3_int64 iBlock, int* pRc)
+{
+  TeensyReadCache* c = p->pReadCache;
+  sqlite3_int64 iBlockOfst = iBlock * SQLITE_VFS_READ_CACHE_BLOCKSZ;
+
+  *pRc = SQLITE_OK;
+
+  int iSlot = teensyReadCacheClaim(c, iBlock);
+  int nRead = teensyReadAt(p, teensyReadCacheBlockData(c, iSlot), SQLITE_VFS_READ_CACHE_BLOCKSZ, iBlockOfst);
+
+  if (nRead <= 0)
+  {
+    teensyReadCacheDrop(c, iSlot);
+    *pRc = (nRead == 0) ? SQLITE_OK : SQLITE_IOERR_READ;
+    return -1;
+  }
+
+  c->aSlot[iSlot].nValid = nRead;
+
+  return iSlot;
+}
+
+/*
+** Read data from a main database file through its read cache. Data
+** beyond the end of the file is zero-filled and reported as a short read.
+*/
+static int teensyCachedRead(TeensyVFSFile* p, void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyReadCache* c = p->pReadCache;
+  T41SQLite::ReadCacheStats& stats = T41SQLite::getInstance().getReadCacheStats();
+  char* z = (char*)zBuf;
+  bool isShortRead = false;
+
+  while (iAmt > 0)
+  {
+    sqlite3_int64 iBlock = iOfst / SQLITE_VFS_READ_CACHE_BLOCKSZ;
+    int iInBlock = static_cast<int>(iOfst % SQLITE_VFS_READ_CACHE_BLOCKSZ);
+    int nCopy = min(iAmt, SQLITE_VFS_READ_CACHE_BLOCKSZ - iInBlock);
+    int iSlot = teensyReadCacheFind(c, iBlock);
+
+    if (iSlot >= 0)
+    {
+      stats.m_hits++;
+      teensyReadCacheTouch(c, iSlot);
+    }
+    else
+    {
+      stats.m_misses++;
+      int rc;
+      iSlot = teensyReadCacheLoad(p, iBlock, &rc);
+
+      if (rc != SQLITE_OK)
+      {
+        return rc;
+      }
+    }
+
+    int nAvailable = (iSlot >= 0) ? max(0, min(nCopy, c->aSlot[iSlot].nValid - iInBlock)) : 0;
+
+    if (nAvailable > 0)
+    {
+      memcpy(z, teensyReadCacheBlockData(c, iSlot) + iInBlock, nAvailable);
+    }
+
+    if (nAvailable < nCopy)
+    {
+      memset(z + nAvailable, 0, nCopy - nAvailable);
+      isShortRead = true;
+    }
+
+    iAmt -= nCopy;
+    iOfst += nCopy;
+    z += nCopy;
+  }
+
+  return isShortRead ? SQLITE_IOERR_SHORT_READ : SQLITE_OK;
+}
+
+/*
+** Read data from the file itself (or its read cache), ignoring any data
+** held by the write-back buffer.
+*/
+static int teensyFileRead(TeensyVFSFile* p, void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  if (p->pReadCache)
+  {
+    return teensyCachedRead(p, zBuf, iAmt, iOfst);
+  }
+  
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_FILE_SIZE ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(teensyStoredSize(p));
+
+  int nReadAt = teensyReadAt(p, zBuf, iAmt, iOfst);
+
+  if (nReadAt < 0)
+  {
+    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (ERROR)");
+    return SQLITE_IOERR_READ;
+  }
+
+  size_t toRead = static_cast<size_t>(iAmt);
+  size_t nRead = static_cast<size_t>(nReadAt);
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_FILE_READ_RETURN_VALUE ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(nRead);
+
+  if (nRead == toRead)
+  {
+    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (OK)");
+
+    return SQLITE_OK;
+  }
+
+  memset(&((char*)zBuf)[nRead], 0, toRead - nRead);
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (SQLITE_IOERR_SHORT_READ)");
+
+  return SQLITE_IOERR_SHORT_READ; // ok
+}
+
+/*
+** Read data from a main database file that has pages waiting in write-back
+** buffer w. A read of (part of) a single buffered extent is served from the
+** buffer, otherwise the file is read and the buffered data is copied over
+** the result.
+*/
+static int teensyWriteBackRead(TeensyVFSFile* p, TeensyWriteBack* w, void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  int i = teensyWriteBackSeek(w, iOfst + 1);
+
+  if (i > 0)
+  {
+    TeensyWriteBackExtent* pExtent = &w->aExtent[i - 1];
+
+    if (pExtent->iOfst <= iOfst && iOfst + iAmt <= pExtent->iOfst + pExtent->nAmt)
+    {
+      memcpy(zBuf, &w->aData[pExtent->iData + (iOfst - pExtent->iOfst)], iAmt);
+      return SQLITE_OK;
+    }
+  }
+
+  int rc = teensyFileRead(p, zBuf, iAmt, iOfst);
+
+  if (rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ)
+  {
+    return rc;
+  }
+
+  i = max(0, i - 1);
+
+  for (; i < w->nExtent && w->aExtent[i].iOfst < iOfst + iAmt; i++)
+  {
+    TeensyWriteBackExtent* pExtent = &w->aExtent[i];
+    sqlite3_int64 iStart = max(pExtent->iOfst, iOfst);
+    sqlite3_int64 iEnd = min(pExtent->iOfst + pExtent->nAmt, iOfst + iAmt);
+
+    if (iStart < iEnd)
+    {
+      memcpy((char*)zBuf + (iStart - iOfst), &w->aData[pExtent->iData + (iStart - pExtent->iOfst)], iEnd - iStart);
+    }
+  }
+
+  /* Bytes beyond the end of the file but covered by the buffer are not
+  ** missing, so only report a short read if the buffer does not reach the
+  ** end of the requested range either.
+  */
+  if (rc == SQLITE_IOERR_SHORT_READ && iOfst + iAmt <= teensyWriteBackEnd(w))
+  {
+    rc = SQLITE_OK;
+  }
+
+  return rc;
+}
+
+/*
+** Read data from a file.
+*/
+static int teensyRead(
+  sqlite3_file *pFile, 
+  void *zBuf, 
+  int iAmt, 
+  sqlite_int64 iOfst
+)
+{
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - BEGIN");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_iAMT ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(iAmt);
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_OFFSET ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(iOfst);
+
+  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+
+  /* Flush any data in the write buffer to disk in case this operation
+  ** is trying to read data the file-region currently cached in the buffer.
+  ** It would be possible to detect this case and possibly save an 
+  ** unnecessary write here, but in practice SQLite will rarely read from
+  ** a journal file when there is data cached in the write-buffer.
+  */
+  int rc = teensyFlushBuffer(p);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  if (p->isBatchActive && p->pBatch->nExtent > 0)
+  {
+    return teensyWriteBackRead(p, p->pBatch, zBuf, iAmt, iOfst);
+  }
+
+  if (p->pMirror && iOfst + iAmt <= p->pMirror->nData)
+  {
+    memcpy(zBuf, &p->pMirror->aData[iOfst], iAmt);
+    return SQLITE_OK;
+  }
+
+  if (p->pWriteBack && p->pWriteBack->nExtent > 0)
+  {
+    return teensyWriteBackRead(p, p->pWriteBack, zBuf, iAmt, iOfst);
+  }
+
+  return teensyFileRead(p, zBuf, iAmt, iOfst);
+}
+
+/*
+** Write data to a crash-file.
+*/
+static int teensyWrite(
+  sqlite3_file *pFile, 
+  const void *zBuf, 
+  int iAmt, 
+  sqlite_int64 iOfst
+){
+  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_WRITE");
+
+  /* Pages of a batch are only staged. A batch that does not fit makes
+  ** SQLite fall back to a rollback journal.
+  */
+  if (p->isBatchActive)
+  {
+    return teensyWriteBackInsert(p->pBatch, zBuf, iAmt, iOfst) ? SQLITE_OK : SQLITE_IOERR_WRITE;
+  }
+
+  /* With deferred syncs, journals and WALs must not change before queued
+  ** database pages are in the file, and database pages may only be written
+  ** to the file once the queued journal is.
+  */
+  bool isBarrierRequired;
+
+  if (p->openFlags & SQLITE_OPEN_MAIN_DB)
+  {
+    isBarrierRequired = p->isSyncPending || (s_pSyncQueue && not p->pWriteBack);
+  }
+  else
+  {
+    isBarrierRequired = teensySyncIsDrainPending();
+  }
+
+  int rc = isBarrierRequired ? teensySyncBarrier() : SQLITE_OK;
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyBatchLogRetire(p);
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  if (p->pMirror)
+  {
+    teensyMirrorWrite(p->pMirror, zBuf, iAmt, iOfst);
+  }
+  
+  if (p->aBuffer)
+  {
+    char *z = (char *)zBuf;       /* Pointer to remaining data to write */
+    int n = iAmt;                 /* Number of bytes at z */
+    sqlite3_int64 i = iOfst;      /* File offset to write to */
+
+    while (n > 0)
+    {
+      int nCopy;                  /* Number of bytes to copy into buffer */
+
+      /* If the buffer is full, or if this data is not being written directly
+      ** following the data already buffered, flush the buffer. Flushing
+      ** the buffer is a no-op if it is empty.  
+      */
+      if (p->nBuffer == SQLITE_VFS_JOURNAL_BUFFERSZ ||
+          p->iBufferOfst + p->nBuffer != i)
+      {
+        int rc = teensyFlushBuffer(p);
+        if (rc != SQLITE_OK)
+        {
+          return rc;
+        }
+      }
+
+      assert(p->nBuffer == 0 || p->iBufferOfst + p->nBuffer == i);
+      p->iBufferOfst = i - p->nBuffer;
+
+      /* Copy as much data as possible into the buffer. */
+      nCopy = SQLITE_VFS_JOURNAL_BUFFERSZ - p->nBuffer;
+      if (nCopy > n)
+      {
+        nCopy = n;
+      }
+      memcpy(&p->aBuffer[p->nBuffer], z, nCopy);
+      p->nBuffer += nCopy;
+
+      n -= nCopy;
+      i += nCopy;
+      z += nCopy;
+    }
+  }
+  else if (p->pWriteBack)
+  {
+    return teensyWriteBackWrite(p, zBuf, iAmt, iOfst);
+  }
+  else
+  {
+    return teensyDirectWrite(p, zBuf, iAmt, iOfst);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Extend the file with zeros to at least nByte bytes, rounded up to a
+** multiple of the chunk size. This is a no-op if no chunk size is set or
+** if the file is already large enough. Zeros are written in SQLITE_VFS_READ_CACHE_BLOCKSZ
+** pieces aligned to the block size, so (apart from the first piece) every
+** write covers whole sectors.
+*/
+static int teensyFileSizeHint(TeensyVFSFile* p, sqlite3_int64 nByte)
+{
+  static const char aZero[SQLITE_VFS_READ_CACHE_BLOCKSZ] = { 0 };
+
+  if (p->szChunk <= 0)
+  {
+    return SQLITE_OK;
+  }
+
+  nByte = ((nByte + p->szChunk - 1) / p->szChunk) * p->szChunk;
+
+  int rc = teensySyncBarrierIfPending();
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  sqlite3_int64 iOfst = teensyStoredSize(p);
+
+  while (iOfst < nByte)
+  {
+    int nWrite = SQLITE_VFS_READ_CACHE_BLOCKSZ - static_cast<int>(iOfst % SQLITE_VFS_READ_CACHE_BLOCKSZ);
+    nWrite = static_cast<int>(min(static_cast<sqlite3_int64>(nWrite), nByte - iOfst));
+
+    rc = teensyWriteAt(p, aZero, nWrite, iOfst);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    iOfst += nWrite;
+  }
+
+  return SQLITE_OK;
+}
+
+/* (From SQLite documentation:)
+** The xTruncate method truncates a file to be nByte bytes in length. If the file is already nByte bytes or less in length then this method is a no-op.
+** The xTruncate method returns SQLITE_OK on success and SQLITE_IOERR_TRUNCATE if anything goes wrong. 
+*/
+static int teensyTruncate(sqlite3_file *pFile, sqlite_int64 size)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  /* Buffered journal/WAL data beyond the new size must not be written
+  ** after the truncate. Deferred syncs are done first, as for xWrite().
+  */
+  int rc = teensySyncBarrierIfPending();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyFlushBuffer(p);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyBatchLogRetire(p);
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  /* Keep preallocated space: like the unix VFS, round up to the chunk size. */
+  if (p->szChunk > 0)
+  {
+    size = ((size + p->szChunk - 1) / p->szChunk) * p->szChunk;
+  }
+
+  if (p->pWriteBack)
+  {
+    teensyWriteBackTruncate(p->pWriteBack, size);
+  }
+
+  if (p->pMirror)
+  {
+    p->pMirror->nData = min(p->pMirror->nData, size);
+  }
+
+  if (teensyStoredSize(p) > size)
+  {
+    teensyReadAheadTruncate(&p->readAhead, size);
+
+    if (p->pReadCache)
+    {
+      teensyReadCacheTruncate(p->pReadCache, size);
+    }
+
+    p->iFilePos = -1;
+    teensyCachesInvalidate(p);
+
+    if (not p->teensyFile->truncate(static_cast<size_t>(size)))
+    {
+      if (p->nFileSize >= 0)
+      {
+        p->nFileSize = static_cast<sqlite3_int64>(p->teensyFile->size());
+      }
+
+      return SQLITE_IOERR_TRUNCATE;
+    }
+
+    if (p->nFileSize >= 0)
+    {
+      p->nFileSize = size;
+    }
+
+    p->nRaw = min(p->nRaw, size - size % TEENSY_RAW_SECTORSZ);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Sync the contents of the file to the persistent media. The FS API only
+** offers flush(), which always writes data and directory entry, so
+** SQLITE_SYNC_DATAONLY cannot be honoured any cheaper than a full sync.
+*/
+static int teensySync(sqlite3_file *pFile, int flags)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  if (T41SQLite::getInstance().getSyncPolicy() == T41SQLite::SyncPolicy::DEFERRED &&
+      (p->openFlags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL)))
+  {
+    teensySyncEnqueue(p);
+    return SQLITE_OK;
+  }
+
+  int rc = teensyFlushBuffer(p);
+  
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  rc = teensyFlushWriteBack(p);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  p->teensyFile->flush();
+  teensyRawRefresh(p);
+
+  return SQLITE_OK;
+}
+
+/*
+** Write the size of the file in bytes to *pSize.
+*/
+static int teensyFileSize(sqlite3_file *pFile, sqlite_int64 *pSize)
+{
+  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+  
+  *pSize = teensyStoredSize(p);
+
+  /* Data in the write buffer may extend the file. */
+  if (p->nBuffer > 0)
+  {
+    *pSize = max(*pSize, p->iBufferOfst + p->nBuffer);
+  }
+
+  if (p->pWriteBack)
+  {
+    *pSize = max(*pSize, teensyWriteBackEnd(p->pWriteBack));
+  }
+
+  if (p->isBatchActive)
+  {
+    *pSize = max(*pSize, teensyWriteBackEnd(p->pBatch));
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Locking functions. The xLock() and xUnlock() methods are both no-ops.
+** The xCheckReservedLock() always indicates that no other process holds
+** a reserved lock on the database file. This ensures that if a hot-journal
+** file is found in the file-system it is rolled back.
+**
+** SQLite takes a SHARED lock before every read transaction. Another
+** connection may have changed the size of the database since (in WAL mode
+** by a checkpoint), so the tracked size is refreshed then from the file
+** handle, which other connections share (see FILE HANDLE POOL). Pages other connections left in
+** their write-back buffers are written first, and caches they made stale
+** since the last transaction are dropped.
+*/
+static int teensyLock(sqlite3_file *pFile, int eLock)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  if (eLock == SQLITE_LOCK_SHARED)
+  {
+    int rc = teensySiblingsFlush(p);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    if (p->nFileSize >= 0)
+    {
+      p->nFileSize = static_cast<sqlite3_int64>(p->teensyFile->size());
+    }
+
+    teensyCachesRefresh(p);
+  }
+
+  return SQLITE_OK;
+}
+static int teensyUnlock(sqlite3_file *pFile, int eLock)
+{
+  return SQLITE_OK;
+}
+static int teensyCheckReservedLock(sqlite3_file *pFile, int *pResOut)
+{
+  *pResOut = 0;
+  return SQLITE_OK;
+}
+
+/*
+** File control method. SQLITE_FCNTL_CHUNK_SIZE and SQLITE_FCNTL_SIZE_HINT
+** are used to preallocate the database file, see PREALLOCATION above.
+** The SQLITE_FCNTL_XXX_ATOMIC_WRITE operations implement BATCH ATOMIC
+** WRITE (see above) for files that have a staging buffer.
+** SQLITE_FCNTL_MMAP_SIZE (PRAGMA mmap_size) changes the mirror limit of
+** the file, see MEMORY-MAPPED PAGES above.
+*/
+static int teensyFileControl(sqlite3_file *pFile, int op, void *pArg)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  switch (op)
+  {
+    case SQLITE_FCNTL_CHUNK_SIZE:
+      p->szChunk = max(0, *(int*)pArg);
+      return SQLITE_OK;
+
+    case SQLITE_FCNTL_SIZE_HINT:
+      /* Zero-filling is a write the batch cannot take. */
+      if (p->isBatchActive)
+      {
+        return SQLITE_OK;
+      }
+      return teensyFileSizeHint(p, *(sqlite3_int64*)pArg);
+
+    case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+    {
+      if (not p->pBatch)
+      {
+        break;
+      }
+
+      int rc = teensyFlushWriteBack(p);
+
+      if (rc == SQLITE_OK)
+      {
+        p->isBatchActive = true;
+      }
+
+      return rc;
+    }
+
+    case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
+      if (not p->isBatchActive)
+      {
+        break;
+      }
+      return teensyBatchCommit(p);
+
+    case SQLITE_FCNTL_MMAP_SIZE:
+    {
+      TeensyMirror* m = p->pMirror;
+      sqlite3_int64 newLimit = *(sqlite3_int64*)pArg;
+      *(sqlite3_int64*)pArg = m ? m->mxData : 0;
+
+      /* The mirror is shared, only its sole user may drop or reload it. */
+      if (not m || newLimit < 0 || m->nFetchOut > 0 || m->nRef > 1)
+      {
+        return SQLITE_OK;
+      }
+
+      newLimit = min(newLimit, static_cast<sqlite3_int64>(T41SQLite::getInstance().getMirrorSizeLimit()));
+
+      if (newLimit != m->mxData)
+      {
+        teensyMirrorDrop(m);
+        m->mxData = newLimit;
+        teensyMirrorLoad(p);
+      }
+
+      return SQLITE_OK;
+    }
+
+    case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+      if (not p->isBatchActive)
+      {
+        break;
+      }
+      p->pBatch->nExtent = 0;
+      p->pBatch->nData = 0;
+      p->isBatchActive = false;
+      return SQLITE_OK;
+  }
+
+  return SQLITE_NOTFOUND;
+}
+
+/*
+** The xSectorSize() and xDeviceCharacteristics() methods. These two
+** may return special values allowing SQLite to optimize file-system 
+** access to some extent. They report what was configured for the file's
+** filesystem with T41SQLite::setFilesystemCharacteristics(), which is 0
+** (always safe) for filesystems that were not configured.
+*/
+static int teensySectorSize(sqlite3_file *pFile)
+{
+  return ((TeensyVFSFile*)pFile)->sectorSize;
+}
+
+static int teensyDeviceCharacteristics(sqlite3_file *pFile)
+{
+  return ((TeensyVFSFile*)pFile)->deviceCharacteristics;
+}
+
+/*
+** Return the wal-index node for database path zPath, creating it if
+** necessary. Returns NULL if memory cannot be allocated.
+*/
+static TeensyShmNode* teensyShmNodeAcquire(const char* zPath)
+{
+  for (TeensyShmNode* pNode = s_pShmNodeList; pNode; pNode = pNode->pNext)
+  {
+    if (strcmp(pNode->zPath, zPath) == 0)
+    {
+      pNode->nRef++;
+      return pNode;
+    }
+  }
+
+  TeensyShmNode* pNode = (TeensyShmNode*)teensyMalloc(sizeof(TeensyShmNode));
+  if (not pNode)
+  {
+    return nullptr;
+  }
+
+  memset(pNode, 0, sizeof(TeensyShmNode));
+  pNode->zPath = teensyMprintf("%s", zPath);
+
+  if (not pNode->zPath)
+  {
+    sqlite3_free(pNode);
+    return nullptr;
+  }
+
+  pNode->nRef = 1;
+  pNode->pNext = s_pShmNodeList;
+  s_pShmNodeList = pNode;
+
+  return pNode;
+}
+
+static void teensyShmNodeRelease(TeensyShmNode* pNode)
+{
+  if (--pNode->nRef > 0)
+  {
+    return;
+  }
+
+  TeensyShmNode** ppNode = &s_pShmNodeList;
+  while (*ppNode != pNode)
+  {
+    ppNode = &(*ppNode)->pNext;
+  }
+  *ppNode = pNode->pNext;
+
+  for (int i = 0; i < pNode->nRegion; i++)
+  {
+    sqlite3_free(pNode->apRegion[i]);
+  }
+
+  sqlite3_free(pNode->apRegion);
+  sqlite3_free(pNode->zPath);
+  sqlite3_free(pNode);
+}
+
+/*
+** Map wal-index region iRegion of szRegion bytes into *pp. If the region
+** does not exist yet, it is allocated (zeroed) if bExtend is true,
+** otherwise *pp is set to NULL.
+*/
+static int teensyShmMap(
+  sqlite3_file *pFile,            /* Handle open on database file */
+  int iRegion,                    /* Region to retrieve */
+  int szRegion,                   /* Size of regions */
+  int bExtend,                    /* True to extend file if necessary */
+  void volatile **pp              /* OUT: Mapped memory */
+){
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  if (not p->pShmNode)
+  {
+    p->pShmNode = teensyShmNodeAcquire(p->zPath);
+
+    if (not p->pShmNode)
+    {
+      return SQLITE_IOERR_NOMEM;
+    }
+  }
+
+  TeensyShmNode* pNode = p->pShmNode;
+  assert(pNode->nRegion == 0 || pNode->szRegion == szRegion);
+  pNode->szRegion = szRegion;
+
+  if (iRegion >= pNode->nRegion)
+  {
+    if (not bExtend)
+    {
+      *pp = nullptr;
+      return SQLITE_OK;
+    }
+
+    char** apNew = (char**)teensyRealloc(pNode->apRegion, (iRegion + 1) * sizeof(char*));
+    if (not apNew)
+    {
+      return SQLITE_IOERR_NOMEM;
+    }
+    pNode->apRegion = apNew;
+
+    while (pNode->nRegion <= iRegion)
+    {
+      char* pRegion = (char*)teensyMalloc(szRegion);
+      if (not pRegion)
+      {
+        return SQLITE_IOERR_NOMEM;
+      }
+
+      memset(pRegion, 0, szRegion);
+      pNode->apRegion[pNode->nRegion++] = pRegion;
+    }
+  }
+
+  *pp = pNode->apRegion[iRegion];
+  return SQLITE_OK;
+}
+
+/*
+** Return true if q is the WAL file of the database p is the main
+** database file of.
+*/
+static bool teensyIsWalOf(TeensyVFSFile* q, TeensyVFSFile* p)
+{
+  size_t nPath = strlen(p->zPath);
+
+  return (q->openFlags & SQLITE_OPEN_WAL) && strncmp(q->zPath, p->zPath, nPath) == 0
+         && strcmp(&q->zPath[nPath], "-wal") == 0;
+}
+
+/*
+** Acquire or release locks on the wal-index. Only other connections of
+** this program can hold conflicting locks, so a conflict is reported as
+** SQLITE_BUSY and SQLite retries.
+**
+** The wal-index is shared, the WAL write buffers are not: a writer
+** releasing the write lock writes out the frames it buffered (a commit
+** with PRAGMA synchronous=NORMAL does not call xSync()), so that other
+** connections can read every frame the wal-index points to. A connection
+** taking a lock drops the read-ahead data of WAL files another connection
+** made stale.
+*/
+static int teensyShmLock(sqlite3_file *pFile, int ofst, int n, int flags)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  TeensyShmNode* pNode = p->pShmNode;
+  uint16_t mask = static_cast<uint16_t>((1 << (ofst + n)) - (1 << ofst));
+  int rc = SQLITE_OK;
+
+  assert(ofst >= 0 && ofst + n <= SQLITE_SHM_NLOCK);
+
+  if (not pNode)
+  {
+    return SQLITE_IOERR_SHMLOCK;
+  }
+
+  /* Database pages another connection checkpointed must be in the file
+  ** before a reader looks for them there.
+  */
+  if ((flags & SQLITE_SHM_SHARED) && not (flags & SQLITE_SHM_UNLOCK))
+  {
+    rc = teensySiblingsFlush(p);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+  }
+
+  /* As in xWrite(), the WAL must not change before queued database pages
+  ** are in the file.
+  */
+  if ((flags & SQLITE_SHM_UNLOCK) && (p->shmExclMask & mask & (1 << TEENSY_WAL_WRITE_LOCK)))
+  {
+    rc = teensySyncIsDrainPending() ? teensySyncBarrier() : SQLITE_OK;
+
+    for (TeensyVFSFile* q = s_pOpenList; q && rc == SQLITE_OK; q = q->pNextOpen)
+    {
+      if (teensyIsWalOf(q, p))
+      {
+        rc = teensyFlushBuffer(q);
+      }
+    }
+  }
+
+  if (flags & SQLITE_SHM_UNLOCK)
+  {
+    for (int i = ofst; i < ofst + n; i++)
+    {
+      if (p->shmExclMask & (1 << i))
+      {
+        pNode->aLock[i] = 0;
+      }
+      else if (p->shmSharedMask & (1 << i))
+      {
+        pNode->aLock[i]--;
+      }
+    }
+
+    p->shmExclMask &= ~mask;
+    p->shmSharedMask &= ~mask;
+  }
+  else if (flags & SQLITE_SHM_SHARED)
+  {
+    assert(n == 1);
+
+    if ((p->shmSharedMask & mask) == 0)
+    {
+      if (pNode->aLock[ofst] < 0)
+      {
+        return SQLITE_BUSY;
+      }
+
+      pNode->aLock[ofst]++;
+      p->shmSharedMask |= mask;
+    }
+  }
+  else
+  {
+    for (int i = ofst; i < ofst + n; i++)
+    {
+      if ((p->shmExclMask & (1 << i)) == 0 && pNode->aLock[i] != 0)
+      {
+        return SQLITE_BUSY;
+      }
+    }
+
+    for (int i = ofst; i < ofst + n; i++)
+    {
+      pNode->aLock[i] = -1;
+    }
+
+    p->shmExclMask |= mask;
+  }
+
+  if (not (flags & SQLITE_SHM_UNLOCK))
+  {
+    for (TeensyVFSFile* q = s_pOpenList; q; q = q->pNextOpen)
+    {
+      if (teensyIsWalOf(q, p))
+      {
+        teensyCachesRefresh(q);
+      }
+    }
+  }
+
+  return rc;
+}
+
+/*
+** There is a single core and the wal-index is never touched from an
+** interrupt, so a compiler/memory barrier is all that is needed.
+*/
+static void teensyShmBarrier(sqlite3_file *pFile)
+{
+  __sync_synchronize();
+}
+
+/*
+** Drop this file's mapping of the wal-index, releasing any locks it still
+** holds. The wal-index itself is freed with the last mapping; there is no
+** file to delete, so deleteFlag needs no handling.
+*/
+static int teensyShmUnmap(sqlite3_file *pFile, int deleteFlag)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  if (p->pShmNode)
+  {
+    teensyShmLock(pFile, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK | SQLITE_SHM_SHARED);
+    teensyShmNodeRelease(p->pShmNode);
+    p->pShmNode = nullptr;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Hand out a pointer to iAmt bytes of the mirror at offset iOfst, or set
+** *pp to NULL (SQLite then reads the page with xRead()) if the range is
+** not mirrored.
+*/
+static int teensyFetch(sqlite3_file *pFile, sqlite3_int64 iOfst, int iAmt, void **pp)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  *pp = nullptr;
+
+  if (p->pMirror && iOfst + iAmt <= p->pMirror->nData && not p->isBatchActive)
+  {
+    *pp = &p->pMirror->aData[iOfst];
+    p->pMirror->nFetchOut++;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Release a pointer handed out by teensyFetch(). The mirror stays coherent
+** with the file, so a request to drop all mappings (pPage NULL) needs no
+** action.
+*/
+static int teensyUnfetch(sqlite3_file *pFile, sqlite3_int64 iOfst, void *pPage)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  if (pPage)
+  {
+    p->pMirror->nFetchOut--;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Open a file handle.
+*/
+static int teensyOpen(
+  sqlite3_vfs *pVfs,              /* VFS */
+  const char *zName,              /* File to open, or 0 for a temp file */
+  sqlite3_file *pFile,            /* Pointer to TeensyVFSFile struct to populate */
+  int flags,                      /* Input SQLITE_OPEN_XXX flags */
+  int *pOutFlags                  /* Output SQLITE_OPEN_XXX flags (or NULL) */
+){
+  static const sqlite3_io_methods teensyio = {
+    3,                            /* iVersion */
+    teensyClose,                    /* xClose */
+    teensyRead,                     /* xRead */
+    teensyWrite,                    /* xWrite */
+    teensyTruncate,                 /* xTruncate */
+    teensySync,                     /* xSync */
+    teensyFileSize,                 /* xFileSize */
+    teensyLock,                     /* xLock */
+    teensyUnlock,                   /* xUnlock */
+    teensyCheckReservedLock,        /* xCheckReservedLock */
+    teensyFileControl,              /* xFileControl */
+    teensySectorSize,               /* xSectorSize */
+    teensyDeviceCharacteristics,    /* xDeviceCharacteristics */
+    teensyShmMap,                   /* xShmMap */
+    teensyShmLock,                  /* xShmLock */
+    teensyShmBarrier,               /* xShmBarrier */
+    teensyShmUnmap,                 /* xShmUnmap */
+    teensyFetch,                    /* xFetch */
+    teensyUnfetch                   /* xUnfetch */
+  };
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_OPEN");
+
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile; /* Populate this structure */
+
+  if (zName == 0)
+  {
+    return SQLITE_IOERR;
+  }
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_OPEN_FILE ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(zName);
+
+  const char* zFsName;
+  FS* filesystem = teensyFilesystem(zName, &zFsName);
+  memset(p, 0, sizeof(TeensyVFSFile));
+  int rc = teensyFileAcquire(p, zName, flags);
+
+  if (rc != SQLITE_OK)
+  {
+    teensyExistsForget(zName);
+    return rc;
+  }
+
+  teensyExistsSet(zName, true);
+
+  p->openFlags = flags;
+  p->zPath = zName;
+  p->nFileSize = (flags & SQLITE_OPEN_WAL) ? -1 : static_cast<sqlite3_int64>(p->teensyFile->size());
+  p->iFilePos = -1;
+
+  T41SQLite::FilesystemCharacteristics characteristics = T41SQLite::getInstance().getFilesystemCharacteristics(filesystem);
+  p->sectorSize = characteristics.m_sectorSize;
+  p->deviceCharacteristics = characteristics.m_deviceCharacteristics;
+
+  if (flags & SQLITE_OPEN_MAIN_DB)
+  {
+    rc = teensyBatchLogRecover(p);
+
+    if (rc != SQLITE_OK)
+    {
+      teensyFileRelease(p, false);
+      return rc;
+    }
+
+    p->pRawSd = T41SQLite::getInstance().getRawSectorAccess(filesystem);
+
+    if (p->pRawSd)
+    {
+      teensyRawLookup(p);
+    }
+  }
+
+  /* A cache or buffer that cannot be allocated only costs performance, so
+  ** the file is opened without it in that case.
+  */
+  if (flags & SQLITE_OPEN_MAIN_DB)
+  {
+    teensyMirrorAcquire(p);
+
+    if (not p->pMirror || p->pMirror->mxData == 0)
+    {
+      p->pReadCache = teensyReadCacheCreate(T41SQLite::getInstance().getReadCacheSize());
+    }
+
+    if (not (flags & SQLITE_OPEN_READONLY))
+    {
+      p->pWriteBack = teensyWriteBackCreate(T41SQLite::getInstance().getWriteBufferSize());
+#ifdef SQLITE_ENABLE_BATCH_ATOMIC_WRITE
+      p->pBatch = teensyWriteBackCreate(T41SQLite::getInstance().getBatchAtomicWriteSize());
+#endif
+    }
+  }
+
+  if (p->pBatch)
+  {
+    p->deviceCharacteristics |= SQLITE_IOCAP_BATCH_ATOMIC;
+  }
+
+  if (pOutFlags)
+  {
+    *pOutFlags = flags;
+  }
+
+  p->sqliteFile.pMethods = &teensyio;
+  p->pNextOpen = s_pOpenList;
+  s_pOpenList = p;
+
+  return SQLITE_OK;
+}
+
+/*
+** Delete the file identified by argument zPath. If the dirSync parameter
+** is non-zero, then WE SHOULD ensure the file-system modification to delete the
+** file has been synced to disk before returning.
+** BUT CANNOT ensure the sync, therefore we ignore the dirSync parameter.
+*/
+static int teensyDelete(sqlite3_vfs *pVfs, const char *zPath, int dirSync)
+{
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_DELETE_PATH ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(zPath);
+
+  /* A journal kept open by the pool is truncated instead of deleted, a
+  ** journal of zero bytes is never hot. It is removed when its slot is
+  ** needed or at sqlite3_os_end().
+  */
+  TeensyFileSlot* s = teensyFilePoolFindKept(zPath);
+
+  if (s)
+  {
+    if (s->isDeleted || s->isDeletePending)
+    {
+      return SQLITE_IOERR_DELETE;
+    }
+
+    /* With deferred syncs, the journal is the only durable copy of the
+    ** previous database contents until the queued pages are in the file.
+    */
+    if (s_pSyncQueue)
+    {
+      s->isDeletePending = true;
+      s_nDeletePending++;
+      teensyExistsSet(zPath, false);
+      return SQLITE_OK;
+    }
+
+    if (s->file.truncate(0))
+    {
+      s->file.flush();
+      s->isDeleted = true;
+      T41SQLite::getInstance().getFilePoolStats().m_deletesAvoided++;
+      teensyExistsSet(zPath, false);
+      return SQLITE_OK;
+    }
+
+    teensyFilePoolEvict(s);
+  }
+
+  int rc = teensySyncBarrierIfPending();
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  const char* zFsPath;
+  FS* filesystem = teensyFilesystem(zPath, &zFsPath);
+
+  if (not filesystem->remove(zFsPath))
+  {
+    teensyExistsForget(zPath);
+    return SQLITE_IOERR_DELETE;
+  }
+
+  teensyExistsSet(zPath, false);
+  
+  return SQLITE_OK;
+}
+
+/*
+** Query the file-system to see if the named file exists, is readable or
+** is both readable and writable.
+*/
+static int teensyAccess(
+  sqlite3_vfs *pVfs, 
+  const char *zPath, 
+  int flags, 
+  int *pResOut
+){
+  assert(flags==SQLITE_ACCESS_EXISTS ||
+         flags==SQLITE_ACCESS_READ ||
+         flags==SQLITE_ACCESS_READWRITE);
+
+  // Because we cannot/don't need to check access permissions,
+  // we will set *pResOut to T41SQLite::ACCESS_SUCCESFUL,
+  // if a file with the given name exists.
+  TeensyFileSlot* s = teensyFilePoolFindKept(zPath);
+  TeensyExistsEntry* e = s ? nullptr : teensyExistsFind(zPath);
+  bool isExisting;
+
+  if (s)
+  {
+    isExisting = not (s->isDeleted || s->isDeletePending);
+  }
+  else if (e)
+  {
+    isExisting = e->isExisting;
+  }
+  else
+  {
+    const char* zFsPath;
+    FS* filesystem = teensyFilesystem(zPath, &zFsPath);
+    isExisting = filesystem->exists(zFsPath);
+    teensyExistsSet(zPath, isExisting);
+  }
+
+  if (s || e)
+  {
+    T41SQLite::getInstance().getFilePoolStats().m_directoryWalksAvoided++;
+  }
+
+  *pResOut = isExisting ? T41SQLite::ACCESS_SUCCESFUL : T41SQLite::ACCESS_FAILED;
+  
+  return SQLITE_OK;
+}
+
+/*
+** Argument zPath points to a nul-terminated string containing a file path.
+** If zPath is an absolute path, then it is copied as is into the output 
+** buffer. Otherwise, if it is a relative path, then the equivalent full
+** path is written to the output buffer.
+**
+** This function assumes that paths are UNIX style. Specifically, that:
+**
+**   1. Path components are separated by a '/'. and 
+**   2. Full paths begin with a '/' character.
+**
+** The output starts with "<name>:" if the file is on a filesystem added
+** by name, either because zPath starts with that prefix or because pVfs
+** is the VFS of that filesystem, and not on the default filesystem.
+*/
+// !!!! It impossible to get the full pathname with exFAT. !!!!
+// !!!! Therefore we prepend (set by user) getDBDirFullPath() to relative paths. !!!!
+static int teensyFullPathname(
+  sqlite3_vfs *pVfs,              /* VFS */
+  const char *zPath,              /* Input path (possibly a relative path) */
+  int nPathOut,                   /* Size of output buffer in bytes */
+  char *zPathOut                  /* Pointer to output buffer */
+){
+  T41SQLite& instance = T41SQLite::getInstance();
+  const char* zFsName = (const char*)pVfs->pAppData; /* Filesystem name of a per-filesystem VFS, or NULL */
+  int nFsName = zFsName ? strlen(zFsName) : 0;
+  int nPrefix = 0;
+  FS* filesystem = teensyFilesystemOfPrefix(zPath, &nPrefix);
+
+  if (filesystem)
+  {
+    zFsName = zPath;
+    nFsName = nPrefix - 1;
+  }
+  else if (zFsName)
+  {
+    filesystem = instance.getFilesystem(zFsName);
+  }
+
+  /* Files on the default filesystem have no prefix */
+  if (not filesystem || filesystem == instance.getFilesystem())
+  {
+    nFsName = 0;
+  }
+
+  const char* zRest = &zPath[nPrefix];
+  sqlite3_snprintf(nPathOut, zPathOut, "%.*s%s%s%s", nFsName, zFsName ? zFsName : "", nFsName > 0 ? ":" : "",
+                   zRest[0] == '/' ? "" : instance.getDBDirFullPath().c_str(), zRest);
+  zPathOut[nPathOut - 1] = '\0';
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_FULL_PATH ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(zPathOut);
+
+  return SQLITE_OK;
+}
+
+/*
+** The following four VFS methods:
+**
+**   xDlOpen
+**   xDlError
+**   xDlSym
+**   xDlClose
+**
+** are supposed to implement the functionality needed by SQLite to load
+** extensions compiled as shared objects. This simple VFS does not support
+** this functionality, so the following functions are no-ops.
+*/
+static void* teensyDlOpen(sqlite3_vfs* pVfs, const char* zPath)
+{
+  return nullptr;
+}
+
+static void teensyDlError(sqlite3_vfs* pVfs, int nByte, char* zErrMsg)
+{
+  sqlite3_snprintf(nByte, zErrMsg, "Loadable extensions are not supported");
+  zErrMsg[nByte-1] = '\0';
+}
+
+static void (*teensyDlSym(sqlite3_vfs* pVfs, void* pH, const char* z))(void)
+{
+  return 0;
+}
+
+static void teensyDlClose(sqlite3_vfs *pVfs, void *pHandle)
+{
+  return;
+}
+
+/*
+** Parameter zByte points to a buffer nByte bytes in size. Populate this
+** buffer with pseudo-random data.
+*/
+static int teensyRandomness(sqlite3_vfs *pVfs, int nByte, char *zByte)
+{
+  return SQLITE_OK;
+}
+
+/*
+** Sleep for at least nMicro microseconds. Return the (approximate) number 
+** of microseconds slept for.
+*/
+static int teensySleep(sqlite3_vfs *pVfs, int nMicro)
+{
+  delayMicroseconds(nMicro);
+  return nMicro;
+}
+
+/*
+** Set *pTime to the current UTC time expressed as a Julian day. Return
+** SQLITE_OK if successful, or an error code otherwise.
+**
+**   http://en.wikipedia.org/wiki/Julian_day
+**
+** This implementation is not very good. The current time is rounded to
+** an integer number of seconds. Also, assuming time_t is a signed 32-bit 
+** value, it will stop working some time in the year 2038 AD (the so-called
+** "year 2038" problem that afflicts systems that store time this way). 
+*/
+static int teensyCurrentTime(sqlite3_vfs *pVfs, double *pTime)
+{
+  time_t t = now();
+  *pTime = t/86400.0 + 2440587.5; 
+  return SQLITE_OK;
+}
+
+/*
+** Return the memory VFS file of zPath, or NULL.
+*/
+static TeensyMemNode* teensyMemNodeFind(const char* zPath)
+{
+  for (TeensyMemNode* m = s_pMemNodeList; m; m = m->pNext)
+  {
+    if (strcmp(m->zPath, zPath) == 0)
+    {
+      return m;
+    }
+  }
+
+  return nullptr;
+}
+
+/*
+** Unlink a memory VFS file from s_pMemNodeList (if it is linked) and free
+** it.
+*/
+static void teensyMemNodeFree(TeensyMemNode* m)
+{
+  for (TeensyMemNode** pp = &s_pMemNodeList; *pp; pp = &(*pp)->pNext)
+  {
+    if (*pp == m)
+    {
+      *pp = m->pNext;
+      break;
+    }
+  }
+
+  extmem_free(m->aData);
+  extmem_free(m->aDirty);
+  sqlite3_free(m->zPath);
+  sqlite3_free(m);
+}
+
+/*
+** Make sure aData can hold nByte bytes. Returns false if out of memory.
+*/
+static bool teensyMemGrow(TeensyMemNode* m, sqlite3_int64 nByte)
+{
+  if (nByte <= m->szData)
+  {
+    return true;
+  }
+
+  sqlite3_int64 szNew = max(nByte, 2 * m->szData);
+  szNew = (szNew + SQLITE_VFS_MEM_BLOCKSZ - 1) / SQLITE_VFS_MEM_BLOCKSZ * SQLITE_VFS_MEM_BLOCKSZ;
+  char* aNew = (char*)teensyExtmemRealloc(m->aData, static_cast<size_t>(szNew));
+
+  if (not aNew)
+  {
+    return false;
+  }
+
+  m->aData = aNew;
+
+  if (m->isBacked)
+  {
+    size_t nDirtyOld = static_cast<size_t>(m->szData / SQLITE_VFS_MEM_BLOCKSZ + 7) / 8;
+    size_t nDirtyNew = static_cast<size_t>(szNew / SQLITE_VFS_MEM_BLOCKSZ + 7) / 8;
+    uint8_t* aDirtyNew = (uint8_t*)teensyExtmemRealloc(m->aDirty, nDirtyNew);
+
+    if (not aDirtyNew)
+    {
+      return false;
+    }
+
+    memset(&aDirtyNew[nDirtyOld], 0, nDirtyNew - nDirtyOld);
+    m->aDirty = aDirtyNew;
+  }
+
+  m->szData = szNew;
+
+  return true;
+}
+
+/*
+** Mark the blocks holding iAmt bytes at offset iOfst as dirty.
+*/
+static void teensyMemMarkDirty(TeensyMemNode* m, int iAmt, sqlite3_int64 iOfst)
+{
+  if (not m->isBacked || iAmt <= 0)
+  {
+    return;
+  }
+
+  sqlite3_int64 iLast = (iOfst + iAmt - 1) / SQLITE_VFS_MEM_BLOCKSZ;
+
+  for (sqlite3_int64 iBlock = iOfst / SQLITE_VFS_MEM_BLOCKSZ; iBlock <= iLast; iBlock++)
+  {
+    m->aDirty[iBlock / 8] |= (uint8_t)(1 << (iBlock % 8));
+  }
+
+  m->isDirty = true;
+}
+
+/*
+** Find the next run of dirty blocks at or after offset *piOfst, at most
+** SQLITE_VFS_WRITE_BACK_MERGESZ bytes and clipped to the end of the file.
+** Returns false if there is none.
+*/
+static bool teensyMemNextRun(TeensyMemNode* m, sqlite3_int64* piOfst, int* pnAmt)
+{
+  if (*piOfst >= m->nData)
+  {
+    return false;
+  }
+
+  sqlite3_int64 nBlock = (m->nData + SQLITE_VFS_MEM_BLOCKSZ - 1) / SQLITE_VFS_MEM_BLOCKSZ;
+  sqlite3_int64 iBlock = *piOfst / SQLITE_VFS_MEM_BLOCKSZ;
+
+  while (iBlock < nBlock && not (m->aDirty[iBlock / 8] & (1 << (iBlock % 8))))
+  {
+    iBlock++;
+  }
+
+  if (iBlock >= nBlock)
+  {
+    return false;
+  }
+
+  sqlite3_int64 iFirst = iBlock;
+
+  while (iBlock < nBlock && (m->aDirty[iBlock / 8] & (1 << (iBlock % 8))) &&
+         (iBlock - iFirst + 1) * SQLITE_VFS_MEM_BLOCKSZ <= SQLITE_VFS_WRITE_BACK_MERGESZ)
+  {
+    iBlock++;
+  }
+
+  *piOfst = iFirst * SQLITE_VFS_MEM_BLOCKSZ;
+  *pnAmt = static_cast<int>(min(iBlock * SQLITE_VFS_MEM_BLOCKSZ, m->nData) - *piOfst);
+
+  return true;
+}
+
+/*
+** Read the backing file of a memory VFS main database into memory, after
+** replaying a flush that was interrupted by a power loss. A missing
+** backing file is an empty database.
+*/
+static int teensyMemLoad(TeensyMemNode* m)
+{
+  const char* zFsPath;
+  FS* filesystem = teensyFilesystem(m->zPath, &zFsPath);
+
+  if (not filesystem->exists(zFsPath))
+  {
+    return SQLITE_OK;
+  }
+
+  TeensyVFSFile backing;
+  memset(&backing, 0, sizeof(TeensyVFSFile));
+  backing.openFlags = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE;
+  backing.zPath = m->zPath;
+  int rc = teensyFileAcquire(&backing, m->zPath, backing.openFlags);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  backing.nFileSize = static_cast<sqlite3_int64>(backing.teensyFile->size());
+  backing.iFilePos = -1;
+  rc = teensyBatchLogRecover(&backing);
+
+  sqlite3_int64 nFile = backing.nFileSize;
+
+  if (rc == SQLITE_OK && not teensyMemGrow(m, nFile))
+  {
+    rc = SQLITE_NOMEM;
+  }
+
+  if (rc == SQLITE_OK && nFile > 0)
+  {
+    if (not teensySeek(&backing, 0) ||
+        teensyReadHere(&backing, m->aData, static_cast<size_t>(nFile)) != static_cast<size_t>(nFile))
+    {
+      rc = SQLITE_IOERR_READ;
+    }
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    m->nData = nFile;
+  }
+
+  teensyFileRelease(&backing, false);
+
+  return rc;
+}
+
+/*
+** Write the dirty blocks of a memory VFS main database to its backing
+** file, see MEMORY VFS above. Returns SQLITE_BUSY if a write transaction
+** is open on the database.
+*/
+static int teensyMemFlush(TeensyMemNode* m)
+{
+  if (not m->isBacked || not m->isDirty)
+  {
+    return SQLITE_OK;
+  }
+
+  if (m->nWriter > 0)
+  {
+    return SQLITE_BUSY;
+  }
+
+  TeensyVFSFile backing;
+  memset(&backing, 0, sizeof(TeensyVFSFile));
+  backing.openFlags = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  backing.zPath = m->zPath;
+  int rc = teensyFileAcquire(&backing, m->zPath, backing.openFlags);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  teensyExistsSet(m->zPath, true);
+  backing.nFileSize = static_cast<sqlite3_int64>(backing.teensyFile->size());
+  backing.iFilePos = -1;
+
+  uint32_t checksum;
+  uint32_t nExtent = 0;
+  uint32_t nData = 0;
+  sqlite3_int64 iOfst = 0;
+  int nAmt = 0;
+  rc = teensyBatchLogBegin(&backing, &checksum);
+
+  while (rc == SQLITE_OK && teensyMemNextRun(m, &iOfst, &nAmt))
+  {
+    rc = teensyBatchLogAppend(&backing, &m->aData[iOfst], nAmt, iOfst, &checksum);
+    nExtent++;
+    nData += nAmt;
+    iOfst += nAmt;
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyBatchLogSeal(&backing, nExtent, nData, checksum);
+  }
+
+  iOfst = 0;
+
+  while (rc == SQLITE_OK && teensyMemNextRun(m, &iOfst, &nAmt))
+  {
+    rc = teensyWriteAt(&backing, &m->aData[iOfst], nAmt, iOfst);
+    iOfst += nAmt;
+  }
+
+  if (rc == SQLITE_OK && backing.nFileSize > m->nData)
+  {
+    if (not backing.teensyFile->truncate(static_cast<uint64_t>(m->nData)))
+    {
+      rc = SQLITE_IOERR_TRUNCATE;
+    }
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyBatchLogRetire(&backing);
+  }
+
+  teensyBatchLogClose(&backing, rc == SQLITE_OK);
+  teensyFileRelease(&backing, false);
+
+  if (rc == SQLITE_OK)
+  {
+    T41SQLite::MemoryVFSStats& stats = T41SQLite::getInstance().getMemoryVFSStats();
+    stats.m_flushes++;
+    stats.m_bytesFlushed += nData;
+
+    memset(m->aDirty, 0, static_cast<size_t>(m->szData / SQLITE_VFS_MEM_BLOCKSZ + 7) / 8);
+    m->isDirty = false;
+  }
+
+  return rc;
+}
+
+/*
+** Close a memory VFS file. Main databases stay in memory until
+** sqlite3_os_end(), other files until they are deleted.
+*/
+static int teensyMemClose(sqlite3_file *pFile)
+{
+  TeensyMemFile* p = (TeensyMemFile*)pFile;
+  TeensyMemNode* m = p->pNode;
+
+  if (p->eLock >= SQLITE_LOCK_RESERVED)
+  {
+    m->nWriter--;
+  }
+
+  m->nRef--;
+
+  if (m->nRef == 0 && m->isDeleteOnClose)
+  {
+    teensyMemNodeFree(m);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Read data from a memory VFS file.
+*/
+static int teensyMemRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyMemNode* m = ((TeensyMemFile*)pFile)->pNode;
+
+  if (iOfst + iAmt > m->nData)
+  {
+    sqlite3_int64 nAvail = max(m->nData - iOfst, static_cast<sqlite3_int64>(0));
+    memset(zBuf, 0, iAmt);
+
+    if (nAvail > 0)
+    {
+      memcpy(zBuf, &m->aData[iOfst], static_cast<size_t>(nAvail));
+    }
+
+    return SQLITE_IOERR_SHORT_READ;
+  }
+
+  memcpy(zBuf, &m->aData[iOfst], iAmt);
+
+  return SQLITE_OK;
+}
+
+/*
+** Write data to a memory VFS file.
+*/
+static int teensyMemWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyMemNode* m = ((TeensyMemFile*)pFile)->pNode;
+
+  if (not teensyMemGrow(m, iOfst + iAmt))
+  {
+    return SQLITE_FULL;
+  }
+
+  if (iOfst > m->nData)
+  {
+    memset(&m->aData[m->nData], 0, static_cast<size_t>(iOfst - m->nData));
+    teensyMemMarkDirty(m, static_cast<int>(iOfst - m->nData), m->nData);
+  }
+
+  memcpy(&m->aData[iOfst], zBuf, iAmt);
+  teensyMemMarkDirty(m, iAmt, iOfst);
+  m->nData = max(m->nData, iOfst + iAmt);
+
+  return SQLITE_OK;
+}
+
+/*
+** Truncate a memory VFS file.
+*/
+static int teensyMemTruncate(sqlite3_file *pFile, sqlite_int64 size)
+{
+  TeensyMemNode* m = ((TeensyMemFile*)pFile)->pNode;
+
+  if (size < m->nData)
+  {
+    m->nData = size;
+
+    if (m->isBacked)
+    {
+      m->isDirty = true;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Memory VFS files do not need syncing, they reach the card with
+** T41SQLite::flushMemoryDatabases().
+*/
+static int teensyMemSync(sqlite3_file *pFile, int flags)
+{
+  return SQLITE_OK;
+}
+
+/*
+** Write the size of a memory VFS file in bytes to *pSize.
+*/
+static int teensyMemFileSize(sqlite3_file *pFile, sqlite_int64 *pSize)
+{
+  *pSize = ((TeensyMemFile*)pFile)->pNode->nData;
+  return SQLITE_OK;
+}
+
+/*
+** Locks of memory VFS files only track whether a write transaction is
+** open, so a flush does not write a half-written transaction to the card.
+*/
+static int teensyMemLock(sqlite3_file *pFile, int eLock)
+{
+  TeensyMemFile* p = (TeensyMemFile*)pFile;
+
+  if (eLock >= SQLITE_LOCK_RESERVED && p->eLock < SQLITE_LOCK_RESERVED)
+  {
+    p->pNode->nWriter++;
+  }
+
+  p->eLock = max(p->eLock, eLock);
+
+  return SQLITE_OK;
+}
+
+static int teensyMemUnlock(sqlite3_file *pFile, int eLock)
+{
+  TeensyMemFile* p = (TeensyMemFile*)pFile;
+
+  if (eLock < SQLITE_LOCK_RESERVED && p->eLock >= SQLITE_LOCK_RESERVED)
+  {
+    p->pNode->nWriter--;
+  }
+
+  p->eLock = min(p->eLock, eLock);
+
+  return SQLITE_OK;
+}
+
+static int teensyMemCheckReservedLock(sqlite3_file *pFile, int *pResOut)
+{
+  *pResOut = ((TeensyMemFile*)pFile)->pNode->nWriter > 0;
+  return SQLITE_OK;
+}
+
+static int teensyMemFileControl(sqlite3_file *pFile, int op, void *pArg)
+{
+  return SQLITE_NOTFOUND;
+}
+
+static int teensyMemSectorSize(sqlite3_file *pFile)
+{
+  return 0;
+}
+
+static int teensyMemDeviceCharacteristics(sqlite3_file *pFile)
+{
+  return SQLITE_IOCAP_ATOMIC | SQLITE_IOCAP_POWERSAFE_OVERWRITE |
+         SQLITE_IOCAP_SAFE_APPEND | SQLITE_IOCAP_SEQUENTIAL;
+}
+
+/*
+** Open a memory VFS file. The first open of a main database loads its
+** backing file from the filesystem.
+*/
+static int teensyMemOpen(
+  sqlite3_vfs *pVfs,              /* VFS */
+  const char *zName,              /* File to open, or NULL for a temp file */
+  sqlite3_file *pFile,            /* Pointer to TeensyMemFile struct to populate */
+  int flags,                      /* Input SQLITE_OPEN_XXX flags */
+  int *pOutFlags                  /* Output SQLITE_OPEN_XXX flags (or NULL) */
+){
+  static const sqlite3_io_methods teensymemio = {
+    1,                              /* iVersion */
+    teensyMemClose,                 /* xClose */
+    teensyMemRead,                  /* xRead */
+    teensyMemWrite,                 /* xWrite */
+    teensyMemTruncate,              /* xTruncate */
+    teensyMemSync,                  /* xSync */
+    teensyMemFileSize,              /* xFileSize */
+    teensyMemLock,                  /* xLock */
+    teensyMemUnlock,                /* xUnlock */
+    teensyMemCheckReservedLock,     /* xCheckReservedLock */
+    teensyMemFileControl,           /* xFileControl */
+    teensyMemSectorSize,            /* xSectorSize */
+    teensyMemDeviceCharacteristics  /* xDeviceCharacteristics */
+  };
+
+  TeensyMemFile* p = (TeensyMemFile*)pFile;
+  memset(p, 0, sizeof(TeensyMemFile));
+
+  TeensyMemNode* m = zName ? teensyMemNodeFind(zName) : nullptr;
+
+  if (not m)
+  {
+    if (zName && not (flags & SQLITE_OPEN_CREATE) && not (flags & SQLITE_OPEN_MAIN_DB))
+    {
+      return SQLITE_CANTOPEN;
+    }
+
+    m = (TeensyMemNode*)teensyMalloc(sizeof(TeensyMemNode));
+
+    if (not m)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    memset(m, 0, sizeof(TeensyMemNode));
+    m->zPath = teensyMprintf("%s", zName ? zName : "");
+    m->isBacked = (zName && (flags & SQLITE_OPEN_MAIN_DB));
+    m->isDeleteOnClose = (not zName || (flags & SQLITE_OPEN_DELETEONCLOSE));
+
+    if (not m->zPath)
+    {
+      sqlite3_free(m);
+      return SQLITE_NOMEM;
+    }
+
+    int rc = m->isBacked ? teensyMemLoad(m) : SQLITE_OK;
+
+    if (rc != SQLITE_OK)
+    {
+      teensyMemNodeFree(m);
+      return rc;
+    }
+
+    if (zName)
+    {
+      m->pNext = s_pMemNodeList;
+      s_pMemNodeList = m;
+    }
+  }
+
+  m->nRef++;
+  p->pNode = m;
+  p->base.pMethods = &teensymemio;
+
+  if (pOutFlags)
+  {
+    *pOutFlags = flags;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Delete a memory VFS file that is not open anymore.
+*/
+static int teensyMemDelete(sqlite3_vfs *pVfs, const char *zPath, int dirSync)
+{
+  TeensyMemNode* m = teensyMemNodeFind(zPath);
+
+  if (not m)
+  {
+    return SQLITE_IOERR_DELETE_NOENT;
+  }
+
+  if (m->nRef > 0)
+  {
+    m->isDeleteOnClose = true;
+  }
+  else
+  {
+    teensyMemNodeFree(m);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Report whether a memory VFS file exists.
+*/
+static int teensyMemAccess(sqlite3_vfs *pVfs, const char *zPath, int flags, int *pResOut)
+{
+  *pResOut = T41SQLite::ACCESS_FAILED;
+  TeensyMemNode* m = teensyMemNodeFind(zPath);
+
+  if (m && not (m->isDeleteOnClose && m->nRef == 0))
+  {
+    *pResOut = T41SQLite::ACCESS_SUCCESFUL;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Flush all memory VFS main databases to their backing files. Databases
+** with an open write transaction are skipped and reported with
+** SQLITE_BUSY, other errors take precedence.
+*/
+int sqlite3_teensy_mem_flush(void)
+{
+  int rc = SQLITE_OK;
+
+  for (TeensyMemNode* m = s_pMemNodeList; m; m = m->pNext)
+  {
+    int rcFlush = teensyMemFlush(m);
+
+    if (rcFlush != SQLITE_OK && (rc == SQLITE_OK || rc == SQLITE_BUSY))
+    {
+      rc = rcFlush;
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Return the page size stored in the database header zHeader, or 0 if it
+** is not a valid page size.
+*/
+static int teensyHeaderPageSize(const void* zHeader)
+{
+  const unsigned char* a = (const unsigned char*)zHeader;
+  int szPage = (a[16] << 8) | a[17];
+
+  if (szPage == 1)
+  {
+    szPage = 65536;
+  }
+
+  return (szPage >= 512 && (szPage & (szPage - 1)) == 0) ? szPage : 0;
+}
+
+static int teensyTierBucket(TeensyTierNode* t, uint32_t iPage)
+{
+  return static_cast<int>(iPage & static_cast<uint32_t>(t->nHash - 1));
+}
+
+/*
+** Return the slot holding page iPage, or -1 if it is not in the tier
+** file.
+*/
+static int teensyTierFind(TeensyTierNode* t, uint32_t iPage)
+{
+  for (int i = t->aHash[teensyTierBucket(t, iPage)]; i >= 0; i = t->aSlot[i].iHashNext)
+  {
+    if (t->aSlot[i].iPage == iPage)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void teensyTierLink(TeensyTierNode* t, int iSlot)
+{
+  int iBucket = teensyTierBucket(t, t->aSlot[iSlot].iPage);
+  t->aSlot[iSlot].iHashNext = t->aHash[iBucket];
+  t->aHash[iBucket] = iSlot;
+}
+
+static void teensyTierUnlink(TeensyTierNode* t, int iSlot)
+{
+  int* piSlot = &t->aHash[teensyTierBucket(t, t->aSlot[iSlot].iPage)];
+
+  while (*piSlot != iSlot)
+  {
+    piSlot = &t->aSlot[*piSlot].iHashNext;
+  }
+
+  *piSlot = t->aSlot[iSlot].iHashNext;
+}
+
+/*
+** Return the path of the tier file of a database on the tier filesystem,
+** which is stored in *pFilesystem. The name of the filesystem of the
+** database, if it has one, is part of it. The result must be freed with
+** sqlite3_free(). Returns NULL if out of memory or if no filesystem was
+** added under the name given to T41SQLite::setTier().
+*/
+static char* teensyTierPath(TeensyTierNode* t, FS** pFilesystem)
+{
+  T41SQLite& instance = T41SQLite::getInstance();
+  int nPrefix = 0;
+  teensyFilesystemOfPrefix(t->zPath, &nPrefix);
+
+  *pFilesystem = instance.getFilesystem(instance.getTierFilesystemName());
+
+  if (not *pFilesystem)
+  {
+    return nullptr;
+  }
+
+  return (nPrefix > 0) ? teensyMprintf("%s-tier-%.*s", &t->zPath[nPrefix], nPrefix - 1, t->zPath) : teensyMprintf("%s-tier", t->zPath);
+}
+
+/*
+** Stop tiering a database for the rest of the session: close its tier
+** file, removing it if isRemove is true, and free the page map.
+*/
+static void teensyTierDrop(TeensyTierNode* t, bool isRemove)
+{
+  if (t->pFile)
+  {
+    t->pFile->close();
+    delete t->pFile;
+    t->pFile = nullptr;
+
+    FS* filesystem;
+    char* zTier = isRemove ? teensyTierPath(t, &filesystem) : nullptr;
+
+    if (zTier)
+    {
+      filesystem->remove(zTier);
+    }
+
+    sqlite3_free(zTier);
+  }
+
+  sqlite3_free(t->aHash);
+  sqlite3_free(t->aSlot);
+  sqlite3_free(t->aSketch);
+  t->aHash = nullptr;
+  t->aSlot = nullptr;
+  t->aSketch = nullptr;
+  t->nSlot = 0;
+}
+
+/*
+** Give up on the tier file of a database after it failed to read or
+** write. It is removed, the next open of the database starts a new one.
+*/
+static void teensyTierFail(TeensyTierNode* t)
+{
+  T41SQLite::getInstance().getTierStats().m_discards++;
+  teensyTierDrop(t, true);
+}
+
+/*
+** Write the map entry of slot iSlot to the tier file.
+*/
+static bool teensyTierWriteEntry(TeensyTierNode* t, int iSlot)
+{
+  uint32_t aEntry[2] = { t->aSlot[iSlot].iPage, t->aSlot[iSlot].checksum };
+  sqlite3_int64 iOfst = TEENSY_TIER_HEADERSZ + static_cast<sqlite3_int64>(iSlot) * TEENSY_TIER_ENTRYSZ;
+
+  t->isDirty = true;
+
+  return t->pFile->seek(iOfst, SeekSet) && t->pFile->write(aEntry, sizeof(aEntry)) == sizeof(aEntry);
+}
+
+/*
+** Write the header of the tier file, with a copy of the database header
+** zHeader (100 bytes).
+*/
+static bool teensyTierWriteHeader(TeensyTierNode* t, const void* zHeader)
+{
+  char aHeader[TEENSY_TIER_HEADERSZ];
+  uint32_t szPage = static_cast<uint32_t>(t->szPage);
+  uint32_t nSlot = static_cast<uint32_t>(t->nSlot);
+
+  memset(aHeader, 0, sizeof(aHeader));
+  memcpy(&aHeader[0], TEENSY_TIER_MAGIC, 8);
+  memcpy(&aHeader[8], &szPage, 4);
+  memcpy(&aHeader[12], &nSlot, 4);
+  memcpy(&aHeader[16], zHeader, 100);
+
+  t->isDirty = true;
+
+  return t->pFile->seek(0, SeekSet) && t->pFile->write(aHeader, sizeof(aHeader)) == sizeof(aHeader);
+}
+
+/*
+** Empty the page map.
+*/
+static void teensyTierClear(TeensyTierNode* t)
+{
+  for (int i = 0; i < t->nHash; i++)
+  {
+    t->aHash[i] = -1;
+  }
+
+  memset(t->aSlot, 0, t->nSlot * sizeof(TeensyTierSlot));
+  t->nFree = t->nSlot;
+}
+
+/*
+** Read the page map of an existing tier file. Returns false if the file
+** does not belong to the database as it is now: its header differs from
+** the database header zHeader (the database was written or replaced
+** without the tier VFS, or the tier file is ahead of it after a power
+** loss), or it was made for another page size or tier size.
+*/
+static bool teensyTierLoadMap(TeensyTierNode* t, const void* zHeader)
+{
+  char aHeader[TEENSY_TIER_HEADERSZ];
+  char aExpected[TEENSY_TIER_HEADERSZ];
+  uint32_t szPage = static_cast<uint32_t>(t->szPage);
+  uint32_t nSlot = static_cast<uint32_t>(t->nSlot);
+
+  memset(aExpected, 0, sizeof(aExpected));
+  memcpy(&aExpected[0], TEENSY_TIER_MAGIC, 8);
+  memcpy(&aExpected[8], &szPage, 4);
+  memcpy(&aExpected[12], &nSlot, 4);
+  memcpy(&aExpected[16], zHeader, 100);
+
+  if (static_cast<sqlite3_int64>(t->pFile->size()) < t->iDataOfst ||
+      not t->pFile->seek(0, SeekSet) ||
+      t->pFile->read(aHeader, sizeof(aHeader)) != sizeof(aHeader) ||
+      memcmp(aHeader, aExpected, sizeof(aHeader)) != 0)
+  {
+    return false;
+  }
+
+  uint32_t aEntry[64][2];
+
+  for (int i = 0; i < t->nSlot; i += 64)
+  {
+    int nEntry = (t->nSlot - i < 64) ? t->nSlot - i : 64;
+    int nByte = nEntry * TEENSY_TIER_ENTRYSZ;
+
+    if (t->pFile->read(aEntry, nByte) != static_cast<size_t>(nByte))
+    {
+      return false;
+    }
+
+    for (int j = 0; j < nEntry; j++)
+    {
+      TeensyTierSlot* s = &t->aSlot[i + j];
+
+      if (aEntry[j][0] != 0 && teensyTierFind(t, aEntry[j][0]) < 0)
+      {
+        s->iPage = aEntry[j][0];
+        s->checksum = aEntry[j][1];
+        teensyTierLink(t, i + j);
+        t->nFree--;
+      }
+    }
+  }
+
+  return true;
+}
+
+/*
+** Start tiering a database with pages of szPage bytes. The tier file is
+** loaded if it matches the database header zHeader, otherwise (or if
+** isReset is true) it starts over empty. Tiering stays off if it is not
+** configured or the tier file cannot be set up.
+*/
+static void teensyTierOpenFile(TeensyTierNode* t, const void* zHeader, int szPage, bool isReset)
+{
+  T41SQLite& instance = T41SQLite::getInstance();
+  int nSlot = static_cast<int>(instance.getTierSize() / static_cast<size_t>(szPage));
+
+  t->szPage = szPage;
+
+  if (nSlot <= 0)
+  {
+    return;
+  }
+
+  FS* filesystem;
+  char* zTier = teensyTierPath(t, &filesystem);
+
+  if (not zTier)
+  {
+    return;
+  }
+
+  int nHash = 1;
+  while (nHash < nSlot)
+  {
+    nHash <<= 1;
+  }
+
+  t->aHash = (int*)teensyMalloc(nHash * sizeof(int));
+  t->aSlot = (TeensyTierSlot*)teensyMalloc(nSlot * sizeof(TeensyTierSlot));
+  t->aSketch = (uint8_t*)teensyMalloc(SQLITE_VFS_TIER_SKETCHSZ);
+  T41SQLite::getInstance().getAllocationStats().m_fileHandles++;
+  t->pFile = new TeensyFile(teensyFsOpen(filesystem, zTier, FILE_WRITE));
+  sqlite3_free(zTier);
+
+  if (not t->aHash || not t->aSlot || not t->aSketch || not *t->pFile)
+  {
+    teensyTierDrop(t, false);
+    return;
+  }
+
+  t->nSlot = nSlot;
+  t->nHash = nHash;
+  t->iDataOfst = (TEENSY_TIER_HEADERSZ + static_cast<sqlite3_int64>(nSlot) * TEENSY_TIER_ENTRYSZ + szPage - 1) / szPage * szPage;
+  t->iHand = 0;
+  t->nAccessTotal = 0;
+  memset(t->aSketch, 0, SQLITE_VFS_TIER_SKETCHSZ);
+
+  teensyTierClear(t);
+
+  if (not isReset && teensyTierLoadMap(t, zHeader))
+  {
+    return;
+  }
+
+  teensyTierClear(t);
+
+  /* A new (or outdated) tier file: header, then an empty map */
+  static const char aZero[512] = { 0 };
+  bool isOk = t->pFile->truncate(0) && teensyTierWriteHeader(t, zHeader);
+
+  for (sqlite3_int64 n = t->iDataOfst - TEENSY_TIER_HEADERSZ; isOk && n > 0; n -= sizeof(aZero))
+  {
+    size_t nWrite = (n < static_cast<sqlite3_int64>(sizeof(aZero))) ? static_cast<size_t>(n) : sizeof(aZero);
+    isOk = (t->pFile->write(aZero, nWrite) == nWrite);
+  }
+
+  if (not isOk)
+  {
+    teensyTierFail(t);
+  }
+}
+
+/*
+** Read the page in slot iSlot into zBuf. A page loaded from the tier file
+** of a previous session is checked against the checksum of its map entry
+** on its first use; if they do not match (a promotion cut short by a
+** power loss), the slot is freed. Returns false if the page must be read
+** from the database file instead.
+*/
+static bool teensyTierReadSlot(TeensyTierNode* t, int iSlot, void* zBuf)
+{
+  TeensyTierSlot* s = &t->aSlot[iSlot];
+  sqlite3_int64 iOfst = t->iDataOfst + static_cast<sqlite3_int64>(iSlot) * t->szPage;
+
+  if (not t->pFile->seek(iOfst, SeekSet) ||
+      t->pFile->read(zBuf, t->szPage) != static_cast<size_t>(t->szPage))
+  {
+    teensyTierFail(t);
+    return false;
+  }
+
+  if (not s->isVerified)
+  {
+    if (teensyChecksum(2166136261u, zBuf, t->szPage) != s->checksum)
+    {
+      T41SQLite::getInstance().getTierStats().m_discards++;
+      teensyTierUnlink(t, iSlot);
+      memset(s, 0, sizeof(TeensyTierSlot));
+      t->nFree++;
+
+      if (not teensyTierWriteEntry(t, iSlot))
+      {
+        teensyTierFail(t);
+      }
+
+      return false;
+    }
+
+    s->isVerified = true;
+  }
+
+  return true;
+}
+
+/*
+** Write page iPage (zBuf) to slot iSlot of the tier file. The data goes
+** first, so a power loss before the map entry is written leaves an entry
+** whose checksum does not match.
+*/
+static bool teensyTierWriteSlot(TeensyTierNode* t, int iSlot, uint32_t iPage, const void* zBuf)
+{
+  TeensyTierSlot* s = &t->aSlot[iSlot];
+  sqlite3_int64 iOfst = t->iDataOfst + static_cast<sqlite3_int64>(iSlot) * t->szPage;
+
+  if (s->iPage != iPage)
+  {
+    if (s->iPage == 0)
+    {
+      t->nFree--;
+    }
+    else
+    {
+      teensyTierUnlink(t, iSlot);
+    }
+
+    s->iPage = iPage;
+    teensyTierLink(t, iSlot);
+  }
+
+  s->checksum = teensyChecksum(2166136261u, zBuf, t->szPage);
+  s->isVerified = true;
+  t->isDirty = true;
+
+  return t->pFile->seek(iOfst, SeekSet) &&
+         t->pFile->write(zBuf, t->szPage) == static_cast<size_t>(t->szPage) &&
+         teensyTierWriteEntry(t, iSlot);
+}
+
+/*
+** Drop page iPage from the tier file, if it is there.
+*/
+static void teensyTierForget(TeensyTierNode* t, uint32_t iPage)
+{
+  int iSlot = teensyTierFind(t, iPage);
+
+  if (iSlot >= 0)
+  {
+    teensyTierUnlink(t, iSlot);
+    memset(&t->aSlot[iSlot], 0, sizeof(TeensyTierSlot));
+    t->nFree++;
+
+    if (not teensyTierWriteEntry(t, iSlot))
+    {
+      teensyTierFail(t);
+    }
+  }
+}
+
+/*
+** Count an access. After about four accesses per counter, all counts
+** are halved, so pages that are not used anymore cool down.
+*/
+static void teensyTierTick(TeensyTierNode* t)
+{
+  if (++t->nAccessTotal < 4u * static_cast<uint32_t>(t->nSlot + SQLITE_VFS_TIER_SKETCHSZ))
+  {
+    return;
+  }
+
+  for (int i = 0; i < t->nSlot; i++)
+  {
+    t->aSlot[i].nAccess >>= 1;
+  }
+
+  for (int i = 0; i < SQLITE_VFS_TIER_SKETCHSZ; i++)
+  {
+    t->aSketch[i] >>= 1;
+  }
+
+  t->nAccessTotal = 0;
+}
+
+/*
+** Return a free slot, or else the coldest of the next
+** SQLITE_VFS_TIER_SAMPLE slots.
+*/
+static int teensyTierVictim(TeensyTierNode* t)
+{
+  int iVictim = -1;
+
+  for (int n = 0; n < t->nSlot && (t->nFree > 0 || n < SQLITE_VFS_TIER_SAMPLE); n++)
+  {
+    int i = t->iHand;
+    t->iHand = (t->iHand + 1 < t->nSlot) ? t->iHand + 1 : 0;
+
+    if (t->aSlot[i].iPage == 0)
+    {
+      return i;
+    }
+
+    if (iVictim < 0 || t->aSlot[i].nAccess < t->aSlot[iVictim].nAccess)
+    {
+      iVictim = i;
+    }
+  }
+
+  return iVictim;
+}
+
+/*
+** Count an access to page iPage, which is not in the tier file, and
+** promote it (zBuf holds its data) once it has been used at least
+** SQLITE_VFS_TIER_PROMOTE_MIN times and more often than the page it
+** would demote.
+*/
+static void teensyTierPromote(TeensyTierNode* t, uint32_t iPage, const void* zBuf)
+{
+  uint8_t* pCount = &t->aSketch[iPage & (SQLITE_VFS_TIER_SKETCHSZ - 1)];
+
+  if (*pCount < UINT8_MAX)
+  {
+    (*pCount)++;
+  }
+
+  teensyTierTick(t);
+
+  if (*pCount < SQLITE_VFS_TIER_PROMOTE_MIN)
+  {
+    return;
+  }
+
+  int iSlot = teensyTierVictim(t);
+  TeensyTierSlot* s = &t->aSlot[iSlot];
+
+  if (s->iPage != 0 && s->nAccess >= *pCount)
+  {
+    return;
+  }
+
+  T41SQLite::TierStats& stats = T41SQLite::getInstance().getTierStats();
+
+  /* The demoted page keeps its count, it may come back */
+  if (s->iPage != 0)
+  {
+    uint8_t* pDemoted = &t->aSketch[s->iPage & (SQLITE_VFS_TIER_SKETCHSZ - 1)];
+    *pDemoted = (*pDemoted > s->nAccess) ? *pDemoted : s->nAccess;
+    stats.m_demotions++;
+  }
+
+  s->nAccess = *pCount;
+  *pCount = 0;
+
+  if (not teensyTierWriteSlot(t, iSlot, iPage, zBuf))
+  {
+    teensyTierFail(t);
+    return;
+  }
+
+  stats.m_promotions++;
+}
+
+/*
+** Return the page number of a read or write of iAmt bytes at iOfst if it
+** is exactly one page and the database is tiered, 0 otherwise.
+*/
+static uint32_t teensyTierPage(TeensyTierNode* t, int iAmt, sqlite3_int64 iOfst)
+{
+  if (not t->pFile || iAmt != t->szPage || iOfst % t->szPage != 0)
+  {
+    return 0;
+  }
+
+  return static_cast<uint32_t>(iOfst / t->szPage) + 1;
+}
+
+/*
+** Return the tier state of the database at zPath, shared by all its
+** opens, or NULL if out of memory. On the first open, the header of the
+** database file pReal decides whether an existing tier file is used.
+*/
+static TeensyTierNode* teensyTierNodeAcquire(const char* zPath, sqlite3_file* pReal)
+{
+  for (TeensyTierNode* t = s_pTierList; t; t = t->pNext)
+  {
+    if (strcmp(t->zPath, zPath) == 0)
+    {
+      t->nRef++;
+      return t;
+    }
+  }
+
+  TeensyTierNode* t = (TeensyTierNode*)teensyMalloc(sizeof(TeensyTierNode));
+
+  if (not t)
+  {
+    return nullptr;
+  }
+
+  memset(t, 0, sizeof(TeensyTierNode));
+  t->zPath = teensyMprintf("%s", zPath);
+
+  if (not t->zPath)
+  {
+    sqlite3_free(t);
+    return nullptr;
+  }
+
+  t->nRef = 1;
+  t->pNext = s_pTierList;
+  s_pTierList = t;
+
+  /* A database without a header (new or empty) starts with an empty tier
+  ** file once its first page is written, see teensyTierWrite().
+  */
+  char aHeader[100];
+
+  if (pReal->pMethods->xRead(pReal, aHeader, sizeof(aHeader), 0) == SQLITE_OK)
+  {
+    int szPage = teensyHeaderPageSize(aHeader);
+
+    if (szPage)
+    {
+      teensyTierOpenFile(t, aHeader, szPage, false);
+    }
+  }
+
+  return t;
+}
+
+static void teensyTierNodeRelease(TeensyTierNode* t)
+{
+  if (--t->nRef > 0)
+  {
+    return;
+  }
+
+  teensyTierDrop(t, false);
+
+  TeensyTierNode** pp = &s_pTierList;
+  while (*pp != t)
+  {
+    pp = &(*pp)->pNext;
+  }
+  *pp = t->pNext;
+
+  sqlite3_free(t->zPath);
+  sqlite3_free(t);
+}
+
+/*
+** Close a tier VFS database file.
+*/
+static int teensyTierClose(sqlite3_file *pFile)
+{
+  TeensyTierFile* p = (TeensyTierFile*)pFile;
+
+  if (p->pNode)
+  {
+    teensyTierNodeRelease(p->pNode);
+  }
+
+  return p->pReal->pMethods->xClose(p->pReal);
+}
+
+/*
+** Read from a tier VFS database file, from the tier file if the page is
+** there. Pages read from the database file may be promoted.
+*/
+static int teensyTierRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyTierFile* p = (TeensyTierFile*)pFile;
+  TeensyTierNode* t = p->pNode;
+  uint32_t iPage = t ? teensyTierPage(t, iAmt, iOfst) : 0;
+
+  if (iPage)
+  {
+    T41SQLite::TierStats& stats = T41SQLite::getInstance().getTierStats();
+    int iSlot = teensyTierFind(t, iPage);
+
+    if (iSlot >= 0 && teensyTierReadSlot(t, iSlot, zBuf))
+    {
+      TeensyTierSlot* s = &t->aSlot[iSlot];
+
+      if (s->nAccess < UINT8_MAX)
+      {
+        s->nAccess++;
+      }
+
+      teensyTierTick(t);
+      stats.m_hits++;
+
+      return SQLITE_OK;
+    }
+
+    stats.m_misses++;
+  }
+
+  int rc = p->pReal->pMethods->xRead(p->pReal, zBuf, iAmt, iOfst);
+
+  /* Promotion may have been turned off by a tier file error above */
+  if (rc == SQLITE_OK && iPage && t->pFile)
+  {
+    teensyTierPromote(t, iPage, zBuf);
+  }
+
+  return rc;
+}
+
+/*
+** Write to a tier VFS database file. The database file is written first,
+** then the copy of the page in the tier file, if there is one. A write
+** of page 1 also updates the copy of the database header in the tier
+** file, or restarts tiering if the page size changed.
+*/
+static int teensyTierWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyTierFile* p = (TeensyTierFile*)pFile;
+  TeensyTierNode* t = p->pNode;
+  int rc = p->pReal->pMethods->xWrite(p->pReal, zBuf, iAmt, iOfst);
+
+  if (not t)
+  {
+    return rc;
+  }
+
+  if (rc == SQLITE_OK && iOfst == 0 && iAmt >= 100)
+  {
+    int szPage = teensyHeaderPageSize(zBuf);
+
+    if (szPage != t->szPage)
+    {
+      teensyTierDrop(t, false);
+
+      if (szPage)
+      {
+        teensyTierOpenFile(t, zBuf, szPage, true);
+      }
+    }
+    else if (t->pFile && not teensyTierWriteHeader(t, zBuf))
+    {
+      teensyTierFail(t);
+    }
+  }
+
+  if (not t->pFile)
+  {
+    return rc;
+  }
+
+  uint32_t iPage = teensyTierPage(t, iAmt, iOfst);
+  int iSlot = (rc == SQLITE_OK && iPage) ? teensyTierFind(t, iPage) : -1;
+
+  if (iSlot >= 0)
+  {
+    if (not teensyTierWriteSlot(t, iSlot, iPage, zBuf))
+    {
+      teensyTierFail(t);
+    }
+  }
+  else if (rc == SQLITE_OK && iPage)
+  {
+    teensyTierPromote(t, iPage, zBuf);
+  }
+  else
+  {
+    /* Partial or failed writes: the tier copies they touch are stale */
+    uint32_t iLast = static_cast<uint32_t>((iOfst + iAmt - 1) / t->szPage) + 1;
+
+    for (uint32_t i = static_cast<uint32_t>(iOfst / t->szPage) + 1; i <= iLast && t->pFile; i++)
+    {
+      teensyTierForget(t, i);
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Truncate a tier VFS database file and drop the pages past its end from
+** the tier file.
+*/
+static int teensyTierTruncate(sqlite3_file *pFile, sqlite_int64 size)
+{
+  TeensyTierFile* p = (TeensyTierFile*)pFile;
+  TeensyTierNode* t = p->pNode;
+  int rc = p->pReal->pMethods->xTruncate(p->pReal, size);
+
+  if (t && t->pFile)
+  {
+    uint32_t nPage = static_cast<uint32_t>((size + t->szPage - 1) / t->szPage);
+
+    for (int i = 0; i < t->nSlot && t->pFile; i++)
+    {
+      if (t->aSlot[i].iPage > nPage)
+      {
+        teensyTierForget(t, t->aSlot[i].iPage);
+      }
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Sync a tier VFS database file. The tier file is flushed first, so it is
+** never behind the database file after a power loss.
+*/
+static int teensyTierSync(sqlite3_file *pFile, int flags)
+{
+  TeensyTierFile* p = (TeensyTierFile*)pFile;
+  TeensyTierNode* t = p->pNode;
+
+  if (t && t->pFile && t->isDirty)
+  {
+    t->pFile->flush();
+    t->isDirty = false;
+  }
+
+  return p->pReal->pMethods->xSync(p->pReal, flags);
+}
+
+/*
+** The other io methods of tier VFS database files are those of T41_VFS.
+*/
+static int teensyTierFileSize(sqlite3_file *pFile, sqlite_int64 *pSize)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xFileSize(pReal, pSize);
+}
+
+static int teensyTierLock(sqlite3_file *pFile, int eLock)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xLock(pReal, eLock);
+}
+
+static int teensyTierUnlock(sqlite3_file *pFile, int eLock)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xUnlock(pReal, eLock);
+}
+
+static int teensyTierCheckReservedLock(sqlite3_file *pFile, int *pResOut)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xCheckReservedLock(pReal, pResOut);
+}
+
+static int teensyTierFileControl(sqlite3_file *pFile, int op, void *pArg)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xFileControl(pReal, op, pArg);
+}
+
+static int teensyTierSectorSize(sqlite3_file *pFile)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xSectorSize(pReal);
+}
+
+/*
+** Batch atomic writes are not offered: a batch rolled back by T41_VFS
+** would leave its pages in the tier file.
+*/
+static int teensyTierDeviceCharacteristics(sqlite3_file *pFile)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xDeviceCharacteristics(pReal) & ~SQLITE_IOCAP_BATCH_ATOMIC;
+}
+
+static int teensyTierShmMap(sqlite3_file *pFile, int iRegion, int szRegion, int bExtend, void volatile **pp)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xShmMap(pReal, iRegion, szRegion, bExtend, pp);
+}
+
+static int teensyTierShmLock(sqlite3_file *pFile, int ofst, int n, int flags)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xShmLock(pReal, ofst, n, flags);
+}
+
+static void teensyTierShmBarrier(sqlite3_file *pFile)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  pReal->pMethods->xShmBarrier(pReal);
+}
+
+static int teensyTierShmUnmap(sqlite3_file *pFile, int deleteFlag)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xShmUnmap(pReal, deleteFlag);
+}
+
+static int teensyTierFetch(sqlite3_file *pFile, sqlite3_int64 iOfst, int iAmt, void **pp)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xFetch(pReal, iOfst, iAmt, pp);
+}
+
+static int teensyTierUnfetch(sqlite3_file *pFile, sqlite3_int64 iOfst, void *pPage)
+{
+  sqlite3_file* pReal = ((TeensyTierFile*)pFile)->pReal;
+  return pReal->pMethods->xUnfetch(pReal, iOfst, pPage);
+}
+
+/*
+** Open a tier VFS file. Main databases are T41_VFS files wrapped by the
+** tier io methods, all other files are plain T41_VFS files.
+*/
+static int teensyTierOpen(
+  sqlite3_vfs *pVfs,              /* VFS */
+  const char *zName,              /* File to open, or 0 for a temp file */
+  sqlite3_file *pFile,            /* Pointer to TeensyTierFile struct to populate */
+  int flags,                      /* Input SQLITE_OPEN_XXX flags */
+  int *pOutFlags                  /* Output SQLITE_OPEN_XXX flags (or NULL) */
+){
+  static const sqlite3_io_methods teensytierio = {
+    3,                                /* iVersion */
+    teensyTierClose,                  /* xClose */
+    teensyTierRead,                   /* xRead */
+    teensyTierWrite,                  /* xWrite */
+    teensyTierTruncate,               /* xTruncate */
+    teensyTierSync,                   /* xSync */
+    teensyTierFileSize,               /* xFileSize */
+    teensyTierLock,                   /* xLock */
+    teensyTierUnlock,                 /* xUnlock */
+    teensyTierCheckReservedLock,      /* xCheckReservedLock */
+    teensyTierFileControl,            /* xFileControl */
+    teensyTierSectorSize,             /* xSectorSize */
+    teensyTierDeviceCharacteristics,  /* xDeviceCharacteristics */
+    teensyTierShmMap,                 /* xShmMap */
+    teensyTierShmLock,                /* xShmLock */
+    teensyTierShmBarrier,             /* xShmBarrier */
+    teensyTierShmUnmap,               /* xShmUnmap */
+    teensyTierFetch,                  /* xFetch */
+    teensyTierUnfetch                 /* xUnfetch */
+  };
+
+  if (not zName || not (flags & SQLITE_OPEN_MAIN_DB))
+  {
+    return teensyOpen(pVfs, zName, pFile, flags, pOutFlags);
+  }
+
+  TeensyTierFile* p = (TeensyTierFile*)pFile;
+  memset(p, 0, sizeof(TeensyTierFile));
+  p->pReal = (sqlite3_file*)&p[1];
+
+  int rc = teensyOpen(pVfs, zName, p->pReal, flags, pOutFlags);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  /* Without memory for the tier state, the database is used untiered */
+  p->pNode = teensyTierNodeAcquire(zName, p->pReal);
+  p->base.pMethods = &teensytierio;
+
+  return SQLITE_OK;
+}
+
+/*
+** Compress nSrc bytes at zSrc into the LZ4 block format at zDst. Returns
+** the compressed size, or 0 if it would exceed nDstMax bytes. Greedy
+** matching with a single hash table of s_aLz4Hash positions, so nSrc
+** must not exceed 65536.
+*/
+static int teensyLz4Compress(const uint8_t* zSrc, int nSrc, uint8_t* zDst, int nDstMax)
+{
+  const int nLastLiterals = 5;    /* LZ4: the last 5 bytes are always literals */
+  const int nMatchLimit = 12;     /* LZ4: the last match starts at least 12 bytes before the end */
+  int iSrc = 0;
+  int iAnchor = 0;
+  int iDst = 0;
+  int nMiss = 0;
+
+  memset(s_aLz4Hash, 0, sizeof(s_aLz4Hash));
+
+  while (iSrc < nSrc - nMatchLimit)
+  {
+    uint32_t seq;
+    memcpy(&seq, &zSrc[iSrc], 4);
+
+    uint32_t h = (seq * 2654435761u) >> (32 - TEENSY_LZ4_HASH_LOG);
+    int iRef = s_aLz4Hash[h];
+    s_aLz4Hash[h] = static_cast<uint16_t>(iSrc);
+
+    if (iRef >= iSrc || memcmp(&zSrc[iRef], &seq, 4) != 0)
+    {
+      /* Skip faster through data that does not compress */
+      iSrc += 1 + (nMiss++ >> 5);
+      continue;
+    }
+
+    nMiss = 0;
+
+    int nMatch = 4;
+    while (iSrc + nMatch < nSrc - nLastLiterals && zSrc[iRef + nMatch] == zSrc[iSrc + nMatch])
+    {
+      nMatch++;
+    }
+
+    int nLiteral = iSrc - iAnchor;
+
+    if (iDst + 1 + nLiteral + nLiteral / 255 + 1 + 2 + nMatch / 255 + 1 > nDstMax)
+    {
+      return 0;
+    }
+
+    uint8_t* pToken = &zDst[iDst++];
+    *pToken = 0;
+
+    if (nLiteral >= 15)
+    {
+      *pToken = 15 << 4;
+
+      for (int n = nLiteral - 15; ; n -= 255)
+      {
+        zDst[iDst++] = static_cast<uint8_t>(n < 255 ? n : 255);
+
+        if (n < 255)
+        {
+          break;
+        }
+      }
+    }
+    else
+    {
+      *pToken = static_cast<uint8_t>(nLiteral << 4);
+    }
+
+    memcpy(&zDst[iDst], &zSrc[iAnchor], nLiteral);
+    iDst += nLiteral;
+
+    zDst[iDst++] = static_cast<uint8_t>((iSrc - iRef) & 0xff);
+    zDst[iDst++] = static_cast<uint8_t>((iSrc - iRef) >> 8);
+
+    if (nMatch - 4 >= 15)
+    {
+      *pToken |= 15;
+
+      for (int n = nMatch - 4 - 15; ; n -= 255)
+      {
+        zDst[iDst++] = static_cast<uint8_t>(n < 255 ? n : 255);
+
+        if (n < 255)
+        {
+          break;
+        }
+      }
+    }
+    else
+    {
+      *pToken |= static_cast<uint8_t>(nMatch - 4);
+    }
+
+    iSrc += nMatch;
+    iAnchor = iSrc;
+  }
+
+  int nLiteral = nSrc - iAnchor;
+
+  if (iDst + 1 + nLiteral + nLiteral / 255 + 1 > nDstMax)
+  {
+    return 0;
+  }
+
+  if (nLiteral >= 15)
+  {
+    zDst[iDst++] = 15 << 4;
+
+    for (int n = nLiteral - 15; ; n -= 255)
+    {
+      zDst[iDst++] = static_cast<uint8_t>(n < 255 ? n : 255);
+
+      if (n < 255)
+      {
+        break;
+      }
+    }
+  }
+  else
+  {
+    zDst[iDst++] = static_cast<uint8_t>(nLiteral << 4);
+  }
+
+  memcpy(&zDst[iDst], &zSrc[iAnchor], nLiteral);
+
+  return iDst + nLiteral;
+}
+
+/*
+** Read the length continuation bytes of an LZ4 sequence. Returns false if
+** the input ends first.
+*/
+static bool teensyLz4Length(const uint8_t* zSrc, int nSrc, int* piSrc, int* pnLength)
+{
+  uint8_t b;
+
+  do
+  {
+    if (*piSrc >= nSrc)
+    {
+      return false;
+    }
+
+    b = zSrc[(*piSrc)++];
+    *pnLength += b;
+  }
+  while (b == 255);
+
+  return true;
+}
+
+/*
+** Decompress the LZ4 block of nSrc bytes at zSrc into zDst, which holds
+** nDst bytes. Returns the decompressed size, or -1 if the block is
+** damaged; never reads or writes outside the buffers.
+*/
+static int teensyLz4Decompress(const uint8_t* zSrc, int nSrc, uint8_t* zDst, int nDst)
+{
+  int iSrc = 0;
+  int iDst = 0;
+
+  while (iSrc < nSrc)
+  {
+    uint8_t token = zSrc[iSrc++];
+    int nLiteral = token >> 4;
+
+    if (nLiteral == 15 && not teensyLz4Length(zSrc, nSrc, &iSrc, &nLiteral))
+    {
+      return -1;
+    }
+
+    if (nLiteral > nSrc - iSrc || nLiteral > nDst - iDst)
+    {
+      return -1;
+    }
+
+    memcpy(&zDst[iDst], &zSrc[iSrc], nLiteral);
+    iSrc += nLiteral;
+    iDst += nLiteral;
+
+    /* The last sequence has no match */
+    if (iSrc == nSrc)
+    {
+      break;
+    }
+
+    if (nSrc - iSrc < 2)
+    {
+      return -1;
+    }
+
+    int iOffset = zSrc[iSrc] | (zSrc[iSrc + 1] << 8);
+    iSrc += 2;
+
+    int nMatch = token & 15;
+
+    if (nMatch == 15 && not teensyLz4Length(zSrc, nSrc, &iSrc, &nMatch))
+    {
+      return -1;
+    }
+
+    nMatch += 4;
+
+    if (iOffset == 0 || iOffset > iDst || nMatch > nDst - iDst)
+    {
+      return -1;
+    }
+
+    /* Byte by byte, a match may overlap the bytes it produces */
+    for (int i = 0; i < nMatch; i++, iDst++)
+    {
+      zDst[iDst] = zDst[iDst - iOffset];
+    }
+  }
+
+  return iDst;
+}
+
+/*
+** Return the path of a file of the log of the database of t, on the
+** filesystem of the database: zSuffix is "seg" (segment iNumber) or "map"
+** (map file iNumber). The result must be freed with sqlite3_free().
+** Returns NULL if out of memory.
+*/
+static char* teensyLogPath(TeensyLogNode* t, const char* zSuffix, uint32_t iNumber, FS** pFilesystem)
+{
+  const char* zFsPath;
+  *pFilesystem = teensyFilesystem(t->zPath, &zFsPath);
+
+  return teensyMprintf("%s-%s%u", zFsPath, zSuffix, iNumber);
+}
+
+/*
+** Return true if the file of the log given by zSuffix and iNumber exists.
+** If isRemove is true, it is removed instead.
+*/
+static bool teensyLogFileExists(TeensyLogNode* t, const char* zSuffix, uint32_t iNumber, bool isRemove)
+{
+  FS* filesystem;
+  char* zFile = teensyLogPath(t, zSuffix, iNumber, &filesystem);
+  bool exists = zFile && filesystem->exists(zFile);
+
+  if (exists && isRemove)
+  {
+    filesystem->remove(zFile);
+  }
+
+  sqlite3_free(zFile);
+
+  return exists;
+}
+
+/*
+** Open a file of the log, for writing if isWrite is true. Returns NULL if
+** it does not exist (when reading) or cannot be opened.
+*/
+static TeensyFile* teensyLogOpenFile(TeensyLogNode* t, const char* zSuffix, uint32_t iNumber, bool isWrite)
+{
+  FS* filesystem;
+  char* zFile = teensyLogPath(t, zSuffix, iNumber, &filesystem);
+
+  if (not zFile)
+  {
+    return nullptr;
+  }
+
+  TeensyFile* pFile = nullptr;
+
+  if (isWrite || filesystem->exists(zFile))
+  {
+    T41SQLite::getInstance().getAllocationStats().m_fileHandles++;
+    pFile = new TeensyFile(teensyFsOpen(filesystem, zFile, isWrite ? FILE_WRITE : FILE_READ));
+
+    if (not *pFile)
+    {
+      delete pFile;
+      pFile = nullptr;
+    }
+  }
+
+  sqlite3_free(zFile);
+
+  return pFile;
+}
+
+static void teensyLogCloseFile(TeensyFile** ppFile)
+{
+  if (*ppFile)
+  {
+    (*ppFile)->close();
+    delete *ppFile;
+    *ppFile = nullptr;
+  }
+}
+
+/*
+** Return the segment iSegment of the log, or NULL if it is older than the
+** oldest one that may exist.
+*/
+static TeensyLogSegment* teensyLogSegment(TeensyLogNode* t, uint32_t iSegment)
+{
+  return (iSegment >= t->iSegmentLow && iSegment - t->iSegmentLow < t->nSegment) ? &t->aSegment[iSegment - t->iSegmentLow] : nullptr;
+}
+
+/*
+** Return segment iSegment opened for reading, or NULL if it does not
+** exist. The segment appended to is read through its write handle.
+*/
+static TeensyFile* teensyLogReadFile(TeensyLogNode* t, uint32_t iSegment)
+{
+  if (iSegment == t->iSegment && t->pHead)
+  {
+    return t->pHead;
+  }
+
+  if (t->pRead && t->iReadSegment == iSegment)
+  {
+    return t->pRead;
+  }
+
+  teensyLogCloseFile(&t->pRead);
+  t->pRead = teensyLogOpenFile(t, "seg", iSegment, false);
+  t->iReadSegment = iSegment;
+
+  return t->pRead;
+}
+
+/*
+** Make sure the page map has room for nPage pages.
+*/
+static bool teensyLogMapReserve(TeensyLogNode* t, uint32_t nPage)
+{
+  if (nPage <= t->nMap)
+  {
+    return true;
+  }
+
+  uint32_t nMap = t->nMap ? t->nMap : 256;
+
+  while (nMap < nPage)
+  {
+    nMap *= 2;
+  }
+
+  TeensyLogEntry* aMap = (TeensyLogEntry*)teensyExtmemRealloc(t->aMap, nMap * sizeof(TeensyLogEntry));
+
+  if (not aMap)
+  {
+    return false;
+  }
+
+  memset(&aMap[t->nMap], 0, (nMap - t->nMap) * sizeof(TeensyLogEntry));
+  t->aMap = aMap;
+  t->nMap = nMap;
+
+  return true;
+}
+
+/*
+** Point page iPage (1 based) of the page map at a record, or at none if
+** iSegment is 0, keeping the live page counts of the segments.
+*/
+static void teensyLogMapSet(TeensyLogNode* t, uint32_t iPage, uint32_t iSegment, uint32_t iOfst)
+{
+  TeensyLogEntry* e = &t->aMap[iPage - 1];
+  TeensyLogSegment* s = teensyLogSegment(t, e->iSegment);
+
+  if (e->iSegment && s)
+  {
+    s->nLive--;
+  }
+
+  e->iSegment = iSegment;
+  e->iOfst = iOfst;
+  s = teensyLogSegment(t, iSegment);
+
+  if (iSegment && s)
+  {
+    s->nLive++;
+  }
+}
+
+/*
+** Write the buffered records to the segment appended to and, if isSync is
+** true, flush it to the medium.
+*/
+static int teensyLogFlush(TeensyLogNode* t, bool isSync)
+{
+  if (t->nBuf > 0)
+  {
+    if (not t->pHead->seek(t->iBufOfst) || t->pHead->write(t->aBuf, t->nBuf) != static_cast<size_t>(t->nBuf))
+    {
+      return SQLITE_IOERR_WRITE;
+    }
+
+    t->iBufOfst += t->nBuf;
+    t->nBuf = 0;
+    t->isUnsynced = true;
+  }
+
+  if (isSync && t->isUnsynced)
+  {
+    t->pHead->flush();
+    t->isUnsynced = false;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Finish the segment appended to and start the next one.
+*/
+static int teensyLogStartSegment(TeensyLogNode* t)
+{
+  if (t->pHead)
+  {
+    int rc = teensyLogFlush(t, true);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    teensyLogCloseFile(&t->pHead);
+  }
+
+  uint32_t iSegment = t->iSegment + 1;
+
+  if (t->nSegment == 0)
+  {
+    t->iSegmentLow = iSegment;
+  }
+
+  TeensyLogSegment* aSegment = (TeensyLogSegment*)teensyRealloc(t->aSegment, (t->nSegment + 1) * sizeof(TeensyLogSegment));
+
+  if (not aSegment)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  t->aSegment = aSegment;
+  t->aSegment[t->nSegment].nLive = 0;
+  t->aSegment[t->nSegment].isRemoved = false;
+  t->nSegment++;
+
+  if (t->pRead && t->iReadSegment == iSegment)
+  {
+    teensyLogCloseFile(&t->pRead);
+  }
+
+  t->pHead = teensyLogOpenFile(t, "seg", iSegment, true);
+  t->iSegment = iSegment;
+
+  if (not t->pHead || not t->pHead->truncate(0))
+  {
+    teensyLogCloseFile(&t->pHead);
+    return SQLITE_IOERR_WRITE;
+  }
+
+  uint32_t aHeader[2] = { static_cast<uint32_t>(t->szPage), iSegment };
+  memcpy(&t->aBuf[0], t->isCompressed ? TEENSY_LZ4_SEG_MAGIC : TEENSY_LOG_SEG_MAGIC, 8);
+  memcpy(&t->aBuf[8], aHeader, 8);
+  t->iBufOfst = 0;
+  t->nBuf = TEENSY_LOG_SEG_HEADERSZ;
+
+  T41SQLite::getInstance().getLogStats().m_segmentsStarted++;
+
+  return SQLITE_OK;
+}
+
+/*
+** Largest size of a record of the log of t, a page record whose page did
+** not compress.
+*/
+static int teensyLogRecordMax(TeensyLogNode* t)
+{
+  return TEENSY_LOG_RECORD_HEADERSZ + (t->isCompressed ? 4 : 0) + t->szPage;
+}
+
+/*
+** Store page zPage LZ4 compressed at zDst, behind a word with the storage
+** method and the stored size, or as it is if it does not compress.
+** Returns the number of bytes stored.
+*/
+static int teensyLogCompress(TeensyLogNode* t, const void* zPage, uint8_t* zDst)
+{
+  int nStored = teensyLz4Compress((const uint8_t*)zPage, t->szPage, &zDst[4], t->szPage - 1);
+  int eMethod = TEENSY_LZ4_BLOCK;
+
+  if (nStored == 0)
+  {
+    memcpy(&zDst[4], zPage, t->szPage);
+    nStored = t->szPage;
+    eMethod = TEENSY_LZ4_RAW;
+  }
+
+  uint32_t word = (static_cast<uint32_t>(eMethod) << 24) | static_cast<uint32_t>(nStored);
+  memcpy(zDst, &word, 4);
+
+  T41SQLite::CompressionStats& stats = T41SQLite::getInstance().getCompressionStats();
+  stats.m_pagesWritten++;
+  stats.m_rawPages += (eMethod == TEENSY_LZ4_RAW) ? 1 : 0;
+  stats.m_bytesIn += t->szPage;
+  stats.m_bytesOut += TEENSY_LOG_RECORD_HEADERSZ + 4 + nStored;
+
+  return 4 + nStored;
+}
+
+/*
+** Restore page zPage from the nStored bytes at zSrc that follow the word
+** of a compressed page record. Returns SQLITE_CORRUPT if they do not
+** decompress to a whole page.
+*/
+static int teensyLogDecompress(TeensyLogNode* t, uint32_t word, const uint8_t* zSrc, void* zPage)
+{
+  int nStored = static_cast<int>(word & 0xffffff);
+  T41SQLite::getInstance().getCompressionStats().m_pagesRead++;
+
+  switch (word >> 24)
+  {
+    case TEENSY_LZ4_RAW:
+      if (nStored != t->szPage)
+      {
+        return SQLITE_CORRUPT;
+      }
+
+      memcpy(zPage, zSrc, t->szPage);
+      return SQLITE_OK;
+
+    case TEENSY_LZ4_BLOCK:
+      return teensyLz4Decompress(zSrc, nStored, (uint8_t*)zPage, t->szPage) == t->szPage ? SQLITE_OK : SQLITE_CORRUPT;
+  }
+
+  return SQLITE_CORRUPT;
+}
+
+/*
+** Append a record to the log: page iPage with the data zPage, or, if
+** iPage is 0, the truncation of the database to t->nPage pages. The page
+** map points at the record afterwards. Pages of a compressed database are
+** stored compressed.
+*/
+static int teensyLogAppend(TeensyLogNode* t, uint32_t iPage, const void* zPage)
+{
+  int nRecord = iPage ? teensyLogRecordMax(t) : TEENSY_LOG_RECORD_HEADERSZ;
+  int rc = SQLITE_OK;
+
+  if (not t->pHead || (t->iBufOfst + t->nBuf + nRecord > SQLITE_VFS_LOG_SEGMENTSZ && t->iBufOfst + t->nBuf > TEENSY_LOG_SEG_HEADERSZ))
+  {
+    rc = teensyLogStartSegment(t);
+  }
+
+  if (rc == SQLITE_OK && t->nBuf + nRecord > t->mxBuf)
+  {
+    rc = teensyLogFlush(t, false);
+  }
 
   if (rc != SQLITE_OK)
   {
     return rc;
   }
-  
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_FILE_SIZE ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->size());
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_CUR ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->position());
 
-  uint64_t seekPosition = min(static_cast<uint64_t>(iOfst), p->teensyFile->size());
-  if (not p->teensyFile->seek(seekPosition, SeekSet))
+  if (iPage > t->nPage)
+  {
+    t->nPage = iPage;
+  }
+
+  char* aRecord = &t->aBuf[t->nBuf];
+  uint32_t aHeader[4] = { iPage, t->nPage, t->iSegment, 0 };
+
+  memcpy(aRecord, aHeader, TEENSY_LOG_RECORD_HEADERSZ);
+
+  if (iPage && t->isCompressed)
+  {
+    nRecord = TEENSY_LOG_RECORD_HEADERSZ + teensyLogCompress(t, zPage, (uint8_t*)&aRecord[TEENSY_LOG_RECORD_HEADERSZ]);
+  }
+  else if (iPage)
+  {
+    memcpy(&aRecord[TEENSY_LOG_RECORD_HEADERSZ], zPage, t->szPage);
+  }
+
+  aHeader[3] = teensyChecksum(teensyChecksum(2166136261u, aRecord, 12), &aRecord[TEENSY_LOG_RECORD_HEADERSZ], nRecord - TEENSY_LOG_RECORD_HEADERSZ);
+  memcpy(&aRecord[12], &aHeader[3], 4);
+
+  if (iPage)
+  {
+    teensyLogMapSet(t, iPage, t->iSegment, t->iBufOfst + t->nBuf);
+  }
+
+  t->nBuf += nRecord;
+  t->nSinceCheckpoint += nRecord;
+  T41SQLite::getInstance().getLogStats().m_bytesAppended += nRecord;
+
+  return SQLITE_OK;
+}
+
+/*
+** Read the data of page iPage (1 based, in the page map) into zPage.
+*/
+static int teensyLogReadPage(TeensyLogNode* t, uint32_t iPage, void* zPage)
+{
+  TeensyLogEntry* e = &t->aMap[iPage - 1];
+
+  /* A page in a hole of the database, it was never written */
+  if (e->iSegment == 0)
+  {
+    memset(zPage, 0, t->szPage);
+    return SQLITE_OK;
+  }
+
+  uint32_t iOfst = e->iOfst + TEENSY_LOG_RECORD_HEADERSZ;
+  uint32_t word;
+
+  if (e->iSegment == t->iSegment && e->iOfst >= t->iBufOfst)
+  {
+    const char* zData = &t->aBuf[iOfst - t->iBufOfst];
+
+    if (not t->isCompressed)
+    {
+      memcpy(zPage, zData, t->szPage);
+      return SQLITE_OK;
+    }
+
+    memcpy(&word, zData, 4);
+    return teensyLogDecompress(t, word, (const uint8_t*)&zData[4], zPage);
+  }
+
+  TeensyFile* pFile = teensyLogReadFile(t, e->iSegment);
+
+  if (not pFile || not pFile->seek(iOfst))
+  {
+    return SQLITE_IOERR_READ;
+  }
+
+  if (not t->isCompressed)
+  {
+    return pFile->read(zPage, t->szPage) == static_cast<size_t>(t->szPage) ? SQLITE_OK : SQLITE_IOERR_READ;
+  }
+
+  /* The record was checked when it was written or replayed */
+  size_t nStored = pFile->read(&word, 4) == 4 ? (word & 0xffffff) : 0;
+
+  if (nStored == 0 || nStored > static_cast<size_t>(t->szPage) || pFile->read(t->aStored, nStored) != nStored)
+  {
+    return SQLITE_IOERR_READ;
+  }
+
+  return teensyLogDecompress(t, word, t->aStored, zPage);
+}
+
+/*
+** Write the page map to the map file of the next generation, after
+** flushing the log. A later open replays the log from here on.
+*/
+static int teensyLogCheckpoint(TeensyLogNode* t)
+{
+  int rc = teensyLogFlush(t, true);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  uint32_t aHeader[6] = { t->iGeneration + 1, static_cast<uint32_t>(t->szPage), t->nPage, t->iSegment, t->iBufOfst, 0 };
+  uint32_t nMapByte = t->nPage * sizeof(TeensyLogEntry);
+
+  aHeader[5] = teensyChecksum(teensyChecksum(2166136261u, aHeader, 20), t->aMap, static_cast<int>(nMapByte));
+
+  TeensyFile* pFile = teensyLogOpenFile(t, "map", aHeader[0] % 2, true);
+  bool isOk = pFile && pFile->truncate(0) && pFile->seek(0) && pFile->write(TEENSY_LOG_MAP_MAGIC, 8) == 8 && pFile->write(aHeader, sizeof(aHeader)) == sizeof(aHeader);
+
+  if (isOk && nMapByte > 0)
+  {
+    isOk = (pFile->write(t->aMap, nMapByte) == nMapByte);
+  }
+
+  if (isOk)
+  {
+    pFile->flush();
+  }
+
+  teensyLogCloseFile(&pFile);
+
+  if (not isOk)
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  t->iGeneration = aHeader[0];
+  t->iCheckpointSegment = t->iSegment;
+  t->iCheckpointOfst = t->iBufOfst;
+  t->nSinceCheckpoint = 0;
+  T41SQLite::getInstance().getLogStats().m_checkpoints++;
+
+  return SQLITE_OK;
+}
+
+/*
+** Load the page map from map file iFile into t->aMap and its header into
+** aHeader. Returns false if the file is missing or damaged.
+*/
+static bool teensyLogLoadMapFile(TeensyLogNode* t, uint32_t iFile, uint32_t* aHeader)
+{
+  TeensyFile* pFile = teensyLogOpenFile(t, "map", iFile, false);
+  char aMagic[8];
+  bool isOk = pFile && pFile->read(aMagic, 8) == 8 && memcmp(aMagic, TEENSY_LOG_MAP_MAGIC, 8) == 0
+              && pFile->read(aHeader, 6 * sizeof(uint32_t)) == 6 * sizeof(uint32_t)
+              && aHeader[1] == static_cast<uint32_t>(t->szPage) && teensyLogMapReserve(t, aHeader[2]);
+
+  if (isOk)
+  {
+    uint32_t nMapByte = aHeader[2] * sizeof(TeensyLogEntry);
+
+    isOk = pFile->read(t->aMap, nMapByte) == nMapByte
+           && teensyChecksum(teensyChecksum(2166136261u, aHeader, 20), t->aMap, static_cast<int>(nMapByte)) == aHeader[5];
+  }
+
+  teensyLogCloseFile(&pFile);
+
+  return isOk;
+}
+
+/*
+** Load the page map of the newest intact map file. Returns false if there
+** is none, the log is then replayed from its start.
+*/
+static bool teensyLogLoadMap(TeensyLogNode* t)
+{
+  uint32_t aHeader[6];
+  uint32_t iGeneration0 = teensyLogLoadMapFile(t, 0, aHeader) ? aHeader[0] : 0;
+
+  if (not (teensyLogLoadMapFile(t, 1, aHeader) && aHeader[0] > iGeneration0))
+  {
+    if (iGeneration0 == 0 || not teensyLogLoadMapFile(t, 0, aHeader))
+    {
+      if (t->nMap > 0)
+      {
+        memset(t->aMap, 0, t->nMap * sizeof(TeensyLogEntry));
+      }
+
+      return false;
+    }
+  }
+
+  memset(&t->aMap[aHeader[2]], 0, (t->nMap - aHeader[2]) * sizeof(TeensyLogEntry));
+  t->iGeneration = aHeader[0];
+  t->nPage = aHeader[2];
+  t->iCheckpointSegment = aHeader[3];
+  t->iCheckpointOfst = aHeader[4];
+
+  return true;
+}
+
+/*
+** Replay the log from the position of the last checkpoint (or from its
+** start) into the page map. A damaged record ends the log, power was lost
+** while it was written: the segment is cut there, later ones are removed.
+** The last segment found is appended to.
+*/
+static int teensyLogReplay(TeensyLogNode* t)
+{
+  uint32_t iSegment = t->iCheckpointSegment ? t->iCheckpointSegment : 1;
+  uint32_t iOfst = t->iCheckpointSegment ? t->iCheckpointOfst : TEENSY_LOG_SEG_HEADERSZ;
+  uint32_t iLast = 0;
+  uint32_t iEnd = 0;
+  TeensyFile* pFile;
+
+  while ((pFile = teensyLogOpenFile(t, "seg", iSegment, false)) != nullptr)
+  {
+    uint32_t nSize = static_cast<uint32_t>(pFile->size());
+    char aSegHeader[TEENSY_LOG_SEG_HEADERSZ];
+    uint32_t aIds[2];
+    bool isOk = pFile->seek(0) && pFile->read(aSegHeader, sizeof(aSegHeader)) == sizeof(aSegHeader);
+    memcpy(aIds, &aSegHeader[8], 8);
+
+    if (not isOk || memcmp(aSegHeader, t->isCompressed ? TEENSY_LZ4_SEG_MAGIC : TEENSY_LOG_SEG_MAGIC, 8) != 0 || aIds[0] != static_cast<uint32_t>(t->szPage) || aIds[1] != iSegment)
+    {
+      /* A segment whose header did not make it, nothing in it counts */
+      iOfst = 0;
+      isOk = false;
+    }
+
+    while (isOk && iOfst + TEENSY_LOG_RECORD_HEADERSZ <= nSize)
+    {
+      uint32_t aHeader[4];
+      isOk = pFile->seek(iOfst) && pFile->read(aHeader, sizeof(aHeader)) == sizeof(aHeader);
+
+      uint32_t nData = (isOk && aHeader[0]) ? t->szPage : 0;
+      uint32_t checksum = teensyChecksum(2166136261u, aHeader, 12);
+
+      /* The data of a compressed page record: its word, then the stored bytes */
+      if (nData > 0 && t->isCompressed)
+      {
+        uint32_t word;
+        isOk = pFile->read(&word, 4) == 4 && (word & 0xffffff) <= nData;
+        checksum = teensyChecksum(checksum, &word, 4);
+        nData = isOk ? (word & 0xffffff) : 0;
+      }
+
+      uint32_t nRecord = TEENSY_LOG_RECORD_HEADERSZ + ((aHeader[0] && t->isCompressed) ? 4 : 0) + nData;
+      isOk = isOk && aHeader[2] == iSegment && iOfst + nRecord <= nSize
+             && (nData == 0 || pFile->read(t->aPage, nData) == nData)
+             && teensyChecksum(checksum, t->aPage, nData) == aHeader[3]
+             && teensyLogMapReserve(t, aHeader[1] > aHeader[0] ? aHeader[1] : aHeader[0]);
+
+      if (not isOk)
+      {
+        break;
+      }
+
+      if (aHeader[0])
+      {
+        t->aMap[aHeader[0] - 1].iSegment = iSegment;
+        t->aMap[aHeader[0] - 1].iOfst = iOfst;
+      }
+
+      for (uint32_t i = aHeader[1]; i < t->nPage; i++)
+      {
+        t->aMap[i].iSegment = 0;
+      }
+
+      t->nPage = aHeader[1];
+      iOfst += nRecord;
+      t->nSinceCheckpoint += nRecord;
+    }
+
+    iLast = iSegment;
+    iEnd = iOfst;
+
+    if (iOfst < nSize)
+    {
+      /* Reading is done with FILE_READ, FILE_WRITE would open at the end */
+      teensyLogCloseFile(&pFile);
+      pFile = teensyLogOpenFile(t, "seg", iSegment, true);
+      isOk = pFile && pFile->truncate(iOfst);
+      teensyLogCloseFile(&pFile);
+
+      for (uint32_t i = iSegment + 1; teensyLogFileExists(t, "seg", i, true); i++)
+      {
+      }
+
+      if (not isOk)
+      {
+        return SQLITE_IOERR_TRUNCATE;
+      }
+
+      break;
+    }
+
+    teensyLogCloseFile(&pFile);
+
+    if (not teensyLogFileExists(t, "seg", iSegment + 1, false))
+    {
+      break;
+    }
+
+    iSegment++;
+    iOfst = TEENSY_LOG_SEG_HEADERSZ;
+  }
+
+  /* Live pages of each segment, from the oldest one the map uses */
+  uint32_t iLow = iLast ? iLast : (t->iCheckpointSegment ? t->iCheckpointSegment : 1);
+
+  for (uint32_t i = 0; i < t->nPage; i++)
+  {
+    if (t->aMap[i].iSegment && t->aMap[i].iSegment < iLow)
+    {
+      iLow = t->aMap[i].iSegment;
+    }
+  }
+
+  if (t->iCheckpointSegment && t->iCheckpointSegment < iLow)
+  {
+    iLow = t->iCheckpointSegment;
+  }
+
+  t->iSegmentLow = iLow;
+  t->nSegment = iLast ? iLast - iLow + 1 : 0;
+  t->iSegment = iLast ? iLast : iLow - 1;
+
+  if (t->nSegment > 0)
+  {
+    t->aSegment = (TeensyLogSegment*)teensyMalloc(t->nSegment * sizeof(TeensyLogSegment));
+
+    if (not t->aSegment)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    memset(t->aSegment, 0, t->nSegment * sizeof(TeensyLogSegment));
+  }
+
+  for (uint32_t i = 0; i < t->nPage; i++)
+  {
+    TeensyLogSegment* s = teensyLogSegment(t, t->aMap[i].iSegment);
+
+    if (t->aMap[i].iSegment && s)
+    {
+      s->nLive++;
+    }
+  }
+
+  /* Segments collected before power was lost */
+  for (uint32_t i = iLow - 1; i > 0 && teensyLogFileExists(t, "seg", i, true); i--)
+  {
+  }
+
+  /* Segment iLast continues, unless its header is missing */
+  if (iLast && iEnd >= TEENSY_LOG_SEG_HEADERSZ)
+  {
+    t->pHead = teensyLogOpenFile(t, "seg", iLast, true);
+
+    if (not t->pHead)
+    {
+      return SQLITE_CANTOPEN;
+    }
+
+    t->iBufOfst = iEnd;
+  }
+  else if (iLast)
+  {
+    /* Start it again, it holds nothing */
+    t->iSegment = iLast - 1;
+    t->nSegment--;
+
+    if (t->nSegment == 0)
+    {
+      t->iSegmentLow = iLast;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Allocate the buffers of a log once the page size is known.
+*/
+static int teensyLogAllocate(TeensyLogNode* t, int szPage)
+{
+  t->szPage = szPage;
+  t->mxBuf = (SQLITE_VFS_LOG_BUFFERSZ > TEENSY_LOG_SEG_HEADERSZ + teensyLogRecordMax(t)) ? SQLITE_VFS_LOG_BUFFERSZ : TEENSY_LOG_SEG_HEADERSZ + teensyLogRecordMax(t);
+  t->aBuf = (char*)teensyExtmemMalloc(t->mxBuf);
+  t->aPage = (uint8_t*)teensyMalloc(szPage);
+  t->aStored = t->isCompressed ? (uint8_t*)teensyMalloc(szPage) : nullptr;
+
+  return (t->aBuf && t->aPage && (t->aStored || not t->isCompressed)) ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+/*
+** Load the log of the database of t: the page size from the header of the
+** database file, the page map from the newest map file, then the rest of
+** the log. A database file without header is a new database, its log
+** starts with the first page written, see teensyLogCreate().
+*/
+static int teensyLogLoad(TeensyLogNode* t, sqlite3_file* pReal)
+{
+  char aHeader[12];
+  int rc = pReal->pMethods->xRead(pReal, aHeader, sizeof(aHeader), 0);
+
+  if (rc == SQLITE_IOERR_SHORT_READ)
+  {
+    return SQLITE_OK;
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  uint32_t szPage;
+  memcpy(&szPage, &aHeader[8], 4);
+
+  if (memcmp(aHeader, t->isCompressed ? TEENSY_LZ4_DB_MAGIC : TEENSY_LOG_DB_MAGIC, 8) != 0 || szPage < 512 || szPage > 65536 || (szPage & (szPage - 1)) != 0)
+  {
+    return SQLITE_NOTADB;
+  }
+
+  rc = teensyLogAllocate(t, static_cast<int>(szPage));
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  teensyLogLoadMap(t);
+
+  return teensyLogReplay(t);
+}
+
+/*
+** Start the log of a new database: write the header of the database
+** file and remove what an earlier database of the same name left.
+*/
+static int teensyLogCreate(TeensyLogNode* t, sqlite3_file* pReal, int szPage)
+{
+  int rc = teensyLogAllocate(t, szPage);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  teensyLogFileExists(t, "map", 0, true);
+  teensyLogFileExists(t, "map", 1, true);
+
+  for (uint32_t i = 1; teensyLogFileExists(t, "seg", i, true); i++)
   {
-    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ_SEEK_FAIL");
-    return SQLITE_IOERR_READ;
   }
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_CUR_AFTER_SEEK ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->position());
+  char aHeader[TEENSY_LOG_DB_HEADERSZ] = { 0 };
+  uint32_t szPageStored = static_cast<uint32_t>(szPage);
+  memcpy(&aHeader[0], t->isCompressed ? TEENSY_LZ4_DB_MAGIC : TEENSY_LOG_DB_MAGIC, 8);
+  memcpy(&aHeader[8], &szPageStored, 4);
 
-  size_t toRead = static_cast<size_t>(iAmt);
-  size_t nRead = p->teensyFile->read(zBuf, toRead);
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_FILE_READ_RETURN_VALUE ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(nRead);
+  rc = pReal->pMethods->xWrite(pReal, aHeader, sizeof(aHeader), 0);
 
-  if (nRead == toRead)
+  if (rc == SQLITE_OK)
   {
-    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (OK)");
+    rc = pReal->pMethods->xSync(pReal, SQLITE_SYNC_NORMAL);
+  }
 
-    return SQLITE_OK;
+  return rc;
+}
+
+/*
+** Do one piece of the idle work of the log of t, see LOG-STRUCTURED
+** STORAGE above. Returns SQLITE_OK if there was work, SQLITE_DONE if
+** there was none, or an error code.
+*/
+static int teensyLogCollect(TeensyLogNode* t)
+{
+  if (t->szPage == 0)
+  {
+    return SQLITE_DONE;
   }
-  else if (nRead >= 0)
+
+  T41SQLite::LogStats& stats = T41SQLite::getInstance().getLogStats();
+  bool isCheckpointNeeded = (t->nSinceCheckpoint >= SQLITE_VFS_LOG_CHECKPOINTSZ);
+
+  /* Remove segments without live pages that a replay does not need */
+  for (uint32_t i = 0; i < t->nSegment; i++)
   {
-    if (nRead < toRead)
+    uint32_t iSegment = t->iSegmentLow + i;
+    TeensyLogSegment* s = &t->aSegment[i];
+
+    if (s->isRemoved || s->nLive > 0 || iSegment == t->iSegment || iSegment == t->iGcSegment)
     {
-      memset(&((char*)zBuf)[nRead], 0, toRead - nRead);
+      continue;
     }
 
-    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (SQLITE_IOERR_SHORT_READ)");
+    if (iSegment >= t->iCheckpointSegment)
+    {
+      isCheckpointNeeded = true;
+      continue;
+    }
 
-    return SQLITE_IOERR_SHORT_READ; // ok
-  }
-  
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (ERROR)");
+    /* Copies of its pages must be on the medium first */
+    int rc = teensyLogFlush(t, true);
 
-  return SQLITE_IOERR_READ; // nRead < 0 --> call to p->teensyFile->read(zBuf, iAmt) failed
-}
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
 
-/*
-** Write data to a crash-file.
-*/
-static int teensyWrite(
-  sqlite3_file *pFile, 
-  const void *zBuf, 
-  int iAmt, 
-  sqlite_int64 iOfst
-){
-  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+    if (t->pRead && t->iReadSegment == iSegment)
+    {
+      teensyLogCloseFile(&t->pRead);
+    }
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_WRITE");
-  
-  if (p->aBuffer)
-  {
-    char *z = (char *)zBuf;       /* Pointer to remaining data to write */
-    int n = iAmt;                 /* Number of bytes at z */
-    sqlite3_int64 i = iOfst;      /* File offset to write to */
+    teensyLogFileExists(t, "seg", iSegment, true);
+    s->isRemoved = true;
+    stats.m_segmentsRemoved++;
 
-    while (n > 0)
+    while (t->nSegment > 1 && t->aSegment[0].isRemoved)
     {
-      int nCopy;                  /* Number of bytes to copy into buffer */
+      memmove(&t->aSegment[0], &t->aSegment[1], (t->nSegment - 1) * sizeof(TeensyLogSegment));
+      t->nSegment--;
+      t->iSegmentLow++;
+    }
 
-      /* If the buffer is full, or if this data is not being written directly
-      ** following the data already buffered, flush the buffer. Flushing
-      ** the buffer is a no-op if it is empty.  
-      */
-      if (p->nBuffer == SQLITE_VFS_JOURNAL_BUFFERSZ ||
-          p->iBufferOfst + p->nBuffer != i)
+    return SQLITE_OK;
+  }
+
+  /* Copy the next live page of the segment being collected */
+  if (t->iGcSegment)
+  {
+    for (; t->iGcPage < t->nPage; t->iGcPage++)
+    {
+      if (t->aMap[t->iGcPage].iSegment == t->iGcSegment)
       {
-        int rc = teensyFlushBuffer(p);
-        if (rc != SQLITE_OK)
+        uint32_t iPage = t->iGcPage + 1;
+        int rc = teensyLogReadPage(t, iPage, t->aPage);
+
+        if (rc == SQLITE_OK)
         {
-          return rc;
+          rc = teensyLogAppend(t, iPage, t->aPage);
         }
-      }
 
-      assert(p->nBuffer == 0 || p->iBufferOfst + p->nBuffer == i);
-      p->iBufferOfst = i - p->nBuffer;
+        stats.m_pagesCopied += (rc == SQLITE_OK) ? 1 : 0;
 
-      /* Copy as much data as possible into the buffer. */
-      nCopy = SQLITE_VFS_JOURNAL_BUFFERSZ - p->nBuffer;
-      if (nCopy > n)
-      {
-        nCopy = n;
+        return rc;
       }
-      memcpy(&p->aBuffer[p->nBuffer], z, nCopy);
-      p->nBuffer += nCopy;
-
-      n -= nCopy;
-      i += nCopy;
-      z += nCopy;
     }
+
+    t->iGcSegment = 0;
+    return SQLITE_OK;
   }
-  else
+
+  /* Collect the segment with the fewest live pages, if few enough. A
+  ** compressed page is counted as if it had not compressed.
+  */
+  TeensyLogSegment* pVictim = nullptr;
+
+  for (uint32_t i = 0; i + 1 < t->nSegment; i++)
   {
-    return teensyDirectWrite(p, zBuf, iAmt, iOfst);
-  }
+    TeensyLogSegment* s = &t->aSegment[i];
+    uint64_t nLiveByte = static_cast<uint64_t>(s->nLive) * teensyLogRecordMax(t);
 
-  return SQLITE_OK;
-}
+    if (not s->isRemoved && s->nLive > 0 && nLiveByte * 100 < static_cast<uint64_t>(SQLITE_VFS_LOG_GC_PERCENT) * SQLITE_VFS_LOG_SEGMENTSZ
+        && (not pVictim || s->nLive < pVictim->nLive))
+    {
+      pVictim = s;
+    }
+  }
 
-/* (From SQLite documentation:)
-** The xTruncate method truncates a file to be nByte bytes in length. If the file is already nByte bytes or less in length then this method is a no-op.
-** The xTruncate method returns SQLITE_OK on success and SQLITE_IOERR_TRUNCATE if anything goes wrong. 
-*/
-static int teensyTruncate(sqlite3_file *pFile, sqlite_int64 size)
-{
-  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
-  size_t reducedSize = static_cast<size_t>(size);
+  if (pVictim)
+  {
+    t->iGcSegment = t->iSegmentLow + static_cast<uint32_t>(pVictim - t->aSegment);
+    t->iGcPage = 0;
+    return SQLITE_OK;
+  }
 
-  if (p->teensyFile->size() > reducedSize)
+  if (isCheckpointNeeded)
   {
-    return p->teensyFile->truncate(reducedSize) ? SQLITE_OK : SQLITE_IOERR_TRUNCATE;
+    return teensyLogCheckpoint(t);
   }
 
-  return SQLITE_OK;
+  return SQLITE_DONE;
 }
 
 /*
-** Sync the contents of the file to the persistent media.
+** Do one piece of the idle work of the logs of all open databases.
+** Returns SQLITE_OK if there was work, SQLITE_DONE if there was none, or
+** an error code.
 */
-static int teensySync(sqlite3_file *pFile, int flags)
+static int teensyLogStep()
 {
-  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
-  int rc = teensyFlushBuffer(p);
-  
-  if (rc != SQLITE_OK)
+  for (TeensyLogNode* t = s_pLogList; t; t = t->pNext)
   {
-    return rc;
+    int rc = teensyLogCollect(t);
+
+    if (rc != SQLITE_DONE)
+    {
+      return rc;
+    }
   }
-  
-  p->teensyFile->flush();
 
-  return SQLITE_OK;
+  return SQLITE_DONE;
 }
 
 /*
-** Write the size of the file in bytes to *pSize.
+** Return the log state of the database zPath, loading it if it is not
+** open yet. isCompressed is true for the compressed VFS, a database open
+** with the other one is SQLITE_NOTADB. Returns NULL and sets *pRc on
+** error.
 */
-static int teensyFileSize(sqlite3_file *pFile, sqlite_int64 *pSize)
+static TeensyLogNode* teensyLogNodeAcquire(const char* zPath, sqlite3_file* pReal, bool isCompressed, int* pRc)
 {
-  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
-  /* Flush the contents of the buffer to disk. As with the flush in the
-  ** teensyRead() method, it would be possible to avoid this and save a write
-  ** here and there. But in practice this comes up so infrequently it is
-  ** not worth the trouble.
-  */
-  int rc = teensyFlushBuffer(p);
+  for (TeensyLogNode* t = s_pLogList; t; t = t->pNext)
+  {
+    if (strcmp(t->zPath, zPath) == 0)
+    {
+      t->nRef++;
+      *pRc = (t->isCompressed == isCompressed) ? SQLITE_OK : SQLITE_NOTADB;
+      return t;
+    }
+  }
 
-  if (rc != SQLITE_OK)
+  TeensyLogNode* t = (TeensyLogNode*)teensyMalloc(sizeof(TeensyLogNode));
+
+  if (not t)
   {
-    return rc;
+    *pRc = SQLITE_NOMEM;
+    return nullptr;
   }
-  
-  *pSize = p->teensyFile->size();
 
-  return SQLITE_OK;
+  memset(t, 0, sizeof(TeensyLogNode));
+  t->isCompressed = isCompressed;
+  t->zPath = teensyMprintf("%s", zPath);
+  t->nRef = 1;
+  t->pNext = s_pLogList;
+  s_pLogList = t;
+
+  *pRc = t->zPath ? teensyLogLoad(t, pReal) : SQLITE_NOMEM;
+
+  return t;
 }
 
 /*
-** Locking functions. The xLock() and xUnlock() methods are both no-ops.
-** The xCheckReservedLock() always indicates that no other process holds
-** a reserved lock on the database file. This ensures that if a hot-journal
-** file is found in the file-system it is rolled back.
+** Drop a reference to the log state of a database. The last one flushes
+** the log, checkpoints the page map if the log grew, and frees it.
 */
-static int teensyLock(sqlite3_file *pFile, int eLock)
-{
-  return SQLITE_OK;
-}
-static int teensyUnlock(sqlite3_file *pFile, int eLock)
-{
-  return SQLITE_OK;
-}
-static int teensyCheckReservedLock(sqlite3_file *pFile, int *pResOut)
+static int teensyLogNodeRelease(TeensyLogNode* t)
 {
-  *pResOut = 0;
-  return SQLITE_OK;
+  if (--t->nRef > 0)
+  {
+    return SQLITE_OK;
+  }
+
+  int rc = SQLITE_OK;
+
+  if (t->pHead)
+  {
+    rc = (t->nSinceCheckpoint > 0) ? teensyLogCheckpoint(t) : teensyLogFlush(t, true);
+  }
+
+  teensyLogCloseFile(&t->pHead);
+  teensyLogCloseFile(&t->pRead);
+
+  TeensyLogNode** pp = &s_pLogList;
+  while (*pp != t)
+  {
+    pp = &(*pp)->pNext;
+  }
+  *pp = t->pNext;
+
+  extmem_free(t->aMap);
+  extmem_free(t->aBuf);
+  sqlite3_free(t->aSegment);
+  sqlite3_free(t->aPage);
+  sqlite3_free(t->aStored);
+  sqlite3_free(t->zPath);
+  sqlite3_free(t);
+
+  return rc;
 }
 
 /*
-** No xFileControl() verbs are implemented by this VFS.
+** Close a log-structured database file.
 */
-static int teensyFileControl(sqlite3_file *pFile, int op, void *pArg)
+static int teensyLogClose(sqlite3_file *pFile)
 {
-  return SQLITE_NOTFOUND;
+  TeensyLogFile* p = (TeensyLogFile*)pFile;
+  int rc = teensyLogNodeRelease(p->pNode);
+  int rcClose = p->pReal->pMethods->xClose(p->pReal);
+
+  return (rc == SQLITE_OK) ? rcClose : rc;
 }
 
 /*
-** The xSectorSize() and xDeviceCharacteristics() methods. These two
-** may return special values allowing SQLite to optimize file-system 
-** access to some extent. But it is also safe to simply return 0.
+** Read from a log-structured database file, page by page.
 */
-static int teensySectorSize(sqlite3_file *pFile)
+static int teensyLogRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite_int64 iOfst)
 {
-  return 0;
-}
+  TeensyLogNode* t = ((TeensyLogFile*)pFile)->pNode;
 
-static int teensyDeviceCharacteristics(sqlite3_file *pFile)
-{
-  return 0;
+  if (t->szPage == 0)
+  {
+    memset(zBuf, 0, iAmt);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+
+  for (int iDone = 0; iDone < iAmt; )
+  {
+    uint32_t iPage = static_cast<uint32_t>((iOfst + iDone) / t->szPage) + 1;
+    int iInPage = static_cast<int>((iOfst + iDone) % t->szPage);
+    int nCopy = (t->szPage - iInPage < iAmt - iDone) ? t->szPage - iInPage : iAmt - iDone;
+
+    if (iPage > t->nPage)
+    {
+      memset((char*)zBuf + iDone, 0, iAmt - iDone);
+      return SQLITE_IOERR_SHORT_READ;
+    }
+
+    int rc;
+
+    if (nCopy == t->szPage)
+    {
+      rc = teensyLogReadPage(t, iPage, (char*)zBuf + iDone);
+    }
+    else
+    {
+      rc = teensyLogReadPage(t, iPage, t->aPage);
+      memcpy((char*)zBuf + iDone, &t->aPage[iInPage], nCopy);
+    }
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    iDone += nCopy;
+  }
+
+  return SQLITE_OK;
 }
 
 /*
-** Open a file handle.
+** Write to a log-structured database file: each page written is appended
+** to the log. The first write to a new database, page 1, decides the page
+** size. Writes of less than a page read the rest of the page first.
 */
-static int teensyOpen(
-  sqlite3_vfs *pVfs,              /* VFS */
-  const char *zName,              /* File to open, or 0 for a temp file */
-  sqlite3_file *pFile,            /* Pointer to TeensyVFSFile struct to populate */
-  int flags,                      /* Input SQLITE_OPEN_XXX flags */
-  int *pOutFlags                  /* Output SQLITE_OPEN_XXX flags (or NULL) */
-){
-  static const sqlite3_io_methods teensyio = {
-    1,                            /* iVersion */
-    teensyClose,                    /* xClose */
-    teensyRead,                     /* xRead */
-    teensyWrite,                    /* xWrite */
-    teensyTruncate,                 /* xTruncate */
-    teensySync,                     /* xSync */
-    teensyFileSize,                 /* xFileSize */
-    teensyLock,                     /* xLock */
-    teensyUnlock,                   /* xUnlock */
-    teensyCheckReservedLock,        /* xCheckReservedLock */
-    teensyFileControl,              /* xFileControl */
-    teensySectorSize,               /* xSectorSize */
-    teensyDeviceCharacteristics     /* xDeviceCharacteristics */
-  };
-
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_OPEN");
+static int teensyLogWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyLogFile* p = (TeensyLogFile*)pFile;
+  TeensyLogNode* t = p->pNode;
 
-  TeensyVFSFile* p = (TeensyVFSFile*)pFile; /* Populate this structure */
-  char* aBuf = 0;
+  if (t->szPage == 0)
+  {
+    int szPage = (iOfst == 0 && iAmt >= 100) ? teensyHeaderPageSize(zBuf) : 0;
+    int rc = szPage ? teensyLogCreate(t, p->pReal, szPage) : SQLITE_IOERR_WRITE;
 
-  if (zName == 0)
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+  }
+  /* Segments and map are kept in one page size, PRAGMA page_size cannot change it */
+  else if (iOfst == 0 && iAmt >= 100 && teensyHeaderPageSize(zBuf) != t->szPage)
   {
-    return SQLITE_IOERR;
+    return SQLITE_IOERR_WRITE;
   }
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_OPEN_FILE ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(zName);
-
-  if (flags & SQLITE_OPEN_MAIN_JOURNAL)
+  for (int iDone = 0; iDone < iAmt; )
   {
-    aBuf = (char*)sqlite3_malloc(SQLITE_VFS_JOURNAL_BUFFERSZ);
-    
-    if (not aBuf)
+    uint32_t iPage = static_cast<uint32_t>((iOfst + iDone) / t->szPage) + 1;
+    int iInPage = static_cast<int>((iOfst + iDone) % t->szPage);
+    int nCopy = (t->szPage - iInPage < iAmt - iDone) ? t->szPage - iInPage : iAmt - iDone;
+    const void* zPage = (const char*)zBuf + iDone;
+
+    if (not teensyLogMapReserve(t, iPage))
     {
       return SQLITE_NOMEM;
     }
+
+    if (nCopy < t->szPage)
+    {
+      int rc = (iPage <= t->nPage) ? teensyLogReadPage(t, iPage, t->aPage) : SQLITE_OK;
+
+      if (rc != SQLITE_OK)
+      {
+        return rc;
+      }
+
+      if (iPage > t->nPage)
+      {
+        memset(t->aPage, 0, t->szPage);
+      }
+
+      memcpy(&t->aPage[iInPage], zPage, nCopy);
+      zPage = t->aPage;
+    }
+
+    int rc = teensyLogAppend(t, iPage, zPage);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    iDone += nCopy;
   }
-  
-  uint8_t openMode = (flags & SQLITE_OPEN_READONLY) ? FILE_READ : FILE_WRITE;
-  memset(p, 0, sizeof(TeensyVFSFile));
-  p->teensyFile = new TeensyFile(T41SQLite::getInstance().getFilesystem()->open(zName, openMode));
-  
-  if (not p->teensyFile) // check if file is open
+
+  return SQLITE_OK;
+}
+
+/*
+** Truncate a log-structured database file: a truncation record in the
+** log.
+*/
+static int teensyLogTruncate(sqlite3_file *pFile, sqlite_int64 size)
+{
+  TeensyLogNode* t = ((TeensyLogFile*)pFile)->pNode;
+
+  if (t->szPage == 0)
   {
-    sqlite3_free(aBuf);
-    return SQLITE_CANTOPEN;
+    return SQLITE_OK;
   }
 
-  p->aBuffer = aBuf;
+  uint32_t nPage = static_cast<uint32_t>((size + t->szPage - 1) / t->szPage);
 
-  if (pOutFlags)
+  if (nPage >= t->nPage)
   {
-    *pOutFlags = flags;
+    return SQLITE_OK;
   }
 
-  p->sqliteFile.pMethods = &teensyio;
+  for (uint32_t iPage = nPage + 1; iPage <= t->nPage; iPage++)
+  {
+    teensyLogMapSet(t, iPage, 0, 0);
+  }
 
-  return SQLITE_OK;
+  t->nPage = nPage;
+
+  return teensyLogAppend(t, 0, nullptr);
 }
 
 /*
-** Delete the file identified by argument zPath. If the dirSync parameter
-** is non-zero, then WE SHOULD ensure the file-system modification to delete the
-** file has been synced to disk before returning.
-** BUT CANNOT ensure the sync, therefore we ignore the dirSync parameter.
+** Sync a log-structured database file: write and flush the buffered
+** records of the log.
 */
-static int teensyDelete(sqlite3_vfs *pVfs, const char *zPath, int dirSync)
+static int teensyLogSync(sqlite3_file *pFile, int flags)
 {
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_DELETE_PATH ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(zPath);
+  TeensyLogNode* t = ((TeensyLogFile*)pFile)->pNode;
 
-  if (not T41SQLite::getInstance().getFilesystem()->remove(zPath))
-  {
-    return SQLITE_IOERR_DELETE;
-  }
-  
-  return SQLITE_OK;
+  return t->pHead ? teensyLogFlush(t, true) : SQLITE_OK;
 }
 
 /*
-** Query the file-system to see if the named file exists, is readable or
-** is both readable and writable.
+** Size of a log-structured database file as SQLite sees it.
 */
-static int teensyAccess(
-  sqlite3_vfs *pVfs, 
-  const char *zPath, 
-  int flags, 
-  int *pResOut
-){
-  assert(flags==SQLITE_ACCESS_EXISTS ||
-         flags==SQLITE_ACCESS_READ ||
-         flags==SQLITE_ACCESS_READWRITE);
+static int teensyLogFileSize(sqlite3_file *pFile, sqlite_int64 *pSize)
+{
+  TeensyLogNode* t = ((TeensyLogFile*)pFile)->pNode;
+
+  *pSize = static_cast<sqlite3_int64>(t->nPage) * t->szPage;
 
-  // Because we cannot/don't need to check access permissions,
-  // we will set *pResOut to T41SQLite::ACCESS_SUCCESFUL,
-  // if a file with the given name exists.
-  if (T41SQLite::getInstance().getFilesystem()->exists(zPath))
-  {
-    *pResOut = T41SQLite::ACCESS_SUCCESFUL;
-  }
-  else
-  {
-    *pResOut = T41SQLite::ACCESS_FAILED;
-  }
-  
   return SQLITE_OK;
 }
 
+static int teensyLogLock(sqlite3_file *pFile, int eLock)
+{
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  return pReal->pMethods->xLock(pReal, eLock);
+}
+
+static int teensyLogUnlock(sqlite3_file *pFile, int eLock)
+{
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  return pReal->pMethods->xUnlock(pReal, eLock);
+}
+
+static int teensyLogCheckReservedLock(sqlite3_file *pFile, int *pResOut)
+{
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  return pReal->pMethods->xCheckReservedLock(pReal, pResOut);
+}
+
 /*
-** Argument zPath points to a nul-terminated string containing a file path.
-** If zPath is an absolute path, then it is copied as is into the output 
-** buffer. Otherwise, if it is a relative path, then the equivalent full
-** path is written to the output buffer.
-**
-** This function assumes that paths are UNIX style. Specifically, that:
-**
-**   1. Path components are separated by a '/'. and 
-**   2. Full paths begin with a '/' character.
+** Size hints are about the pages, the log has no use for them.
 */
-// !!!! It impossible to get the full pathname with exFAT. !!!!
-// !!!! Therefore we copy zPath with (set by user) getDBDirFullPath() into zPathOut. !!!!
-static int teensyFullPathname(
-  sqlite3_vfs *pVfs,              /* VFS */
-  const char *zPath,              /* Input path (possibly a relative path) */
-  int nPathOut,                   /* Size of output buffer in bytes */
-  char *zPathOut                  /* Pointer to output buffer */
-){
-  String fullPath = T41SQLite::getInstance().getDBDirFullPath();
-  fullPath.append(zPath);
-  sqlite3_snprintf(nPathOut, zPathOut, "%s", fullPath.c_str());
-  zPathOut[nPathOut - 1] = '\0';
+static int teensyLogFileControl(sqlite3_file *pFile, int op, void *pArg)
+{
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_FULL_PATH ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(zPathOut);
+  if (op == SQLITE_FCNTL_SIZE_HINT)
+  {
+    return SQLITE_OK;
+  }
 
-  return SQLITE_OK;
+  return pReal->pMethods->xFileControl(pReal, op, pArg);
+}
+
+static int teensyLogSectorSize(sqlite3_file *pFile)
+{
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  return pReal->pMethods->xSectorSize(pReal);
 }
 
 /*
-** The following four VFS methods:
-**
-**   xDlOpen
-**   xDlError
-**   xDlSym
-**   xDlClose
-**
-** are supposed to implement the functionality needed by SQLite to load
-** extensions compiled as shared objects. This simple VFS does not support
-** this functionality, so the following functions are no-ops.
+** Batch atomic writes are not offered, the pages of a batch would go to
+** the log one by one.
 */
-static void* teensyDlOpen(sqlite3_vfs* pVfs, const char* zPath)
+static int teensyLogDeviceCharacteristics(sqlite3_file *pFile)
 {
-  return nullptr;
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  return pReal->pMethods->xDeviceCharacteristics(pReal) & ~SQLITE_IOCAP_BATCH_ATOMIC;
 }
 
-static void teensyDlError(sqlite3_vfs* pVfs, int nByte, char* zErrMsg)
+static int teensyLogShmMap(sqlite3_file *pFile, int iRegion, int szRegion, int bExtend, void volatile **pp)
 {
-  sqlite3_snprintf(nByte, zErrMsg, "Loadable extensions are not supported");
-  zErrMsg[nByte-1] = '\0';
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  return pReal->pMethods->xShmMap(pReal, iRegion, szRegion, bExtend, pp);
 }
 
-static void (*teensyDlSym(sqlite3_vfs* pVfs, void* pH, const char* z))(void)
+static int teensyLogShmLock(sqlite3_file *pFile, int ofst, int n, int flags)
 {
-  return 0;
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  return pReal->pMethods->xShmLock(pReal, ofst, n, flags);
 }
 
-static void teensyDlClose(sqlite3_vfs *pVfs, void *pHandle)
+static void teensyLogShmBarrier(sqlite3_file *pFile)
 {
-  return;
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  pReal->pMethods->xShmBarrier(pReal);
+}
+
+static int teensyLogShmUnmap(sqlite3_file *pFile, int deleteFlag)
+{
+  sqlite3_file* pReal = ((TeensyLogFile*)pFile)->pReal;
+  return pReal->pMethods->xShmUnmap(pReal, deleteFlag);
 }
 
 /*
-** Parameter zByte points to a buffer nByte bytes in size. Populate this
-** buffer with pseudo-random data.
+** Pages cannot be mapped, they are scattered over the log. SQLite reads
+** them with xRead() instead.
 */
-static int teensyRandomness(sqlite3_vfs *pVfs, int nByte, char *zByte)
+static int teensyLogFetch(sqlite3_file *pFile, sqlite3_int64 iOfst, int iAmt, void **pp)
+{
+  *pp = nullptr;
+  return SQLITE_OK;
+}
+
+static int teensyLogUnfetch(sqlite3_file *pFile, sqlite3_int64 iOfst, void *pPage)
 {
   return SQLITE_OK;
 }
 
 /*
-** Sleep for at least nMicro microseconds. Return the (approximate) number 
-** of microseconds slept for.
+** Open a file of the log or the compressed VFS. Main databases are
+** T41_VFS files (holding just a header) wrapped by the log-structured io
+** methods, all other files are plain T41_VFS files.
 */
-static int teensySleep(sqlite3_vfs *pVfs, int nMicro)
+static int teensyLogOpenAny(
+  sqlite3_vfs *pVfs,              /* VFS */
+  const char *zName,              /* File to open, or 0 for a temp file */
+  sqlite3_file *pFile,            /* Pointer to TeensyLogFile struct to populate */
+  int flags,                      /* Input SQLITE_OPEN_XXX flags */
+  int *pOutFlags,                 /* Output SQLITE_OPEN_XXX flags (or NULL) */
+  bool isCompressed               /* True to store the pages LZ4 compressed */
+){
+  static const sqlite3_io_methods teensylogio = {
+    3,                                /* iVersion */
+    teensyLogClose,                   /* xClose */
+    teensyLogRead,                    /* xRead */
+    teensyLogWrite,                   /* xWrite */
+    teensyLogTruncate,                /* xTruncate */
+    teensyLogSync,                    /* xSync */
+    teensyLogFileSize,                /* xFileSize */
+    teensyLogLock,                    /* xLock */
+    teensyLogUnlock,                  /* xUnlock */
+    teensyLogCheckReservedLock,       /* xCheckReservedLock */
+    teensyLogFileControl,             /* xFileControl */
+    teensyLogSectorSize,              /* xSectorSize */
+    teensyLogDeviceCharacteristics,   /* xDeviceCharacteristics */
+    teensyLogShmMap,                  /* xShmMap */
+    teensyLogShmLock,                 /* xShmLock */
+    teensyLogShmBarrier,              /* xShmBarrier */
+    teensyLogShmUnmap,                /* xShmUnmap */
+    teensyLogFetch,                   /* xFetch */
+    teensyLogUnfetch                  /* xUnfetch */
+  };
+
+  if (not zName || not (flags & SQLITE_OPEN_MAIN_DB))
+  {
+    return teensyOpen(pVfs, zName, pFile, flags, pOutFlags);
+  }
+
+  TeensyLogFile* p = (TeensyLogFile*)pFile;
+  memset(p, 0, sizeof(TeensyLogFile));
+  p->pReal = (sqlite3_file*)&p[1];
+
+  int rc = teensyOpen(pVfs, zName, p->pReal, flags, pOutFlags);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  p->pNode = teensyLogNodeAcquire(zName, p->pReal, isCompressed, &rc);
+
+  if (rc != SQLITE_OK)
+  {
+    if (p->pNode)
+    {
+      teensyLogNodeRelease(p->pNode);
+    }
+
+    p->pReal->pMethods->xClose(p->pReal);
+    return rc;
+  }
+
+  p->base.pMethods = &teensylogio;
+
+  return SQLITE_OK;
+}
+
+/*
+** Open a log VFS file, see LOG-STRUCTURED STORAGE above.
+*/
+static int teensyLogOpen(sqlite3_vfs *pVfs, const char *zName, sqlite3_file *pFile, int flags, int *pOutFlags)
 {
-  delayMicroseconds(nMicro);
-  return nMicro;
+  return teensyLogOpenAny(pVfs, zName, pFile, flags, pOutFlags, false);
 }
 
 /*
-** Set *pTime to the current UTC time expressed as a Julian day. Return
-** SQLITE_OK if successful, or an error code otherwise.
-**
-**   http://en.wikipedia.org/wiki/Julian_day
-**
-** This implementation is not very good. The current time is rounded to
-** an integer number of seconds. Also, assuming time_t is a signed 32-bit 
-** value, it will stop working some time in the year 2038 AD (the so-called
-** "year 2038" problem that afflicts systems that store time this way). 
+** Open a compressed VFS file, see PAGE COMPRESSION above.
 */
-static int teensyCurrentTime(sqlite3_vfs *pVfs, double *pTime)
+static int teensyLz4Open(sqlite3_vfs *pVfs, const char *zName, sqlite3_file *pFile, int flags, int *pOutFlags)
 {
-  time_t t = now();
-  *pTime = t/86400.0 + 2440587.5; 
-  return SQLITE_OK;
+  return teensyLogOpenAny(pVfs, zName, pFile, flags, pOutFlags, true);
 }
 
 /*
@@ -714,13 +7923,225 @@ sqlite3_vfs* sqlite3_teensy_vfs(void)
   return &teensyvfs;
 }
 
+/*
+** This function returns a pointer to the memory VFS implemented in this
+** file, see MEMORY VFS above.
+*/
+sqlite3_vfs* sqlite3_teensy_mem_vfs(void)
+{
+  static sqlite3_vfs teensymemvfs = {
+    1,                              /* iVersion */
+    sizeof(TeensyMemFile),          /* szOsFile */
+    MAXPATHNAME,                    /* mxPathname */
+    0,                              /* pNext */
+    T41SQLite::MEMORY_VFS_NAME,     /* zName */
+    0,                              /* pAppData */
+    teensyMemOpen,                  /* xOpen */
+    teensyMemDelete,                /* xDelete */
+    teensyMemAccess,                /* xAccess */
+    teensyFullPathname,             /* xFullPathname */
+    teensyDlOpen,                   /* xDlOpen */
+    teensyDlError,                  /* xDlError */
+    teensyDlSym,                    /* xDlSym */
+    teensyDlClose,                  /* xDlClose */
+    teensyRandomness,               /* xRandomness */
+    teensySleep,                    /* xSleep */
+    teensyCurrentTime,              /* xCurrentTime */
+  };
+
+  return &teensymemvfs;
+}
+
+/*
+** This function returns a pointer to the tier VFS implemented in this
+** file, see TIERED STORAGE above.
+*/
+sqlite3_vfs* sqlite3_teensy_tier_vfs(void)
+{
+  static sqlite3_vfs teensytiervfs = {
+    1,                                            /* iVersion */
+    sizeof(TeensyTierFile) + sizeof(TeensyVFSFile), /* szOsFile */
+    MAXPATHNAME,                                  /* mxPathname */
+    0,                                            /* pNext */
+    T41SQLite::TIER_VFS_NAME,                     /* zName */
+    0,                                            /* pAppData */
+    teensyTierOpen,                               /* xOpen */
+    teensyDelete,                                 /* xDelete */
+    teensyAccess,                                 /* xAccess */
+    teensyFullPathname,                           /* xFullPathname */
+    teensyDlOpen,                                 /* xDlOpen */
+    teensyDlError,                                /* xDlError */
+    teensyDlSym,                                  /* xDlSym */
+    teensyDlClose,                                /* xDlClose */
+    teensyRandomness,                             /* xRandomness */
+    teensySleep,                                  /* xSleep */
+    teensyCurrentTime,                            /* xCurrentTime */
+  };
+
+  return &teensytiervfs;
+}
+
+/*
+** This function returns a pointer to the compressed VFS implemented in
+** this file, see PAGE COMPRESSION above.
+*/
+sqlite3_vfs* sqlite3_teensy_lz4_vfs(void)
+{
+  static sqlite3_vfs teensylz4vfs = {
+    1,                                            /* iVersion */
+    sizeof(TeensyLogFile) + sizeof(TeensyVFSFile), /* szOsFile */
+    MAXPATHNAME,                                  /* mxPathname */
+    0,                                            /* pNext */
+    T41SQLite::COMPRESSED_VFS_NAME,               /* zName */
+    0,                                            /* pAppData */
+    teensyLz4Open,                                /* xOpen */
+    teensyDelete,                                 /* xDelete */
+    teensyAccess,                                 /* xAccess */
+    teensyFullPathname,                           /* xFullPathname */
+    teensyDlOpen,                                 /* xDlOpen */
+    teensyDlError,                                /* xDlError */
+    teensyDlSym,                                  /* xDlSym */
+    teensyDlClose,                                /* xDlClose */
+    teensyRandomness,                             /* xRandomness */
+    teensySleep,                                  /* xSleep */
+    teensyCurrentTime,                            /* xCurrentTime */
+  };
+
+  return &teensylz4vfs;
+}
+
+/*
+** This function returns a pointer to the log VFS implemented in this
+** file, see LOG-STRUCTURED STORAGE above.
+*/
+sqlite3_vfs* sqlite3_teensy_log_vfs(void)
+{
+  static sqlite3_vfs teensylogvfs = {
+    1,                                            /* iVersion */
+    sizeof(TeensyLogFile) + sizeof(TeensyVFSFile), /* szOsFile */
+    MAXPATHNAME,                                  /* mxPathname */
+    0,                                            /* pNext */
+    T41SQLite::LOG_VFS_NAME,                      /* zName */
+    0,                                            /* pAppData */
+    teensyLogOpen,                                /* xOpen */
+    teensyDelete,                                 /* xDelete */
+    teensyAccess,                                 /* xAccess */
+    teensyFullPathname,                           /* xFullPathname */
+    teensyDlOpen,                                 /* xDlOpen */
+    teensyDlError,                                /* xDlError */
+    teensyDlSym,                                  /* xDlSym */
+    teensyDlClose,                                /* xDlClose */
+    teensyRandomness,                             /* xRandomness */
+    teensySleep,                                  /* xSleep */
+    teensyCurrentTime,                            /* xCurrentTime */
+  };
+
+  return &teensylogvfs;
+}
+
+/*
+** This function returns a pointer to the VFS of the filesystem added as
+** zName, see MULTIPLE FILESYSTEMS above, or NULL if there are
+** T41SQLite::MAX_FILESYSTEMS of them already. T41SQLite registers it.
+*/
+sqlite3_vfs* sqlite3_teensy_fs_vfs(const char* zName)
+{
+  TeensyFsVfs* pFree = nullptr;
+
+  for (int i = 0; i < T41SQLite::MAX_FILESYSTEMS; i++)
+  {
+    TeensyFsVfs* v = &s_aFsVfs[i];
+
+    if (v->zName[0] == '\0')
+    {
+      pFree = pFree ? pFree : v;
+    }
+    else if (strcmp(v->zName, zName) == 0)
+    {
+      return &v->base;
+    }
+  }
+
+  if (not pFree)
+  {
+    return nullptr;
+  }
+
+  pFree->base = *sqlite3_teensy_vfs();
+  pFree->base.pNext = 0;
+  sqlite3_snprintf(sizeof(pFree->zName), pFree->zName, "%s", zName);
+  pFree->base.zName = pFree->zName;
+  pFree->base.pAppData = pFree->zName;
+
+  return &pFree->base;
+}
+
 int sqlite3_os_init(void)
 {
-  return sqlite3_vfs_register(sqlite3_teensy_vfs(), T41SQLite::IS_DEFAULT_VFS);
+  int rc = sqlite3_vfs_register(sqlite3_teensy_vfs(), T41SQLite::IS_DEFAULT_VFS);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_vfs_register(sqlite3_teensy_mem_vfs(), 0);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_vfs_register(sqlite3_teensy_tier_vfs(), 0);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_vfs_register(sqlite3_teensy_lz4_vfs(), 0);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_vfs_register(sqlite3_teensy_log_vfs(), 0);
+  }
+
+  return rc;
 }
 
 int sqlite3_os_end(void)
 {
   // undo what sqlite3_os_init did (e.g. free resources)
-  return SQLITE_OK;
+  int rc = teensySyncBarrierIfPending();
+
+  if (rc != SQLITE_OK)
+  {
+    sqlite3_log(rc, "deferred syncs failed at shutdown");
+  }
+
+  sqlite3_teensy_mem_flush();
+
+  while (s_pMemNodeList)
+  {
+    teensyMemNodeFree(s_pMemNodeList);
+  }
+
+  for (int i = 0; i < SQLITE_VFS_FILE_POOL_SIZE; i++)
+  {
+    TeensyFileSlot* s = &s_aFileSlot[i];
+
+    if (s->isKept)
+    {
+      teensyFilePoolEvict(s);
+    }
+
+    if (not s->isInUse)
+    {
+      sqlite3_free(s->aBuffer);
+      s->aBuffer = nullptr;
+      extmem_free(s->aReadAhead);
+      s->aReadAhead = nullptr;
+    }
+  }
+
+  for (int i = 0; i < SQLITE_VFS_EXISTS_CACHE_SIZE; i++)
+  {
+    s_aExists[i].zPath[0] = '\0';
+  }
+
+  return rc;
 }
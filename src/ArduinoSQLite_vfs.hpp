@@ -0,0 +1,21 @@
+#pragma once
+
+#include "sqlite3.h"
+
+// VFS implementations registered by sqlite3_os_init()
+sqlite3_vfs* sqlite3_teensy_vfs(void);
+sqlite3_vfs* sqlite3_teensy_mem_vfs(void);
+sqlite3_vfs* sqlite3_teensy_tier_vfs(void);
+sqlite3_vfs* sqlite3_teensy_lz4_vfs(void);
+sqlite3_vfs* sqlite3_teensy_log_vfs(void);
+
+// VFS storing files on the filesystem added with T41SQLite::addFilesystem() as zName, registered by T41SQLite
+sqlite3_vfs* sqlite3_teensy_fs_vfs(const char* zName);
+
+// Function to write the dirty blocks of all memory VFS main databases to their backing files
+int sqlite3_teensy_mem_flush(void);
+
+// Functions to do the work queued by T41SQLite::SyncPolicy::DEFERRED (and clean the logs of log VFS databases,
+// poll only), in slices or all of it
+int sqlite3_teensy_poll(uint32_t nMicro);
+int sqlite3_teensy_barrier(void);
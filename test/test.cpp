@@ -1,8 +1,10 @@
 #include <Arduino.h>
 
 #include "ArduinoSQLite.hpp"
+#include "ArduinoSQLitePCache.hpp"
 #include "MemoryInfo.hpp"
 
+#include <LittleFS.h>
 #include <SD.h>
 
 namespace memInfo = halvoe::memoryInfo;
@@ -10,6 +12,16 @@ namespace memInfo = halvoe::memoryInfo;
 const char* dbName = "test.db";
 const char* dbJournalName = "test.db-journal";
 
+// second filesystem for the tiered storage test
+EXTMEM char ramDiskBuffer[512 * 1024];
+LittleFS_RAM ramDisk;
+
+// RAM1 slabs of the hybrid memory test
+alignas(8) uint8_t hybridRAM1Buffer[32 * 1024];
+
+// fast tier of the two-tier page cache test, eight 1 KiB slots (plus room for aligning them)
+uint8_t twoTierFastBuffer[8 * 1024 + 8];
+
 void setupSerial(long in_serialBaudrate, unsigned long in_timeoutInSeconds = 15)
 {
   Serial.begin(in_serialBaudrate);
@@ -122,6 +134,941 @@ void testSQLite()
   Serial.println("---- testSQLite - sqlite3_close - end ----");
 }
 
+// runs in_sql on in_db and returns the first column of its first row as text, "" if there is none
+String queryText(sqlite3* in_db, const char* in_sql)
+{
+  String result;
+  sqlite3_stmt* stmt;
+
+  if (sqlite3_prepare_v2(in_db, in_sql, -1, &stmt, 0) == SQLITE_OK)
+  {
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0) != nullptr)
+    {
+      result = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    }
+
+    sqlite3_finalize(stmt);
+  }
+
+  return result;
+}
+
+// end() and begin() again, so nothing of a closed database stays in memory
+int restartT41SQLite()
+{
+  int rc = T41SQLite::getInstance().end();
+  return rc == SQLITE_OK ? T41SQLite::getInstance().begin(&SD, false) : rc;
+}
+
+// 500 rows of about 200 bytes, about 25 pages of 4 KiB, the same on every run
+const char* sqlFillRoundTrip = "DROP TABLE IF EXISTS RoundTrip; CREATE TABLE RoundTrip(ID INTEGER PRIMARY KEY, Data TEXT); "
+                               "WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 500) "
+                               "INSERT INTO RoundTrip SELECT x, printf('%.*c%d', 200, char(97 + x % 26), x) FROM n;";
+const char* sqlCheckRoundTrip = "SELECT count(*) || '/' || sum(length(Data)) || '/' || sum(ID * unicode(Data)) || '/' || "
+                                "(SELECT group_concat(integrity_check) FROM pragma_integrity_check) FROM RoundTrip;";
+const char* sqlUpdateRoundTrip = "UPDATE RoundTrip SET Data = upper(Data) WHERE ID % 3 = 0;";
+
+// a database with a read cache and a write-back buffer: a transaction reads what it wrote, a rolled back one leaves
+// no trace, a second connection sees what the first one committed and the other way round, and the pages must survive
+// a restart
+bool testCachedWriteBack()
+{
+  Serial.println("---- testCachedWriteBack - begin ----");
+  sqlite3* db = nullptr;
+  int rc = T41SQLite::getInstance().end();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = T41SQLite::getInstance().begin(&SD, false, 64 * 1024, 64 * 1024);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    T41SQLite::getInstance().resetReadCacheStats();
+    rc = sqlite3_open("cached.db", &db);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+  }
+
+  String written = queryText(db, sqlCheckRoundTrip);
+  bool isPassed = rc == SQLITE_OK && written.endsWith("/ok");
+  sqlite3* otherDb = nullptr;
+
+  // the second connection fills its read cache with the table as written
+  if (isPassed)
+  {
+    rc = sqlite3_open("cached.db", &otherDb);
+    isPassed = rc == SQLITE_OK && queryText(otherDb, sqlCheckRoundTrip) == written;
+  }
+
+  if (isPassed)
+  {
+    rc = sqlite3_exec(db, "BEGIN;", NULL, 0, NULL);
+    rc = rc == SQLITE_OK ? sqlite3_exec(db, sqlUpdateRoundTrip, NULL, 0, NULL) : rc;
+    isPassed = rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip) != written;
+    rc = rc == SQLITE_OK ? sqlite3_exec(db, "ROLLBACK;", NULL, 0, NULL) : rc;
+    isPassed = isPassed && rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip) == written
+               && queryText(otherDb, sqlCheckRoundTrip) == written;
+  }
+
+  if (isPassed)
+  {
+    rc = sqlite3_exec(db, sqlUpdateRoundTrip, NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  String updated = queryText(db, sqlCheckRoundTrip);
+  isPassed = isPassed && rc == SQLITE_OK && updated.endsWith("/ok") && updated != written
+             && queryText(otherDb, sqlCheckRoundTrip) == updated;
+
+  // the second connection undoes the update, the first one must not answer from its cache
+  if (isPassed)
+  {
+    rc = sqlite3_exec(otherDb, "UPDATE RoundTrip SET Data = lower(Data);", NULL, 0, NULL);
+    checkSQLiteError(otherDb, rc);
+    isPassed = rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip) == written;
+  }
+
+  // without syncs a commit stays in the write-back buffer, the second connection must still see it
+  if (isPassed)
+  {
+    rc = sqlite3_exec(db, "PRAGMA synchronous = OFF;", NULL, 0, NULL);
+    rc = rc == SQLITE_OK ? sqlite3_exec(db, sqlUpdateRoundTrip, NULL, 0, NULL) : rc;
+    checkSQLiteError(db, rc);
+    isPassed = rc == SQLITE_OK && queryText(otherDb, sqlCheckRoundTrip) == updated;
+  }
+
+  sqlite3_close(otherDb);
+  sqlite3_close(db);
+
+  const T41SQLite::ReadCacheStats& stats = T41SQLite::getInstance().getReadCacheStats();
+  Serial.printf("read cache hits: %u, misses: %u, evictions: %u\n", stats.m_hits, stats.m_misses, stats.m_evictions);
+  isPassed = isPassed && stats.m_hits > 0;
+  rc = restartT41SQLite();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open_v2("cached.db", &db, SQLITE_OPEN_READWRITE, nullptr);
+    isPassed = isPassed && rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip) == updated;
+    sqlite3_close(db);
+  }
+
+  Serial.printf(">>>> testCachedWriteBack - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testCachedWriteBack - end ----");
+
+  return isPassed;
+}
+
+// WAL mode: commits append frames to the WAL, checkpoint() copies them to the database, a second connection reads
+// the frames of the first one and the other way round, and closing the database checkpoints the rest
+bool testWAL()
+{
+  Serial.println("---- testWAL - begin ----");
+  sqlite3* db;
+  int walFrames = 0;
+  int checkpointedFrames = 0;
+  int rc = sqlite3_open("wal.db", &db);
+  bool isPassed = rc == SQLITE_OK && queryText(db, "PRAGMA journal_mode=WAL;") == "wal";
+
+  if (isPassed)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+  }
+
+  String filled = queryText(db, sqlCheckRoundTrip);
+
+  if (isPassed && rc == SQLITE_OK)
+  {
+    rc = T41SQLite::getInstance().checkpoint(db, T41SQLite::CheckpointMode::FULL, &walFrames, &checkpointedFrames);
+    isPassed = rc == SQLITE_OK && walFrames > 0 && checkpointedFrames == walFrames;
+  }
+
+  if (isPassed)
+  {
+    rc = sqlite3_exec(db, sqlUpdateRoundTrip, NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  String written = queryText(db, sqlCheckRoundTrip);
+  sqlite3* otherDb = nullptr;
+
+  // commits are not synced (PRAGMA synchronous=NORMAL), a second connection must still read their frames, and the
+  // first one the frames of the second
+  if (isPassed && rc == SQLITE_OK)
+  {
+    rc = sqlite3_open("wal.db", &otherDb);
+    isPassed = rc == SQLITE_OK && written.endsWith("/ok") && written != filled
+               && queryText(otherDb, sqlCheckRoundTrip) == written;
+  }
+
+  if (isPassed)
+  {
+    rc = sqlite3_exec(otherDb, "UPDATE RoundTrip SET Data = lower(Data);", NULL, 0, NULL);
+    checkSQLiteError(otherDb, rc);
+    isPassed = rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip) == filled;
+  }
+
+  sqlite3_close(otherDb);
+  sqlite3_close(db);
+  Serial.printf("WAL frames: %d, checkpointed: %d\n", walFrames, checkpointedFrames);
+
+  rc = restartT41SQLite();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open_v2("wal.db", &db, SQLITE_OPEN_READWRITE, nullptr);
+    isPassed = isPassed && rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip) == filled
+               && queryText(db, "PRAGMA journal_mode;") == "wal";
+    sqlite3_close(db);
+  }
+
+  Serial.printf(">>>> testWAL - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testWAL - end ----");
+
+  return isPassed;
+}
+
+// PRAGMA user_version of in_dbName, opened on its own connection
+String queryUserVersion(const char* in_dbName)
+{
+  sqlite3* db;
+  String userVersion;
+
+  if (sqlite3_open(in_dbName, &db) == SQLITE_OK)
+  {
+    userVersion = queryText(db, "PRAGMA user_version;");
+  }
+
+  sqlite3_close(db);
+  return userVersion;
+}
+
+// writes the batch log a power loss leaves behind (see BATCH ATOMIC WRITE in ArduinoSQLite_vfs.cpp) with one record
+// setting the user version (4 bytes big endian at offset 60 of the database header), in_isComplete false writes a
+// checksum that does not match, like a log whose records did not all reach the card
+bool writeBatchLog(const char* in_logName, uint32_t in_userVersion, bool in_isComplete)
+{
+  uint8_t data[4] = { static_cast<uint8_t>(in_userVersion >> 24), static_cast<uint8_t>(in_userVersion >> 16),
+                      static_cast<uint8_t>(in_userVersion >> 8), static_cast<uint8_t>(in_userVersion) };
+  uint8_t record[12];
+  int64_t offset = 60;
+  int32_t size = sizeof(data);
+  memcpy(&record[0], &offset, 8);
+  memcpy(&record[8], &size, 4);
+
+  // FNV-1a over the records
+  uint32_t checksum = 2166136261u;
+
+  for (uint8_t byte : record)
+  {
+    checksum = (checksum ^ byte) * 16777619u;
+  }
+
+  for (uint8_t byte : data)
+  {
+    checksum = (checksum ^ byte) * 16777619u;
+  }
+
+  checksum += in_isComplete ? 0 : 1;
+
+  uint8_t header[24] = {};
+  uint32_t recordCount = 1;
+  uint32_t dataSize = sizeof(data);
+  memcpy(&header[0], "T41BATCH", 8);
+  memcpy(&header[8], &recordCount, 4);
+  memcpy(&header[12], &dataSize, 4);
+  memcpy(&header[16], &checksum, 4);
+
+  SD.remove(in_logName);
+  File log = SD.open(in_logName, FILE_WRITE);
+  bool isWritten = log && log.write(header, sizeof(header)) == sizeof(header)
+                   && log.write(record, sizeof(record)) == sizeof(record)
+                   && log.write(data, sizeof(data)) == sizeof(data);
+  log.close();
+
+  return isWritten;
+}
+
+// a complete batch log found at open is replayed into the database, an incomplete one is ignored, both are removed;
+// then a transaction is committed as a batch and read back after a restart
+bool testBatchRecovery()
+{
+  Serial.println("---- testBatchRecovery - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open("batch.db", &db);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "PRAGMA user_version = 7;", NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  sqlite3_close(db);
+
+  bool isPassed = rc == SQLITE_OK && writeBatchLog("/batch.db-batch", 41, true) && queryUserVersion("batch.db") == "41"
+                  && not SD.exists("/batch.db-batch");
+  isPassed = isPassed && writeBatchLog("/batch.db-batch", 99, false) && queryUserVersion("batch.db") == "41"
+             && not SD.exists("/batch.db-batch");
+
+  T41SQLite::getInstance().setBatchAtomicWriteSize(256 * 1024);
+  rc = sqlite3_open("batch.db", &db);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  String written = queryText(db, sqlCheckRoundTrip);
+  sqlite3_close(db);
+  T41SQLite::getInstance().setBatchAtomicWriteSize(0);
+
+  rc = restartT41SQLite();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open_v2("batch.db", &db, SQLITE_OPEN_READWRITE, nullptr);
+    isPassed = isPassed && rc == SQLITE_OK && written.endsWith("/ok") && queryText(db, sqlCheckRoundTrip) == written;
+    sqlite3_close(db);
+  }
+
+  Serial.printf(">>>> testBatchRecovery - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testBatchRecovery - end ----");
+
+  return isPassed;
+}
+
+// writes pages to in_dbName through in_vfsName, closes it, restarts T41SQLite and reads the pages back
+bool testRoundTrip(const char* in_dbName, const char* in_vfsName)
+{
+  Serial.printf("---- testRoundTrip - %s - begin ----\n", in_vfsName);
+  sqlite3* db;
+  int rc = sqlite3_open_v2(in_dbName, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, in_vfsName);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  String written = queryText(db, sqlCheckRoundTrip);
+  sqlite3_close(db);
+
+  rc = restartT41SQLite();
+  String read;
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open_v2(in_dbName, &db, SQLITE_OPEN_READWRITE, in_vfsName);
+    read = queryText(db, sqlCheckRoundTrip);
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+  }
+
+  bool isPassed = written.endsWith("/ok") && read == written;
+  Serial.printf("written: %s, read back: %s\n", written.c_str(), read.c_str());
+  Serial.printf(">>>> testRoundTrip - %s - %s <<<<\n", in_vfsName, isPassed ? "passed" : "failed");
+  printMemoryInfo();
+  Serial.printf("---- testRoundTrip - %s - end ----\n", in_vfsName);
+
+  return isPassed;
+}
+
+// FNV-1a of the contents of in_fileName on the card, 0 if it does not exist
+uint32_t fileDigest(const char* in_fileName)
+{
+  uint32_t digest = 0;
+  File file = SD.open(in_fileName, FILE_READ);
+
+  if (file)
+  {
+    uint8_t buffer[512];
+    size_t count;
+    digest = 2166136261u;
+
+    while ((count = file.read(buffer, sizeof(buffer))) > 0)
+    {
+      for (size_t i = 0; i < count; i++)
+      {
+        digest = (digest ^ buffer[i]) * 16777619u;
+      }
+    }
+
+    file.close();
+  }
+
+  return digest;
+}
+
+// size of in_fileName on the card, 0 if it does not exist
+uint64_t fileSize(const char* in_fileName)
+{
+  File file = SD.open(in_fileName, FILE_READ);
+  uint64_t size = file ? file.size() : 0;
+  file.close();
+
+  return size;
+}
+
+// SyncPolicy::DEFERRED: poll() does a commit piece by piece, the journal is on the card before the first database page
+// and is only emptied once all of them are there; a second connection starting to read and barrier() do the queued
+// work at once
+bool testDeferredSync()
+{
+  Serial.println("---- testDeferredSync - begin ----");
+  sqlite3* db = nullptr;
+  sqlite3* otherDb = nullptr;
+  int rc = T41SQLite::getInstance().end();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = T41SQLite::getInstance().begin(&SD, false, 0, 256 * 1024);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open("deferred.db", &db);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  String written = queryText(db, sqlCheckRoundTrip);
+  uint32_t writtenDigest = fileDigest("/deferred.db");
+  T41SQLite::getInstance().setSyncPolicy(T41SQLite::SyncPolicy::DEFERRED);
+  bool isPassed = rc == SQLITE_OK && written.endsWith("/ok");
+
+  if (isPassed)
+  {
+    rc = sqlite3_exec(db, sqlUpdateRoundTrip, NULL, 0, NULL);
+    checkSQLiteError(db, rc);
+    isPassed = rc == SQLITE_OK && fileDigest("/deferred.db") == writtenDigest;
+  }
+
+  // poll(0) does one piece of the queued work per call
+  int steps = 0;
+  bool isDatabaseChanged = false;
+  uint32_t journalEmptiedDigest = 0;
+
+  while (isPassed && (rc = T41SQLite::getInstance().poll(0)) == SQLITE_OK)
+  {
+    steps++;
+    bool isJournalEmpty = fileSize("/deferred.db-journal") == 0;
+    uint32_t digest = fileDigest("/deferred.db");
+
+    if (digest != writtenDigest && not isDatabaseChanged)
+    {
+      isDatabaseChanged = true;
+      isPassed = not isJournalEmpty;
+    }
+
+    if (isJournalEmpty && journalEmptiedDigest == 0)
+    {
+      journalEmptiedDigest = digest;
+    }
+  }
+
+  String updated = queryText(db, sqlCheckRoundTrip);
+  isPassed = isPassed && rc == SQLITE_DONE && steps > 2 && isDatabaseChanged
+             && journalEmptiedDigest == fileDigest("/deferred.db") && updated.endsWith("/ok") && updated != written;
+  Serial.printf("deferred commit done in %d steps\n", steps);
+
+  // a second connection reads the next commit without waiting for poll()
+  if (isPassed)
+  {
+    rc = sqlite3_open("deferred.db", &otherDb);
+    rc = rc == SQLITE_OK ? sqlite3_exec(db, "UPDATE RoundTrip SET Data = lower(Data);", NULL, 0, NULL) : rc;
+    checkSQLiteError(db, rc);
+    isPassed = rc == SQLITE_OK && queryText(otherDb, sqlCheckRoundTrip) == written;
+  }
+
+  if (isPassed)
+  {
+    rc = sqlite3_exec(db, sqlUpdateRoundTrip, NULL, 0, NULL);
+    isPassed = rc == SQLITE_OK && T41SQLite::getInstance().barrier() == SQLITE_OK
+               && T41SQLite::getInstance().poll(0) == SQLITE_DONE && fileDigest("/deferred.db") != writtenDigest;
+  }
+
+  sqlite3_close(otherDb);
+  sqlite3_close(db);
+  T41SQLite::getInstance().setSyncPolicy(T41SQLite::SyncPolicy::STRICT);
+  rc = restartT41SQLite();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open_v2("deferred.db", &db, SQLITE_OPEN_READWRITE, nullptr);
+    isPassed = isPassed && rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip) == updated;
+    sqlite3_close(db);
+  }
+
+  Serial.printf(">>>> testDeferredSync - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testDeferredSync - end ----");
+
+  return isPassed;
+}
+
+// a round trip through the tier VFS, the read back after the restart must find pages in the tier file
+bool testTierPass(const char* in_dbName)
+{
+  T41SQLite::getInstance().resetTierStats();
+  bool isPassed = testRoundTrip(in_dbName, T41SQLite::TIER_VFS_NAME);
+  const T41SQLite::TierStats& stats = T41SQLite::getInstance().getTierStats();
+  Serial.printf("tier hits: %u, misses: %u, promotions: %u\n", stats.m_hits, stats.m_misses, stats.m_promotions);
+
+  return isPassed && stats.m_hits > 0;
+}
+
+// tiers on a RAM disk, for a database on the card and one on the RAM disk itself, which must not share a tier file
+bool testTierRoundTrip()
+{
+  Serial.println("---- testTierRoundTrip - begin ----");
+  bool isPassed = ramDisk.begin(ramDiskBuffer, sizeof(ramDiskBuffer)) && T41SQLite::getInstance().addFilesystem("ram", &ramDisk) == SQLITE_OK;
+
+  if (isPassed)
+  {
+    T41SQLite::getInstance().setTier("ram", 32 * 1024);
+    isPassed = testTierPass("tier.db") && testTierPass("ram:/tier.db") && ramDisk.exists("/tier.db-tier")
+               && ramDisk.exists("/tier.db-tier-ram");
+    T41SQLite::getInstance().setTier("ram", 0);
+  }
+
+  Serial.printf(">>>> testTierRoundTrip - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testTierRoundTrip - end ----");
+
+  return isPassed;
+}
+
+// pages of repeated letters compress well, their records must take less than half the bytes of the pages
+bool testCompressedRoundTrip()
+{
+  Serial.println("---- testCompressedRoundTrip - begin ----");
+  T41SQLite::getInstance().resetCompressionStats();
+  bool isPassed = testRoundTrip("compressed.db", T41SQLite::COMPRESSED_VFS_NAME);
+  const T41SQLite::CompressionStats& stats = T41SQLite::getInstance().getCompressionStats();
+  Serial.printf("compressed pages written: %u, read: %u, bytes in: %llu, bytes out: %llu\n", stats.m_pagesWritten,
+                stats.m_pagesRead, stats.m_bytesIn, stats.m_bytesOut);
+
+  isPassed = isPassed && stats.m_pagesWritten > 0 && stats.m_pagesRead > 0 && stats.m_bytesOut * 2 < stats.m_bytesIn;
+  Serial.printf(">>>> testCompressedRoundTrip - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testCompressedRoundTrip - end ----");
+
+  return isPassed;
+}
+
+// rewriting the table first fills more than one segment, so reopening replays the log across segments
+bool testLogRoundTrip()
+{
+  sqlite3* db;
+  int rc = sqlite3_open_v2("log.db", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, T41SQLite::LOG_VFS_NAME);
+
+  for (int i = 0; i < 10 && rc == SQLITE_OK; i++)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  sqlite3_close(db);
+
+  bool isPassed = testRoundTrip("log.db", T41SQLite::LOG_VFS_NAME);
+  Serial.printf("log segments started: %u, checkpoints: %u\n", T41SQLite::getInstance().getLogStats().m_segmentsStarted,
+                T41SQLite::getInstance().getLogStats().m_checkpoints);
+
+  return isPassed;
+}
+
+// a database grown in chunks of 1 MiB takes its clusters in one piece, so its pages go to the card with raw sector
+// calls and must come back the same after a restart
+bool testRawSectorRoundTrip()
+{
+  Serial.println("---- testRawSectorRoundTrip - begin ----");
+  sqlite3* db;
+  int chunkSize = 1024 * 1024;
+  int rc = T41SQLite::getInstance().setRawSectorAccess(&SD, &SD.sdfs);
+  T41SQLite::getInstance().resetRawSectorStats();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open("raw.db", &db);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_file_control(db, "main", SQLITE_FCNTL_CHUNK_SIZE, &chunkSize);
+  }
+
+  // the first commit extends the file to a whole chunk, the next one finds it contiguous
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "PRAGMA user_version = 19;", NULL, 0, NULL);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  String written = queryText(db, sqlCheckRoundTrip);
+  sqlite3_close(db);
+
+  rc = restartT41SQLite();
+  String read;
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open_v2("raw.db", &db, SQLITE_OPEN_READWRITE, nullptr);
+    read = queryText(db, sqlCheckRoundTrip);
+    sqlite3_close(db);
+  }
+
+  const T41SQLite::RawSectorStats& stats = T41SQLite::getInstance().getRawSectorStats();
+  bool isPassed = written.endsWith("/ok") && read == written && stats.m_contiguousFiles > 0
+                  && stats.m_sectorsWritten > 0 && stats.m_sectorsRead > 0;
+  Serial.printf("contiguous files: %u, fragmented files: %u, sectors read: %u, written: %u, partial: %u\n",
+                stats.m_contiguousFiles, stats.m_fragmentedFiles, stats.m_sectorsRead, stats.m_sectorsWritten,
+                stats.m_partialSectors);
+  T41SQLite::getInstance().setRawSectorAccess(&SD, nullptr);
+  Serial.printf(">>>> testRawSectorRoundTrip - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testRawSectorRoundTrip - end ----");
+
+  return isPassed;
+}
+
+// once the statements have run, transactions must take nothing from the heap inside the VFS
+bool testAllocationStats()
+{
+  Serial.println("---- testAllocationStats - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open("allocation.db", &db);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "DROP TABLE IF EXISTS Counter; CREATE TABLE Counter(ID INTEGER PRIMARY KEY, Value INT);", NULL, 0, NULL);
+  }
+
+  const char* sqlTransaction = "BEGIN; INSERT INTO Counter(Value) VALUES (random()); "
+                               "UPDATE Counter SET Value = Value + 1 WHERE ID % 7 = 0; COMMIT;";
+
+  // the first transactions open the journal and fill the caches
+  for (int i = 0; i < 2 && rc == SQLITE_OK; i++)
+  {
+    rc = sqlite3_exec(db, sqlTransaction, NULL, 0, NULL);
+  }
+
+  T41SQLite::getInstance().resetAllocationStats();
+
+  for (int i = 0; i < 50 && rc == SQLITE_OK; i++)
+  {
+    rc = sqlite3_exec(db, sqlTransaction, NULL, 0, NULL);
+  }
+
+  checkSQLiteError(db, rc);
+  sqlite3_close(db);
+
+  const T41SQLite::AllocationStats& stats = T41SQLite::getInstance().getAllocationStats();
+  bool isPassed = rc == SQLITE_OK && stats.m_allocations == 0 && stats.m_fileHandles == 0 && stats.m_fileOpens == 0;
+  Serial.printf("allocations: %u (%llu bytes), file handles: %u, file opens: %u\n", stats.m_allocations, stats.m_bytes,
+                stats.m_fileHandles, stats.m_fileOpens);
+  Serial.printf(">>>> testAllocationStats - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testAllocationStats - end ----");
+
+  return isPassed;
+}
+
+void fillBlock(uint8_t* io_block, int in_size, uint8_t in_seed)
+{
+  for (int i = 0; i < in_size; i++)
+  {
+    io_block[i] = static_cast<uint8_t>(in_seed + i * 7);
+  }
+}
+
+bool isBlockIntact(const uint8_t* in_block, int in_size, uint8_t in_seed)
+{
+  for (int i = 0; i < in_size; i++)
+  {
+    if (in_block[i] != static_cast<uint8_t>(in_seed + i * 7))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// random mallocs, reallocs and frees through the EXTMEM slab allocator, every block filled with its own pattern,
+// which must survive until it is freed; sizes mostly fall in the slab size classes, some are larger
+bool testAllocator()
+{
+  Serial.println("---- testAllocator - begin ----");
+  int rc = T41SQLite::getInstance().end();
+
+  // the library is built with SQLITE_DEFAULT_MEMSTATUS=0, sqlite3_memory_used() counts nothing without this
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 1);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = T41SQLite::getInstance().begin(&SD, true);
+  }
+
+  const int blockCount = 64;
+  uint8_t* blocks[blockCount] = {};
+  int sizes[blockCount] = {};
+  uint8_t seeds[blockCount] = {};
+  sqlite3_int64 usedBefore = sqlite3_memory_used();
+  bool isPassed = rc == SQLITE_OK;
+  randomSeed(41);
+
+  for (int i = 0; i < 20000 && isPassed; i++)
+  {
+    int index = random(blockCount);
+    int size = random(16) == 0 ? random(4097, 65536) : random(1, 4097);
+    uint8_t seed = static_cast<uint8_t>(random(256));
+
+    if (blocks[index] == nullptr)
+    {
+      blocks[index] = static_cast<uint8_t*>(sqlite3_malloc(size));
+    }
+    else if (not isBlockIntact(blocks[index], sizes[index], seeds[index]))
+    {
+      isPassed = false;
+    }
+    else if (random(2) == 0)
+    {
+      uint8_t* block = static_cast<uint8_t*>(sqlite3_realloc(blocks[index], size));
+
+      // a moved block must keep its bytes
+      if (block != nullptr && not isBlockIntact(block, min(size, sizes[index]), seeds[index]))
+      {
+        isPassed = false;
+      }
+
+      blocks[index] = block != nullptr ? block : blocks[index];
+      size = block != nullptr ? size : sizes[index];
+    }
+    else
+    {
+      sqlite3_free(blocks[index]);
+      blocks[index] = nullptr;
+    }
+
+    if (blocks[index] != nullptr)
+    {
+      isPassed = isPassed && sqlite3_msize(blocks[index]) >= static_cast<sqlite3_uint64>(size);
+      fillBlock(blocks[index], size, seed);
+      sizes[index] = size;
+      seeds[index] = seed;
+    }
+  }
+
+  for (int index = 0; index < blockCount; index++)
+  {
+    isPassed = isPassed && (blocks[index] == nullptr || isBlockIntact(blocks[index], sizes[index], seeds[index]));
+    sqlite3_free(blocks[index]);
+  }
+
+  isPassed = isPassed && sqlite3_memory_used() == usedBefore;
+  Serial.printf("memory used before: %lld, after: %lld\n", usedBefore, sqlite3_memory_used());
+  Serial.printf(">>>> testAllocator - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testAllocator - end ----");
+
+  return isPassed;
+}
+
+// allocations of up to 256 bytes come from the RAM1 slabs, up to 1 KiB from the RAM2 heap and larger ones from
+// EXTMEM, filling a table takes some from each region; stays on for the rest of the session
+bool testHybridMemory()
+{
+  Serial.println("---- testHybridMemory - begin ----");
+  int rc = T41SQLite::getInstance().end();
+
+  if (rc == SQLITE_OK)
+  {
+    T41SQLite::getInstance().setHybridMemory(hybridRAM1Buffer, sizeof(hybridRAM1Buffer), 256, 1024);
+    rc = T41SQLite::getInstance().begin(&SD, false);
+  }
+
+  sqlite3* db = nullptr;
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open("hybrid.db", &db);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+    checkSQLiteError(db, rc);
+  }
+
+  bool isPassed = rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip).endsWith("/ok");
+  sqlite3_close(db);
+  const T41SQLite::HybridMemoryStats& stats = T41SQLite::getInstance().getHybridMemoryStats();
+  isPassed = isPassed && stats.m_ram1Allocations > 0 && stats.m_ram2Allocations > 0 && stats.m_psramAllocations > 0;
+  Serial.printf("allocations RAM1: %u, RAM2: %u, EXTMEM: %u, fallbacks: %u\n", stats.m_ram1Allocations,
+                stats.m_ram2Allocations, stats.m_psramAllocations, stats.m_fallbacks);
+  Serial.printf("peak bytes RAM1: %u, RAM2: %u, EXTMEM: %u\n", stats.m_ram1Peak, stats.m_ram2Peak, stats.m_psramPeak);
+  Serial.printf(">>>> testHybridMemory - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testHybridMemory - end ----");
+
+  return isPassed;
+}
+
+// 64 preallocated slots for pages of 4 KiB in EXTMEM: a round trip must find its pages in them, none on the heap;
+// setPageCache() with no slots afterwards gives the page cache back to the allocator
+bool testPageCache()
+{
+  Serial.println("---- testPageCache - begin ----");
+  int rc = T41SQLite::getInstance().end();
+
+  if (rc == SQLITE_OK)
+  {
+    T41SQLite::getInstance().setPageCache(4096, 64, T41SQLite::MemoryRegion::PSRAM);
+    rc = T41SQLite::getInstance().begin(&SD, false);
+  }
+
+  T41SQLite::getInstance().resetPageCacheStats();
+  sqlite3* db = nullptr;
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open("pagecache.db", &db);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, sqlFillRoundTrip, NULL, 0, NULL);
+    checkSQLiteError(db, rc);
+  }
+
+  T41SQLite::PageCacheStats stats = T41SQLite::getInstance().getPageCacheStats();
+  bool isPassed = rc == SQLITE_OK && queryText(db, sqlCheckRoundTrip).endsWith("/ok") && stats.m_slots == 64
+                  && stats.m_slotsUsed > 0 && stats.m_slotsPeak <= 64 && stats.m_overflowPeak == 0;
+  sqlite3_close(db);
+  Serial.printf("slots: %u, used: %u, peak: %u, overflow peak: %u bytes, largest request: %u bytes\n", stats.m_slots,
+                stats.m_slotsUsed, stats.m_slotsPeak, stats.m_overflowPeak, stats.m_largestRequest);
+
+  rc = T41SQLite::getInstance().end();
+
+  if (rc == SQLITE_OK)
+  {
+    T41SQLite::getInstance().setPageCache(4096, 0);
+    rc = T41SQLite::getInstance().begin(&SD, false);
+  }
+
+  isPassed = isPassed && rc == SQLITE_OK && T41SQLite::getInstance().getPageCacheStats().m_slots == 0;
+  Serial.printf(">>>> testPageCache - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testPageCache - end ----");
+
+  return isPassed;
+}
+
+// drives the two-tier page cache through its methods like SQLite does: twelve new pages fill the eight fast slots
+// and four slow pages, a slow page hit twice is promoted (demoting the least recently used fast page), truncate and
+// shrink drop pages, and a cache that is not purgeable keeps its pages in the slow tier
+bool testTwoTierPageCache()
+{
+  Serial.println("---- testTwoTierPageCache - begin ----");
+  T41SQLite::TwoTierPageCacheStats stats;
+  sqlite3_pcache_methods2 methods = {};
+  int rc = T41SQLite::getInstance().end();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_use_two_tier_pcache(twoTierFastBuffer, sizeof(twoTierFastBuffer), 1024, 2, &stats);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_config(SQLITE_CONFIG_GETPCACHE2, &methods);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = T41SQLite::getInstance().begin(&SD, false);
+  }
+
+  bool isPassed = rc == SQLITE_OK && stats.m_fastSlots == 8;
+  sqlite3_pcache* cache = isPassed ? methods.xCreate(1024, 16, 1) : nullptr;
+  isPassed = isPassed && cache != nullptr;
+
+  if (isPassed)
+  {
+    methods.xCachesize(cache, 16);
+
+    for (unsigned key = 1; key <= 12 && isPassed; key++)
+    {
+      sqlite3_pcache_page* page = methods.xFetch(cache, key, 2);
+      isPassed = page != nullptr;
+
+      if (isPassed)
+      {
+        memset(page->pBuf, key, 1024);
+        methods.xUnpin(cache, page, 0);
+      }
+    }
+
+    isPassed = isPassed && stats.m_fastPages == 8 && stats.m_slowPages == 4 && methods.xPagecount(cache) == 12;
+
+    // the second hit promotes page 12, SQLite would load it again (its extra data is cleared)
+    for (int hit = 0; hit < 2 && isPassed; hit++)
+    {
+      sqlite3_pcache_page* page = methods.xFetch(cache, 12, 1);
+      isPassed = page != nullptr;
+
+      if (isPassed)
+      {
+        methods.xUnpin(cache, page, 0);
+      }
+    }
+
+    isPassed = isPassed && stats.m_promotions == 1 && stats.m_demotions == 1 && methods.xFetch(cache, 1, 0) == nullptr
+               && methods.xPagecount(cache) == 11;
+
+    methods.xTruncate(cache, 7);
+    sqlite3_pcache_page* page = methods.xFetch(cache, 3, 0);
+    isPassed = isPassed && methods.xPagecount(cache) == 5 && page != nullptr
+               && static_cast<uint8_t*>(page->pBuf)[0] == 3 && static_cast<uint8_t*>(page->pBuf)[1023] == 3;
+
+    if (page != nullptr)
+    {
+      methods.xUnpin(cache, page, 0);
+    }
+
+    methods.xShrink(cache);
+    isPassed = isPassed && methods.xPagecount(cache) == 0 && stats.m_fastPages == 0 && stats.m_slowPages == 0;
+    methods.xDestroy(cache);
+  }
+
+  if (isPassed)
+  {
+    sqlite3_pcache* memoryCache = methods.xCreate(1024, 16, 0);
+    isPassed = memoryCache != nullptr && methods.xFetch(memoryCache, 1, 2) != nullptr && stats.m_fastPages == 0
+               && stats.m_slowPages == 1;
+
+    if (memoryCache != nullptr)
+    {
+      methods.xDestroy(memoryCache);
+    }
+  }
+
+  Serial.printf("fast hits: %u, slow hits: %u, misses: %u, promotions: %u, demotions: %u\n", stats.m_fastHits,
+                stats.m_slowHits, stats.m_misses, stats.m_promotions, stats.m_demotions);
+  Serial.printf(">>>> testTwoTierPageCache - %s <<<<\n", isPassed ? "passed" : "failed");
+  Serial.println("---- testTwoTierPageCache - end ----");
+
+  return isPassed;
+}
+
 void setup()
 {
   setupSerial(115200);
@@ -154,6 +1101,21 @@ void setup()
     printMemoryInfo();
 
     testSQLite();
+    testCachedWriteBack();
+    testWAL();
+    testBatchRecovery();
+    testRoundTrip("memory.db", T41SQLite::MEMORY_VFS_NAME);
+    testDeferredSync();
+    testTierRoundTrip();
+    testCompressedRoundTrip();
+    testLogRoundTrip();
+    testRawSectorRoundTrip();
+    testAllocationStats();
+    testAllocator();
+    testHybridMemory();
+    testPageCache();
+    // replaces the page cache for the rest of the session, so it runs last
+    testTwoTierPageCache();
 
     int resultEnd = T41SQLite::getInstance().end();
 